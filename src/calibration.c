@@ -0,0 +1,291 @@
+/*
+ *   calibration.c
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+#include "calibration.h"
+#include "utils.h"
+
+#define CALIBRATION_FILE "/calibration.json"
+#define CALIBRATION_TMP_SUFFIX ".tmp"
+
+#define CAL_TAG_DEVICE "device"
+#define CAL_TAG_SAMPLERATE "samplerate"
+#define CAL_TAG_RATIO "ratio"
+#define CAL_TAG_Z1 "z1"
+#define CAL_TAG_Z2 "z2"
+#define CAL_TAG_Z3 "z3"
+
+//Several resamplers might save at the same time.
+static GMutex calibration_mutex;
+
+void
+ow_calibration_get_id (struct ow_engine *engine, char *id)
+{
+  if (engine->serial_number[0])
+    {
+      snprintf (id, OW_CALIBRATION_ID_MAX_LEN, "%04x-%s",
+		engine->device->pid, engine->serial_number);
+    }
+  else
+    {
+      snprintf (id, OW_CALIBRATION_ID_MAX_LEN, "%04x", engine->device->pid);
+    }
+}
+
+static gdouble
+calibration_read_double (JsonReader *reader, const gchar *member)
+{
+  gdouble v = 0.0;
+
+  if (json_reader_read_member (reader, member))
+    {
+      v = json_reader_get_double_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  return v;
+}
+
+//Returns the device of the current element or NULL if it is not valid.
+static const gchar *
+calibration_read (JsonReader *reader, struct ow_calibration *calibration)
+{
+  const gchar *device = NULL;
+
+  if (json_reader_read_member (reader, CAL_TAG_DEVICE))
+    {
+      device = json_reader_get_string_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  calibration->samplerate = 0;
+  if (json_reader_read_member (reader, CAL_TAG_SAMPLERATE))
+    {
+      calibration->samplerate = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  calibration->ratio = calibration_read_double (reader, CAL_TAG_RATIO);
+  calibration->z1 = calibration_read_double (reader, CAL_TAG_Z1);
+  calibration->z2 = calibration_read_double (reader, CAL_TAG_Z2);
+  calibration->z3 = calibration_read_double (reader, CAL_TAG_Z3);
+
+  if (!device || !calibration->samplerate || calibration->ratio <= 0.0)
+    {
+      return NULL;
+    }
+
+  return device;
+}
+
+static void
+calibration_build (JsonBuilder *builder, const gchar *device,
+		   const struct ow_calibration *calibration)
+{
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, CAL_TAG_DEVICE);
+  json_builder_add_string_value (builder, device);
+
+  json_builder_set_member_name (builder, CAL_TAG_SAMPLERATE);
+  json_builder_add_int_value (builder, calibration->samplerate);
+
+  json_builder_set_member_name (builder, CAL_TAG_RATIO);
+  json_builder_add_double_value (builder, calibration->ratio);
+
+  json_builder_set_member_name (builder, CAL_TAG_Z1);
+  json_builder_add_double_value (builder, calibration->z1);
+
+  json_builder_set_member_name (builder, CAL_TAG_Z2);
+  json_builder_add_double_value (builder, calibration->z2);
+
+  json_builder_set_member_name (builder, CAL_TAG_Z3);
+  json_builder_add_double_value (builder, calibration->z3);
+
+  json_builder_end_object (builder);
+}
+
+//Returns a reader for the calibrations array or NULL if there are none.
+static JsonReader *
+calibration_open (JsonParser *parser, const gchar *file)
+{
+  JsonReader *reader;
+  GError *error = NULL;
+
+  if (!json_parser_load_from_file (parser, file, &error))
+    {
+      debug_print (1, "%s", error->message);
+      g_clear_error (&error);
+      return NULL;
+    }
+
+  reader = json_reader_new (json_parser_get_root (parser));
+  if (!json_reader_is_array (reader))
+    {
+      error_print ("Calibrations in `%s' are not an array", file);
+      g_object_unref (reader);
+      return NULL;
+    }
+
+  return reader;
+}
+
+int
+ow_calibration_load (const char *id, struct ow_calibration *calibrations,
+		     int max)
+{
+  gint elements;
+  const gchar *device;
+  JsonReader *reader;
+  JsonParser *parser;
+  struct ow_calibration *calibration = calibrations;
+  gchar *file = get_expanded_dir (CONF_DIR CALIBRATION_FILE);
+  int len = 0;
+
+  g_mutex_lock (&calibration_mutex);
+
+  parser = json_parser_new_immutable ();
+  reader = calibration_open (parser, file);
+  if (!reader)
+    {
+      goto cleanup;
+    }
+
+  elements = json_reader_count_elements (reader);
+  for (int i = 0; i < elements && len < max; i++)
+    {
+      if (json_reader_read_element (reader, i))
+	{
+	  device = calibration_read (reader, calibration);
+	  if (device && !strcmp (device, id))
+	    {
+	      debug_print (1, "Calibration for %s at %d Hz: ratio %.9f", id,
+			   calibration->samplerate, calibration->ratio);
+	      calibration++;
+	      len++;
+	    }
+	}
+      json_reader_end_element (reader);
+    }
+
+  g_object_unref (reader);
+
+cleanup:
+  g_object_unref (parser);
+  g_mutex_unlock (&calibration_mutex);
+  g_free (file);
+
+  return len;
+}
+
+int
+ow_calibration_save (const char *id, const struct ow_calibration *calibration)
+{
+  size_t n;
+  gint elements;
+  gchar *dir, *file, *tmp;
+  const gchar *device;
+  JsonBuilder *builder;
+  JsonGenerator *gen;
+  JsonReader *reader;
+  JsonParser *parser;
+  JsonNode *root;
+  struct ow_calibration saved;
+  int err = 0;
+
+  dir = get_expanded_dir (CONF_DIR);
+  if (g_mkdir_with_parents (dir,
+			    S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH |
+			    S_IXOTH))
+    {
+      error_print ("Error wile creating dir `%s'", CONF_DIR);
+      g_free (dir);
+      return -1;
+    }
+
+  n = PATH_MAX - strlen (dir) - 1;
+  strncat (dir, CALIBRATION_FILE, n);
+  dir[PATH_MAX - 1] = 0;
+  file = dir;
+  tmp = g_strconcat (file, CALIBRATION_TMP_SUFFIX, NULL);
+
+  debug_print (1, "Saving calibration for %s at %d Hz to '%s'...", id,
+	       calibration->samplerate, file);
+
+  g_mutex_lock (&calibration_mutex);
+
+  builder = json_builder_new ();
+  json_builder_begin_array (builder);
+
+  //The calibrations of other devices and sample rates are kept.
+  parser = json_parser_new_immutable ();
+  reader = calibration_open (parser, file);
+  if (reader)
+    {
+      elements = json_reader_count_elements (reader);
+      for (int i = 0; i < elements; i++)
+	{
+	  if (json_reader_read_element (reader, i))
+	    {
+	      device = calibration_read (reader, &saved);
+	      if (device && (strcmp (device, id) ||
+			     saved.samplerate != calibration->samplerate))
+		{
+		  calibration_build (builder, device, &saved);
+		}
+	    }
+	  json_reader_end_element (reader);
+	}
+      g_object_unref (reader);
+    }
+  g_object_unref (parser);
+
+  calibration_build (builder, id, calibration);
+
+  json_builder_end_array (builder);
+
+  gen = json_generator_new ();
+  root = json_builder_get_root (builder);
+  json_generator_set_root (gen, root);
+  json_generator_set_pretty (gen, TRUE);
+
+  //Renaming is atomic so a crash never leaves a truncated file.
+  if (!json_generator_to_file (gen, tmp, NULL) || g_rename (tmp, file))
+    {
+      error_print ("Error while saving calibration to `%s'", file);
+      g_unlink (tmp);
+      err = -1;
+    }
+
+  json_node_free (root);
+  g_object_unref (gen);
+  g_object_unref (builder);
+
+  g_mutex_unlock (&calibration_mutex);
+
+  g_free (tmp);
+  g_free (file);
+
+  return err;
+}
@@ -0,0 +1,48 @@
+/*
+ *   calibration.h
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "engine.h"
+
+//Calibrations are stored for every device and host sample rate.
+#define OW_CALIBRATION_MAX_SAMPLERATES 8
+
+//"pid-serial" with the PID in hexadecimal.
+#define OW_CALIBRATION_ID_MAX_LEN (OW_SERIAL_NUMBER_MAX_LEN + 8)
+
+//The converged state of the host side of the DLL for a sample rate.
+struct ow_calibration
+{
+  uint32_t samplerate;
+  double ratio;
+  double z1;
+  double z2;
+  double z3;
+};
+
+void ow_calibration_get_id (struct ow_engine *, char *);
+
+//Returns the amount of calibrations found for the device.
+int ow_calibration_load (const char *, struct ow_calibration *, int);
+
+//The calibration replaces the one with the same sample rate, if any.
+int ow_calibration_save (const char *, const struct ow_calibration *);
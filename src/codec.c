@@ -0,0 +1,1232 @@
+/*
+ *   codec.c
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <endian.h>
+#include "codec.h"
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OW_CODEC_X86
+#include <immintrin.h>
+#define SIMD_KERNEL(k) k
+#else
+#define SIMD_KERNEL(k) NULL
+#endif
+
+#define INT32_TO_FLOAT32_SCALE ((float) (1.0f / INT32_MAX))
+#define FLOAT32_TO_INT32_SCALE ((float) INT32_MAX)
+#define FLOAT32_INT32_MAX 2147483520.0f	//Biggest float below 2^31
+#define FLOAT32_INT32_MIN -2147483648.0f
+#define UNIFORM_SCALE (1.0f / (1 << 24))
+
+static const char *layout_names[] = {
+  "generic",
+  "32 bits",
+  "32 and 24 bits",
+  "16 bits"
+};
+
+static const char *isa_names[] = {
+  "scalar",
+  "SSE2",
+  "SSSE3",
+  "AVX2"
+};
+
+//All the samples are converted to left aligned int32 values so the
+//conversion to float is the same regardless of the USB sample size.
+
+static inline uint32_t
+load_be32 (const uint8_t *s)
+{
+  uint32_t v;
+  memcpy (&v, s, sizeof (uint32_t));
+  return be32toh (v);
+}
+
+static inline uint32_t
+load_be24 (const uint8_t *s)
+{
+  return (uint32_t) s[0] << 24 | (uint32_t) s[1] << 16 | (uint32_t) s[2] << 8;
+}
+
+static inline uint32_t
+load_be16 (const uint8_t *s)
+{
+  return (uint32_t) s[0] << 24 | (uint32_t) s[1] << 16;
+}
+
+static inline void
+store_be32 (uint8_t *d, uint32_t v)
+{
+  v = htobe32 (v);
+  memcpy (d, &v, sizeof (uint32_t));
+}
+
+static inline void
+store_be24 (uint8_t *d, uint32_t v)
+{
+  d[0] = v >> 24;
+  d[1] = v >> 16;
+  d[2] = v >> 8;
+}
+
+static inline void
+store_be16 (uint8_t *d, uint32_t v)
+{
+  d[0] = v >> 24;
+  d[1] = v >> 16;
+}
+
+static inline float
+int32_to_float (uint32_t v)
+{
+  return (int32_t) v * INT32_TO_FLOAT32_SCALE;
+}
+
+//The clamping is done in float with the same comparisons than the SSE min
+//and max instructions so the saturation (and NaN, that goes to the maximum)
+//is bit-identical in every kernel.
+static inline uint32_t
+float_to_int32 (float v)
+{
+  v = v < FLOAT32_INT32_MAX ? v : FLOAT32_INT32_MAX;
+  v = v > FLOAT32_INT32_MIN ? v : FLOAT32_INT32_MIN;
+  return (int32_t) v;
+}
+
+static inline uint32_t
+xorshift32 (uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+//Triangular noise in [-0.5, 1.5) LSB. The offset centers the truncation
+//done by the conversion to integer.
+static inline float
+tpdf (uint32_t *state, float lsb)
+{
+  float r1 = (xorshift32 (state) >> 8) * UNIFORM_SCALE;
+  float r2 = (xorshift32 (state) >> 8) * UNIFORM_SCALE;
+  return (r1 - r2 + 0.5f) * lsb;
+}
+
+static inline void
+decode_run_32 (const uint8_t *src, float *dst, int samples, int shift)
+{
+  for (int i = 0; i < samples; i++)
+    {
+      dst[i] = int32_to_float (load_be32 (&src[i * 4]) << shift);
+    }
+}
+
+static inline void
+decode_run_24 (const uint8_t *src, float *dst, int samples)
+{
+  for (int i = 0; i < samples; i++)
+    {
+      dst[i] = int32_to_float (load_be24 (&src[i * 3]));
+    }
+}
+
+static inline void
+decode_run_16 (const uint8_t *src, float *dst, int samples)
+{
+  for (int i = 0; i < samples; i++)
+    {
+      dst[i] = int32_to_float (load_be16 (&src[i * 2]));
+    }
+}
+
+static inline float
+decode_sample (const uint8_t *src, const struct ow_codec_run *run)
+{
+  switch (run->size)
+    {
+    case 4:
+      return int32_to_float (load_be32 (src) << run->shift);
+    case 3:
+      return int32_to_float (load_be24 (src));
+    case 2:
+      return int32_to_float (load_be16 (src));
+    default:
+      return 0;
+    }
+}
+
+static void
+decode_generic (const struct ow_codec_plan *plan, const uint8_t *src,
+		float *dst, int frames)
+{
+  const struct ow_codec_run *run;
+
+  for (int i = 0; i < frames; i++)
+    {
+      run = plan->runs;
+      for (int j = 0; j < plan->runs_len; j++, run++)
+	{
+	  for (int k = 0; k < run->tracks; k++)
+	    {
+	      *dst = decode_sample (src, run);
+	      src += run->size;
+	      dst++;
+	    }
+	}
+    }
+}
+
+static void
+decode_32 (const struct ow_codec_plan *plan, const uint8_t *src,
+	   float *dst, int frames)
+{
+  decode_run_32 (src, dst, frames * plan->tracks, plan->runs[0].shift);
+}
+
+static void
+decode_32_24 (const struct ow_codec_plan *plan, const uint8_t *src,
+	      float *dst, int frames)
+{
+  int tracks32 = plan->runs[0].tracks;
+  int tracks24 = plan->runs[1].tracks;
+  int shift = plan->runs[0].shift;
+
+  for (int i = 0; i < frames; i++)
+    {
+      decode_run_32 (src, dst, tracks32, shift);
+      src += tracks32 * 4;
+      dst += tracks32;
+
+      decode_run_24 (src, dst, tracks24);
+      src += tracks24 * 3;
+      dst += tracks24;
+    }
+}
+
+static void
+decode_16 (const struct ow_codec_plan *plan, const uint8_t *src,
+	   float *dst, int frames)
+{
+  decode_run_16 (src, dst, frames * plan->tracks);
+}
+
+#if defined(OW_CODEC_X86)
+
+//The SIMD kernels do the same integer operations than the scalar ones and
+//the conversion to float rounds to nearest as the C conversion does, so the
+//results are bit-identical.
+
+#define TARGET_SSE2 __attribute__ ((target ("sse2")))
+#define TARGET_SSSE3 __attribute__ ((target ("ssse3")))
+#define TARGET_AVX2 __attribute__ ((target ("avx2")))
+#define ALWAYS_INLINE inline __attribute__ ((always_inline))
+
+static inline TARGET_SSE2 void
+store_int32_sse2 (float *dst, __m128i v)
+{
+  __m128 scale = _mm_set1_ps (INT32_TO_FLOAT32_SCALE);
+  _mm_storeu_ps (dst, _mm_mul_ps (_mm_cvtepi32_ps (v), scale));
+}
+
+static ALWAYS_INLINE TARGET_SSE2 __m128i
+bswap16_sse2 (__m128i v)
+{
+  return _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+}
+
+static ALWAYS_INLINE TARGET_SSE2 __m128i
+bswap32_sse2 (__m128i v)
+{
+  v = bswap16_sse2 (v);
+  v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+  return _mm_shufflehi_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+}
+
+static TARGET_SSE2 void
+decode_run_32_sse2 (const uint8_t *src, float *dst, int samples, int shift)
+{
+  int i = 0;
+  __m128i count = _mm_cvtsi32_si128 (shift);
+
+  for (; i + 4 <= samples; i += 4)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) &src[i * 4]);
+      v = _mm_sll_epi32 (bswap32_sse2 (v), count);
+      store_int32_sse2 (&dst[i], v);
+    }
+
+  decode_run_32 (&src[i * 4], &dst[i], samples - i, shift);
+}
+
+static TARGET_SSE2 void
+decode_run_16_sse2 (const uint8_t *src, float *dst, int samples)
+{
+  int i = 0;
+  __m128i zero = _mm_setzero_si128 ();
+
+  for (; i + 8 <= samples; i += 8)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) &src[i * 2]);
+      v = bswap16_sse2 (v);
+      store_int32_sse2 (&dst[i], _mm_unpacklo_epi16 (zero, v));
+      store_int32_sse2 (&dst[i + 4], _mm_unpackhi_epi16 (zero, v));
+    }
+
+  decode_run_16 (&src[i * 2], &dst[i], samples - i);
+}
+
+static TARGET_SSE2 void
+decode_32_sse2 (const struct ow_codec_plan *plan, const uint8_t *src,
+		float *dst, int frames)
+{
+  decode_run_32_sse2 (src, dst, frames * plan->tracks, plan->runs[0].shift);
+}
+
+static TARGET_SSE2 void
+decode_32_24_sse2 (const struct ow_codec_plan *plan, const uint8_t *src,
+		   float *dst, int frames)
+{
+  int tracks32 = plan->runs[0].tracks;
+  int tracks24 = plan->runs[1].tracks;
+  int shift = plan->runs[0].shift;
+
+  for (int i = 0; i < frames; i++)
+    {
+      decode_run_32_sse2 (src, dst, tracks32, shift);
+      src += tracks32 * 4;
+      dst += tracks32;
+
+      decode_run_24 (src, dst, tracks24);
+      src += tracks24 * 3;
+      dst += tracks24;
+    }
+}
+
+static TARGET_SSE2 void
+decode_16_sse2 (const struct ow_codec_plan *plan, const uint8_t *src,
+		float *dst, int frames)
+{
+  decode_run_16_sse2 (src, dst, frames * plan->tracks);
+}
+
+static TARGET_SSSE3 void
+decode_run_32_ssse3 (const uint8_t *src, float *dst, int samples, int shift)
+{
+  int i = 0;
+  __m128i count = _mm_cvtsi32_si128 (shift);
+  __m128i mask = _mm_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15,
+				14, 13, 12);
+
+  for (; i + 4 <= samples; i += 4)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) &src[i * 4]);
+      v = _mm_sll_epi32 (_mm_shuffle_epi8 (v, mask), count);
+      store_int32_sse2 (&dst[i], v);
+    }
+
+  decode_run_32 (&src[i * 4], &dst[i], samples - i, shift);
+}
+
+//4 samples use 12 bytes but 16 bytes are loaded so a vector is only used if
+//there are enough readable bytes after the samples.
+static TARGET_SSSE3 void
+decode_run_24_ssse3 (const uint8_t *src, float *dst, int samples,
+		     size_t readable)
+{
+  int i = 0;
+  __m128i mask = _mm_setr_epi8 (-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1,
+				11, 10, 9);
+
+  for (; i + 4 <= samples && i * 3 + 16 <= readable; i += 4)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) &src[i * 3]);
+      store_int32_sse2 (&dst[i], _mm_shuffle_epi8 (v, mask));
+    }
+
+  decode_run_24 (&src[i * 3], &dst[i], samples - i);
+}
+
+static TARGET_SSSE3 void
+decode_run_16_ssse3 (const uint8_t *src, float *dst, int samples)
+{
+  int i = 0;
+  __m128i lo = _mm_setr_epi8 (-1, -1, 1, 0, -1, -1, 3, 2, -1, -1, 5, 4, -1,
+			      -1, 7, 6);
+  __m128i hi = _mm_setr_epi8 (-1, -1, 9, 8, -1, -1, 11, 10, -1, -1, 13, 12,
+			      -1, -1, 15, 14);
+
+  for (; i + 8 <= samples; i += 8)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) &src[i * 2]);
+      store_int32_sse2 (&dst[i], _mm_shuffle_epi8 (v, lo));
+      store_int32_sse2 (&dst[i + 4], _mm_shuffle_epi8 (v, hi));
+    }
+
+  decode_run_16 (&src[i * 2], &dst[i], samples - i);
+}
+
+static TARGET_SSSE3 void
+decode_32_ssse3 (const struct ow_codec_plan *plan, const uint8_t *src,
+		 float *dst, int frames)
+{
+  decode_run_32_ssse3 (src, dst, frames * plan->tracks, plan->runs[0].shift);
+}
+
+static TARGET_SSSE3 void
+decode_32_24_ssse3 (const struct ow_codec_plan *plan, const uint8_t *src,
+		    float *dst, int frames)
+{
+  int tracks32 = plan->runs[0].tracks;
+  int tracks24 = plan->runs[1].tracks;
+  int shift = plan->runs[0].shift;
+  const uint8_t *end = src + frames * plan->frame_size;
+
+  for (int i = 0; i < frames; i++)
+    {
+      decode_run_32_ssse3 (src, dst, tracks32, shift);
+      src += tracks32 * 4;
+      dst += tracks32;
+
+      decode_run_24_ssse3 (src, dst, tracks24, end - src);
+      src += tracks24 * 3;
+      dst += tracks24;
+    }
+}
+
+static TARGET_SSSE3 void
+decode_16_ssse3 (const struct ow_codec_plan *plan, const uint8_t *src,
+		 float *dst, int frames)
+{
+  decode_run_16_ssse3 (src, dst, frames * plan->tracks);
+}
+
+static inline TARGET_AVX2 void
+store_int32_avx2 (float *dst, __m256i v)
+{
+  __m256 scale = _mm256_set1_ps (INT32_TO_FLOAT32_SCALE);
+  _mm256_storeu_ps (dst, _mm256_mul_ps (_mm256_cvtepi32_ps (v), scale));
+}
+
+static TARGET_AVX2 void
+decode_run_32_avx2 (const uint8_t *src, float *dst, int samples, int shift)
+{
+  int i = 0;
+  __m128i count = _mm_cvtsi32_si128 (shift);
+  __m256i mask = _mm256_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15,
+				   14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11,
+				   10, 9, 8, 15, 14, 13, 12);
+
+  for (; i + 8 <= samples; i += 8)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) &src[i * 4]);
+      v = _mm256_sll_epi32 (_mm256_shuffle_epi8 (v, mask), count);
+      store_int32_avx2 (&dst[i], v);
+    }
+
+  decode_run_32 (&src[i * 4], &dst[i], samples - i, shift);
+}
+
+//8 samples use 24 bytes. Each lane loads 16 bytes, the first one from the
+//first sample and the second one from the fifth.
+static TARGET_AVX2 void
+decode_run_24_avx2 (const uint8_t *src, float *dst, int samples,
+		    size_t readable)
+{
+  int i = 0;
+  __m256i mask = _mm256_setr_epi8 (-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6,
+				   -1, 11, 10, 9, -1, 2, 1, 0, -1, 5, 4, 3,
+				   -1, 8, 7, 6, -1, 11, 10, 9);
+
+  for (; i + 8 <= samples && i * 3 + 28 <= readable; i += 8)
+    {
+      __m128i lo = _mm_loadu_si128 ((const __m128i *) &src[i * 3]);
+      __m128i hi = _mm_loadu_si128 ((const __m128i *) &src[i * 3 + 12]);
+      __m256i v = _mm256_inserti128_si256 (_mm256_castsi128_si256 (lo), hi,
+					   1);
+      store_int32_avx2 (&dst[i], _mm256_shuffle_epi8 (v, mask));
+    }
+
+  decode_run_24 (&src[i * 3], &dst[i], samples - i);
+}
+
+static TARGET_AVX2 void
+decode_run_16_avx2 (const uint8_t *src, float *dst, int samples)
+{
+  int i = 0;
+  __m128i mask = _mm_setr_epi8 (1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13,
+				12, 15, 14);
+
+  for (; i + 8 <= samples; i += 8)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) &src[i * 2]);
+      v = _mm_shuffle_epi8 (v, mask);
+      store_int32_avx2 (&dst[i],
+			_mm256_slli_epi32 (_mm256_cvtepu16_epi32 (v), 16));
+    }
+
+  decode_run_16 (&src[i * 2], &dst[i], samples - i);
+}
+
+static TARGET_AVX2 void
+decode_32_avx2 (const struct ow_codec_plan *plan, const uint8_t *src,
+		float *dst, int frames)
+{
+  decode_run_32_avx2 (src, dst, frames * plan->tracks, plan->runs[0].shift);
+}
+
+static TARGET_AVX2 void
+decode_32_24_avx2 (const struct ow_codec_plan *plan, const uint8_t *src,
+		   float *dst, int frames)
+{
+  int tracks32 = plan->runs[0].tracks;
+  int tracks24 = plan->runs[1].tracks;
+  int shift = plan->runs[0].shift;
+  const uint8_t *end = src + frames * plan->frame_size;
+
+  for (int i = 0; i < frames; i++)
+    {
+      decode_run_32_avx2 (src, dst, tracks32, shift);
+      src += tracks32 * 4;
+      dst += tracks32;
+
+      decode_run_24_avx2 (src, dst, tracks24, end - src);
+      src += tracks24 * 3;
+      dst += tracks24;
+    }
+}
+
+static TARGET_AVX2 void
+decode_16_avx2 (const struct ow_codec_plan *plan, const uint8_t *src,
+		float *dst, int frames)
+{
+  decode_run_16_avx2 (src, dst, frames * plan->tracks);
+}
+
+#endif
+
+//The dither is the LSB size of the run or 0 if it is disabled.
+static inline uint32_t
+encode_sample (float f, float dither, uint32_t *state)
+{
+  f *= FLOAT32_TO_INT32_SCALE;
+  if (dither)
+    {
+      f += tpdf (state, dither);
+    }
+  return float_to_int32 (f);
+}
+
+static inline void
+encode_run_32 (const float *src, uint8_t *dst, int samples, int shift,
+	       float dither, uint32_t *state)
+{
+  for (int i = 0; i < samples; i++)
+    {
+      uint32_t v = encode_sample (src[i], dither, state);
+      store_be32 (&dst[i * 4], (int32_t) v >> shift);
+    }
+}
+
+static inline void
+encode_run_24 (const float *src, uint8_t *dst, int samples, float dither,
+	       uint32_t *state)
+{
+  for (int i = 0; i < samples; i++)
+    {
+      store_be24 (&dst[i * 3], encode_sample (src[i], dither, state));
+    }
+}
+
+static inline void
+encode_run_16 (const float *src, uint8_t *dst, int samples, float dither,
+	       uint32_t *state)
+{
+  for (int i = 0; i < samples; i++)
+    {
+      store_be16 (&dst[i * 2], encode_sample (src[i], dither, state));
+    }
+}
+
+static inline void
+store_sample (uint8_t *dst, const struct ow_codec_run *run, uint32_t v)
+{
+  switch (run->size)
+    {
+    case 4:
+      store_be32 (dst, (int32_t) v >> run->shift);
+      break;
+    case 3:
+      store_be24 (dst, v);
+      break;
+    case 2:
+      store_be16 (dst, v);
+      break;
+    }
+}
+
+static void
+encode_generic (struct ow_codec_plan *plan, const float *src,
+		uint8_t *dst, int frames)
+{
+  const struct ow_codec_run *run;
+
+  for (int i = 0; i < frames; i++)
+    {
+      run = plan->runs;
+      for (int j = 0; j < plan->runs_len; j++, run++)
+	{
+	  for (int k = 0; k < run->tracks; k++)
+	    {
+	      store_sample (dst, run, encode_sample (*src, run->dither,
+						     plan->dither_state));
+	      src++;
+	      dst += run->size;
+	    }
+	}
+    }
+}
+
+static void
+encode_32 (struct ow_codec_plan *plan, const float *src, uint8_t *dst,
+	   int frames)
+{
+  encode_run_32 (src, dst, frames * plan->tracks, plan->runs[0].shift,
+		 plan->runs[0].dither, plan->dither_state);
+}
+
+static void
+encode_32_24 (struct ow_codec_plan *plan, const float *src, uint8_t *dst,
+	      int frames)
+{
+  int tracks32 = plan->runs[0].tracks;
+  int tracks24 = plan->runs[1].tracks;
+  int shift = plan->runs[0].shift;
+
+  for (int i = 0; i < frames; i++)
+    {
+      encode_run_32 (src, dst, tracks32, shift, plan->runs[0].dither,
+		     plan->dither_state);
+      src += tracks32;
+      dst += tracks32 * 4;
+
+      encode_run_24 (src, dst, tracks24, plan->runs[1].dither,
+		     plan->dither_state);
+      src += tracks24;
+      dst += tracks24 * 3;
+    }
+}
+
+static void
+encode_16 (struct ow_codec_plan *plan, const float *src, uint8_t *dst,
+	   int frames)
+{
+  encode_run_16 (src, dst, frames * plan->tracks, plan->runs[0].dither,
+		 plan->dither_state);
+}
+
+#if defined(OW_CODEC_X86)
+
+//Without dither, the SIMD encoders are bit-identical to the scalar ones as
+//the scaling, the clamping and the truncation are the same operations. With
+//dither, the noise sequence depends on the vector width.
+//The AVX2 encoders finish the runs with the 128 bits ones as the tracks of a
+//frame are often not a multiple of 8. These are always inlined so they are
+//VEX encoded in the AVX2 kernels as the transitions between AVX and legacy
+//SSE code are expensive.
+
+static ALWAYS_INLINE TARGET_SSE2 __m128i
+xorshift32_sse2 (__m128i x)
+{
+  x = _mm_xor_si128 (x, _mm_slli_epi32 (x, 13));
+  x = _mm_xor_si128 (x, _mm_srli_epi32 (x, 17));
+  return _mm_xor_si128 (x, _mm_slli_epi32 (x, 5));
+}
+
+static ALWAYS_INLINE TARGET_SSE2 __m128
+tpdf_sse2 (__m128i *state, float dither)
+{
+  __m128 r1, r2;
+
+  *state = xorshift32_sse2 (*state);
+  r1 = _mm_cvtepi32_ps (_mm_srli_epi32 (*state, 8));
+  *state = xorshift32_sse2 (*state);
+  r2 = _mm_cvtepi32_ps (_mm_srli_epi32 (*state, 8));
+  r1 = _mm_mul_ps (_mm_sub_ps (r1, r2), _mm_set1_ps (UNIFORM_SCALE));
+  r1 = _mm_add_ps (r1, _mm_set1_ps (0.5f));
+  return _mm_mul_ps (r1, _mm_set1_ps (dither));
+}
+
+static ALWAYS_INLINE TARGET_SSE2 __m128i
+load_int32_sse2 (const float *src, float dither, __m128i *state)
+{
+  __m128 v = _mm_loadu_ps (src);
+
+  v = _mm_mul_ps (v, _mm_set1_ps (FLOAT32_TO_INT32_SCALE));
+  if (dither)
+    {
+      v = _mm_add_ps (v, tpdf_sse2 (state, dither));
+    }
+  v = _mm_min_ps (v, _mm_set1_ps (FLOAT32_INT32_MAX));
+  v = _mm_max_ps (v, _mm_set1_ps (FLOAT32_INT32_MIN));
+  return _mm_cvttps_epi32 (v);
+}
+
+static TARGET_SSE2 void
+encode_run_32_sse2 (const float *src, uint8_t *dst, int samples, int shift,
+		    float dither, uint32_t *state)
+{
+  int i = 0;
+  __m128i count = _mm_cvtsi32_si128 (shift);
+  __m128i s = _mm_loadu_si128 ((const __m128i *) state);
+
+  for (; i + 4 <= samples; i += 4)
+    {
+      __m128i v = load_int32_sse2 (&src[i], dither, &s);
+      v = bswap32_sse2 (_mm_sra_epi32 (v, count));
+      _mm_storeu_si128 ((__m128i *) &dst[i * 4], v);
+    }
+
+  _mm_storeu_si128 ((__m128i *) state, s);
+  encode_run_32 (&src[i], &dst[i * 4], samples - i, shift, dither, state);
+}
+
+static ALWAYS_INLINE TARGET_SSE2 void
+encode_run_16_sse2 (const float *src, uint8_t *dst, int samples,
+		    float dither, uint32_t *state)
+{
+  int i = 0;
+  __m128i s = _mm_loadu_si128 ((const __m128i *) state);
+
+  for (; i + 8 <= samples; i += 8)
+    {
+      __m128i lo = load_int32_sse2 (&src[i], dither, &s);
+      __m128i hi = load_int32_sse2 (&src[i + 4], dither, &s);
+      lo = _mm_srai_epi32 (lo, 16);
+      hi = _mm_srai_epi32 (hi, 16);
+      _mm_storeu_si128 ((__m128i *) &dst[i * 2],
+			bswap16_sse2 (_mm_packs_epi32 (lo, hi)));
+    }
+
+  _mm_storeu_si128 ((__m128i *) state, s);
+  encode_run_16 (&src[i], &dst[i * 2], samples - i, dither, state);
+}
+
+static TARGET_SSE2 void
+encode_32_sse2 (struct ow_codec_plan *plan, const float *src, uint8_t *dst,
+		int frames)
+{
+  encode_run_32_sse2 (src, dst, frames * plan->tracks, plan->runs[0].shift,
+		      plan->runs[0].dither, plan->dither_state);
+}
+
+static TARGET_SSE2 void
+encode_32_24_sse2 (struct ow_codec_plan *plan, const float *src,
+		   uint8_t *dst, int frames)
+{
+  int tracks32 = plan->runs[0].tracks;
+  int tracks24 = plan->runs[1].tracks;
+  int shift = plan->runs[0].shift;
+
+  for (int i = 0; i < frames; i++)
+    {
+      encode_run_32_sse2 (src, dst, tracks32, shift, plan->runs[0].dither,
+			  plan->dither_state);
+      src += tracks32;
+      dst += tracks32 * 4;
+
+      encode_run_24 (src, dst, tracks24, plan->runs[1].dither,
+		     plan->dither_state);
+      src += tracks24;
+      dst += tracks24 * 3;
+    }
+}
+
+static TARGET_SSE2 void
+encode_16_sse2 (struct ow_codec_plan *plan, const float *src, uint8_t *dst,
+		int frames)
+{
+  encode_run_16_sse2 (src, dst, frames * plan->tracks, plan->runs[0].dither,
+		      plan->dither_state);
+}
+
+static ALWAYS_INLINE TARGET_SSSE3 void
+encode_run_32_ssse3 (const float *src, uint8_t *dst, int samples, int shift,
+		     float dither, uint32_t *state)
+{
+  int i = 0;
+  __m128i count = _mm_cvtsi32_si128 (shift);
+  __m128i mask = _mm_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15,
+				14, 13, 12);
+  __m128i s = _mm_loadu_si128 ((const __m128i *) state);
+
+  for (; i + 4 <= samples; i += 4)
+    {
+      __m128i v = load_int32_sse2 (&src[i], dither, &s);
+      v = _mm_shuffle_epi8 (_mm_sra_epi32 (v, count), mask);
+      _mm_storeu_si128 ((__m128i *) &dst[i * 4], v);
+    }
+
+  _mm_storeu_si128 ((__m128i *) state, s);
+  encode_run_32 (&src[i], &dst[i * 4], samples - i, shift, dither, state);
+}
+
+//4 samples use 12 bytes but 16 bytes are stored so a vector is only used if
+//there are enough writable bytes after the samples. The 4 extra bytes are
+//overwritten later as the frames are encoded in order.
+static ALWAYS_INLINE TARGET_SSSE3 void
+encode_run_24_ssse3 (const float *src, uint8_t *dst, int samples,
+		     size_t writable, float dither, uint32_t *state)
+{
+  int i = 0;
+  __m128i mask = _mm_setr_epi8 (3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1,
+				-1, -1, -1);
+  __m128i s = _mm_loadu_si128 ((const __m128i *) state);
+
+  for (; i + 4 <= samples && i * 3 + 16 <= writable; i += 4)
+    {
+      __m128i v = load_int32_sse2 (&src[i], dither, &s);
+      _mm_storeu_si128 ((__m128i *) &dst[i * 3], _mm_shuffle_epi8 (v, mask));
+    }
+
+  _mm_storeu_si128 ((__m128i *) state, s);
+  encode_run_24 (&src[i], &dst[i * 3], samples - i, dither, state);
+}
+
+static TARGET_SSSE3 void
+encode_32_ssse3 (struct ow_codec_plan *plan, const float *src, uint8_t *dst,
+		 int frames)
+{
+  encode_run_32_ssse3 (src, dst, frames * plan->tracks, plan->runs[0].shift,
+		       plan->runs[0].dither, plan->dither_state);
+}
+
+static TARGET_SSSE3 void
+encode_32_24_ssse3 (struct ow_codec_plan *plan, const float *src,
+		    uint8_t *dst, int frames)
+{
+  int tracks32 = plan->runs[0].tracks;
+  int tracks24 = plan->runs[1].tracks;
+  int shift = plan->runs[0].shift;
+  const uint8_t *end = dst + frames * plan->frame_size;
+
+  for (int i = 0; i < frames; i++)
+    {
+      encode_run_32_ssse3 (src, dst, tracks32, shift, plan->runs[0].dither,
+			   plan->dither_state);
+      src += tracks32;
+      dst += tracks32 * 4;
+
+      encode_run_24_ssse3 (src, dst, tracks24, end - dst,
+			   plan->runs[1].dither, plan->dither_state);
+      src += tracks24;
+      dst += tracks24 * 3;
+    }
+}
+
+static inline TARGET_AVX2 __m256i
+xorshift32_avx2 (__m256i x)
+{
+  x = _mm256_xor_si256 (x, _mm256_slli_epi32 (x, 13));
+  x = _mm256_xor_si256 (x, _mm256_srli_epi32 (x, 17));
+  return _mm256_xor_si256 (x, _mm256_slli_epi32 (x, 5));
+}
+
+static inline TARGET_AVX2 __m256
+tpdf_avx2 (__m256i *state, float dither)
+{
+  __m256 r1, r2;
+
+  *state = xorshift32_avx2 (*state);
+  r1 = _mm256_cvtepi32_ps (_mm256_srli_epi32 (*state, 8));
+  *state = xorshift32_avx2 (*state);
+  r2 = _mm256_cvtepi32_ps (_mm256_srli_epi32 (*state, 8));
+  r1 = _mm256_mul_ps (_mm256_sub_ps (r1, r2), _mm256_set1_ps (UNIFORM_SCALE));
+  r1 = _mm256_add_ps (r1, _mm256_set1_ps (0.5f));
+  return _mm256_mul_ps (r1, _mm256_set1_ps (dither));
+}
+
+static inline TARGET_AVX2 __m256i
+load_int32_avx2 (const float *src, float dither, __m256i *state)
+{
+  __m256 v = _mm256_loadu_ps (src);
+
+  v = _mm256_mul_ps (v, _mm256_set1_ps (FLOAT32_TO_INT32_SCALE));
+  if (dither)
+    {
+      v = _mm256_add_ps (v, tpdf_avx2 (state, dither));
+    }
+  v = _mm256_min_ps (v, _mm256_set1_ps (FLOAT32_INT32_MAX));
+  v = _mm256_max_ps (v, _mm256_set1_ps (FLOAT32_INT32_MIN));
+  return _mm256_cvttps_epi32 (v);
+}
+
+static TARGET_AVX2 void
+encode_run_32_avx2 (const float *src, uint8_t *dst, int samples, int shift,
+		    float dither, uint32_t *state)
+{
+  int i = 0;
+  __m128i count = _mm_cvtsi32_si128 (shift);
+  __m256i mask = _mm256_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15,
+				   14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11,
+				   10, 9, 8, 15, 14, 13, 12);
+  __m256i s = _mm256_loadu_si256 ((const __m256i *) state);
+
+  for (; i + 8 <= samples; i += 8)
+    {
+      __m256i v = load_int32_avx2 (&src[i], dither, &s);
+      v = _mm256_shuffle_epi8 (_mm256_sra_epi32 (v, count), mask);
+      _mm256_storeu_si256 ((__m256i *) &dst[i * 4], v);
+    }
+
+  _mm256_storeu_si256 ((__m256i *) state, s);
+  encode_run_32_ssse3 (&src[i], &dst[i * 4], samples - i, shift, dither,
+		       state);
+}
+
+//8 samples use 24 bytes. Each lane packs 12 bytes and is stored with 16
+//bytes, the second one overwriting the 4 extra bytes of the first one.
+static TARGET_AVX2 void
+encode_run_24_avx2 (const float *src, uint8_t *dst, int samples,
+		    size_t writable, float dither, uint32_t *state)
+{
+  int i = 0;
+  __m256i mask = _mm256_setr_epi8 (3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13,
+				   -1, -1, -1, -1, 3, 2, 1, 7, 6, 5, 11, 10,
+				   9, 15, 14, 13, -1, -1, -1, -1);
+  __m256i s = _mm256_loadu_si256 ((const __m256i *) state);
+
+  for (; i + 8 <= samples && i * 3 + 28 <= writable; i += 8)
+    {
+      __m256i v = load_int32_avx2 (&src[i], dither, &s);
+      v = _mm256_shuffle_epi8 (v, mask);
+      _mm_storeu_si128 ((__m128i *) &dst[i * 3],
+			_mm256_castsi256_si128 (v));
+      _mm_storeu_si128 ((__m128i *) &dst[i * 3 + 12],
+			_mm256_extracti128_si256 (v, 1));
+    }
+
+  _mm256_storeu_si256 ((__m256i *) state, s);
+  encode_run_24_ssse3 (&src[i], &dst[i * 3], samples - i, writable - i * 3,
+		       dither, state);
+}
+
+static TARGET_AVX2 void
+encode_run_16_avx2 (const float *src, uint8_t *dst, int samples,
+		    float dither, uint32_t *state)
+{
+  int i = 0;
+  __m256i mask = _mm256_setr_epi8 (1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13,
+				   12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8,
+				   11, 10, 13, 12, 15, 14);
+  __m256i s = _mm256_loadu_si256 ((const __m256i *) state);
+
+  for (; i + 16 <= samples; i += 16)
+    {
+      __m256i lo = load_int32_avx2 (&src[i], dither, &s);
+      __m256i hi = load_int32_avx2 (&src[i + 8], dither, &s);
+      __m256i v;
+      lo = _mm256_srai_epi32 (lo, 16);
+      hi = _mm256_srai_epi32 (hi, 16);
+      //The pack works per lane so the 64 bits blocks need to be reordered.
+      v = _mm256_packs_epi32 (lo, hi);
+      v = _mm256_permute4x64_epi64 (v, _MM_SHUFFLE (3, 1, 2, 0));
+      _mm256_storeu_si256 ((__m256i *) &dst[i * 2],
+			   _mm256_shuffle_epi8 (v, mask));
+    }
+
+  _mm256_storeu_si256 ((__m256i *) state, s);
+  encode_run_16_sse2 (&src[i], &dst[i * 2], samples - i, dither, state);
+}
+
+static TARGET_AVX2 void
+encode_32_avx2 (struct ow_codec_plan *plan, const float *src, uint8_t *dst,
+		int frames)
+{
+  encode_run_32_avx2 (src, dst, frames * plan->tracks, plan->runs[0].shift,
+		      plan->runs[0].dither, plan->dither_state);
+}
+
+static TARGET_AVX2 void
+encode_32_24_avx2 (struct ow_codec_plan *plan, const float *src,
+		   uint8_t *dst, int frames)
+{
+  int tracks32 = plan->runs[0].tracks;
+  int tracks24 = plan->runs[1].tracks;
+  int shift = plan->runs[0].shift;
+  const uint8_t *end = dst + frames * plan->frame_size;
+
+  for (int i = 0; i < frames; i++)
+    {
+      encode_run_32_avx2 (src, dst, tracks32, shift, plan->runs[0].dither,
+			  plan->dither_state);
+      src += tracks32;
+      dst += tracks32 * 4;
+
+      encode_run_24_avx2 (src, dst, tracks24, end - dst,
+			  plan->runs[1].dither, plan->dither_state);
+      src += tracks24;
+      dst += tracks24 * 3;
+    }
+}
+
+static TARGET_AVX2 void
+encode_16_avx2 (struct ow_codec_plan *plan, const float *src, uint8_t *dst,
+		int frames)
+{
+  encode_run_16_avx2 (src, dst, frames * plan->tracks, plan->runs[0].dither,
+		      plan->dither_state);
+}
+
+#endif
+
+static const ow_codec_decoder_t DECODERS[][OW_CODEC_ISA_MAX] = {
+  [OW_CODEC_LAYOUT_GENERIC] = {decode_generic, NULL, NULL, NULL},
+  [OW_CODEC_LAYOUT_32] = {decode_32, SIMD_KERNEL (decode_32_sse2),
+			  SIMD_KERNEL (decode_32_ssse3),
+			  SIMD_KERNEL (decode_32_avx2)},
+  [OW_CODEC_LAYOUT_32_24] = {decode_32_24, SIMD_KERNEL (decode_32_24_sse2),
+			     SIMD_KERNEL (decode_32_24_ssse3),
+			     SIMD_KERNEL (decode_32_24_avx2)},
+  [OW_CODEC_LAYOUT_16] = {decode_16, SIMD_KERNEL (decode_16_sse2),
+			  SIMD_KERNEL (decode_16_ssse3),
+			  SIMD_KERNEL (decode_16_avx2)}
+};
+
+static const ow_codec_encoder_t ENCODERS[][OW_CODEC_ISA_MAX] = {
+  [OW_CODEC_LAYOUT_GENERIC] = {encode_generic, NULL, NULL, NULL},
+  [OW_CODEC_LAYOUT_32] = {encode_32, SIMD_KERNEL (encode_32_sse2),
+			  SIMD_KERNEL (encode_32_ssse3),
+			  SIMD_KERNEL (encode_32_avx2)},
+  [OW_CODEC_LAYOUT_32_24] = {encode_32_24, SIMD_KERNEL (encode_32_24_sse2),
+			     SIMD_KERNEL (encode_32_24_ssse3),
+			     SIMD_KERNEL (encode_32_24_avx2)},
+  [OW_CODEC_LAYOUT_16] = {encode_16, SIMD_KERNEL (encode_16_sse2), NULL,
+			  SIMD_KERNEL (encode_16_avx2)}
+};
+
+ow_codec_isa_t
+ow_codec_get_cpu_isa ()
+{
+#if defined(OW_CODEC_X86)
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    {
+      return OW_CODEC_ISA_AVX2;
+    }
+  if (__builtin_cpu_supports ("ssse3"))
+    {
+      return OW_CODEC_ISA_SSSE3;
+    }
+  if (__builtin_cpu_supports ("sse2"))
+    {
+      return OW_CODEC_ISA_SSE2;
+    }
+#endif
+  return OW_CODEC_ISA_SCALAR;
+}
+
+ow_codec_isa_t
+ow_codec_plan_set_isa (struct ow_codec_plan *plan, ow_codec_isa_t isa)
+{
+  ow_codec_isa_t cpu_isa = ow_codec_get_cpu_isa ();
+  ow_codec_isa_t i;
+
+  plan->isa = isa > cpu_isa ? cpu_isa : isa;
+
+  for (i = plan->isa; !DECODERS[plan->layout][i]; i--);
+  plan->decoder = DECODERS[plan->layout][i];
+
+  for (i = plan->isa; !ENCODERS[plan->layout][i]; i--);
+  plan->encoder = ENCODERS[plan->layout][i];
+
+  return plan->isa;
+}
+
+void
+ow_codec_plan_set_dither (struct ow_codec_plan *plan, int enabled)
+{
+  int bits;
+  struct ow_codec_run *run = plan->runs;
+
+  plan->dither = enabled != 0;
+
+  for (int i = 0; i < plan->runs_len; i++, run++)
+    {
+      bits = run->size * 8 - run->shift;
+      run->dither = plan->dither && bits < 32 ? 1u << (32 - bits) : 0;
+    }
+}
+
+void
+ow_codec_plan_init (struct ow_codec_plan *plan, ow_device_type_t type,
+		    int tracks, const struct ow_device_track *track)
+{
+  int shift;
+  size_t offset = 0;
+  struct ow_codec_run *run = NULL;
+
+  plan->tracks = tracks;
+  plan->runs_len = 0;
+
+  for (int i = 0; i < tracks; i++, track++)
+    {
+      //Type 3 devices send 24 bits samples in 4 bytes words.
+      shift = type == OW_DEVICE_TYPE_3 && track->size == 4 ? 8 : 0;
+      if (!run || run->size != track->size || run->shift != shift)
+	{
+	  run = &plan->runs[plan->runs_len];
+	  plan->runs_len++;
+	  run->tracks = 0;
+	  run->size = track->size;
+	  run->offset = offset;
+	  run->shift = shift;
+	}
+      run->tracks++;
+      offset += track->size;
+    }
+
+  plan->frame_size = offset;
+  plan->tracks_mask = tracks < 64 ? (1ULL << tracks) - 1 : ~0ULL;
+
+  for (int i = 0; i < OW_CODEC_DITHER_LANES; i++)
+    {
+      plan->dither_state[i] = 0x9e3779b9 * (i + 1);
+    }
+  ow_codec_plan_set_dither (plan, 0);
+
+  if (plan->runs_len == 1 && plan->runs[0].size == 4)
+    {
+      plan->layout = OW_CODEC_LAYOUT_32;
+    }
+  else if (plan->runs_len == 1 && plan->runs[0].size == 2)
+    {
+      plan->layout = OW_CODEC_LAYOUT_16;
+    }
+  else if (plan->runs_len == 2 && plan->runs[0].size == 4
+	   && plan->runs[1].size == 3)
+    {
+      plan->layout = OW_CODEC_LAYOUT_32_24;
+    }
+  else
+    {
+      plan->layout = OW_CODEC_LAYOUT_GENERIC;
+    }
+
+  ow_codec_plan_set_isa (plan, OW_CODEC_ISA_MAX - 1);
+
+  debug_print (2,
+	       "Codec plan: %d tracks, %d runs, %zu B frames (%s layout, %s)",
+	       plan->tracks, plan->runs_len, plan->frame_size,
+	       ow_codec_get_layout_name (plan->layout),
+	       ow_codec_get_isa_name (plan->isa));
+}
+
+//The tracks are converted one at a time as only a few of them are usually
+//enabled. There is no SIMD kernel for this as the samples of a track are
+//not contiguous.
+void
+ow_codec_decode_tracks (const struct ow_codec_plan *plan, const uint8_t *src,
+			float *dst, int frames, uint64_t tracks)
+{
+  const struct ow_codec_run *run = plan->runs;
+  const uint8_t *s;
+  float *d;
+  int track = 0;
+
+  for (int i = 0; i < plan->runs_len; i++, run++)
+    {
+      for (int j = 0; j < run->tracks; j++, track++)
+	{
+	  s = src + run->offset + j * run->size;
+	  d = dst + track;
+	  if (tracks & (1ULL << track))
+	    {
+	      for (int k = 0; k < frames; k++)
+		{
+		  *d = decode_sample (s, run);
+		  s += plan->frame_size;
+		  d += plan->tracks;
+		}
+	    }
+	  else
+	    {
+	      for (int k = 0; k < frames; k++)
+		{
+		  *d = 0;
+		  d += plan->tracks;
+		}
+	    }
+	}
+    }
+}
+
+void
+ow_codec_encode_tracks (struct ow_codec_plan *plan, const float *src,
+			uint8_t *dst, int frames, uint64_t tracks)
+{
+  const struct ow_codec_run *run = plan->runs;
+  const float *s;
+  uint8_t *d;
+  int track = 0;
+
+  for (int i = 0; i < plan->runs_len; i++, run++)
+    {
+      for (int j = 0; j < run->tracks; j++, track++)
+	{
+	  s = src + track;
+	  d = dst + run->offset + j * run->size;
+	  if (tracks & (1ULL << track))
+	    {
+	      for (int k = 0; k < frames; k++)
+		{
+		  store_sample (d, run, encode_sample (*s, run->dither,
+						       plan->dither_state));
+		  s += plan->tracks;
+		  d += plan->frame_size;
+		}
+	    }
+	  else
+	    {
+	      for (int k = 0; k < frames; k++)
+		{
+		  memset (d, 0, run->size);
+		  d += plan->frame_size;
+		}
+	    }
+	}
+    }
+}
+
+const char *
+ow_codec_get_layout_name (ow_codec_layout_t layout)
+{
+  return layout_names[layout];
+}
+
+const char *
+ow_codec_get_isa_name (ow_codec_isa_t isa)
+{
+  return isa_names[isa];
+}
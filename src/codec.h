@@ -0,0 +1,128 @@
+/*
+ *   codec.h
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "overwitch.h"
+
+//A codec plan converts the USB frames of a device to and from floats.
+//It is built once from the device tracks and the hot path only runs the
+//kernel selected for the layout.
+
+typedef enum
+{
+  OW_CODEC_LAYOUT_GENERIC,
+  OW_CODEC_LAYOUT_32,		//All tracks use 4 bytes (Type 2 and Type 3 inputs)
+  OW_CODEC_LAYOUT_32_24,	//4 bytes tracks followed by 3 bytes tracks (Type 3 outputs)
+  OW_CODEC_LAYOUT_16		//All tracks use 2 bytes (Type 1)
+} ow_codec_layout_t;
+
+//Instruction sets the kernels are available for, from the slowest to the fastest.
+typedef enum
+{
+  OW_CODEC_ISA_SCALAR,
+  OW_CODEC_ISA_SSE2,
+  OW_CODEC_ISA_SSSE3,
+  OW_CODEC_ISA_AVX2,
+  OW_CODEC_ISA_MAX
+} ow_codec_isa_t;
+
+//Consecutive tracks with the same sample size.
+struct ow_codec_run
+{
+  int tracks;
+  int size;			//Bytes per sample
+  int offset;			//Bytes from the beginning of the USB frame
+  int shift;			//Bits the big endian word is shifted to be left aligned
+  float dither;			//Dither amplitude (the LSB of the run) or 0 if disabled
+};
+
+struct ow_codec_plan;
+
+typedef void (*ow_codec_decoder_t) (const struct ow_codec_plan *,
+				    const uint8_t *, float *, int);
+
+//Encoders are not const as the dither state changes.
+typedef void (*ow_codec_encoder_t) (struct ow_codec_plan *,
+				    const float *, uint8_t *, int);
+
+#define OW_CODEC_DITHER_LANES 8
+
+struct ow_codec_plan
+{
+  ow_codec_layout_t layout;
+  ow_codec_isa_t isa;
+  int tracks;
+  uint64_t tracks_mask;		//All the tracks enabled
+  size_t frame_size;
+  int runs_len;
+  struct ow_codec_run runs[OB_MAX_TRACKS];
+  ow_codec_decoder_t decoder;
+  ow_codec_encoder_t encoder;
+  int dither;
+  uint32_t dither_state[OW_CODEC_DITHER_LANES];	//A xorshift generator per SIMD lane
+};
+
+void ow_codec_plan_init (struct ow_codec_plan *, ow_device_type_t, int,
+			 const struct ow_device_track *);
+
+const char *ow_codec_get_layout_name (ow_codec_layout_t);
+
+//The best instruction set supported by the running CPU.
+ow_codec_isa_t ow_codec_get_cpu_isa ();
+
+//Use the fastest kernels not exceeding the given instruction set. The plan
+//initialization already selects the ones for the running CPU.
+ow_codec_isa_t ow_codec_plan_set_isa (struct ow_codec_plan *,
+				      ow_codec_isa_t);
+
+const char *ow_codec_get_isa_name (ow_codec_isa_t);
+
+//Add TPDF dither when encoding floats into 24 and 16 bits samples. It is
+//disabled after the plan initialization. The dither sequence depends on the
+//instruction set so dithered outputs are not comparable between kernels.
+void ow_codec_plan_set_dither (struct ow_codec_plan *, int);
+
+//Decode USB frames into interleaved floats.
+static inline void
+ow_codec_decode (const struct ow_codec_plan *plan, const uint8_t *src,
+		 float *dst, int frames)
+{
+  plan->decoder (plan, src, dst, frames);
+}
+
+//Encode interleaved floats into USB frames. Samples out of [-1, 1] saturate.
+static inline void
+ow_codec_encode (struct ow_codec_plan *plan, const float *src,
+		 uint8_t *dst, int frames)
+{
+  plan->encoder (plan, src, dst, frames);
+}
+
+//Same as ow_codec_decode but only the tracks in the mask, where the bit n is
+//the track n, are decoded. The samples of the other tracks are set to 0.
+void ow_codec_decode_tracks (const struct ow_codec_plan *, const uint8_t *,
+			     float *, int, uint64_t);
+
+//Same as ow_codec_encode but only the tracks in the mask are encoded. The
+//samples of the other tracks are set to 0.
+void ow_codec_encode_tracks (struct ow_codec_plan *, const float *,
+			     uint8_t *, int, uint64_t);
@@ -125,6 +125,25 @@ get_ow_blocks_per_transfer_argument (const char *optarg)
   return blocks_per_transfer;
 }
 
+int
+get_ow_xfr_queue_depth_argument (const char *optarg)
+{
+  char *endstr;
+  int xfr_queue_depth;
+
+  errno = 0;
+  xfr_queue_depth = (int) strtol (optarg, &endstr, 10);
+  if (errno || endstr == optarg || *endstr != '\0' || xfr_queue_depth < 1
+      || xfr_queue_depth > OW_MAX_XFR_QUEUE_DEPTH)
+    {
+      xfr_queue_depth = OW_DEFAULT_XFR_QUEUE_DEPTH;
+      fprintf (stderr,
+	       "Queue depth value must be in [1..%d]. Using value %d...\n",
+	       OW_MAX_XFR_QUEUE_DEPTH, xfr_queue_depth);
+    }
+  return xfr_queue_depth;
+}
+
 int
 get_bus_address_from_str (char *input, uint8_t *bus, uint8_t *address)
 {
@@ -156,3 +175,42 @@ get_bus_address_from_str (char *input, uint8_t *bus, uint8_t *address)
 
   return 0;
 }
+
+//The target delay is either 'auto', an amount of frames or a multiple of the
+//default ending with 'x'.
+int
+get_ow_target_delay_argument (const char *optarg,
+			      ow_target_delay_policy_t *policy, double *value)
+{
+  char *endstr;
+
+  *policy = OW_TARGET_DELAY_DEFAULT;
+  *value = 0;
+
+  if (!strcmp (optarg, "auto"))
+    {
+      *policy = OW_TARGET_DELAY_AUTO;
+      return 0;
+    }
+
+  errno = 0;
+  *value = strtod (optarg, &endstr);
+  if (errno || endstr == optarg || *value <= 0)
+    {
+      return -EINVAL;
+    }
+
+  if (!strcmp (endstr, "x"))
+    {
+      *policy = OW_TARGET_DELAY_FACTOR;
+      return 0;
+    }
+
+  if (*endstr != '\0' || *value != (int) *value)
+    {
+      return -EINVAL;
+    }
+
+  *policy = OW_TARGET_DELAY_FRAMES;
+  return 0;
+}
@@ -36,4 +36,9 @@ int get_ow_xfr_timeout_argument (const char *);
 
 int get_ow_blocks_per_transfer_argument (const char *);
 
+int get_ow_xfr_queue_depth_argument (const char *);
+
 int get_bus_address_from_str (char *str, uint8_t *, uint8_t *);
+
+int get_ow_target_delay_argument (const char *, ow_target_delay_policy_t *,
+				  double *);
@@ -24,6 +24,13 @@
 #include "dll.h"
 
 #define ERR_TUNED_THRES 2
+#define KALMAN_INIT_DEVIATION 1.0e-3	//Initial drift uncertainty
+#define KALMAN_SEED_DEVIATION 1.0e-5	//Drift uncertainty when seeded
+#define KALMAN_ERROR_NOISE 1.0e-2	//Unmodelled error in frames per cycle
+#define KALMAN_INIT_MEASUREMENT_NOISE 1.0
+#define KALMAN_MIN_MEASUREMENT_NOISE 0.01
+#define KALMAN_MEASUREMENT_NOISE_RATE 1.0e-3
+#define KALMAN_OUTLIER_SIGMAS 8.0
 #define USEC_PER_SEC 1.0e6
 #define SEC_PER_USEC 1.0e-6
 
@@ -74,6 +81,8 @@ ow_dll_overbridge_update (void *data, uint32_t frames, uint64_t t)
 
   time = UINT64_USEC_TO_DOUBLE_SEC (t);
 
+  seqlock_write_begin (&dll_ob->seq);
+
   if (dll_ob->boot)
     {
       dll_ob->i0.time = time;
@@ -98,6 +107,8 @@ ow_dll_overbridge_update (void *data, uint32_t frames, uint64_t t)
   dll_ob->i0.frames = dll_ob->i1.frames;
   dll_ob->i1.frames += frames;
 
+  seqlock_write_end (&dll_ob->seq);
+
   debug_print (4, "time: %3.6f; t0: %3.6f: t1: %3.6f; f0: % 8d; f1: % 8d",
 	       time, dll_ob->i0.time, dll_ob->i1.time, dll_ob->i0.frames,
 	       dll_ob->i1.frames);
@@ -134,24 +145,203 @@ ow_dll_host_update_error (struct ow_dll *dll, uint64_t t)
 	       dll->target_delay, dll->err);
 }
 
-inline void
-ow_dll_host_update (struct ow_dll *dll)
+static void
+ow_dll_zalsa_update (struct ow_dll *dll)
 {
-  debug_print (4, "Updating host side of DLL...");
-
   dll->z1 += dll->w0 * (dll->w1 * dll->err - dll->z1);
   dll->z2 += dll->w0 * (dll->z1 - dll->z2);
   dll->z3 += dll->w2 * dll->z2;
   dll->ratio = 1.0 - dll->z2 - dll->z3;
 }
 
+static void
+ow_dll_zalsa_reset (struct ow_dll *dll, uint32_t output_frames)
+{
+}
+
+static void
+ow_dll_zalsa_seed (struct ow_dll *dll, double ratio, double z1, double z2,
+		   double z3)
+{
+  dll->z1 = z1;
+  dll->z2 = z2;
+  dll->z3 = z3;
+}
+
+//Taken from https://github.com/jackaudio/tools/blob/master/zalsa/jackclient.cc.
+static void
+ow_dll_zalsa_set_loop_filter (struct ow_dll *dll, double bw,
+			      uint32_t output_frames, double output_samplerate)
+{
+  double w = 2.0 * M_PI * 20 * bw * output_frames / output_samplerate;
+  dll->w0 = 1.0 - exp (-w);
+  w = 2.0 * M_PI * bw * dll->ratio / output_samplerate;
+  dll->w1 = w * 1.6;
+  dll->w2 = w * output_frames / 1.6;
+}
+
+static void
+ow_dll_kalman_reset (struct ow_dll *dll, uint32_t output_frames)
+{
+  struct ow_dll_kalman *k = &dll->kalman;
+  double deviation = KALMAN_INIT_DEVIATION / dll->ratio;
+
+  k->e = 0.0;
+  k->v = 1.0 / dll->ratio;
+  k->p_ee = ERR_TUNED_THRES * ERR_TUNED_THRES;
+  k->p_ev = 0.0;
+  k->p_vv = deviation * deviation;
+  k->r = KALMAN_INIT_MEASUREMENT_NOISE;
+  k->output_frames = output_frames;
+  k->set = 0;
+}
+
+static void
+ow_dll_kalman_seed (struct ow_dll *dll, double ratio, double z1, double z2,
+		    double z3)
+{
+  struct ow_dll_kalman *k = &dll->kalman;
+  double deviation = KALMAN_SEED_DEVIATION / ratio;
+
+  k->v = 1.0 / ratio;
+  k->p_ev = 0.0;
+  k->p_vv = deviation * deviation;
+}
+
+//The bandwidth sets how fast the error is corrected and how much the drift
+//is allowed to wander so that the estimator follows the loop filter stages.
+static void
+ow_dll_kalman_set_loop_filter (struct ow_dll *dll, double bw,
+			       uint32_t output_frames,
+			       double output_samplerate)
+{
+  struct ow_dll_kalman *k = &dll->kalman;
+
+  k->output_frames = output_frames;
+  k->w = 2.0 * M_PI * bw * output_frames / output_samplerate;
+  k->tau = output_frames / k->w;
+  if (k->tau < 2.0 * output_frames)
+    {
+      k->tau = 2.0 * output_frames;
+    }
+}
+
+//The state is the error and the device frames per host frame. The frames
+//consumed by the host since the previous update are known so the error is
+//predicted from them and corrected with the measured one.
+static void
+ow_dll_kalman_update (struct ow_dll *dll)
+{
+  double y, s, k0, k1, p_ee, p_ev, p_vv, n, w2, q_v;
+  int32_t used;
+  struct ow_dll_kalman *k = &dll->kalman;
+
+  if (k->set)
+    {
+      n = k->output_frames;
+      used = dll->frames - k->frames;
+
+      //The drift noise keeps the bandwidth of the estimator at the one of
+      //the loop filter regardless of the measurement noise.
+      w2 = k->w * k->w;
+      q_v = k->r * w2 * w2 / (n * n);
+
+      k->e += k->v * n - used;
+      p_ee = k->p_ee + 2.0 * n * k->p_ev + n * n * k->p_vv +
+	KALMAN_ERROR_NOISE * KALMAN_ERROR_NOISE;
+      p_ev = k->p_ev + n * k->p_vv;
+      p_vv = k->p_vv + q_v;
+
+      y = dll->err - k->e;
+      s = p_ee + k->r;
+
+      //A skipped cycle or a transfer that took too long must not affect
+      //the drift so the error is just taken as it is.
+      if (y * y > KALMAN_OUTLIER_SIGMAS * KALMAN_OUTLIER_SIGMAS * s)
+	{
+	  debug_print (2, "Ignoring DLL error %f (expected %f)", dll->err,
+		       k->e);
+	  k->e = dll->err;
+	  k->p_ee = p_ee;
+	  k->p_ev = p_ev;
+	  k->p_vv = p_vv;
+	}
+      else
+	{
+	  k0 = p_ee / s;
+	  k1 = p_ev / s;
+	  k->e += k0 * y;
+	  k->v += k1 * y;
+	  k->p_ee = (1.0 - k0) * p_ee;
+	  k->p_ev = (1.0 - k0) * p_ev;
+	  k->p_vv = p_vv - k1 * p_ev;
+
+	  //The measurement noise follows the jitter of the innovations.
+	  k->r += KALMAN_MEASUREMENT_NOISE_RATE * (y * y - p_ee - k->r);
+	  if (k->r < KALMAN_MIN_MEASUREMENT_NOISE)
+	    {
+	      k->r = KALMAN_MIN_MEASUREMENT_NOISE;
+	    }
+	}
+    }
+  else
+    {
+      k->e = dll->err;
+      k->set = 1;
+    }
+
+  k->frames = dll->frames;
+
+  dll->ratio = 1.0 / (k->v + k->e / k->tau);
+
+  //This keeps the state compatible with the loop filter so that the
+  //calibrations are valid for both estimators.
+  dll->z1 = 0.0;
+  dll->z2 = 0.0;
+  dll->z3 = 1.0 - dll->ratio;
+
+  debug_print (4, "Kalman error: %f; drift: %f; deviation: %e; noise: %f",
+	       k->e, k->v, sqrt (k->p_vv), k->r);
+}
+
+static const struct ow_dll_estimator OW_DLL_ESTIMATORS[] = {
+  {
+   .name = "zalsa",
+   .reset = ow_dll_zalsa_reset,
+   .seed = ow_dll_zalsa_seed,
+   .set_loop_filter = ow_dll_zalsa_set_loop_filter,
+   .update = ow_dll_zalsa_update},
+  {
+   .name = "kalman",
+   .reset = ow_dll_kalman_reset,
+   .seed = ow_dll_kalman_seed,
+   .set_loop_filter = ow_dll_kalman_set_loop_filter,
+   .update = ow_dll_kalman_update}
+};
+
+const char *
+ow_dll_estimator_name (ow_dll_estimator_t estimator)
+{
+  return OW_DLL_ESTIMATORS[estimator].name;
+}
+
+inline void
+ow_dll_host_update (struct ow_dll *dll)
+{
+  debug_print (4, "Updating host side of DLL...");
+
+  dll->estimator->update (dll);
+}
+
 inline void
-ow_dll_host_init (struct ow_dll *dll)
+ow_dll_host_init (struct ow_dll *dll, ow_dll_estimator_t estimator)
 {
   debug_print (2, "Initializing host side of DLL...");
+  dll->estimator = &OW_DLL_ESTIMATORS[estimator];
   dll->set = 0;
   dll->boot = 1;
   dll->dll_overbridge.boot = 1;
+  atomic_init (&dll->dll_overbridge.seq, 0);
   dll->t_quantum = ldexp (1e-6, 28);	//28 bits as used in UINT64_USEC_TO_DOUBLE_SEC
 }
 
@@ -173,25 +363,55 @@ ow_dll_host_reset (struct ow_dll *dll, double output_samplerate,
   dll->frames = -input_frames / dll->ratio;
 
   dll->target_delay = 2.0 * input_frames + 1.5 * output_frames;
+
+  dll->estimator->reset (dll, output_frames);
+}
+
+inline void
+ow_dll_host_seed (struct ow_dll *dll, double ratio, double z1, double z2,
+		  double z3)
+{
+  debug_print (2, "Seeding the DLL with ratio %f...", ratio);
+
+  dll->ratio = ratio;
+
+  dll->estimator->seed (dll, ratio, z1, z2, z3);
 }
 
-//Taken from https://github.com/jackaudio/tools/blob/master/zalsa/jackclient.cc.
 inline void
 ow_dll_host_set_loop_filter (struct ow_dll *dll, double bw,
 			     uint32_t output_frames, double output_samplerate)
 {
-  double w = 2.0 * M_PI * 20 * bw * output_frames / output_samplerate;
-  dll->w0 = 1.0 - exp (-w);
-  w = 2.0 * M_PI * bw * dll->ratio / output_samplerate;
-  dll->w1 = w * 1.6;
-  dll->w2 = w * output_frames / 1.6;
+  dll->estimator->set_loop_filter (dll, bw, output_frames,
+				   output_samplerate);
+}
+
+inline void
+ow_dll_host_resync (struct ow_dll *dll, int32_t frames)
+{
+  debug_print (2, "Resyncing the DLL by %d frames...", frames);
+
+  dll->frames += frames;
+  dll->err -= frames;
 }
 
+//This never blocks the engine thread. The host thread retries if an update
+//happened while copying.
 inline void
 ow_dll_host_load_dll_overbridge (struct ow_dll *dll)
 {
-  dll->i0 = dll->dll_overbridge.i0;
-  dll->i1 = dll->dll_overbridge.i1;
+  unsigned int s0, s1;
+  struct ow_dll_overbridge *dll_ob = &dll->dll_overbridge;
+
+  do
+    {
+      s0 = atomic_load_explicit (&dll_ob->seq, memory_order_acquire);
+      dll->i0 = dll_ob->i0;
+      dll->i1 = dll_ob->i1;
+      atomic_thread_fence (memory_order_acquire);
+      s1 = atomic_load_explicit (&dll_ob->seq, memory_order_relaxed);
+    }
+  while ((s0 & 1) || s0 != s1);
 }
 
 inline int
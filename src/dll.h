@@ -21,6 +21,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdatomic.h>
+#include "overwitch.h"
 
 struct instant
 {
@@ -28,8 +30,11 @@ struct instant
   uint32_t frames;
 };
 
+//i0 and i1 are written by the engine thread and read by the host thread so
+//they are published with a seqlock. The sequence is odd while writing.
 struct ow_dll_overbridge
 {
+  atomic_uint seq;
   struct instant i0;
   struct instant i1;
   double dt;
@@ -38,8 +43,39 @@ struct ow_dll_overbridge
   int boot;
 };
 
+//State of the Kalman estimator. The error in frames and the device frames
+//per host frame are estimated together from the DLL error.
+struct ow_dll_kalman
+{
+  double e;
+  double v;
+  double p_ee;
+  double p_ev;
+  double p_vv;
+  double r;			//Measurement noise
+  double w;			//Bandwidth in radians per cycle
+  double tau;			//Error correction time in host frames
+  uint32_t output_frames;
+  uint32_t frames;		//Host frames seen in the previous update
+  int set;
+};
+
+struct ow_dll;
+
+//A clock estimator computes the ratio from the DLL error on every host
+//cycle. The loop filter bandwidth is given for every resampler stage.
+struct ow_dll_estimator
+{
+  const char *name;
+  void (*reset) (struct ow_dll *, uint32_t);
+  void (*seed) (struct ow_dll *, double, double, double, double);
+  void (*set_loop_filter) (struct ow_dll *, double, uint32_t, double);
+  void (*update) (struct ow_dll *);
+};
+
 struct ow_dll
 {
+  const struct ow_dll_estimator *estimator;
   double ratio;
   uint32_t frames;
   double w0;
@@ -49,6 +85,7 @@ struct ow_dll
   double z1;
   double z2;
   double z3;
+  struct ow_dll_kalman kalman;
   double t_quantum;
   double err;
   struct instant i0;
@@ -62,12 +99,21 @@ void ow_dll_overbridge_init (void *, double, uint32_t);
 
 void ow_dll_overbridge_update (void *, uint32_t, uint64_t);
 
-void ow_dll_host_init (struct ow_dll *);
+void ow_dll_host_init (struct ow_dll *, ow_dll_estimator_t);
 
 void ow_dll_host_reset (struct ow_dll *, double, double, uint32_t, uint32_t);
 
+//Start from a previously converged ratio and loop state instead of the
+//nominal ratio. It must be called after resetting.
+void ow_dll_host_seed (struct ow_dll *, double, double, double, double);
+
 void ow_dll_host_set_loop_filter (struct ow_dll *, double, uint32_t, double);
 
+//Account the frames dropped from the buffer (or the silence added if
+//negative) so that these are not seen as an error. The ratio and the loop
+//state are kept. It must be called after updating the error.
+void ow_dll_host_resync (struct ow_dll *, int32_t);
+
 void ow_dll_host_update_error (struct ow_dll *, uint64_t);
 
 void ow_dll_host_update (struct ow_dll *);
@@ -75,3 +121,5 @@ void ow_dll_host_update (struct ow_dll *);
 void ow_dll_host_load_dll_overbridge (struct ow_dll *);
 
 int ow_dll_tuned (struct ow_dll *);
+
+const char *ow_dll_estimator_name (ow_dll_estimator_t);
@@ -28,9 +28,11 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <endian.h>
+#include <inttypes.h>
 #include <time.h>
 #include <unistd.h>
 #include "engine.h"
+#include "reactor.h"
 
 #define AUDIO_OUT_EP 0x03
 #define AUDIO_OUT_INTERFACE 2
@@ -42,12 +44,15 @@
 
 #define PAUSE_TO_BE_WAITING_USECS 500000
 
-#define USB_CONTROL_LEN (sizeof (struct libusb_control_setup) + OB_NAME_MAX_LEN)
+//Larger frame counter jumps, forwards or backwards, are not filled.
+#define O2H_MAX_GAP_TRANSFERS 8
 
-#define INT32_TO_FLOAT32_SCALE ((float) (1.0f / INT32_MAX))
+#define USB_CONTROL_LEN (sizeof (struct libusb_control_setup) + OB_NAME_MAX_LEN)
 
-static void prepare_cycle_in_audio ();
-static void prepare_cycle_out_audio ();
+static void prepare_cycle_in_audio (struct ow_engine *,
+				    struct libusb_transfer *, uint8_t *);
+static void prepare_cycle_out_audio (struct ow_engine *,
+				     struct libusb_transfer *, uint8_t *);
 static void ow_engine_load_overbridge_name (struct ow_engine *);
 
 static void
@@ -60,18 +65,23 @@ ow_engine_init_name (struct ow_engine *engine)
 }
 
 static int
-prepare_transfers (struct ow_engine *engine)
+prepare_transfers (struct ow_engine *engine, unsigned int blocks_per_transfer)
 {
-  engine->usb.xfr_audio_in = libusb_alloc_transfer (0);
-  if (!engine->usb.xfr_audio_in)
-    {
-      return -ENOMEM;
-    }
+  int iso_packets = engine->usb.iso ? blocks_per_transfer : 0;
 
-  engine->usb.xfr_audio_out = libusb_alloc_transfer (0);
-  if (!engine->usb.xfr_audio_out)
+  for (int i = 0; i < engine->usb.xfr_queue_depth; i++)
     {
-      return -ENOMEM;
+      engine->usb.xfr_audio_in[i] = libusb_alloc_transfer (iso_packets);
+      if (!engine->usb.xfr_audio_in[i])
+	{
+	  return -ENOMEM;
+	}
+
+      engine->usb.xfr_audio_out[i] = libusb_alloc_transfer (iso_packets);
+      if (!engine->usb.xfr_audio_out[i])
+	{
+	  return -ENOMEM;
+	}
     }
 
   engine->usb.xfr_control_in = libusb_alloc_transfer (0);
@@ -89,119 +99,372 @@ prepare_transfers (struct ow_engine *engine)
   return LIBUSB_SUCCESS;
 }
 
-inline void
-ow_engine_read_usb_input_blocks (struct ow_engine *engine)
+//The regions must have room for a whole transfer. As they are frame
+//aligned, only the frames of a block might be split between them.
+//The disabled tracks are not decoded but cleared so the frames in the
+//buffer always have all the tracks.
+void
+ow_engine_decode_usb_input_blocks (struct ow_engine *engine,
+				   struct ow_buffer_region *regions)
 {
-  int32_t hv;
-  uint8_t *s;
   struct ow_engine_usb_blk *blk;
-  float *f = engine->o2h_transfer_buf;
+  struct ow_buffer_region *region = regions;
+  size_t frame_size = engine->o2h_codec.tracks * OW_BYTES_PER_SAMPLE;
+  size_t available = region->len / frame_size;
+  float *f = (float *) region->data;
+  const uint8_t *src;
+  int frames, n;
 
   for (int i = 0; i < engine->blocks_per_transfer; i++)
     {
       blk = GET_NTH_INPUT_USB_BLK (engine, i);
-      s = (uint8_t *) blk->data;
-      for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
+      src = (uint8_t *) blk->data;
+      frames = OB_FRAMES_PER_BLOCK;
+      while (frames)
 	{
-	  for (int k = 0; k < engine->device->desc.outputs; k++)
+	  if (!available)
 	    {
-	      int size = engine->device->desc.output_tracks[k].size;
+	      region++;
+	      available = region->len / frame_size;
+	      f = (float *) region->data;
+	    }
+	  n = frames < available ? frames : available;
+	  if (engine->o2h_tracks == engine->o2h_codec.tracks_mask)
+	    {
+	      ow_codec_decode (&engine->o2h_codec, src, f, n);
+	    }
+	  else
+	    {
+	      ow_codec_decode_tracks (&engine->o2h_codec, src, f, n,
+				      engine->o2h_tracks);
+	    }
+	  src += n * engine->o2h_codec.frame_size;
+	  f += n * engine->o2h_codec.tracks;
+	  available -= n;
+	  frames -= n;
+	}
+    }
+}
 
-	      memcpy (&hv, s, size);
+inline void
+ow_engine_read_usb_input_blocks (struct ow_engine *engine)
+{
+  struct ow_buffer_region regions[] = {
+    {.data = (char *) engine->o2h_transfer_buf,.len =
+     engine->o2h_transfer_size},
+    {.data = NULL,.len = 0}
+  };
+  ow_engine_decode_usb_input_blocks (engine, regions);
+}
 
-	      if (engine->device->desc.type == OW_DEVICE_TYPE_3 && size == 4)
-		{
-		  hv >>= 8;
-		}
+//The maximum might be reset by other threads at any time.
+static inline void
+set_latency (atomic_size_t *latency, atomic_size_t *max_latency,
+	     size_t value)
+{
+  size_t max = atomic_load_explicit (max_latency, memory_order_relaxed);
+
+  atomic_store_explicit (latency, value, memory_order_relaxed);
+  while (value > max &&
+	 !atomic_compare_exchange_weak_explicit (max_latency, &max, value,
+						 memory_order_relaxed,
+						 memory_order_relaxed));
+}
+
+static inline void
+ow_engine_count (struct ow_engine *engine, ow_engine_stat_t stat, uint64_t n)
+{
+  atomic_fetch_add_explicit (&engine->stats[stat], n, memory_order_relaxed);
+}
+
+static void
+ow_engine_count_usb_error (struct ow_engine *engine,
+			   enum libusb_transfer_status status)
+{
+  if (status >= LIBUSB_TRANSFER_ERROR && status <= LIBUSB_TRANSFER_OVERFLOW)
+    {
+      ow_engine_count (engine, OW_ENGINE_STAT_USB_ERROR + status -
+		       LIBUSB_TRANSFER_ERROR, 1);
+    }
+}
+
+//Only the first bucket and the last one include durations out of their
+//range.
+void
+ow_engine_add_histogram_sample (struct ow_engine *engine,
+				ow_histogram_t histogram, uint64_t ns)
+{
+  struct ow_engine_histogram *h = &engine->histograms[histogram];
+  int bucket = ns ? 63 - __builtin_clzll (ns) : 0;
+  uint64_t max = atomic_load_explicit (&h->max, memory_order_relaxed);
+
+  if (bucket >= OW_HISTOGRAM_BUCKETS)
+    {
+      bucket = OW_HISTOGRAM_BUCKETS - 1;
+    }
+
+  atomic_fetch_add_explicit (&h->buckets[bucket], 1, memory_order_relaxed);
+
+  while (ns > max &&
+	 !atomic_compare_exchange_weak_explicit (&h->max, &max, ns,
+						 memory_order_relaxed,
+						 memory_order_relaxed));
+}
+
+//Returns the callback start time.
+static inline uint64_t
+ow_engine_start_cb_timing (struct ow_engine *engine, uint64_t *last,
+			   ow_histogram_t period)
+{
+  uint64_t now = ow_get_raw_time ();
+
+  if (*last)
+    {
+      ow_engine_add_histogram_sample (engine, period, now - *last);
+    }
+  *last = now;
 
-	      hv = be32toh (hv);
+  return now;
+}
+
+//The device increments the frame counter by the frames of a block. Repeated
+//blocks are kept as they are as the device has spent their time anyway.
+int
+ow_engine_check_usb_input_frames (struct ow_engine *engine)
+{
+  int16_t diff;
+  uint16_t frames;
+  struct ow_engine_usb_blk *blk;
+  int missing = 0;
+  int max = engine->frames_per_transfer * O2H_MAX_GAP_TRANSFERS;
+
+  for (int i = 0; i < engine->blocks_per_transfer; i++)
+    {
+      blk = GET_NTH_INPUT_USB_BLK (engine, i);
+      frames = be16toh (blk->frames);
+      diff = frames - engine->usb.audio_in_frames_counter;
 
-	      *f = hv / (float) INT32_MAX;
-	      f++;
-	      s += size;
+      if (engine->usb.audio_in_frames_counter_valid && diff)
+	{
+	  //The counter wraps around so the larger jumps are ambiguous.
+	  if (diff < 0 && diff >= -max)
+	    {
+	      debug_print (2, "o2h: Block %d repeated (%d frames)", i, diff);
+	      ow_engine_count (engine, OW_ENGINE_STAT_O2H_REPEATS, 1);
+	    }
+	  else if (diff > 0 && diff <= max)
+	    {
+	      debug_print (2, "o2h: %d frames missing before block %d", diff,
+			   i);
+	      ow_engine_count (engine, OW_ENGINE_STAT_O2H_GAPS, 1);
+	      missing += diff;
+	    }
+	  else
+	    {
+	      error_print ("o2h: Frame counter jump of %d frames", diff);
+	      ow_engine_count (engine, OW_ENGINE_STAT_O2H_GAPS, 1);
 	    }
 	}
+
+      engine->usb.audio_in_frames_counter = frames + OB_FRAMES_PER_BLOCK;
+      engine->usb.audio_in_frames_counter_valid = 1;
+    }
+
+  return missing;
+}
+
+//The missing frames are written as silence before the transfer, so its
+//position inside the transfer is lost but the ring stays aligned with the
+//frames counted by the DLL.
+static void
+write_usb_input_silence (struct ow_engine *engine, int frames)
+{
+  size_t len;
+  struct ow_context *context = engine->context;
+  size_t bytes = frames * engine->device->desc.outputs * OW_BYTES_PER_SAMPLE;
+
+  if (context->write_space (context->o2h_audio) <
+      bytes + engine->o2h_transfer_size)
+    {
+      error_print ("o2h: No space for %d missing frames", frames);
+      return;
+    }
+
+  memset (engine->o2h_transfer_buf, 0, engine->o2h_transfer_size);
+  while (bytes)
+    {
+      len = bytes < engine->o2h_transfer_size ? bytes :
+	engine->o2h_transfer_size;
+      context->write (context->o2h_audio, (void *) engine->o2h_transfer_buf,
+		      len);
+      bytes -= len;
     }
+
+  ow_engine_count (engine, OW_ENGINE_STAT_O2H_INSERTED_FRAMES, frames);
 }
 
 static void
-set_usb_input_data_blks (struct ow_engine *engine)
+set_usb_input_data_blks (struct ow_engine *engine, int missing)
 {
   size_t wso2h;
   ow_engine_status_t status;
+  struct ow_buffer_region regions[2];
+  struct ow_context *context = engine->context;
 
-  pthread_spin_lock (&engine->lock);
-  if (engine->context->dll)
+  if (context->dll)
     {
-      engine->context->dll_overbridge_update (engine->context->dll,
-					      engine->frames_per_transfer,
-					      engine->context->get_time ());
+      context->dll_overbridge_update (context->dll,
+				      engine->frames_per_transfer + missing,
+				      context->get_time ());
     }
-  status = engine->status;
-  pthread_spin_unlock (&engine->lock);
-
-  ow_engine_read_usb_input_blocks (engine);
+  status = ow_engine_get_status (engine);
 
   if (status < OW_ENGINE_STATUS_RUN)
     {
       return;
     }
 
-  wso2h = engine->context->write_space (engine->context->o2h_audio);
-  if (engine->o2h_transfer_size <= wso2h)
+  engine->o2h_tracks = ~atomic_load_explicit (&context->o2h_disabled_tracks,
+					      memory_order_relaxed) &
+    engine->o2h_codec.tracks_mask;
+
+  if (missing)
     {
-      engine->context->write (engine->context->o2h_audio,
-			      (void *) engine->o2h_transfer_buf,
-			      engine->o2h_transfer_size);
+      write_usb_input_silence (engine, missing);
+    }
+
+  //The samples are decoded straight into the buffer memory if possible.
+  if (context->get_write_regions)
+    {
+      wso2h = context->get_write_regions (context->o2h_audio, regions);
     }
   else
     {
-      error_print ("o2h: Audio ring buffer overflow. Discarding data...");
+      wso2h = context->write_space (context->o2h_audio);
     }
 
-  pthread_spin_lock (&engine->lock);
-  engine->o2h_latency =
-    engine->context->read_space (engine->context->o2h_audio);
-  if (engine->o2h_latency > engine->o2h_max_latency)
+  if (engine->o2h_transfer_size <= wso2h)
     {
-      engine->o2h_max_latency = engine->o2h_latency;
+      if (context->get_write_regions)
+	{
+	  ow_engine_decode_usb_input_blocks (engine, regions);
+	  context->write_commit (context->o2h_audio,
+				 engine->o2h_transfer_size);
+	}
+      else
+	{
+	  ow_engine_read_usb_input_blocks (engine);
+	  context->write (context->o2h_audio,
+			  (void *) engine->o2h_transfer_buf,
+			  engine->o2h_transfer_size);
+	}
     }
-  pthread_spin_unlock (&engine->lock);
+  else
+    {
+      error_print ("o2h: Audio ring buffer overflow. Discarding data...");
+      ow_engine_count (engine, OW_ENGINE_STAT_O2H_OVERFLOWS, 1);
+    }
+
+  set_latency (&engine->o2h_latency, &engine->o2h_max_latency,
+	       engine->context->read_space (engine->context->o2h_audio));
 }
 
-inline void
-ow_engine_write_usb_output_blocks (struct ow_engine *engine)
+//The regions must hold a whole transfer. See the decoding.
+void
+ow_engine_encode_usb_output_blocks (struct ow_engine *engine,
+				    struct ow_buffer_region *regions)
 {
-  int32_t ov;
-  uint8_t *s;
   struct ow_engine_usb_blk *blk;
-  float *f = engine->h2o_transfer_buf;
+  struct ow_buffer_region *region = regions;
+  size_t frame_size = engine->h2o_codec.tracks * OW_BYTES_PER_SAMPLE;
+  size_t available = region->len / frame_size;
+  const float *f = (float *) region->data;
+  uint8_t *dst;
+  int frames, n;
 
   for (int i = 0; i < engine->blocks_per_transfer; i++)
     {
       blk = GET_NTH_OUTPUT_USB_BLK (engine, i);
       blk->frames = htobe16 (engine->usb.audio_frames_counter);
       engine->usb.audio_frames_counter += OB_FRAMES_PER_BLOCK;
-      s = (uint8_t *) blk->data;
-      for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
+      dst = (uint8_t *) blk->data;
+      frames = OB_FRAMES_PER_BLOCK;
+      while (frames)
 	{
-	  for (int k = 0; k < engine->device->desc.inputs; k++)
+	  if (!available)
+	    {
+	      region++;
+	      available = region->len / frame_size;
+	      f = (float *) region->data;
+	    }
+	  n = frames < available ? frames : available;
+	  if (engine->h2o_tracks == engine->h2o_codec.tracks_mask)
 	    {
-	      int size = engine->device->desc.input_tracks[k].size;
-	      ov = (int32_t) (*f * INT32_MAX);
+	      ow_codec_encode (&engine->h2o_codec, f, dst, n);
+	    }
+	  else
+	    {
+	      ow_codec_encode_tracks (&engine->h2o_codec, f, dst, n,
+				      engine->h2o_tracks);
+	    }
+	  dst += n * engine->h2o_codec.frame_size;
+	  f += n * engine->h2o_codec.tracks;
+	  available -= n;
+	  frames -= n;
+	}
+    }
+}
 
-	      if (engine->device->desc.type == OW_DEVICE_TYPE_3 && size == 4)
-		{
-		  ov >>= 8;
-		}
+inline void
+ow_engine_write_usb_output_blocks (struct ow_engine *engine)
+{
+  struct ow_buffer_region regions[] = {
+    {.data = (char *) engine->h2o_transfer_buf,.len =
+     engine->h2o_transfer_size},
+    {.data = NULL,.len = 0}
+  };
+  ow_engine_encode_usb_output_blocks (engine, regions);
+}
 
-	      ov = htobe32 (ov);
+//Linear interpolation is enough as this only happens very occasionally and
+//nothing is allocated in the USB thread. With no frames, there is silence.
+void
+ow_engine_conceal_h2o (struct ow_engine *engine, long frames)
+{
+  long i;
+  double pos, step, frac;
+  int channels = engine->device->desc.inputs;
+  const float *src = engine->h2o_conceal_buf;
+  float *dst = engine->h2o_transfer_buf;
 
-	      memcpy (s, &ov, size);
+  ow_engine_count (engine, OW_ENGINE_STAT_H2O_UNDERFLOWS, 1);
+  ow_engine_count (engine, OW_ENGINE_STAT_H2O_CONCEALED_FRAMES,
+		   engine->frames_per_transfer - frames);
 
-	      f++;
-	      s += size;
-	    }
+  if (frames <= 0)
+    {
+      memset (dst, 0, engine->h2o_transfer_size);
+      return;
+    }
+
+  //The first and the last frames are kept so that the transfer joins the
+  //previous and the next ones.
+  step = (frames - 1) / (double) (engine->frames_per_transfer - 1);
+  for (int j = 0; j < engine->frames_per_transfer; j++, dst += channels)
+    {
+      pos = j * step;
+      i = (long) pos;
+      if (i >= frames - 1)
+	{
+	  memcpy (dst, &src[(frames - 1) * channels],
+		  channels * sizeof (float));
+	  continue;
+	}
+      frac = pos - i;
+      for (int k = 0; k < channels; k++)
+	{
+	  dst[k] = src[i * channels + k] * (1.0 - frac) +
+	    src[(i + 1) * channels + k] * frac;
 	}
     }
 }
@@ -212,8 +475,15 @@ set_usb_output_data_blks (struct ow_engine *engine)
   size_t rsh2o;
   size_t bytes;
   long frames;
-  int res;
+  struct ow_buffer_region regions[2];
   int h2o_enabled = ow_engine_is_option (engine, OW_ENGINE_OPTION_H2O_AUDIO);
+  int dither = ow_engine_is_option (engine, OW_ENGINE_OPTION_H2O_DITHER);
+
+  //The plan is only changed here as this thread is the one that uses it.
+  if (dither != engine->h2o_codec.dither)
+    {
+      ow_codec_plan_set_dither (&engine->h2o_codec, dither);
+    }
 
   if (h2o_enabled)
     {
@@ -239,22 +509,32 @@ set_usb_output_data_blks (struct ow_engine *engine)
 	  debug_print (2, "h2o: Clearing buffer and stopping...");
 	  memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
 	  engine->reading_at_h2o_end = 0;
-	  engine->h2o_max_latency = 0;
+	  atomic_store_explicit (&engine->h2o_max_latency, 0,
+				 memory_order_relaxed);
 	  goto set_blocks;
 	}
       return;
     }
 
-  pthread_spin_lock (&engine->lock);
-  engine->h2o_latency = rsh2o;
-  if (engine->h2o_latency > engine->h2o_max_latency)
-    {
-      engine->h2o_max_latency = engine->h2o_latency;
-    }
-  pthread_spin_unlock (&engine->lock);
+  set_latency (&engine->h2o_latency, &engine->h2o_max_latency, rsh2o);
+
+  engine->h2o_tracks =
+    ~atomic_load_explicit (&engine->context->h2o_disabled_tracks,
+			   memory_order_relaxed) &
+    engine->h2o_codec.tracks_mask;
 
   if (rsh2o >= engine->h2o_transfer_size)
     {
+      //The samples are encoded straight from the buffer memory if possible.
+      if (engine->context->get_read_regions)
+	{
+	  engine->context->get_read_regions (engine->context->h2o_audio,
+					     regions);
+	  ow_engine_encode_usb_output_blocks (engine, regions);
+	  engine->context->read_commit (engine->context->h2o_audio,
+					engine->h2o_transfer_size);
+	  return;
+	}
       engine->context->read (engine->context->h2o_audio,
 			     (void *) engine->h2o_transfer_buf,
 			     engine->h2o_transfer_size);
@@ -262,73 +542,173 @@ set_usb_output_data_blks (struct ow_engine *engine)
   else if (rsh2o > engine->h2o_frame_size)	//At least 2 frames to apply resampling to
     {
       debug_print (2,
-		   "h2o: Audio ring buffer underflow (%zu B < %zu B). Resampling...",
+		   "h2o: Audio ring buffer underflow (%zu B < %zu B). Stretching...",
 		   rsh2o, engine->h2o_transfer_size);
       frames = rsh2o / engine->h2o_frame_size;
       bytes = frames * engine->h2o_frame_size;
       engine->context->read (engine->context->h2o_audio,
-			     (void *) engine->h2o_resampler_buf, bytes);
-      engine->h2o_data.input_frames = frames;
-      engine->h2o_data.src_ratio =
-	(double) engine->frames_per_transfer / frames;
-      //We should NOT use the simple API but since this only happens very occasionally and mostly at startup, this has very low impact on audio quality.
-      res = src_simple (&engine->h2o_data, SRC_SINC_FASTEST,
-			engine->device->desc.inputs);
-      if (res)
-	{
-	  error_print
-	    ("h2o: Error while resampling %zu frames (%zu B, ratio %f): %s",
-	     frames, bytes, engine->h2o_data.src_ratio, src_strerror (res));
-	}
-      else if (engine->h2o_data.output_frames_gen !=
-	       engine->frames_per_transfer)
-	{
-	  error_print
-	    ("h2o: Unexpected frames with ratio %f (output %ld, expected %d)",
-	     engine->h2o_data.src_ratio, engine->h2o_data.output_frames_gen,
-	     engine->frames_per_transfer);
-	}
+			     (void *) engine->h2o_conceal_buf, bytes);
+      ow_engine_conceal_h2o (engine, frames);
     }
   else
     {
       debug_print (2, "h2o: Not enough data (%zu B). Waiting...", rsh2o);
-      memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
+      ow_engine_conceal_h2o (engine, 0);
     }
 
 set_blocks:
   ow_engine_write_usb_output_blocks (engine);
 }
 
-static void LIBUSB_CALL
-cb_xfr_audio_in (struct libusb_transfer *xfr)
+//Every isochronous packet has its own status and a lost packet does not
+//make the transfer fail. The blocks of the input packets with errors are
+//cleared so that they are decoded as silence. Returns the failed packets.
+int
+ow_engine_check_iso_packets (struct ow_engine *engine,
+			     struct libusb_transfer *xfr, int input)
 {
-  struct ow_engine *engine = xfr->user_data;
+  struct libusb_iso_packet_descriptor *pkt;
+  struct ow_engine_usb_blk *blk, *prev;
+  int errors = 0;
+
+  for (int i = 0; i < xfr->num_iso_packets; i++)
+    {
+      pkt = &xfr->iso_packet_desc[i];
+      if (pkt->status == LIBUSB_TRANSFER_COMPLETED &&
+	  pkt->actual_length == pkt->length)
+	{
+	  continue;
+	}
+
+      debug_print (2, "%s: Error on USB audio packet %d (%d B < %d B): %s",
+		   input ? "o2h" : "h2o", i, pkt->actual_length,
+		   pkt->length, libusb_error_name (pkt->status));
+      errors++;
+
+      if (input)
+	{
+	  blk = GET_NTH_USB_BLK (xfr->buffer, engine->usb.audio_in_blk_len,
+				 i);
+	  memset (blk->data, 0, engine->usb.audio_in_blk_len -
+		  sizeof (struct ow_engine_usb_blk));
+	  //The frame counter is set to the expected one as the silence takes
+	  //the place of the lost block.
+	  if (i)
+	    {
+	      prev = GET_NTH_USB_BLK (xfr->buffer,
+				      engine->usb.audio_in_blk_len, i - 1);
+	      blk->frames = htobe16 (be16toh (prev->frames) +
+				     OB_FRAMES_PER_BLOCK);
+	    }
+	  else if (engine->usb.audio_in_frames_counter_valid)
+	    {
+	      blk->frames = htobe16 (engine->usb.audio_in_frames_counter);
+	    }
+	}
+    }
+
+  return errors;
+}
+
+//libusb does not set the actual length of isochronous transfers.
+int
+ow_engine_get_xfr_actual_length (struct ow_engine *engine,
+				 struct libusb_transfer *xfr)
+{
+  int length = 0;
+
+  if (!engine->usb.iso)
+    {
+      return xfr->actual_length;
+    }
+
+  for (int i = 0; i < xfr->num_iso_packets; i++)
+    {
+      length += xfr->iso_packet_desc[i].actual_length;
+    }
+
+  return length;
+}
+
+//The blocks after the actual length of an incomplete transfer still hold the
+//data from the last time the buffer was used, so the whole transfer is
+//discarded. The blocks received are then found missing by the next one.
+void
+ow_engine_process_usb_input (struct ow_engine *engine,
+			     struct libusb_transfer *xfr)
+{
+  int errors, missing;
 
   if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
     {
-      if (xfr->length < xfr->actual_length)
+      ow_engine_count (engine, OW_ENGINE_STAT_O2H_TRANSFERS, 1);
+      ow_engine_count (engine, OW_ENGINE_STAT_O2H_BYTES,
+		       ow_engine_get_xfr_actual_length (engine, xfr));
+    }
+
+  if (xfr->status == LIBUSB_TRANSFER_COMPLETED && engine->usb.iso)
+    {
+      errors = ow_engine_check_iso_packets (engine, xfr, 1);
+      if (errors)
+	{
+	  error_print ("o2h: %d of %d USB audio packets lost", errors,
+		       xfr->num_iso_packets);
+	  ow_engine_count (engine, OW_ENGINE_STAT_O2H_LOST_PACKETS, errors);
+	}
+
+      missing = ow_engine_check_usb_input_frames (engine);
+
+      if (engine->context->options & OW_ENGINE_OPTION_O2H_AUDIO)
+	{
+	  set_usb_input_data_blks (engine, missing);
+	}
+    }
+  else if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
+    {
+      if (xfr->actual_length < xfr->length)
 	{
 	  error_print
-	    ("o2h: incomplete USB audio transfer (%d B < %d B)", xfr->length,
-	     xfr->actual_length);
+	    ("o2h: incomplete USB audio transfer (%d B < %d B)",
+	     xfr->actual_length, xfr->length);
+	  ow_engine_count (engine, OW_ENGINE_STAT_O2H_INCOMPLETE, 1);
+	  return;
 	}
 
-      struct ow_engine *engine = xfr->user_data;
+      missing = ow_engine_check_usb_input_frames (engine);
+
       if (engine->context->options & OW_ENGINE_OPTION_O2H_AUDIO)
 	{
-	  set_usb_input_data_blks (engine);
+	  set_usb_input_data_blks (engine, missing);
 	}
     }
   else
     {
       error_print ("o2h: Error on USB audio transfer (%d B): %s",
 		   xfr->actual_length, libusb_error_name (xfr->status));
+      ow_engine_count_usb_error (engine, xfr->status);
     }
+}
+
+static void LIBUSB_CALL
+cb_xfr_audio_in (struct libusb_transfer *xfr)
+{
+  struct ow_engine *engine = xfr->user_data;
+  uint64_t start = ow_engine_start_cb_timing (engine,
+					      &engine->usb.audio_in_cb_time,
+					      OW_HISTOGRAM_O2H_PERIOD);
+
+  engine->usb.xfrs_in_flight--;
+  engine->usb.xfr_audio_in_data = xfr->buffer;
+
+  ow_engine_process_usb_input (engine, xfr);
+
+  ow_engine_add_histogram_sample (engine, OW_HISTOGRAM_O2H_PROCESSING,
+				  ow_get_raw_time () - start);
 
   if (ow_engine_get_status (engine) > OW_ENGINE_STATUS_STOP)
     {
       // start new cycle even if this one did not succeed
-      prepare_cycle_in_audio (xfr->user_data);
+      prepare_cycle_in_audio (engine, xfr, xfr->buffer);
     }
 }
 
@@ -336,68 +716,133 @@ static void LIBUSB_CALL
 cb_xfr_audio_out (struct libusb_transfer *xfr)
 {
   struct ow_engine *engine = xfr->user_data;
+  int errors;
+  uint64_t start = ow_engine_start_cb_timing (engine,
+					      &engine->usb.audio_out_cb_time,
+					      OW_HISTOGRAM_H2O_PERIOD);
+
+  engine->usb.xfrs_in_flight--;
+  engine->usb.xfr_audio_out_data = xfr->buffer;
 
   if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
     {
-      if (xfr->length < xfr->actual_length)
+      ow_engine_count (engine, OW_ENGINE_STAT_H2O_TRANSFERS, 1);
+      ow_engine_count (engine, OW_ENGINE_STAT_H2O_BYTES,
+		       ow_engine_get_xfr_actual_length (engine, xfr));
+    }
+
+  if (xfr->status == LIBUSB_TRANSFER_COMPLETED && engine->usb.iso)
+    {
+      errors = ow_engine_check_iso_packets (engine, xfr, 0);
+      if (errors)
+	{
+	  error_print ("h2o: %d of %d USB audio packets not sent", errors,
+		       xfr->num_iso_packets);
+	  ow_engine_count (engine, OW_ENGINE_STAT_H2O_LOST_PACKETS, errors);
+	}
+    }
+  else if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
+    {
+      if (xfr->actual_length < xfr->length)
 	{
 	  error_print
-	    ("h2o: incomplete USB audio transfer (%d B < %d B)", xfr->length,
-	     xfr->actual_length);
+	    ("h2o: incomplete USB audio transfer (%d B < %d B)",
+	     xfr->actual_length, xfr->length);
+	  ow_engine_count (engine, OW_ENGINE_STAT_H2O_INCOMPLETE, 1);
 	}
     }
   else
     {
       error_print ("h2o: Error on USB audio transfer (%d B): %s",
 		   xfr->actual_length, libusb_error_name (xfr->status));
+      ow_engine_count_usb_error (engine, xfr->status);
     }
 
-  set_usb_output_data_blks (xfr->user_data);
+  set_usb_output_data_blks (engine);
+
+  ow_engine_add_histogram_sample (engine, OW_HISTOGRAM_H2O_PROCESSING,
+				  ow_get_raw_time () - start);
 
   if (ow_engine_get_status (engine) > OW_ENGINE_STATUS_STOP)
     {
       // We have to make sure that the out cycle is always started after its callback
       // Race condition on slower systems!
-      prepare_cycle_out_audio (xfr->user_data);
+      prepare_cycle_out_audio (engine, xfr, xfr->buffer);
     }
 }
 
 static void
-prepare_cycle_out_audio (struct ow_engine *engine)
+prepare_cycle_out_audio (struct ow_engine *engine,
+			 struct libusb_transfer *xfr, uint8_t *data)
 {
-  libusb_fill_interrupt_transfer (engine->usb.xfr_audio_out,
-				  engine->usb.device_handle, AUDIO_OUT_EP,
-				  engine->usb.xfr_audio_out_data,
-				  engine->usb.xfr_audio_out_data_len,
-				  cb_xfr_audio_out, engine,
-				  engine->usb.xfr_timeout);
-
-  int err = libusb_submit_transfer (engine->usb.xfr_audio_out);
+  if (engine->usb.iso)
+    {
+      libusb_fill_iso_transfer (xfr, engine->usb.device_handle,
+				AUDIO_OUT_EP, data,
+				engine->usb.xfr_audio_out_data_len,
+				engine->blocks_per_transfer,
+				cb_xfr_audio_out, engine,
+				engine->usb.xfr_timeout);
+      libusb_set_iso_packet_lengths (xfr, engine->usb.audio_out_blk_len);
+    }
+  else
+    {
+      libusb_fill_interrupt_transfer (xfr, engine->usb.device_handle,
+				      AUDIO_OUT_EP, data,
+				      engine->usb.xfr_audio_out_data_len,
+				      cb_xfr_audio_out, engine,
+				      engine->usb.xfr_timeout);
+    }
+
+  int err = libusb_submit_transfer (xfr);
   if (err)
     {
       error_print ("h2o: Error when submitting USB audio out transfer: %s",
 		   libusb_strerror (err));
+      ow_engine_count (engine, OW_ENGINE_STAT_USB_SUBMIT_ERRORS, 1);
       ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
     }
+  else
+    {
+      engine->usb.xfrs_in_flight++;
+    }
 }
 
 static void
-prepare_cycle_in_audio (struct ow_engine *engine)
+prepare_cycle_in_audio (struct ow_engine *engine,
+			struct libusb_transfer *xfr, uint8_t *data)
 {
-  libusb_fill_interrupt_transfer (engine->usb.xfr_audio_in,
-				  engine->usb.device_handle, AUDIO_IN_EP,
-				  engine->usb.xfr_audio_in_data,
-				  engine->usb.xfr_audio_in_data_len,
-				  cb_xfr_audio_in, engine,
-				  engine->usb.xfr_timeout);
-
-  int err = libusb_submit_transfer (engine->usb.xfr_audio_in);
+  if (engine->usb.iso)
+    {
+      libusb_fill_iso_transfer (xfr, engine->usb.device_handle,
+				AUDIO_IN_EP, data,
+				engine->usb.xfr_audio_in_data_len,
+				engine->blocks_per_transfer,
+				cb_xfr_audio_in, engine,
+				engine->usb.xfr_timeout);
+      libusb_set_iso_packet_lengths (xfr, engine->usb.audio_in_blk_len);
+    }
+  else
+    {
+      libusb_fill_interrupt_transfer (xfr, engine->usb.device_handle,
+				      AUDIO_IN_EP, data,
+				      engine->usb.xfr_audio_in_data_len,
+				      cb_xfr_audio_in, engine,
+				      engine->usb.xfr_timeout);
+    }
+
+  int err = libusb_submit_transfer (xfr);
   if (err)
     {
       error_print ("o2h: Error when submitting USB audio in transfer: %s",
 		   libusb_strerror (err));
+      ow_engine_count (engine, OW_ENGINE_STAT_USB_SUBMIT_ERRORS, 1);
       ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
     }
+  else
+    {
+      engine->usb.xfrs_in_flight++;
+    }
 }
 
 static void
@@ -407,23 +852,35 @@ usb_shutdown (struct ow_engine *engine)
   libusb_release_interface (engine->usb.device_handle, 3);
   libusb_close (engine->usb.device_handle);
   libusb_unref_device (engine->usb.device);
-  libusb_free_transfer (engine->usb.xfr_audio_in);
-  libusb_free_transfer (engine->usb.xfr_audio_out);
+  for (int i = 0; i < engine->usb.xfr_queue_depth; i++)
+    {
+      libusb_free_transfer (engine->usb.xfr_audio_in[i]);
+      libusb_free_transfer (engine->usb.xfr_audio_out[i]);
+    }
   libusb_free_transfer (engine->usb.xfr_control_in);
   libusb_free_transfer (engine->usb.xfr_control_out);
-  libusb_exit (engine->usb.context);
+  if (engine->loop)
+    {
+      sem_destroy (&engine->finished);
+      ow_reactor_release_loop (engine->loop);
+    }
+  else
+    {
+      libusb_exit (engine->usb.context);
+    }
 }
 
 int
 ow_engine_init_mem (struct ow_engine *engine,
-		    unsigned int blocks_per_transfer)
+		    unsigned int blocks_per_transfer,
+		    unsigned int xfr_queue_depth)
 {
   size_t size;
   struct ow_engine_usb_blk *blk;
 
   engine->context = NULL;
-
-  pthread_spin_init (&engine->lock, PTHREAD_PROCESS_SHARED);
+  engine->o2h_ring = NULL;
+  engine->h2o_ring = NULL;
 
   engine->blocks_per_transfer = blocks_per_transfer;
   debug_print (1, "Blocks per transfer: %u", engine->blocks_per_transfer);
@@ -431,14 +888,23 @@ ow_engine_init_mem (struct ow_engine *engine,
   engine->frames_per_transfer =
     OB_FRAMES_PER_BLOCK * engine->blocks_per_transfer;
 
-  engine->o2h_frame_size =
-    ow_get_frame_size_from_desc_tracks (engine->device->desc.outputs,
-					engine->device->desc.output_tracks);
+  engine->usb.xfr_queue_depth = xfr_queue_depth;
+  debug_print (1, "USB transfer queue depth: %u",
+	       engine->usb.xfr_queue_depth);
+
+  ow_codec_plan_init (&engine->o2h_codec, engine->device->desc.type,
+		      engine->device->desc.outputs,
+		      engine->device->desc.output_tracks);
 
-  engine->h2o_frame_size =
-    ow_get_frame_size_from_desc_tracks (engine->device->desc.inputs,
-					engine->device->desc.input_tracks);
+  ow_codec_plan_init (&engine->h2o_codec, engine->device->desc.type,
+		      engine->device->desc.inputs,
+		      engine->device->desc.input_tracks);
 
+  engine->o2h_frame_size = engine->o2h_codec.frame_size;
+  engine->h2o_frame_size = engine->h2o_codec.frame_size;
+
+  engine->o2h_tracks = engine->o2h_codec.tracks_mask;
+  engine->h2o_tracks = engine->h2o_codec.tracks_mask;
 
   debug_print (2, "o2h: USB in frame size: %zu B", engine->o2h_frame_size);
   debug_print (2, "h2o: USB out frame size: %zu B", engine->h2o_frame_size);
@@ -484,25 +950,40 @@ ow_engine_init_mem (struct ow_engine *engine,
   debug_print (2, "h2o: audio transfer size: %zu B",
 	       engine->h2o_transfer_size);
 
-  engine->o2h_min_latency = engine->frames_per_transfer;
-  engine->h2o_min_latency = engine->frames_per_transfer;
+  atomic_init (&engine->o2h_latency, 0);
+  atomic_init (&engine->o2h_min_latency, engine->frames_per_transfer);
+  atomic_init (&engine->o2h_max_latency, 0);
+  atomic_init (&engine->h2o_latency, 0);
+  atomic_init (&engine->h2o_min_latency, engine->frames_per_transfer);
+  atomic_init (&engine->h2o_max_latency, 0);
 
   engine->usb.audio_frames_counter = 0;
+  engine->usb.audio_in_frames_counter = 0;
+  engine->usb.audio_in_frames_counter_valid = 0;
+  engine->usb.audio_in_cb_time = 0;
+  engine->usb.audio_out_cb_time = 0;
+  engine->usb.xfrs_in_flight = 0;
   engine->usb.xfr_audio_in_data_len =
     engine->usb.audio_in_blk_len * engine->blocks_per_transfer;
   engine->usb.xfr_audio_out_data_len =
     engine->usb.audio_out_blk_len * engine->blocks_per_transfer;
-  engine->usb.xfr_audio_in_data = malloc (engine->usb.xfr_audio_in_data_len);
-  engine->usb.xfr_audio_out_data =
-    malloc (engine->usb.xfr_audio_out_data_len);
-  memset (engine->usb.xfr_audio_in_data, 0,
-	  engine->usb.xfr_audio_in_data_len);
-  memset (engine->usb.xfr_audio_out_data, 0,
-	  engine->usb.xfr_audio_out_data_len);
 
-  for (int i = 0; i < engine->blocks_per_transfer; i++)
+  size = engine->usb.xfr_audio_in_data_len * engine->usb.xfr_queue_depth;
+  engine->usb.xfr_audio_in_ring = malloc (size);
+  memset (engine->usb.xfr_audio_in_ring, 0, size);
+
+  size = engine->usb.xfr_audio_out_data_len * engine->usb.xfr_queue_depth;
+  engine->usb.xfr_audio_out_ring = malloc (size);
+  memset (engine->usb.xfr_audio_out_ring, 0, size);
+
+  engine->usb.xfr_audio_in_data = engine->usb.xfr_audio_in_ring;
+  engine->usb.xfr_audio_out_data = engine->usb.xfr_audio_out_ring;
+
+  for (int i = 0;
+       i < engine->blocks_per_transfer * engine->usb.xfr_queue_depth; i++)
     {
-      blk = GET_NTH_OUTPUT_USB_BLK (engine, i);
+      blk = GET_NTH_USB_BLK (engine->usb.xfr_audio_out_ring,
+			     engine->usb.audio_out_blk_len, i);
       blk->header = htobe16 (0x07ff);
     }
 
@@ -511,14 +992,23 @@ ow_engine_init_mem (struct ow_engine *engine,
   memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
   memset (engine->o2h_transfer_buf, 0, engine->o2h_transfer_size);
 
-  //o2h resampler
-  engine->h2o_resampler_buf = malloc (engine->h2o_transfer_size);
-  memset (engine->h2o_resampler_buf, 0, engine->h2o_transfer_size);
-  engine->h2o_data.data_in = engine->h2o_resampler_buf;
-  engine->h2o_data.data_out = engine->h2o_transfer_buf;
-  engine->h2o_data.end_of_input = 1;
-  engine->h2o_data.input_frames = engine->frames_per_transfer;
-  engine->h2o_data.output_frames = engine->frames_per_transfer;
+  //h2o concealment
+  engine->h2o_conceal_buf = malloc (engine->h2o_transfer_size);
+  memset (engine->h2o_conceal_buf, 0, engine->h2o_transfer_size);
+
+  for (int i = 0; i < OW_ENGINE_STATS; i++)
+    {
+      atomic_init (&engine->stats[i], 0);
+    }
+
+  for (int i = 0; i < OW_HISTOGRAMS; i++)
+    {
+      for (int j = 0; j < OW_HISTOGRAM_BUCKETS; j++)
+	{
+	  atomic_init (&engine->histograms[i].buckets[j], 0);
+	}
+      atomic_init (&engine->histograms[i].max, 0);
+    }
 
   //Control
   engine->usb.xfr_control_out_data = malloc (USB_CONTROL_LEN);
@@ -531,20 +1021,30 @@ ow_engine_init_mem (struct ow_engine *engine,
 
 static ow_err_t
 ow_engine_init (struct ow_engine *engine, struct ow_device *device,
-		unsigned int blocks_per_transfer, unsigned int xfr_timeout)
+		unsigned int blocks_per_transfer,
+		unsigned int xfr_queue_depth, unsigned int xfr_timeout)
 {
   int err;
   ow_err_t ret = OW_OK;
 
   engine->device = device;
-  engine->usb.xfr_audio_in = NULL;
-  engine->usb.xfr_audio_out = NULL;
+  for (int i = 0; i < OW_MAX_XFR_QUEUE_DEPTH; i++)
+    {
+      engine->usb.xfr_audio_in[i] = NULL;
+      engine->usb.xfr_audio_out[i] = NULL;
+    }
   engine->usb.xfr_control_in = NULL;
   engine->usb.xfr_control_out = NULL;
 
   engine->usb.xfr_timeout = xfr_timeout;
   debug_print (1, "USB transfer timeout: %u", engine->usb.xfr_timeout);
 
+  engine->usb.xfr_queue_depth = xfr_queue_depth;
+
+  engine->usb.iso = device->desc.type == OW_DEVICE_TYPE_1;
+  debug_print (1, "USB transfer type: %s",
+	       engine->usb.iso ? "isochronous" : "interrupt");
+
   libusb_detach_kernel_driver (engine->usb.device_handle, 4);
   libusb_detach_kernel_driver (engine->usb.device_handle, 5);
 
@@ -586,20 +1086,24 @@ ow_engine_init (struct ow_engine *engine, struct ow_device *device,
       goto end;
     }
 
-  err = libusb_clear_halt (engine->usb.device_handle, AUDIO_IN_EP);
-  if (LIBUSB_SUCCESS != err)
+  //Isochronous endpoints can not halt.
+  if (!engine->usb.iso)
     {
-      ret = OW_USB_ERROR_CANT_CLEAR_EP;
-      goto end;
-    }
-  err = libusb_clear_halt (engine->usb.device_handle, AUDIO_OUT_EP);
-  if (LIBUSB_SUCCESS != err)
-    {
-      ret = OW_USB_ERROR_CANT_CLEAR_EP;
-      goto end;
+      err = libusb_clear_halt (engine->usb.device_handle, AUDIO_IN_EP);
+      if (LIBUSB_SUCCESS != err)
+	{
+	  ret = OW_USB_ERROR_CANT_CLEAR_EP;
+	  goto end;
+	}
+      err = libusb_clear_halt (engine->usb.device_handle, AUDIO_OUT_EP);
+      if (LIBUSB_SUCCESS != err)
+	{
+	  ret = OW_USB_ERROR_CANT_CLEAR_EP;
+	  goto end;
+	}
     }
 
-  err = prepare_transfers (engine);
+  err = prepare_transfers (engine, blocks_per_transfer);
   if (LIBUSB_SUCCESS != err)
     {
       ret = OW_USB_ERROR_CANT_PREPARE_TRANSFER;
@@ -623,7 +1127,7 @@ ow_engine_init (struct ow_engine *engine, struct ow_device *device,
 #endif
 
   err = LIBUSB_SUCCESS;
-  ret = ow_engine_init_mem (engine, blocks_per_transfer);
+  ret = ow_engine_init_mem (engine, blocks_per_transfer, xfr_queue_depth);
 
 end:
   if (ret != OW_OK)
@@ -640,7 +1144,9 @@ ow_err_t
 ow_engine_init_from_device (struct ow_engine **engine_,
 			    struct ow_device *ow_device,
 			    unsigned int blocks_per_transfer,
-			    unsigned int xfr_timeout)
+			    unsigned int xfr_queue_depth,
+			    unsigned int xfr_timeout,
+			    struct ow_reactor *reactor)
 {
   int err;
   ow_err_t ret;
@@ -652,13 +1158,24 @@ ow_engine_init_from_device (struct ow_engine **engine_,
 
   engine = malloc (sizeof (struct ow_engine));
 
-  if (libusb_init (&engine->usb.context) != LIBUSB_SUCCESS)
+  if (reactor)
     {
-      ret = OW_USB_ERROR_LIBUSB_INIT_FAILED;
-      goto error;
+      engine->loop = ow_reactor_acquire_loop (reactor);
+      engine->usb.context = engine->loop->context;
+      sem_init (&engine->finished, 0, 0);
+    }
+  else
+    {
+      engine->loop = NULL;
+      if (libusb_init (&engine->usb.context) != LIBUSB_SUCCESS)
+	{
+	  ret = OW_USB_ERROR_LIBUSB_INIT_FAILED;
+	  goto error;
+	}
     }
 
   engine->usb.device_handle = NULL;
+  engine->serial_number[0] = 0;
   total = libusb_get_device_list (engine->usb.context, &devices);
   device = devices;
   for (int i = 0; i < total; i++, device++)
@@ -682,6 +1199,22 @@ ow_engine_init_from_device (struct ow_engine **engine_,
 	      continue;
 	    }
 
+	  if (desc.iSerialNumber)
+	    {
+	      err = libusb_get_string_descriptor_ascii (engine->usb.
+							device_handle,
+							desc.iSerialNumber,
+							(unsigned char *)
+							engine->serial_number,
+							OW_SERIAL_NUMBER_MAX_LEN);
+	      if (err < 0)
+		{
+		  error_print ("Error while getting serial number: %s",
+			       libusb_error_name (err));
+		  engine->serial_number[0] = 0;
+		}
+	    }
+
 	  libusb_ref_device (*device);
 	  engine->usb.device = *device;
 	  break;
@@ -697,7 +1230,8 @@ ow_engine_init_from_device (struct ow_engine **engine_,
     }
 
   *engine_ = engine;
-  ret = ow_engine_init (engine, ow_device, blocks_per_transfer, xfr_timeout);
+  ret = ow_engine_init (engine, ow_device, blocks_per_transfer,
+			xfr_queue_depth, xfr_timeout);
   if (!ret)
     {
       ow_engine_init_name (engine);
@@ -705,6 +1239,11 @@ ow_engine_init_from_device (struct ow_engine **engine_,
   return ret;
 
 error:
+  if (engine->loop)
+    {
+      sem_destroy (&engine->finished);
+      ow_reactor_release_loop (engine->loop);
+    }
   free (engine);
   return ret;
 }
@@ -728,14 +1267,47 @@ static const char *ob_err_strgs[] = {
   "'o2h_audio' not set in context",
   "'h2o_audio' not set in context",
   "'get_time' not set in context",
-  "'dll' not set in context"
+  "'dll' not set in context",
+  "can't create ring buffer"
 };
 
-static void *
-run_audio (void *data)
+static const char *ow_engine_stat_names[] = {
+  "o2hTransfers",
+  "o2hBytes",
+  "h2oTransfers",
+  "h2oBytes",
+  "o2hOverflows",
+  "h2oUnderflows",
+  "h2oConcealedFrames",
+  "o2hIncomplete",
+  "h2oIncomplete",
+  "o2hLostPackets",
+  "h2oLostPackets",
+  "usbError",
+  "usbTimedOut",
+  "usbCancelled",
+  "usbStall",
+  "usbNoDevice",
+  "usbOverflow",
+  "usbSubmitErrors",
+  "o2hGaps",
+  "o2hRepeats",
+  "o2hInsertedFrames"
+};
+
+static const char *ow_engine_histogram_names[] = {
+  "o2hPeriod",
+  "o2hProcessing",
+  "h2oPeriod",
+  "h2oProcessing",
+  "hostProcessing"
+};
+
+//These calls are needed to initialize the Overbridge side before the host side.
+static void
+ow_engine_boot (struct ow_engine *engine)
 {
-  size_t rsh2o, bytes;
-  struct ow_engine *engine = data;
+  uint8_t *data;
 
   if (engine->context->dll)
     {
@@ -746,9 +1318,21 @@ run_audio (void *data)
 
   //status == OW_ENGINE_STATUS_STEADY
 
-  //These calls are needed to initialize the Overbridge side before the host side.
-  prepare_cycle_in_audio (engine);
-  prepare_cycle_out_audio (engine);
+  //All the out transfers are filled with silence and consecutive frame counters before being queued.
+  for (int i = 0; i < engine->usb.xfr_queue_depth; i++)
+    {
+      data = engine->usb.xfr_audio_in_ring +
+	i * engine->usb.xfr_audio_in_data_len;
+      prepare_cycle_in_audio (engine, engine->usb.xfr_audio_in[i], data);
+    }
+  for (int i = 0; i < engine->usb.xfr_queue_depth; i++)
+    {
+      data = engine->usb.xfr_audio_out_ring +
+	i * engine->usb.xfr_audio_out_data_len;
+      engine->usb.xfr_audio_out_data = data;
+      ow_engine_write_usb_output_blocks (engine);
+      prepare_cycle_out_audio (engine, engine->usb.xfr_audio_out[i], data);
+    }
 
   if (engine->context->dll)
     {
@@ -758,35 +1342,62 @@ run_audio (void *data)
     }
 
   ow_engine_set_status (engine, OW_ENGINE_STATUS_BOOT);
+}
 
-  while (1)
+static void
+ow_engine_enter_run (struct ow_engine *engine)
+{
+  ow_engine_status_t status;
+
+  atomic_store_explicit (&engine->h2o_latency, 0, memory_order_relaxed);
+  atomic_store_explicit (&engine->h2o_max_latency, 0, memory_order_relaxed);
+  engine->reading_at_h2o_end = engine->context->dll ? 0 : 1;
+  atomic_store_explicit (&engine->o2h_latency, 0, memory_order_relaxed);
+  atomic_store_explicit (&engine->o2h_max_latency, 0, memory_order_relaxed);
+
+  //status == OW_ENGINE_STATUS_BOOT || status == OW_ENGINE_STATUS_CLEAR
+
+  status = OW_ENGINE_STATUS_CLEAR;
+  atomic_compare_exchange_strong (&engine->status, &status,
+				  OW_ENGINE_STATUS_RUN);
+
+  if (engine->context->dll)
+    {
+      status = OW_ENGINE_STATUS_BOOT;
+      atomic_compare_exchange_strong (&engine->status, &status,
+				      OW_ENGINE_STATUS_WAIT);
+    }
+  else
     {
-      engine->h2o_latency = 0;
-      engine->h2o_max_latency = 0;
-      engine->reading_at_h2o_end = engine->context->dll ? 0 : 1;
-      engine->o2h_latency = 0;
-      engine->o2h_max_latency = 0;
+      ow_engine_set_status (engine, OW_ENGINE_STATUS_RUN);
+    }
+}
 
-      //status == OW_ENGINE_STATUS_BOOT || status == OW_ENGINE_STATUS_CLEAR
+static void
+ow_engine_clear_h2o_buffer (struct ow_engine *engine)
+{
+  size_t rsh2o, bytes;
 
-      if (ow_engine_get_status (engine) == OW_ENGINE_STATUS_CLEAR)
-	{
-	  engine->status = OW_ENGINE_STATUS_RUN;
-	}
+  //status == OW_ENGINE_STATUS_BOOT || status == OW_ENGINE_STATUS_CLEAR
 
-      pthread_spin_lock (&engine->lock);
-      if (engine->context->dll)
-	{
-	  if (engine->status == OW_ENGINE_STATUS_BOOT)
-	    {
-	      engine->status = OW_ENGINE_STATUS_WAIT;
-	    }
-	}
-      else
-	{
-	  engine->status = OW_ENGINE_STATUS_RUN;
-	}
-      pthread_spin_unlock (&engine->lock);
+  debug_print (1, "Clearing buffers...");
+
+  rsh2o = engine->context->read_space (engine->context->h2o_audio);
+  bytes = ow_bytes_to_frame_bytes (rsh2o, engine->h2o_frame_size);
+  engine->context->read (engine->context->h2o_audio, NULL, bytes);
+  memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
+}
+
+static void *
+run_audio (void *arg)
+{
+  struct ow_engine *engine = arg;
+
+  ow_engine_boot (engine);
+
+  while (1)
+    {
+      ow_engine_enter_run (engine);
 
       while (ow_engine_get_status (engine) >= OW_ENGINE_STATUS_WAIT)
 	{
@@ -798,35 +1409,61 @@ run_audio (void *data)
 	  break;
 	}
 
-      //status == OW_ENGINE_STATUS_BOOT || status == OW_ENGINE_STATUS_CLEAR
-
-      debug_print (1, "Clearing buffers...");
-
-      rsh2o = engine->context->read_space (engine->context->h2o_audio);
-      bytes = ow_bytes_to_frame_bytes (rsh2o, engine->h2o_frame_size);
-      engine->context->read (engine->context->h2o_audio, NULL, bytes);
-      memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
+      ow_engine_clear_h2o_buffer (engine);
     }
 
   //status == OW_ENGINE_STATUS_STOP || status == OW_ENGINE_STATUS_ERROR
 
   //Handle completed events but not actually processed.
   //No new transfers will be submitted due to the status.
-  debug_print (2, "Processing remaining event...");
-  libusb_handle_events_completed (engine->usb.context, NULL);
+  debug_print (2, "Processing remaining events...");
+  while (engine->usb.xfrs_in_flight)
+    {
+      libusb_handle_events_completed (engine->usb.context, NULL);
+    }
 
   return NULL;
 }
 
-void
-ow_engine_clear_buffers (struct ow_engine *engine)
+//Same as run_audio but the events are handled by the reactor loop.
+int
+ow_engine_poll (struct ow_engine *engine)
 {
-  pthread_spin_lock (&engine->lock);
-  if (engine->status == OW_ENGINE_STATUS_RUN)
+  ow_engine_status_t status;
+
+  switch (engine->phase)
     {
-      engine->status = OW_ENGINE_STATUS_CLEAR;
+    case OW_ENGINE_PHASE_BOOT:
+      ow_engine_boot (engine);
+      ow_engine_enter_run (engine);
+      engine->phase = OW_ENGINE_PHASE_RUN;
+      return 1;
+    case OW_ENGINE_PHASE_RUN:
+      status = ow_engine_get_status (engine);
+      if (status >= OW_ENGINE_STATUS_WAIT)
+	{
+	  return 1;
+	}
+      if (status < OW_ENGINE_STATUS_BOOT)
+	{
+	  debug_print (2, "Processing remaining events...");
+	  engine->phase = OW_ENGINE_PHASE_DRAIN;
+	  return 1;
+	}
+      ow_engine_clear_h2o_buffer (engine);
+      ow_engine_enter_run (engine);
+      return 1;
+    default:
+      return engine->usb.xfrs_in_flight != 0;
     }
-  pthread_spin_unlock (&engine->lock);
+}
+
+void
+ow_engine_clear_buffers (struct ow_engine *engine)
+{
+  ow_engine_status_t status = OW_ENGINE_STATUS_RUN;
+  atomic_compare_exchange_strong (&engine->status, &status,
+				  OW_ENGINE_STATUS_CLEAR);
 }
 
 ow_err_t
@@ -834,6 +1471,40 @@ ow_engine_start (struct ow_engine *engine, struct ow_context *context)
 {
   engine->context = context;
 
+  //Without buffers, the engine uses its own rings. These can be read and
+  //written by the client with the ring API.
+  if (!context->read_space && !context->write_space && !context->read
+      && !context->write && !context->o2h_audio && !context->h2o_audio)
+    {
+      ow_context_set_rings (context, NULL, NULL);
+    }
+
+  if (context->read_space == ow_ring_read_space)
+    {
+      if (!context->o2h_audio)
+	{
+	  engine->o2h_ring = ow_ring_create (OW_DEFAULT_RING_FRAMES,
+					     OW_BYTES_PER_SAMPLE *
+					     engine->o2h_codec.tracks);
+	  if (!engine->o2h_ring)
+	    {
+	      return OW_INIT_ERROR_CANT_CREATE_RING;
+	    }
+	  context->o2h_audio = engine->o2h_ring;
+	}
+      if (!context->h2o_audio)
+	{
+	  engine->h2o_ring = ow_ring_create (OW_DEFAULT_RING_FRAMES,
+					     OW_BYTES_PER_SAMPLE *
+					     engine->h2o_codec.tracks);
+	  if (!engine->h2o_ring)
+	    {
+	      return OW_INIT_ERROR_CANT_CREATE_RING;
+	    }
+	  context->h2o_audio = engine->h2o_ring;
+	}
+    }
+
   if (context->options & OW_ENGINE_OPTION_O2H_AUDIO)
     {
       if (!context->read_space)
@@ -890,19 +1561,35 @@ ow_engine_start (struct ow_engine *engine, struct ow_context *context)
 	{
 	  return OW_INIT_ERROR_NO_DLL;
 	}
-      engine->status = OW_ENGINE_STATUS_READY;
+      ow_engine_set_status (engine, OW_ENGINE_STATUS_READY);
     }
 
-  debug_print (1, "Starting thread...");
-  if (pthread_create (&engine->thread, NULL, run_audio, engine))
+  ow_codec_plan_set_dither (&engine->h2o_codec,
+			    context->options & OW_ENGINE_OPTION_H2O_DITHER);
+
+  if (engine->loop)
     {
-      error_print ("Could not start thread");
-      return OW_GENERIC_ERROR;
+      debug_print (1, "Starting engine in reactor...");
+      engine->phase = OW_ENGINE_PHASE_BOOT;
+      if (ow_reactor_add_engine (engine->loop, engine))
+	{
+	  return OW_GENERIC_ERROR;
+	}
     }
-  pthread_setname_np (engine->thread, "engine-worker");
-  if (context->set_rt_priority)
+  else
     {
-      context->set_rt_priority (engine->thread, engine->context->priority);
+      debug_print (1, "Starting thread...");
+      if (pthread_create (&engine->thread, NULL, run_audio, engine))
+	{
+	  error_print ("Could not start thread");
+	  return OW_GENERIC_ERROR;
+	}
+      pthread_setname_np (engine->thread, "engine-worker");
+      if (context->set_rt_priority)
+	{
+	  context->set_rt_priority (engine->thread,
+				    engine->context->priority);
+	}
     }
 
   //Wait till the thread has reached the USB loop
@@ -917,7 +1604,14 @@ ow_engine_start (struct ow_engine *engine, struct ow_context *context)
 inline void
 ow_engine_wait (struct ow_engine *engine)
 {
-  pthread_join (engine->thread, NULL);
+  if (engine->loop)
+    {
+      sem_wait (&engine->finished);
+    }
+  else
+    {
+      pthread_join (engine->thread, NULL);
+    }
 }
 
 const char *
@@ -929,6 +1623,15 @@ ow_get_err_str (ow_err_t errcode)
 void
 ow_engine_destroy (struct ow_engine *engine)
 {
+  debug_print (1, "%s (%s): h2o: %" PRIu64 " transfers concealed (%" PRIu64
+	       " frames)", engine->name, engine->overbridge_name,
+	       atomic_load_explicit
+	       (&engine->stats[OW_ENGINE_STAT_H2O_UNDERFLOWS],
+		memory_order_relaxed),
+	       atomic_load_explicit
+	       (&engine->stats[OW_ENGINE_STAT_H2O_CONCEALED_FRAMES],
+		memory_order_relaxed));
+
   usb_shutdown (engine);
   ow_engine_free_mem (engine);
   free (engine->device);
@@ -939,64 +1642,92 @@ void
 ow_engine_free_mem (struct ow_engine *engine)
 {
   free (engine->h2o_transfer_buf);
-  free (engine->h2o_resampler_buf);
+  free (engine->h2o_conceal_buf);
   free (engine->o2h_transfer_buf);
-  free (engine->usb.xfr_audio_in_data);
-  free (engine->usb.xfr_audio_out_data);
+  free (engine->usb.xfr_audio_in_ring);
+  free (engine->usb.xfr_audio_out_ring);
   free (engine->usb.xfr_control_out_data);
   free (engine->usb.xfr_control_in_data);
-  pthread_spin_destroy (&engine->lock);
+  ow_ring_destroy (engine->o2h_ring);
+  ow_ring_destroy (engine->h2o_ring);
 }
 
+//The status is written by the engine thread and by the controlling threads
+//(the resampler, the signal handlers...) and read on every USB cycle so it
+//uses acquire and release semantics instead of a lock.
 inline ow_engine_status_t
 ow_engine_get_status (struct ow_engine *engine)
 {
-  ow_engine_status_t status;
-  pthread_spin_lock (&engine->lock);
-  status = engine->status;
-  pthread_spin_unlock (&engine->lock);
-  return status;
+  return atomic_load_explicit (&engine->status, memory_order_acquire);
 }
 
 inline void
 ow_engine_set_status (struct ow_engine *engine, ow_engine_status_t status)
 {
-  pthread_spin_lock (&engine->lock);
-  engine->status = status;
-  pthread_spin_unlock (&engine->lock);
+  atomic_store_explicit (&engine->status, status, memory_order_release);
 }
 
 inline int
 ow_engine_is_option (struct ow_engine *engine, ow_engine_option_t option)
 {
-  int enabled;
-  pthread_spin_lock (&engine->lock);
-  enabled = (engine->context->options & option) != 0;
-  pthread_spin_unlock (&engine->lock);
-  return enabled;
+  return (atomic_load_explicit (&engine->context->options,
+				memory_order_relaxed) & option) != 0;
 }
 
 inline void
 ow_engine_set_option (struct ow_engine *engine, ow_engine_option_t option,
 		      int enabled)
 {
-  int last = ow_engine_is_option (engine, option);
-  if (last != enabled)
+  int last;
+
+  if (enabled)
+    {
+      last = atomic_fetch_or_explicit (&engine->context->options, option,
+				       memory_order_relaxed);
+    }
+  else
+    {
+      last = atomic_fetch_and_explicit (&engine->context->options, ~option,
+					memory_order_relaxed);
+    }
+
+  //The dither is applied by the USB thread before encoding.
+  if (((last & option) != 0) != (enabled != 0))
     {
-      pthread_spin_lock (&engine->lock);
-      if (enabled)
-	{
-	  engine->context->options |= option;
-	}
-      else
-	{
-	  engine->context->options &= ~option;
-	}
-      pthread_spin_unlock (&engine->lock);
       debug_print (1, "Setting option %d to %d...", option, enabled);
     }
 }
 
+inline uint64_t
+ow_engine_get_o2h_tracks (struct ow_engine *engine)
+{
+  return ~atomic_load_explicit (&engine->context->o2h_disabled_tracks,
+				memory_order_relaxed);
+}
+
+inline void
+ow_engine_set_o2h_tracks (struct ow_engine *engine, uint64_t tracks)
+{
+  debug_print (2, "Setting o2h tracks to 0x%016" PRIx64 "...", tracks);
+  atomic_store_explicit (&engine->context->o2h_disabled_tracks, ~tracks,
+			 memory_order_relaxed);
+}
+
+inline uint64_t
+ow_engine_get_h2o_tracks (struct ow_engine *engine)
+{
+  return ~atomic_load_explicit (&engine->context->h2o_disabled_tracks,
+				memory_order_relaxed);
+}
+
+inline void
+ow_engine_set_h2o_tracks (struct ow_engine *engine, uint64_t tracks)
+{
+  debug_print (2, "Setting h2o tracks to 0x%016" PRIx64 "...", tracks);
+  atomic_store_explicit (&engine->context->h2o_disabled_tracks, ~tracks,
+			 memory_order_relaxed);
+}
+
 inline int
 ow_bytes_to_frame_bytes (int bytes, int bytes_per_frame)
 {
@@ -1101,6 +1832,53 @@ ow_engine_get_overbridge_name (struct ow_engine *engine)
   return engine->overbridge_name;
 }
 
+//Every counter is consistent but the set is not a snapshot as the USB thread
+//keeps running.
+void
+ow_engine_get_stats (struct ow_engine *engine, struct ow_engine_stats *stats)
+{
+  for (int i = 0; i < OW_ENGINE_STATS; i++)
+    {
+      stats->counters[i] = atomic_load_explicit (&engine->stats[i],
+						 memory_order_relaxed);
+    }
+}
+
+const char *
+ow_engine_get_stat_name (ow_engine_stat_t stat)
+{
+  return stat < OW_ENGINE_STATS ? ow_engine_stat_names[stat] : NULL;
+}
+
+//As with the counters, a sample might be added while a histogram is copied.
+void
+ow_engine_get_histograms (struct ow_engine *engine,
+			  struct ow_histogram *histograms, int reset)
+{
+  struct ow_engine_histogram *h = engine->histograms;
+
+  for (int i = 0; i < OW_HISTOGRAMS; i++, h++, histograms++)
+    {
+      for (int j = 0; j < OW_HISTOGRAM_BUCKETS; j++)
+	{
+	  histograms->buckets[j] = reset ?
+	    atomic_exchange_explicit (&h->buckets[j], 0,
+				      memory_order_relaxed) :
+	    atomic_load_explicit (&h->buckets[j], memory_order_relaxed);
+	}
+      histograms->max = reset ?
+	atomic_exchange_explicit (&h->max, 0, memory_order_relaxed) :
+	atomic_load_explicit (&h->max, memory_order_relaxed);
+    }
+}
+
+const char *
+ow_engine_get_histogram_name (ow_histogram_t histogram)
+{
+  return histogram < OW_HISTOGRAMS ?
+    ow_engine_histogram_names[histogram] : NULL;
+}
+
 static int
 ow_hotplug_callback (struct libusb_context *ctx, struct libusb_device *device,
 		     libusb_hotplug_event event, void *user_data)
@@ -144,13 +144,17 @@
 
  */
 
+#pragma once
+
 #include <libusb.h>
-#include <samplerate.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <semaphore.h>
 #include "utils.h"
+#include "codec.h"
 #include "overwitch.h"
 
-#define GET_NTH_USB_BLK(blks,blk_len,n) ((struct ow_engine_usb_blk *) &blks[n * blk_len])
+#define GET_NTH_USB_BLK(blks,blk_len,n) ((struct ow_engine_usb_blk *) &(blks)[(n) * (blk_len)])
 #define GET_NTH_INPUT_USB_BLK(engine,n) (GET_NTH_USB_BLK((engine)->usb.xfr_audio_in_data, (engine)->usb.audio_in_blk_len, n))
 #define GET_NTH_OUTPUT_USB_BLK(engine,n) (GET_NTH_USB_BLK((engine)->usb.xfr_audio_out_data, (engine)->usb.audio_out_blk_len, n))
 
@@ -158,43 +162,84 @@
 
 #define OB_NAME_MAX_LEN 32
 
+#define OW_SERIAL_NUMBER_MAX_LEN 64
+
 //This stores "%s @ %03d,%03d" where the string is OW_LABEL_MAX_LEN so more
 //space than OW_LABEL_MAX_LEN is needed.
 #define OW_ENGINE_NAME_MAX_LEN (OW_LABEL_MAX_LEN * 2)
 
+//Stages of an engine driven by a reactor loop
+typedef enum
+{
+  OW_ENGINE_PHASE_BOOT,
+  OW_ENGINE_PHASE_RUN,
+  OW_ENGINE_PHASE_DRAIN
+} ow_engine_phase_t;
+
+struct ow_engine_histogram
+{
+  _Atomic uint64_t buckets[OW_HISTOGRAM_BUCKETS];
+  _Atomic uint64_t max;
+};
+
 struct ow_engine
 {
   char name[OW_ENGINE_NAME_MAX_LEN];
   char overbridge_name[OB_NAME_MAX_LEN];
+  char serial_number[OW_SERIAL_NUMBER_MAX_LEN];	//Empty if not available
   struct ow_device *device;
-  ow_engine_status_t status;
+  _Atomic ow_engine_status_t status;
   unsigned int blocks_per_transfer;
   unsigned int frames_per_transfer;
-  pthread_spinlock_t lock;
   //Latencies are measured in bytes
-  size_t o2h_latency;
-  size_t o2h_min_latency;
-  size_t o2h_max_latency;
-  size_t h2o_latency;
-  size_t h2o_min_latency;
-  size_t h2o_max_latency;
+  atomic_size_t o2h_latency;
+  atomic_size_t o2h_min_latency;
+  atomic_size_t o2h_max_latency;
+  atomic_size_t h2o_latency;
+  atomic_size_t h2o_min_latency;
+  atomic_size_t h2o_max_latency;
   pthread_t thread;
+  //Only used when running from a reactor loop instead of the thread
+  struct ow_reactor_loop *loop;
+  ow_engine_phase_t phase;
+  sem_t finished;
   size_t h2o_transfer_size;
   size_t o2h_transfer_size;
   float *h2o_transfer_buf;
   float *o2h_transfer_buf;
   size_t o2h_frame_size;
   size_t h2o_frame_size;
+  struct ow_codec_plan o2h_codec;
+  struct ow_codec_plan h2o_codec;
+  //Tracks enabled in the current transfer. See the context.
+  uint64_t o2h_tracks;
+  uint64_t h2o_tracks;
   struct
   {
     libusb_context *context;
     libusb_device *device;
     libusb_device_handle *device_handle;
     unsigned int xfr_timeout;
+    //Type 1 devices use isochronous transfers with a packet per block.
+    int iso;
     //Audio
     uint16_t audio_frames_counter;
-    struct libusb_transfer *xfr_audio_in;
-    struct libusb_transfer *xfr_audio_out;
+    //Next expected o2h block frame counter
+    uint16_t audio_in_frames_counter;
+    int audio_in_frames_counter_valid;
+    //Times of the last audio callbacks
+    uint64_t audio_in_cb_time;
+    uint64_t audio_out_cb_time;
+    //Several transfers are kept in flight per direction so that the host
+    //controller always has one pending while the previous one is processed.
+    unsigned int xfr_queue_depth;
+    unsigned int xfrs_in_flight;
+    struct libusb_transfer *xfr_audio_in[OW_MAX_XFR_QUEUE_DEPTH];
+    struct libusb_transfer *xfr_audio_out[OW_MAX_XFR_QUEUE_DEPTH];
+    //Rings of xfr_queue_depth transfer buffers
+    uint8_t *xfr_audio_in_ring;
+    uint8_t *xfr_audio_out_ring;
+    //Transfer buffers being processed
     uint8_t *xfr_audio_in_data;
     uint8_t *xfr_audio_out_data;
     size_t audio_in_blk_len;
@@ -207,11 +252,16 @@ struct ow_engine
     uint8_t *xfr_control_out_data;
     uint8_t *xfr_control_in_data;
   } usb;
-  //j2o resampler
-  float *h2o_resampler_buf;
-  SRC_DATA h2o_data;
+  //h2o underflow concealment. The frames available are stretched to a whole
+  //transfer.
+  float *h2o_conceal_buf;
+  _Atomic uint64_t stats[OW_ENGINE_STATS];
+  struct ow_engine_histogram histograms[OW_HISTOGRAMS];
   int reading_at_h2o_end;
   struct ow_context *context;
+  //Rings created by the engine when the context has no buffers
+  struct ow_ring *o2h_ring;
+  struct ow_ring *h2o_ring;
 };
 
 struct ow_engine_usb_blk
@@ -224,10 +274,35 @@ struct ow_engine_usb_blk
 
 int ow_bytes_to_frame_bytes (int, int);
 
+void ow_engine_decode_usb_input_blocks (struct ow_engine *,
+					struct ow_buffer_region *);
+
+void ow_engine_encode_usb_output_blocks (struct ow_engine *,
+					 struct ow_buffer_region *);
+
 void ow_engine_read_usb_input_blocks (struct ow_engine *);
 
+//Advance the engine without blocking. Returns 0 once it has finished.
+int ow_engine_poll (struct ow_engine *);
+
+int ow_engine_check_iso_packets (struct ow_engine *,
+				 struct libusb_transfer *, int);
+
+int ow_engine_get_xfr_actual_length (struct ow_engine *,
+				     struct libusb_transfer *);
+
+//Handle a finished o2h transfer, whose buffer must be the input data.
+void ow_engine_process_usb_input (struct ow_engine *,
+				  struct libusb_transfer *);
+
 void ow_engine_write_usb_output_blocks (struct ow_engine *);
 
-int ow_engine_init_mem (struct ow_engine *, unsigned int);
+//Fill the h2o transfer with the given frames of the concealment buffer.
+void ow_engine_conceal_h2o (struct ow_engine *, long);
+
+int ow_engine_init_mem (struct ow_engine *, unsigned int, unsigned int);
 
 void ow_engine_free_mem (struct ow_engine *);
+
+//Check the frame counters of the o2h blocks. Returns the frames missing.
+int ow_engine_check_usb_input_frames (struct ow_engine *);
@@ -38,26 +38,13 @@
 
 #define JCLIENT_WAIT_TIME_US 500000
 
-size_t
-jclient_buffer_read (void *buffer, char *src, size_t size)
-{
-  if (src)
-    {
-      return jack_ringbuffer_read (buffer, src, size);
-    }
-  else
-    {
-      jack_ringbuffer_read_advance (buffer, size);
-      return 0;
-    }
-}
-
 static int
 jclient_thread_xrun_cb (void *cb_data)
 {
   struct ow_resampler *resampler = cb_data;
   error_print ("JACK xrun");
   ow_resampler_reset_latencies (resampler);
+  ow_resampler_resync (resampler);
   return 0;
 }
 
@@ -109,6 +96,7 @@ jclient_port_connect_cb (jack_port_id_t a, jack_port_id_t b, int connect,
 			 void *cb_data)
 {
   int total_connections = 0;
+  uint64_t tracks;
   struct jclient *jclient = cb_data;
   struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
   const struct ow_device_desc *desc = &ow_engine_get_device (engine)->desc;
@@ -123,10 +111,26 @@ jclient_port_connect_cb (jack_port_id_t a, jack_port_id_t b, int connect,
   ow_engine_set_option (engine, OW_ENGINE_OPTION_H2O_AUDIO,
 			total_connections != 0);
 
+  //Only the tracks of the connected ports are decoded and encoded.
+  tracks = 0;
+  for (int i = 0; i < desc->inputs; i++)
+    {
+      if (jack_port_connected (jclient->input_ports[i]))
+	{
+	  tracks |= 1ULL << i;
+	}
+    }
+  ow_engine_set_h2o_tracks (engine, tracks);
+
+  tracks = 0;
   for (int i = 0; i < desc->outputs; i++)
     {
-      total_connections += jack_port_connected (jclient->output_ports[i]);
+      if (jack_port_connected (jclient->output_ports[i]))
+	{
+	  tracks |= 1ULL << i;
+	}
     }
+  ow_engine_set_o2h_tracks (engine, tracks);
 }
 
 static void
@@ -178,21 +182,6 @@ jclient_set_sample_rate_cb (jack_nframes_t nframes, void *cb_data)
   return 0;
 }
 
-inline void
-jclient_copy_o2j_audio (float *f, jack_nframes_t nframes,
-			jack_default_audio_sample_t *buffer[],
-			const struct ow_device_desc *desc)
-{
-  for (int i = 0; i < nframes; i++)
-    {
-      for (int j = 0; j < desc->outputs; j++)
-	{
-	  buffer[j][i] = *f;
-	  f++;
-	}
-    }
-}
-
 inline void
 jclient_copy_j2o_audio (float *f, jack_nframes_t nframes,
 			jack_default_audio_sample_t *buffer[],
@@ -226,6 +215,7 @@ jclient_process_cb (jack_nframes_t nframes, void *arg)
   float period_usecs;
   struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
   const struct ow_device_desc *desc = &ow_engine_get_device (engine)->desc;
+  uint64_t start = ow_get_raw_time ();
 
   if (jack_get_cycle_times (jclient->client, &current_frames, &current_usecs,
 			    &next_usecs, &period_usecs))
@@ -241,14 +231,22 @@ jclient_process_cb (jack_nframes_t nframes, void *arg)
 
   //o2h
 
+  //The resampler writes straight into the port buffers and the ports
+  //without connections are skipped.
   for (int i = 0; i < desc->outputs; i++)
     {
-      buffer[i] = jack_port_get_buffer (jclient->output_ports[i], nframes);
+      if (jack_port_connected (jclient->output_ports[i]))
+	{
+	  buffer[i] = jack_port_get_buffer (jclient->output_ports[i],
+					    nframes);
+	}
+      else
+	{
+	  buffer[i] = NULL;
+	}
     }
 
-  f = ow_resampler_get_o2h_audio_buffer (jclient->resampler);
-  ow_resampler_read_audio (jclient->resampler);
-  jclient_copy_o2j_audio (f, nframes, buffer, desc);
+  ow_resampler_read_audio_planar (jclient->resampler, buffer);
 
   //h2o
 
@@ -264,6 +262,9 @@ jclient_process_cb (jack_nframes_t nframes, void *arg)
       ow_resampler_write_audio (jclient->resampler);
     }
 
+  ow_engine_add_histogram_sample (engine, OW_HISTOGRAM_HOST_PROCESSING,
+				  ow_get_raw_time () - start);
+
   return 0;
 }
 
@@ -286,8 +287,11 @@ jclient_stop (struct jclient *jclient)
 
 int
 jclient_init (struct jclient *jclient, struct ow_device *device,
-	      unsigned int blocks_per_transfer, unsigned int xfr_timeout,
-	      int quality, int priority)
+	      unsigned int blocks_per_transfer, unsigned int xfr_queue_depth,
+	      unsigned int xfr_timeout, int quality,
+	      ow_resampler_backend_t backend, unsigned int threads,
+	      ow_dll_estimator_t estimator, int priority,
+	      struct ow_reactor *reactor)
 {
   ow_err_t err;
   struct ow_resampler *resampler;
@@ -299,8 +303,9 @@ jclient_init (struct jclient *jclient, struct ow_device *device,
   pthread_spin_init (&jclient->lock, PTHREAD_PROCESS_PRIVATE);
 
   err = ow_resampler_init_from_device (&resampler, device,
-				       blocks_per_transfer, xfr_timeout,
-				       quality);
+				       blocks_per_transfer, xfr_queue_depth,
+				       xfr_timeout, quality, backend, threads,
+				       estimator, reactor);
 
   if (err)
     {
@@ -329,6 +334,7 @@ jclient_run (struct jclient *jclient)
   const char *name;
   struct ow_engine *engine;
   const struct ow_device_desc *desc;
+  struct ow_ring *o2h_ring, *h2o_ring;
 
   jclient->output_ports = NULL;
   jclient->input_ports = NULL;
@@ -466,28 +472,28 @@ jclient_run (struct jclient *jclient)
 	}
     }
 
-  jclient->context.o2h_audio = jack_ringbuffer_create (MAX_LATENCY *
-						       ow_resampler_get_o2h_frame_size
-						       (jclient->resampler));
-  jack_ringbuffer_mlock (jclient->context.o2h_audio);
-
-  jclient->context.h2o_audio = jack_ringbuffer_create (MAX_LATENCY *
-						       ow_resampler_get_h2o_frame_size
-						       (jclient->resampler));
-  jack_ringbuffer_mlock (jclient->context.h2o_audio);
-
-  jclient->context.read_space =
-    (ow_buffer_rw_space_t) jack_ringbuffer_read_space;
-  jclient->context.write_space =
-    (ow_buffer_rw_space_t) jack_ringbuffer_write_space;
-  jclient->context.read = jclient_buffer_read;
-  jclient->context.write = (ow_buffer_write_t) jack_ringbuffer_write;
+  o2h_ring = ow_ring_create (MAX_LATENCY,
+			     ow_resampler_get_o2h_frame_size
+			     (jclient->resampler));
+  h2o_ring = ow_ring_create (MAX_LATENCY,
+			     ow_resampler_get_h2o_frame_size
+			     (jclient->resampler));
+  ow_context_set_rings (&jclient->context, o2h_ring, h2o_ring);
+  if (!o2h_ring || !h2o_ring)
+    {
+      error_print ("Cannot create ring buffers");
+      err = OW_INIT_ERROR_CANT_CREATE_RING;
+      goto cleanup_jack;
+    }
   jclient->context.get_time = jack_get_time;
 
   jclient->context.set_rt_priority = set_rt_priority;
   jclient->context.priority = jclient->priority;
 
   jclient->context.options = OW_ENGINE_OPTION_O2H_AUDIO;
+  //Set from the port connections.
+  jclient->context.o2h_disabled_tracks = OW_ALL_TRACKS;
+  jclient->context.h2o_disabled_tracks = OW_ALL_TRACKS;
 
   err = ow_resampler_start (jclient->resampler, &jclient->context);
   if (err)
@@ -514,8 +520,8 @@ jclient_run (struct jclient *jclient)
   jack_deactivate (jclient->client);
 
 cleanup_jack:
-  jack_ringbuffer_free (jclient->context.h2o_audio);
-  jack_ringbuffer_free (jclient->context.o2h_audio);
+  ow_ring_destroy (jclient->context.h2o_audio);
+  ow_ring_destroy (jclient->context.o2h_audio);
   jack_client_close (jclient->client);
   free (jclient->output_ports);
   free (jclient->input_ports);
@@ -18,7 +18,6 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <jack/ringbuffer.h>
 #include <jack/types.h>
 #include "overwitch.h"
 
@@ -50,8 +49,11 @@ struct jclient
 void jclient_check_jack_server (jclient_notify_status_t);
 
 int jclient_init (struct jclient *jclient, struct ow_device *device,
-		  unsigned int blocks_per_transfer, unsigned int xfr_timeout,
-		  int quality, int priority);
+		  unsigned int blocks_per_transfer,
+		  unsigned int xfr_queue_depth, unsigned int xfr_timeout,
+		  int quality, ow_resampler_backend_t backend,
+		  unsigned int threads, ow_dll_estimator_t estimator,
+		  int priority, struct ow_reactor *reactor);
 
 int jclient_start (struct jclient *);
 
@@ -63,10 +65,6 @@ void jclient_stop (struct jclient *);
 
 void jclient_print_latencies (struct ow_resampler *, const char *);
 
-void jclient_copy_o2j_audio (float *, jack_nframes_t,
-			     jack_default_audio_sample_t *[],
-			     const struct ow_device_desc *);
-
 void jclient_copy_j2o_audio (float *, jack_nframes_t,
 			     jack_default_audio_sample_t *[],
 			     const struct ow_device_desc *);
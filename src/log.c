@@ -0,0 +1,283 @@
+/*
+ *   log.c
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+#define OW_LOG_DRAIN_PERIOD_NS 10000000
+
+#define OW_LOG_ERROR_START "\x1b[31m"
+#define OW_LOG_ERROR_END "\x1b[m"
+
+struct ow_log_record
+{
+  int error;
+  char msg[OW_LOG_RECORD_LEN];
+};
+
+//Single producer and single consumer. The ring is claimed by a thread the
+//first time it logs and it is released when the thread exits and the ring
+//has been drained.
+struct ow_log_ring
+{
+  atomic_int claimed;
+  atomic_int released;
+  atomic_uint head;
+  atomic_uint tail;
+  struct ow_log_record records[OW_LOG_RECORDS];
+};
+
+struct ow_log
+{
+  struct ow_log_ring *rings;
+  atomic_int running;
+  pthread_t thread;
+  pthread_key_t key;
+  int tty;
+  atomic_uint_least64_t printed;
+  atomic_uint_least64_t dropped;
+  uint64_t dropped_reported;
+};
+
+static struct ow_log ow_log;
+static pthread_once_t ow_log_once = PTHREAD_ONCE_INIT;
+static __thread struct ow_log_ring *ow_log_thread_ring;
+
+static void
+ow_log_output (int error, const char *msg)
+{
+  int color = error && ow_log.tty;
+
+  fprintf (stderr, "%s%s%s\n", color ? OW_LOG_ERROR_START : "", msg,
+	   color ? OW_LOG_ERROR_END : "");
+}
+
+static void
+ow_log_release (void *data)
+{
+  struct ow_log_ring *ring = data;
+  atomic_store_explicit (&ring->released, 1, memory_order_release);
+}
+
+//The rings are never freed as the threads keep a pointer to theirs.
+static void
+ow_log_init ()
+{
+  size_t size = sizeof (struct ow_log_ring) * OW_LOG_MAX_THREADS;
+
+  ow_log.rings = malloc (size);
+  memset (ow_log.rings, 0, size);
+  pthread_key_create (&ow_log.key, ow_log_release);
+  atomic_init (&ow_log.running, 0);
+  atomic_init (&ow_log.printed, 0);
+  atomic_init (&ow_log.dropped, 0);
+}
+
+static struct ow_log_ring *
+ow_log_get_ring ()
+{
+  int expected;
+  struct ow_log_ring *ring = ow_log.rings;
+
+  if (ow_log_thread_ring)
+    {
+      return ow_log_thread_ring;
+    }
+
+  for (int i = 0; i < OW_LOG_MAX_THREADS; i++, ring++)
+    {
+      expected = 0;
+      if (atomic_compare_exchange_strong_explicit (&ring->claimed, &expected,
+						   1, memory_order_acquire,
+						   memory_order_relaxed))
+	{
+	  atomic_store_explicit (&ring->released, 0, memory_order_relaxed);
+	  pthread_setspecific (ow_log.key, ring);
+	  ow_log_thread_ring = ring;
+	  return ring;
+	}
+    }
+
+  return NULL;
+}
+
+static void
+ow_log_drain ()
+{
+  unsigned int head, tail;
+  uint64_t dropped;
+  char msg[OW_LOG_RECORD_LEN];
+  struct ow_log_record *record;
+  struct ow_log_ring *ring = ow_log.rings;
+
+  for (int i = 0; i < OW_LOG_MAX_THREADS; i++, ring++)
+    {
+      if (!atomic_load_explicit (&ring->claimed, memory_order_acquire))
+	{
+	  continue;
+	}
+
+      head = atomic_load_explicit (&ring->head, memory_order_acquire);
+      tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+      for (; tail != head; tail++)
+	{
+	  record = &ring->records[tail % OW_LOG_RECORDS];
+	  ow_log_output (record->error, record->msg);
+	  atomic_store_explicit (&ring->tail, tail + 1, memory_order_release);
+	  atomic_fetch_add_explicit (&ow_log.printed, 1,
+				     memory_order_relaxed);
+	}
+
+      //Messages written after reading the head are printed in the next
+      //iteration.
+      if (atomic_load_explicit (&ring->released, memory_order_acquire) &&
+	  atomic_load_explicit (&ring->head, memory_order_acquire) == tail)
+	{
+	  atomic_store_explicit (&ring->released, 0, memory_order_relaxed);
+	  atomic_store_explicit (&ring->claimed, 0, memory_order_release);
+	}
+    }
+
+  dropped = atomic_load_explicit (&ow_log.dropped, memory_order_relaxed);
+  if (dropped != ow_log.dropped_reported)
+    {
+      snprintf (msg, OW_LOG_RECORD_LEN, "ERROR:%s: %" PRIu64
+		" messages dropped", __FILE__,
+		dropped - ow_log.dropped_reported);
+      ow_log_output (1, msg);
+      ow_log.dropped_reported = dropped;
+    }
+}
+
+static void *
+ow_log_run (void *data)
+{
+  int running;
+  struct timespec period = {.tv_sec = 0,.tv_nsec = OW_LOG_DRAIN_PERIOD_NS };
+
+  do
+    {
+      running = atomic_load_explicit (&ow_log.running, memory_order_acquire);
+      ow_log_drain ();
+      nanosleep (&period, NULL);
+    }
+  while (running);
+
+  return NULL;
+}
+
+void
+ow_log_start ()
+{
+  pthread_attr_t attr;
+  struct sched_param param;
+
+  pthread_once (&ow_log_once, ow_log_init);
+
+  if (atomic_load_explicit (&ow_log.running, memory_order_relaxed))
+    {
+      return;
+    }
+
+  ow_log.tty = isatty (fileno (stderr));
+
+  //The thread must not inherit a real time policy.
+  pthread_attr_init (&attr);
+  pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy (&attr, SCHED_OTHER);
+  param.sched_priority = 0;
+  pthread_attr_setschedparam (&attr, &param);
+
+  atomic_store_explicit (&ow_log.running, 1, memory_order_release);
+  if (pthread_create (&ow_log.thread, &attr, ow_log_run, NULL))
+    {
+      atomic_store_explicit (&ow_log.running, 0, memory_order_release);
+      fprintf (stderr, "ERROR:%s: Could not start logger: %s\n", __FILE__,
+	       strerror (errno));
+    }
+
+  pthread_attr_destroy (&attr);
+}
+
+void
+ow_log_stop ()
+{
+  if (!atomic_load_explicit (&ow_log.running, memory_order_relaxed))
+    {
+      return;
+    }
+
+  atomic_store_explicit (&ow_log.running, 0, memory_order_release);
+  pthread_join (ow_log.thread, NULL);
+}
+
+void
+ow_log_print (int error, const char *format, ...)
+{
+  va_list args;
+  unsigned int head, tail;
+  struct ow_log_ring *ring;
+
+  va_start (args, format);
+
+  if (!atomic_load_explicit (&ow_log.running, memory_order_acquire) ||
+      !(ring = ow_log_get_ring ()))
+    {
+      int color = error && isatty (fileno (stderr));
+      fputs (color ? OW_LOG_ERROR_START : "", stderr);
+      vfprintf (stderr, format, args);
+      fprintf (stderr, "%s\n", color ? OW_LOG_ERROR_END : "");
+      goto end;
+    }
+
+  head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+  if (head - tail == OW_LOG_RECORDS)
+    {
+      atomic_fetch_add_explicit (&ow_log.dropped, 1, memory_order_relaxed);
+      goto end;
+    }
+
+  ring->records[head % OW_LOG_RECORDS].error = error;
+  vsnprintf (ring->records[head % OW_LOG_RECORDS].msg, OW_LOG_RECORD_LEN,
+	     format, args);
+  atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+
+end:
+  va_end (args);
+}
+
+void
+ow_log_get_stats (uint64_t *printed, uint64_t *dropped)
+{
+  pthread_once (&ow_log_once, ow_log_init);
+
+  *printed = atomic_load_explicit (&ow_log.printed, memory_order_relaxed);
+  *dropped = atomic_load_explicit (&ow_log.dropped, memory_order_relaxed);
+}
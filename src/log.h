@@ -0,0 +1,41 @@
+/*
+ *   log.h
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define OW_LOG_MAX_THREADS 64
+#define OW_LOG_RECORDS 32	//Per thread
+#define OW_LOG_RECORD_LEN 256	//Longer messages are truncated
+
+//While the logger runs, every thread writes the messages already formatted
+//to a ring of its own and a low priority thread prints them so that the
+//real time threads never block on stderr. A full ring drops the message.
+//Otherwise, and for the threads without a ring, these are printed at once.
+void ow_log_start ();
+
+//The pending messages are printed before returning.
+void ow_log_stop ();
+
+void ow_log_print (int, const char *, ...)
+  __attribute__((format (printf, 2, 3)));
+
+void ow_log_get_stats (uint64_t * printed, uint64_t * dropped);
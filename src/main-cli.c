@@ -20,15 +20,23 @@
 
 #include <signal.h>
 #include <errno.h>
+#include <inttypes.h>
 #include "../config.h"
 #include "jclient.h"
 #include "utils.h"
 #include "common.h"
+#include "pool.h"
 
 #define DEFAULT_QUALITY 2
 
 static int blocks_per_transfer = OW_DEFAULT_BLOCKS;
+static int xfr_queue_depth = OW_DEFAULT_XFR_QUEUE_DEPTH;
 static int quality = DEFAULT_QUALITY;
+static int backend = OW_RESAMPLER_BACKEND_LIBSAMPLERATE;
+static int threads = 0;
+static int estimator = OW_DLL_ESTIMATOR_ZALSA;
+static ow_target_delay_policy_t target_delay_policy = OW_TARGET_DELAY_DEFAULT;
+static double target_delay_value = 0;
 static int priority = JCLIENT_DEFAULT_PRIORITY;
 static int xfr_timeout = OW_DEFAULT_XFR_TIMEOUT;
 
@@ -42,7 +50,12 @@ static struct option options[] = {
   {"use-device", 1, NULL, 'd'},
   {"bus-device-address", 1, NULL, 'a'},
   {"resampling-quality", 1, NULL, 'q'},
+  {"resampler-backend", 1, NULL, 'R'},
+  {"resampler-threads", 1, NULL, 'w'},
+  {"dll-estimator", 1, NULL, 'e'},
+  {"target-delay", 1, NULL, 'y'},
   {"blocks-per-transfer", 1, NULL, 'b'},
+  {"usb-transfer-queue-depth", 1, NULL, 'x'},
   {"usb-transfer-timeout", 1, NULL, 't'},
   {"rt-priority", 1, NULL, 'p'},
   {"rename", 1, NULL, 'r'},
@@ -82,6 +95,24 @@ signal_handler (int signum)
     }
 }
 
+static void
+print_stats (struct ow_engine *engine)
+{
+  struct ow_engine_stats stats;
+
+  if (!debug_level)
+    {
+      return;
+    }
+
+  ow_engine_get_stats (engine, &stats);
+  for (int i = 0; i < OW_ENGINE_STATS; i++)
+    {
+      debug_print (1, "%s: %" PRIu64, ow_engine_get_stat_name (i),
+		   stats.counters[i]);
+    }
+}
+
 static int
 run_jclient (int device_num, const char *device_name, uint8_t bus,
 	     uint8_t address)
@@ -103,13 +134,17 @@ run_jclient (int device_num, const char *device_name, uint8_t bus,
     }
   pthread_spin_unlock (&lock);
 
-  if (jclient_init (&jclient, device, blocks_per_transfer, xfr_timeout,
-		    quality, priority))
+  if (jclient_init (&jclient, device, blocks_per_transfer, xfr_queue_depth,
+		    xfr_timeout, quality, backend, threads, estimator, priority,
+		    NULL))
     {
       free (device);
       return EXIT_FAILURE;
     }
 
+  ow_resampler_set_target_delay (jclient.resampler, target_delay_policy,
+				 target_delay_value);
+
   jclient_start (&jclient);
 
   pthread_spin_lock (&lock);
@@ -124,6 +159,7 @@ run_jclient (int device_num, const char *device_name, uint8_t bus,
   pthread_spin_unlock (&lock);
 
   jclient_wait (&jclient);
+  print_stats (ow_resampler_get_engine (jclient.resampler));
   jclient_destroy (&jclient);
 
   return err;
@@ -145,7 +181,8 @@ rename_device (int device_num, const char *device_name, uint8_t bus,
     }
 
   err = ow_engine_init_from_device (&engine, device, OW_DEFAULT_BLOCKS,
-				    OW_DEFAULT_XFR_TIMEOUT);
+				    OW_DEFAULT_XFR_QUEUE_DEPTH,
+				    OW_DEFAULT_XFR_TIMEOUT, NULL);
   if (err)
     {
       free (device);
@@ -166,6 +203,8 @@ rename_device (int device_num, const char *device_name, uint8_t bus,
   context.read = NULL;
   context.h2o_audio = NULL;
   context.options = 0;
+  context.o2h_disabled_tracks = 0;
+  context.h2o_disabled_tracks = 0;
   context.set_rt_priority = NULL;
 
   err = ow_engine_start (engine, &context);
@@ -184,8 +223,8 @@ int
 main (int argc, char *argv[])
 {
   int opt, err = EXIT_SUCCESS;
-  int vflg = 0, lflg = 0, dflg = 0, bflg = 0, pflg = 0, tflg = 0, nflg =
-    0, aflg = 0, rflg = 0, errflg = 0;
+  int vflg = 0, lflg = 0, dflg = 0, bflg = 0, xflg = 0, pflg = 0, tflg =
+    0, nflg = 0, aflg = 0, rflg = 0, errflg = 0;
   char *endstr;
   char *device_name = NULL, *name = NULL;
   uint8_t bus = 0, address = 0;
@@ -207,7 +246,7 @@ main (int argc, char *argv[])
   sigaction (SIGUSR1, &action, NULL);
   sigaction (SIGUSR2, &action, NULL);
 
-  while ((opt = getopt_long (argc, argv, "sn:d:a:q:b:t:p:r:lvh",
+  while ((opt = getopt_long (argc, argv, "sn:d:a:q:R:w:e:y:b:x:t:p:r:lvh",
 			     options, &long_index)) != -1)
     {
       switch (opt)
@@ -241,10 +280,59 @@ main (int argc, char *argv[])
 		       quality);
 	    }
 	  break;
+	case 'R':
+	  errno = 0;
+	  backend = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || backend > OW_RESAMPLER_BACKEND_POLYPHASE || backend < 0)
+	    {
+	      backend = OW_RESAMPLER_BACKEND_LIBSAMPLERATE;
+	      fprintf (stderr,
+		       "Resampler backend value must be in [0..1]. Using value %d...\n",
+		       backend);
+	    }
+	  break;
+	case 'w':
+	  errno = 0;
+	  threads = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || threads > OW_POOL_MAX_THREADS || threads < 0)
+	    {
+	      threads = 0;
+	      fprintf (stderr,
+		       "Resampler threads value must be in [0..%d]. Using value %d...\n",
+		       OW_POOL_MAX_THREADS, threads);
+	    }
+	  break;
+	case 'e':
+	  errno = 0;
+	  estimator = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0'
+	      || estimator > OW_DLL_ESTIMATOR_KALMAN || estimator < 0)
+	    {
+	      estimator = OW_DLL_ESTIMATOR_ZALSA;
+	      fprintf (stderr,
+		       "DLL estimator value must be in [0..1]. Using value %d...\n",
+		       estimator);
+	    }
+	  break;
+	case 'y':
+	  if (get_ow_target_delay_argument (optarg, &target_delay_policy,
+					    &target_delay_value))
+	    {
+	      target_delay_policy = OW_TARGET_DELAY_DEFAULT;
+	      fprintf (stderr,
+		       "Target delay must be 'auto', frames or a factor like '0.5x'. Using default value...\n");
+	    }
+	  break;
 	case 'b':
 	  blocks_per_transfer = get_ow_blocks_per_transfer_argument (optarg);
 	  bflg++;
 	  break;
+	case 'x':
+	  xfr_queue_depth = get_ow_xfr_queue_depth_argument (optarg);
+	  xflg++;
+	  break;
 	case 't':
 	  xfr_timeout = get_ow_xfr_timeout_argument (optarg);
 	  tflg++;
@@ -308,6 +396,13 @@ main (int argc, char *argv[])
       goto cleanup;
     }
 
+  if (xflg > 1)
+    {
+      fprintf (stderr, "Undetermined queue depth\n");
+      err = EXIT_FAILURE;
+      goto cleanup;
+    }
+
   if (pflg > 1)
     {
       fprintf (stderr, "Undetermined priority\n");
@@ -337,7 +432,9 @@ main (int argc, char *argv[])
 	}
       else
 	{
+	  ow_log_start ();
 	  err = run_jclient (device_num, device_name, bus, address);
+	  ow_log_stop ();
 	}
     }
   else
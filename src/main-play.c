@@ -18,9 +18,11 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <signal.h>
 #include <sndfile.h>
 #include <unistd.h>
+#include <stdatomic.h>
 #include "../config.h"
 #include "utils.h"
 #include "common.h"
@@ -33,13 +35,27 @@ static float max[OB_MAX_TRACKS];
 static float min[OB_MAX_TRACKS];
 static char *file;
 static sf_count_t frames;
+static int dither;
+
+//The reader thread converts the file straight into the ring and the engine
+//encodes the samples from the ring memory.
+static struct
+{
+  struct ow_ring *ring;
+  pthread_t pthread;
+  size_t transfer_frames;
+  int running;
+  atomic_int end;
+} buffer;
 
 static struct option options[] = {
   {"use-device-number", 1, NULL, 'n'},
   {"use-device", 1, NULL, 'd'},
   {"bus-device-address", 1, NULL, 'a'},
   {"blocks-per-transfer", 1, NULL, 'b'},
+  {"usb-transfer-queue-depth", 1, NULL, 'x'},
   {"usb-transfer-timeout", 1, NULL, 't'},
+  {"dither", 0, NULL, 'D'},
   {"list-devices", 0, NULL, 'l'},
   {"verbose", 0, NULL, 'v'},
   {"help", 0, NULL, 'h'},
@@ -52,44 +68,21 @@ print_status ()
   fprintf (stderr, "%lu frames read\n", frames);
 }
 
-static size_t
-buffer_read_space (void *data)
-{
-  const struct ow_device_desc *desc = &ow_engine_get_device (engine)->desc;
-  size_t rbsp = (sfinfo.frames - frames) * desc->inputs * OW_BYTES_PER_SAMPLE;
-
-  if (!rbsp)
-    {
-      ow_engine_stop (engine);
-    }
-
-  return rbsp;
-}
-
-static size_t
-buffer_read (void *data, char *buf, size_t size)
+static sf_count_t
+read_frames (float *buf, sf_count_t wanted_frames)
 {
   const struct ow_device_desc *desc = &ow_engine_get_device (engine)->desc;
-  int bytes_per_frame = desc->inputs * OW_BYTES_PER_SAMPLE;
-  sf_count_t wanted_frames, read_frames;
-
-  wanted_frames = size / bytes_per_frame;
+  sf_count_t read_frames;
 
-  debug_print (2, "Reading %ld bytes (%ld frames) from file...", size,
-	       wanted_frames);
+  debug_print (2, "Reading %ld frames from file...", wanted_frames);
 
-  read_frames = sf_readf_float (sf, (float *) buf, wanted_frames);
-
-  if (read_frames < wanted_frames)
-    {
-      ow_engine_stop (engine);
-    }
+  read_frames = sf_readf_float (sf, buf, wanted_frames);
 
   for (int i = 0; i < read_frames; i++)
     {
       for (int j = 0; j < desc->inputs; j++)
 	{
-	  float x = *((float *) buf);
+	  float x = *buf;
 	  if (x >= 0.0)
 	    {
 	      if (x > max[j])
@@ -104,12 +97,90 @@ buffer_read (void *data, char *buf, size_t size)
 		  min[j] = x;
 		}
 	    }
-	  buf += OW_BYTES_PER_SAMPLE;
+	  buf++;
 	}
     }
 
   frames += read_frames;
-  return read_frames * bytes_per_frame;
+  return read_frames;
+}
+
+//The engine only takes whole transfers so the last one is completed with
+//silence.
+static void
+write_padding (size_t frame_size)
+{
+  struct ow_buffer_region regions[2];
+  size_t pad = (buffer.transfer_frames -
+		frames % buffer.transfer_frames) % buffer.transfer_frames;
+  size_t bytes, len;
+
+  while (pad && !atomic_load (&buffer.end))
+    {
+      bytes = ow_ring_get_write_regions (buffer.ring, regions);
+      if (bytes > pad * frame_size)
+	{
+	  bytes = pad * frame_size;
+	}
+      len = regions[0].len < bytes ? regions[0].len : bytes;
+      memset (regions[0].data, 0, len);
+      memset (regions[1].data, 0, bytes - len);
+      ow_ring_write_commit (buffer.ring, bytes);
+      pad -= bytes / frame_size;
+      if (pad)
+	{
+	  usleep (100);
+	}
+    }
+}
+
+//Fill all the available space and return 0 if the end of the file has been
+//reached.
+static int
+fill_regions ()
+{
+  struct ow_buffer_region regions[2];
+  size_t frame_size = ow_ring_get_frame_size (buffer.ring);
+  size_t bytes = 0, wanted;
+  sf_count_t n;
+  int eof = 0;
+
+  if (ow_ring_get_write_regions (buffer.ring, regions))
+    {
+      for (int i = 0; i < 2 && !eof; i++)
+	{
+	  wanted = regions[i].len / frame_size;
+	  n = read_frames ((float *) regions[i].data, wanted);
+	  bytes += n * frame_size;
+	  eof = n < wanted;
+	}
+      ow_ring_write_commit (buffer.ring, bytes);
+    }
+
+  return !eof;
+}
+
+static void *
+fill_buffer (void *data)
+{
+  int running = buffer.running;
+
+  while (running && !atomic_load (&buffer.end))
+    {
+      usleep (100);
+      running = fill_regions ();
+    }
+
+  write_padding (ow_ring_get_frame_size (buffer.ring));
+
+  while (ow_ring_read_space (buffer.ring) && !atomic_load (&buffer.end))
+    {
+      usleep (100);
+    }
+
+  ow_engine_stop (engine);
+
+  return NULL;
 }
 
 static void
@@ -135,7 +206,8 @@ signal_handler (int signo)
 static int
 run_play (int device_num, const char *device_name, uint8_t bus,
 	  uint8_t address, unsigned int blocks_per_transfer,
-	  unsigned int xfr_timeout, const char *file)
+	  unsigned int xfr_queue_depth, unsigned int xfr_timeout,
+	  const char *file)
 {
   ow_err_t err;
   struct ow_device *device;
@@ -147,7 +219,7 @@ run_play (int device_num, const char *device_name, uint8_t bus,
     }
 
   err = ow_engine_init_from_device (&engine, device, blocks_per_transfer,
-				    xfr_timeout);
+				    xfr_queue_depth, xfr_timeout, NULL);
   if (err)
     {
       free (device);
@@ -175,21 +247,56 @@ run_play (int device_num, const char *device_name, uint8_t bus,
       min[i] = 0.0f;
     }
 
-  ow_set_thread_rt_priority (pthread_self (), OW_DEFAULT_RT_PROPERTY);
+  buffer.ring = ow_ring_create (OW_DEFAULT_RING_FRAMES,
+				device->desc.inputs * OW_BYTES_PER_SAMPLE);
+  if (!buffer.ring)
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_audio;
+    }
+  buffer.transfer_frames = blocks_per_transfer * OB_FRAMES_PER_BLOCK;
+  atomic_init (&buffer.end, 0);
 
   context.dll = NULL;
-  context.read_space = buffer_read_space;
-  context.read = buffer_read;
-  context.h2o_audio = sf;
+  ow_context_set_rings (&context, NULL, buffer.ring);
   context.options = OW_ENGINE_OPTION_H2O_AUDIO;
+  context.o2h_disabled_tracks = OW_ALL_TRACKS;
+  context.h2o_disabled_tracks = 0;
+  if (dither)
+    {
+      context.options |= OW_ENGINE_OPTION_H2O_DITHER;
+    }
+
+  //The engine starts with a full ring.
+  buffer.running = fill_regions ();
 
   err = ow_engine_start (engine, &context);
-  if (!err)
+  if (err)
     {
+      goto cleanup_ring;
+    }
+
+  //The reader might stop the engine so it is started afterwards.
+  if (pthread_create (&buffer.pthread, NULL, fill_buffer, NULL))
+    {
+      error_print ("Could not start reader thread");
+      ow_engine_stop (engine);
       ow_engine_wait (engine);
-      print_status ();
+      err = OW_GENERIC_ERROR;
+      goto cleanup_ring;
     }
 
+  pthread_setname_np (buffer.pthread, "reader-worker");
+  ow_set_thread_rt_priority (buffer.pthread, OW_DEFAULT_RT_PROPERTY);
+
+  ow_engine_wait (engine);
+  print_status ();
+
+  atomic_store (&buffer.end, 1);
+  pthread_join (buffer.pthread, NULL);
+
+cleanup_ring:
+  ow_ring_destroy (buffer.ring);
 cleanup_audio:
   sf_close (sf);
 cleanup_engine:
@@ -207,15 +314,17 @@ main (int argc, char *argv[])
 {
   int opt;
   int lflg = 0, vflg = 0, errflg = 0;
-  int nflg = 0, dflg = 0, aflg = 0, bflg = 0, tflg = 0;
+  int nflg = 0, dflg = 0, aflg = 0, bflg = 0, xflg = 0, tflg = 0;
   char *endstr;
   const char *device_name = NULL;
   uint8_t bus = 0, address = 0;
   int long_index = 0;
+  int err;
   ow_err_t ow_err;
   struct sigaction action;
   int device_num = -1;
   unsigned int blocks_per_transfer = OW_DEFAULT_BLOCKS;
+  unsigned int xfr_queue_depth = OW_DEFAULT_XFR_QUEUE_DEPTH;
   unsigned int xfr_timeout = OW_DEFAULT_XFR_TIMEOUT;
 
   action.sa_handler = signal_handler;
@@ -227,7 +336,7 @@ main (int argc, char *argv[])
   sigaction (SIGUSR1, &action, NULL);
   sigaction (SIGTSTP, &action, NULL);
 
-  while ((opt = getopt_long (argc, argv, "n:d:a:b:t:lvh",
+  while ((opt = getopt_long (argc, argv, "n:d:a:b:x:t:Dlvh",
 			     options, &long_index)) != -1)
     {
       switch (opt)
@@ -248,10 +357,17 @@ main (int argc, char *argv[])
 	  blocks_per_transfer = get_ow_blocks_per_transfer_argument (optarg);
 	  bflg++;
 	  break;
+	case 'x':
+	  xfr_queue_depth = get_ow_xfr_queue_depth_argument (optarg);
+	  xflg++;
+	  break;
 	case 't':
 	  xfr_timeout = get_ow_xfr_timeout_argument (optarg);
 	  tflg++;
 	  break;
+	case 'D':
+	  dither = 1;
+	  break;
 	case 'l':
 	  lflg++;
 	  break;
@@ -303,6 +419,12 @@ main (int argc, char *argv[])
       exit (EXIT_FAILURE);
     }
 
+  if (xflg > 1)
+    {
+      fprintf (stderr, "Undetermined queue depth\n");
+      exit (EXIT_FAILURE);
+    }
+
   if (tflg > 1)
     {
       fprintf (stderr, "Undetermined timeout\n");
@@ -311,8 +433,12 @@ main (int argc, char *argv[])
 
   if (nflg + dflg == 1)
     {
-      return run_play (device_num, device_name, bus, address,
-		       blocks_per_transfer, xfr_timeout, file);
+      ow_log_start ();
+      err = run_play (device_num, device_name, bus, address,
+		      blocks_per_transfer, xfr_queue_depth, xfr_timeout,
+		      file);
+      ow_log_stop ();
+      return err;
     }
   else
     {
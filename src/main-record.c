@@ -23,6 +23,7 @@
 #include <sndfile.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdatomic.h>
 #include "../config.h"
 #include "utils.h"
 #include "common.h"
@@ -30,6 +31,7 @@
 #define TRACK_BUF_KB 256
 #define MAX_FILENAME_LEN 128
 #define MAX_TIME_LEN 32
+#define DISK_FRAMES 4096
 
 static struct ow_context context;
 static struct ow_engine *engine;
@@ -42,23 +44,14 @@ static float max[OB_MAX_TRACKS];
 static float min[OB_MAX_TRACKS];
 static char filename[MAX_FILENAME_LEN];
 
-typedef enum
-{
-  END = -1,
-  EMPTY,
-  READY
-} buffer_status_t;
-
+//The engine decodes the samples straight into the ring and the recorder
+//thread takes the selected tracks from the ring memory to the disk buffer.
 static struct
 {
-  char *mem;
-  char *disk;
-  size_t len;
+  struct ow_ring *ring;
+  float disk[DISK_FRAMES * OB_MAX_TRACKS];
   pthread_t pthread;
-  size_t disk_samples;
-  size_t disk_frames;
-  pthread_spinlock_t lock;
-  buffer_status_t status;
+  atomic_int end;
   int outputs;
   int outputs_mask_len;
 } buffer;
@@ -70,6 +63,7 @@ static struct option options[] = {
   {"track-mask", 1, NULL, 'm'},
   {"track-buffer-size-kilobytes", 1, NULL, 's'},
   {"blocks-per-transfer", 1, NULL, 'b'},
+  {"usb-transfer-queue-depth", 1, NULL, 'x'},
   {"usb-transfer-timeout", 1, NULL, 't'},
   {"list-devices", 0, NULL, 'l'},
   {"verbose", 0, NULL, 'v'},
@@ -83,87 +77,23 @@ print_status ()
   fprintf (stderr, "%lu frames written\n", sfinfo.frames);
 }
 
-static size_t
-buffer_dummy_rw_space (void *data)
-{
-  return OW_DEFAULT_BLOCKS * OB_FRAMES_PER_BLOCK * OB_MAX_TRACKS *
-    OW_BYTES_PER_SAMPLE;
-}
-
-static buffer_status_t
-get_buffer_status ()
-{
-  buffer_status_t status;
-
-  pthread_spin_lock (&buffer.lock);
-  status = buffer.status;
-  pthread_spin_unlock (&buffer.lock);
-
-  return status;
-}
-
-static void *
-dump_buffer (void *data)
-{
-  buffer_status_t status = get_buffer_status ();
-  while (status >= EMPTY)
-    {
-      if (status == READY)
-	{
-	  pthread_spin_lock (&buffer.lock);
-	  debug_print (2, "Writing %ld frames to disk...",
-		       buffer.disk_frames);
-	  sf_write_float (sf, (float *) buffer.disk, buffer.disk_samples);
-	  debug_print (2, "Done");
-
-	  buffer.status = EMPTY;
-	  pthread_spin_unlock (&buffer.lock);
-	}
-
-      usleep (100);
-
-      status = get_buffer_status ();
-    }
-  return NULL;
-}
-
-static size_t
-buffer_write (void *data, const char *buf, size_t size)
+static void
+write_frames (const float *src, size_t frames)
 {
   static int print_control = 0;
-  static size_t pos = 0;
-  size_t new_pos;
-  void *dst;
-  size_t frames = size / (desc->outputs * OW_BYTES_PER_SAMPLE);
-
-  debug_print (2, "Writing %ld bytes (%ld frames) to buffer...", size,
-	       frames);
-  new_pos = pos + frames * buffer.outputs * OW_BYTES_PER_SAMPLE;
-  if (new_pos >= buffer.len)
-    {
-      pthread_spin_lock (&buffer.lock);
-      buffer.status = READY;
-      buffer.disk_samples = pos / OW_BYTES_PER_SAMPLE;
-      buffer.disk_frames = buffer.disk_samples / buffer.outputs;
-      memcpy (buffer.disk, buffer.mem,
-	      buffer.disk_frames * buffer.outputs * OW_BYTES_PER_SAMPLE);
-      pthread_spin_unlock (&buffer.lock);
-      sfinfo.frames += buffer.disk_frames;
-      pos = 0;
-    }
+  float *dst = buffer.disk;
+  size_t disk_frames = 0;
 
-  dst = &buffer.mem[pos];
-  for (int i = 0; i < frames; i++)
+  for (size_t i = 0; i < frames; i++)
     {
-      for (int j = 0; j < desc->outputs; j++)
+      for (int j = 0; j < desc->outputs; j++, src++)
 	{
 	  if (!track_mask
 	      || (j < buffer.outputs_mask_len && (track_mask[j] != '0')))
 	    {
-	      memcpy (dst, buf, OW_BYTES_PER_SAMPLE);
-	      dst += OW_BYTES_PER_SAMPLE;
-	      pos += OW_BYTES_PER_SAMPLE;
-	      float x = *((float *) buf);
+	      float x = *src;
+	      *dst = x;
+	      dst++;
 	      if (x >= 0.0)
 		{
 		  if (x > max[j])
@@ -179,7 +109,16 @@ buffer_write (void *data, const char *buf, size_t size)
 		    }
 		}
 	    }
-	  buf += OW_BYTES_PER_SAMPLE;
+	}
+
+      disk_frames++;
+      if (disk_frames == DISK_FRAMES || i == frames - 1)
+	{
+	  debug_print (2, "Writing %ld frames to disk...", disk_frames);
+	  sf_writef_float (sf, buffer.disk, disk_frames);
+	  sfinfo.frames += disk_frames;
+	  dst = buffer.disk;
+	  disk_frames = 0;
 	}
     }
 
@@ -192,8 +131,40 @@ buffer_write (void *data, const char *buf, size_t size)
 	  print_status ();
 	}
     }
+}
+
+static void *
+dump_buffer (void *data)
+{
+  struct ow_buffer_region regions[2];
+  size_t frame_size = ow_ring_get_frame_size (buffer.ring);
+  size_t bytes;
+  int end;
 
-  return size;
+  while (1)
+    {
+      //Checked before the read space so that the ring is drained.
+      end = atomic_load (&buffer.end);
+      bytes = ow_ring_get_read_regions (buffer.ring, regions);
+      if (!bytes)
+	{
+	  if (end)
+	    {
+	      break;
+	    }
+	  usleep (100);
+	  continue;
+	}
+
+      for (int i = 0; i < 2; i++)
+	{
+	  write_frames ((float *) regions[i].data,
+			regions[i].len / frame_size);
+	}
+      ow_ring_read_commit (buffer.ring, bytes);
+    }
+
+  return NULL;
 }
 
 static void
@@ -223,7 +194,7 @@ signal_handler (int signo)
 static int
 run_record (int device_num, const char *device_name, uint8_t bus,
 	    uint8_t address, unsigned int blocks_per_transfer,
-	    unsigned int xfr_timeout)
+	    unsigned int xfr_queue_depth, unsigned int xfr_timeout)
 {
   char curr_time_string[MAX_TIME_LEN];
   time_t curr_time;
@@ -238,7 +209,7 @@ run_record (int device_num, const char *device_name, uint8_t bus,
     }
 
   err = ow_engine_init_from_device (&engine, device, blocks_per_transfer,
-				    xfr_timeout);
+				    xfr_queue_depth, xfr_timeout, NULL);
   if (err)
     {
       free (device);
@@ -250,19 +221,26 @@ run_record (int device_num, const char *device_name, uint8_t bus,
   if (track_mask)
     {
       buffer.outputs = 0;
+      context.o2h_disabled_tracks = OW_ALL_TRACKS;
       const char *c = track_mask;
       for (int i = 0; i < strlen (track_mask); i++, c++)
 	{
 	  if (*c != '0')
 	    {
 	      buffer.outputs++;
+	      if (i < OB_MAX_TRACKS)
+		{
+		  context.o2h_disabled_tracks &= ~(1ULL << i);
+		}
 	    }
 	}
     }
   else
     {
       buffer.outputs = device->desc.outputs;
+      context.o2h_disabled_tracks = 0;
     }
+  context.h2o_disabled_tracks = OW_ALL_TRACKS;
 
   if (buffer.outputs == 0)
     {
@@ -285,23 +263,15 @@ run_record (int device_num, const char *device_name, uint8_t bus,
   debug_print (1, "Creating sample (%d channels)...", buffer.outputs);
   sf = sf_open (filename, SFM_WRITE, &sfinfo);
 
-  context.dll = NULL;
-  context.write_space = buffer_dummy_rw_space;
-  context.read_space = buffer_dummy_rw_space;
-  context.write = buffer_write;
-  context.o2h_audio = sf;
-  context.options = OW_ENGINE_OPTION_O2H_AUDIO;
-
-  err = ow_engine_start (engine, &context);
-  if (err)
+  buffer.ring = ow_ring_create (track_buf_size_kb * 1000,
+				desc->outputs * OW_BYTES_PER_SAMPLE);
+  if (!buffer.ring)
     {
+      err = OW_GENERIC_ERROR;
       goto cleanup;
     }
-
-  buffer.len = track_buf_size_kb * 1000 * buffer.outputs;
-  buffer.mem = malloc (buffer.len * OW_BYTES_PER_SAMPLE);
-  buffer.disk = malloc (buffer.len * OW_BYTES_PER_SAMPLE);
   buffer.outputs_mask_len = track_mask ? strlen (track_mask) : 0;
+  atomic_init (&buffer.end, 0);
 
   for (int i = 0; i < device->desc.outputs; i++)
     {
@@ -309,31 +279,34 @@ run_record (int device_num, const char *device_name, uint8_t bus,
       min[i] = 0.0f;
     }
 
-  buffer.status = READY;
-  pthread_spin_init (&buffer.lock, PTHREAD_PROCESS_SHARED);
+  context.dll = NULL;
+  ow_context_set_rings (&context, buffer.ring, NULL);
+  context.options = OW_ENGINE_OPTION_O2H_AUDIO;
+
   if (pthread_create (&buffer.pthread, NULL, dump_buffer, NULL))
     {
       error_print ("Could not start recording thread");
+      err = OW_GENERIC_ERROR;
       goto cleanup;
     }
 
   pthread_setname_np (buffer.pthread, "recorder-worker");
   ow_set_thread_rt_priority (buffer.pthread, OW_DEFAULT_RT_PROPERTY);
 
-  ow_engine_wait (engine);
+  err = ow_engine_start (engine, &context);
+  if (!err)
+    {
+      ow_engine_wait (engine);
+    }
 
-  pthread_spin_lock (&buffer.lock);
-  buffer.status = END;
-  pthread_spin_unlock (&buffer.lock);
+  atomic_store (&buffer.end, 1);
   pthread_join (buffer.pthread, NULL);
 
 cleanup:
-  pthread_spin_destroy (&buffer.lock);
-  free (buffer.mem);
-  free (buffer.disk);
   sf_close (sf);
 cleanup_engine:
   ow_engine_destroy (engine);
+  ow_ring_destroy (buffer.ring);
 end:
   if (err)
     {
@@ -347,15 +320,18 @@ main (int argc, char *argv[])
 {
   int opt;
   int lflg = 0, vflg = 0, errflg = 0;
-  int nflg = 0, dflg = 0, aflg = 0, mflg = 0, sflg = 0, bflg = 0, tflg = 0;
+  int nflg = 0, dflg = 0, aflg = 0, mflg = 0, sflg = 0, bflg = 0, xflg = 0,
+    tflg = 0;
   char *endstr;
   const char *device_name = NULL;
   uint8_t bus = 0, address = 0;
   int long_index = 0;
+  int err;
   ow_err_t ow_err;
   struct sigaction action;
   int device_num = -1;
   unsigned int blocks_per_transfer = OW_DEFAULT_BLOCKS;
+  unsigned int xfr_queue_depth = OW_DEFAULT_XFR_QUEUE_DEPTH;
   unsigned int xfr_timeout = OW_DEFAULT_XFR_TIMEOUT;
 
   action.sa_handler = signal_handler;
@@ -367,7 +343,7 @@ main (int argc, char *argv[])
   sigaction (SIGUSR1, &action, NULL);
   sigaction (SIGTSTP, &action, NULL);
 
-  while ((opt = getopt_long (argc, argv, "n:d:a:m:s:b:t:lvh",
+  while ((opt = getopt_long (argc, argv, "n:d:a:m:s:b:x:t:lvh",
 			     options, &long_index)) != -1)
     {
       switch (opt)
@@ -396,6 +372,10 @@ main (int argc, char *argv[])
 	  blocks_per_transfer = get_ow_blocks_per_transfer_argument (optarg);
 	  bflg++;
 	  break;
+	case 'x':
+	  xfr_queue_depth = get_ow_xfr_queue_depth_argument (optarg);
+	  xflg++;
+	  break;
 	case 't':
 	  xfr_timeout = get_ow_xfr_timeout_argument (optarg);
 	  tflg++;
@@ -448,6 +428,12 @@ main (int argc, char *argv[])
       exit (EXIT_FAILURE);
     }
 
+  if (xflg > 1)
+    {
+      fprintf (stderr, "Undetermined queue depth\n");
+      exit (EXIT_FAILURE);
+    }
+
   if (tflg > 1)
     {
       fprintf (stderr, "Undetermined timeout\n");
@@ -456,8 +442,11 @@ main (int argc, char *argv[])
 
   if (nflg + dflg + aflg == 1)
     {
-      return run_record (device_num, device_name, bus, address,
-			 blocks_per_transfer, xfr_timeout);
+      ow_log_start ();
+      err = run_record (device_num, device_name, bus, address,
+			blocks_per_transfer, xfr_queue_depth, xfr_timeout);
+      ow_log_stop ();
+      return err;
     }
   else
     {
@@ -52,6 +52,7 @@ static gint hotplug_running;
 static pthread_t hotplug_thread;
 static gint force_stop;
 static GApplication *app;
+static struct ow_reactor *reactor;	//Only used if the preferences set threads
 
 static GDBusNodeInfo *introspection_data = NULL;
 
@@ -61,6 +62,10 @@ static const gchar introspection_xml[] =
   "    <method name='GetState'>"
   "      <arg type='s' name='status' direction='out'/>"
   "    </method>"
+  "    <method name='GetHistograms'>"
+  "      <arg type='b' name='reset' direction='in'/>"
+  "      <arg type='s' name='histograms' direction='out'/>"
+  "    </method>"
   "    <method name='Start'>"
   "    </method>"
   "    <method name='Stop'>"
@@ -145,13 +150,19 @@ static void
 start_single (struct pooled_jclient *pjc, guint id, struct ow_device *device)
 {
   if (jclient_init (&pjc->jclient, device, preferences.blocks,
-		    preferences.timeout, preferences.quality,
-		    JCLIENT_DEFAULT_PRIORITY))
+		    preferences.xfr_queue_depth, preferences.timeout,
+		    preferences.quality, preferences.resampler_backend,
+		    preferences.resampler_threads, preferences.dll_estimator,
+		    JCLIENT_DEFAULT_PRIORITY, reactor))
     {
       free (device);
       return;
     }
 
+  ow_resampler_set_target_delay (pjc->jclient.resampler,
+				 preferences.target_delay_policy,
+				 preferences.target_delay_value);
+
   debug_print (1, "Starting pooled jclient %d...", id);
   pjc->status = PJC_RUNNING;
   if (pthread_create (&pjc->thread, NULL, jclient_runner, pjc))
@@ -368,6 +379,34 @@ handle_get_state ()
 				    target_delay_ms);
 }
 
+static gchar *
+handle_get_histograms (gboolean reset)
+{
+  struct pooled_jclient *pjc = jcpool;
+  struct ow_histogram histograms[OW_HISTOGRAMS];
+
+  JsonBuilder *builder = message_histograms_builder_start ();
+
+  pthread_spin_lock (&lock);
+
+  for (guint32 i = 0; i < POOLED_JCLIENT_LEN; i++, pjc++)
+    {
+      if (pjc->status == PJC_RUNNING)
+	{
+	  struct ow_engine *engine =
+	    ow_resampler_get_engine (pjc->jclient.resampler);
+	  const gchar *name = ow_engine_get_overbridge_name (engine);
+	  ow_engine_get_histograms (engine, histograms, reset);
+	  message_histograms_builder_add_device (builder, i, name,
+						 histograms);
+	}
+    }
+
+  pthread_spin_unlock (&lock);
+
+  return message_histograms_builder_end (builder);
+}
+
 static gint
 handle_set_device_name (guint id, const gchar *name)
 {
@@ -424,6 +463,16 @@ handle_method_call (GDBusConnection *connection, const gchar *sender,
       g_dbus_method_invocation_return_value (invocation, v);
       g_free (state);
     }
+  else if (g_strcmp0 (method_name, "GetHistograms") == 0)
+    {
+      gboolean reset;
+      GVariant *params = g_dbus_method_invocation_get_parameters (invocation);
+      g_variant_get (params, "(b)", &reset);
+      gchar *histograms = handle_get_histograms (reset);
+      GVariant *v = g_variant_new ("(s)", histograms);
+      g_dbus_method_invocation_return_value (invocation, v);
+      g_free (histograms);
+    }
   else if (g_strcmp0 (method_name, "SetDeviceName") == 0)
     {
       guint id;
@@ -465,6 +514,19 @@ startup ()
       setenv (PIPEWIRE_PROPS_ENV_VAR, preferences.pipewire_props, TRUE);
     }
 
+  //All the clients have been stopped at this point.
+  if (reactor)
+    {
+      ow_reactor_destroy (reactor);
+      reactor = NULL;
+    }
+
+  if (preferences.reactor_threads > 0 &&
+      ow_reactor_init (&reactor, preferences.reactor_threads))
+    {
+      reactor = NULL;
+    }
+
   force_stop = 0;
   if (start_all ())
     {
@@ -532,6 +594,8 @@ main (gint argc, gchar *argv[])
   g_signal_connect (app, "startup", G_CALLBACK (app_startup), NULL);
   g_signal_connect (app, "activate", G_CALLBACK (app_activate), NULL);
 
+  ow_log_start ();
+
   status = g_application_run (G_APPLICATION (app), argc, argv);
 
   g_object_unref (app);
@@ -545,7 +609,14 @@ main (gint argc, gchar *argv[])
       pthread_join (hotplug_thread, NULL);
     }
 
+  if (reactor)
+    {
+      ow_reactor_destroy (reactor);
+    }
+
   pthread_spin_destroy (&lock);
 
+  ow_log_stop ();
+
   return status;
 }
@@ -40,6 +40,13 @@ static GDBusConnection *connection;
 static gint devices;
 static guint source_id;
 static gchar *pipewire_props;
+static gint64 xfr_queue_depth;
+static gint64 reactor_threads;
+static gint64 resampler_backend;
+static gint64 resampler_threads;
+static gint64 dll_estimator;
+static gint64 target_delay_policy;
+static gdouble target_delay_value;
 
 static GtkApplication *app;
 
@@ -119,6 +126,13 @@ save_preferences ()
   prefs.timeout = gtk_spin_button_get_value_as_int (timeout_spin_button);
   prefs.quality = gtk_drop_down_get_selected (quality_drop_down);
   prefs.pipewire_props = pipewire_props;
+  prefs.xfr_queue_depth = xfr_queue_depth;
+  prefs.reactor_threads = reactor_threads;
+  prefs.resampler_backend = resampler_backend;
+  prefs.resampler_threads = resampler_threads;
+  prefs.dll_estimator = dll_estimator;
+  prefs.target_delay_policy = target_delay_policy;
+  prefs.target_delay_value = target_delay_value;
 
   ow_save_preferences (&prefs);
 }
@@ -133,6 +147,13 @@ load_preferences ()
   ow_load_preferences (&prefs);
 
   pipewire_props = prefs.pipewire_props;
+  xfr_queue_depth = prefs.xfr_queue_depth;
+  reactor_threads = prefs.reactor_threads;
+  resampler_backend = prefs.resampler_backend;
+  resampler_threads = prefs.resampler_threads;
+  dll_estimator = prefs.dll_estimator;
+  target_delay_policy = prefs.target_delay_policy;
+  target_delay_value = prefs.target_delay_value;
 
   a = g_action_map_lookup_action (G_ACTION_MAP (app), "show_all_columns");
   v = g_variant_new_boolean (prefs.show_all_columns);
@@ -548,9 +569,13 @@ main (gint argc, gchar *argv[])
 
   g_application_add_main_option_entries (G_APPLICATION (app), CMD_PARAMS);
 
+  ow_log_start ();
+
   status = g_application_run (G_APPLICATION (app), argc, argv);
 
   g_object_unref (app);
 
+  ow_log_stop ();
+
   return status;
 }
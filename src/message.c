@@ -36,11 +36,37 @@
 #define STATE_DEVICE_LATENCY_H2O_MIN "latencyH2OMin"
 #define STATE_DEVICE_RATIO_O2H "ratioO2H"
 #define STATE_DEVICE_RATIO_H2O "ratioH2O"
+#define STATE_DEVICE_STATS "stats"
 
 #define STATE_SERVER_SAMPLE_RATE "sampleRate"
 #define STATE_SERVER_BUFFER_SIZE "bufferSize"
 #define STATE_SERVER_TARGET_DELAY "targetDelay"
 
+#define HISTOGRAMS_DEVICE_HISTOGRAMS "histograms"
+#define HISTOGRAM_MAX "max"
+#define HISTOGRAM_BUCKETS "buckets"
+
+static gchar *
+message_builder_to_data (JsonBuilder *builder)
+{
+  gchar *json;
+  JsonNode *root;
+  JsonGenerator *gen;
+
+  gen = json_generator_new ();
+  root = json_builder_get_root (builder);
+
+  json_generator_set_root (gen, root);
+  json_generator_set_pretty (gen, TRUE);
+  json = json_generator_to_data (gen, NULL);
+
+  json_node_free (root);
+  g_object_unref (gen);
+  g_object_unref (builder);
+
+  return json;
+}
+
 JsonBuilder *
 message_state_builder_start ()
 {
@@ -89,6 +115,14 @@ message_state_builder_add_device (JsonBuilder *builder, guint32 id,
   json_builder_add_double_value (builder, state->ratio_o2h);
   json_builder_set_member_name (builder, STATE_DEVICE_RATIO_H2O);
   json_builder_add_double_value (builder, state->ratio_h2o);
+  json_builder_set_member_name (builder, STATE_DEVICE_STATS);
+  json_builder_begin_object (builder);
+  for (gint i = 0; i < OW_ENGINE_STATS; i++)
+    {
+      json_builder_set_member_name (builder, ow_engine_get_stat_name (i));
+      json_builder_add_int_value (builder, state->stats.counters[i]);
+    }
+  json_builder_end_object (builder);
   json_builder_end_object (builder);
 }
 
@@ -96,10 +130,6 @@ gchar *
 message_state_builder_end (JsonBuilder *builder, guint32 samplerate,
 			   guint32 buffer_size, gdouble target_delay_ms)
 {
-  gchar *json;
-  JsonNode *root;
-  JsonGenerator *gen;
-
   json_builder_end_array (builder);
 
   json_builder_set_member_name (builder, STATE_SERVER_SAMPLE_RATE);
@@ -111,18 +141,54 @@ message_state_builder_end (JsonBuilder *builder, guint32 samplerate,
 
   json_builder_end_object (builder);
 
-  gen = json_generator_new ();
-  root = json_builder_get_root (builder);
+  return message_builder_to_data (builder);
+}
 
-  json_generator_set_root (gen, root);
-  json_generator_set_pretty (gen, TRUE);
-  json = json_generator_to_data (gen, NULL);
+JsonBuilder *
+message_histograms_builder_start ()
+{
+  return message_state_builder_start ();
+}
 
-  json_node_free (root);
-  g_object_unref (gen);
-  g_object_unref (builder);
+void
+message_histograms_builder_add_device (JsonBuilder *builder, guint32 id,
+				       const gchar *overbridge_name,
+				       struct ow_histogram *histograms)
+{
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, STATE_DEVICE_ID);
+  json_builder_add_int_value (builder, id);
+  json_builder_set_member_name (builder, STATE_DEVICE_NAME);
+  json_builder_add_string_value (builder, overbridge_name);
+  json_builder_set_member_name (builder, HISTOGRAMS_DEVICE_HISTOGRAMS);
+  json_builder_begin_object (builder);
+  for (gint i = 0; i < OW_HISTOGRAMS; i++, histograms++)
+    {
+      json_builder_set_member_name (builder,
+				    ow_engine_get_histogram_name (i));
+      json_builder_begin_object (builder);
+      json_builder_set_member_name (builder, HISTOGRAM_MAX);
+      json_builder_add_int_value (builder, histograms->max);
+      json_builder_set_member_name (builder, HISTOGRAM_BUCKETS);
+      json_builder_begin_array (builder);
+      for (gint j = 0; j < OW_HISTOGRAM_BUCKETS; j++)
+	{
+	  json_builder_add_int_value (builder, histograms->buckets[j]);
+	}
+      json_builder_end_array (builder);
+      json_builder_end_object (builder);
+    }
+  json_builder_end_object (builder);
+  json_builder_end_object (builder);
+}
 
-  return json;
+gchar *
+message_histograms_builder_end (JsonBuilder *builder)
+{
+  json_builder_end_array (builder);
+  json_builder_end_object (builder);
+
+  return message_builder_to_data (builder);
 }
 
 static const char *
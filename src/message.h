@@ -36,6 +36,15 @@ gchar *message_state_builder_end (JsonBuilder * builder, guint32 samplerate,
 				  guint32 buffer_size,
 				  gdouble target_delay_ms);
 
+JsonBuilder *message_histograms_builder_start ();
+
+void message_histograms_builder_add_device (JsonBuilder * builder,
+					    guint32 id,
+					    const gchar * overbridge_name,
+					    struct ow_histogram *histograms);
+
+gchar *message_histograms_builder_end (JsonBuilder * builder);
+
 JsonReader *message_state_reader_start (const gchar * state,
 					guint32 * devices);
 
@@ -22,6 +22,7 @@
 #include <string.h>
 #include <sched.h>
 #include <errno.h>
+#include <time.h>
 #include "overwitch.h"
 #include "utils.h"
 
@@ -508,3 +509,11 @@ ow_get_frame_size_from_desc_tracks (unsigned int tracks,
     }
   return frame_size;
 }
+
+uint64_t
+ow_get_raw_time ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -23,6 +23,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #define ELEKTRON_VID 0x1935
 
@@ -38,14 +39,34 @@
 
 #define OW_LABEL_MAX_LEN 32
 
+#define OW_ALL_TRACKS UINT64_MAX
+
 #define OW_DEFAULT_XFR_TIMEOUT 10
 
 #define OW_DEFAULT_BLOCKS 24
 
+#define OW_DEFAULT_XFR_QUEUE_DEPTH 2
+#define OW_MAX_XFR_QUEUE_DEPTH 8
+
+#define OW_DEFAULT_RING_FRAMES 8192
+
 typedef size_t (*ow_buffer_rw_space_t) (void *);
 typedef size_t (*ow_buffer_read_t) (void *, char *, size_t);
 typedef size_t (*ow_buffer_write_t) (void *, const char *, size_t);
 
+//A buffer might expose its memory as two contiguous regions (the second one
+//is only used when the data wraps around) so the engine can decode and
+//encode in place. The returned value is the total size of the regions.
+struct ow_buffer_region
+{
+  char *data;
+  size_t len;
+};
+
+typedef size_t (*ow_buffer_get_regions_t) (void *,
+					   struct ow_buffer_region *);
+typedef void (*ow_buffer_commit_t) (void *, size_t);
+
 typedef uint64_t (*ow_get_time_t) ();	//Time in us
 
 struct ow_context;
@@ -80,7 +101,8 @@ typedef enum
   OW_INIT_ERROR_NO_O2H_AUDIO_BUF,
   OW_INIT_ERROR_NO_H2O_AUDIO_BUF,
   OW_INIT_ERROR_NO_GET_TIME,
-  OW_INIT_ERROR_NO_DLL
+  OW_INIT_ERROR_NO_DLL,
+  OW_INIT_ERROR_CANT_CREATE_RING
 } ow_err_t;
 
 typedef enum
@@ -105,12 +127,72 @@ typedef enum
   OW_RESAMPLER_STATUS_RUN
 } ow_resampler_status_t;
 
+typedef enum
+{
+  OW_RESAMPLER_BACKEND_LIBSAMPLERATE,
+  OW_RESAMPLER_BACKEND_POLYPHASE	//Built-in windowed sinc with SIMD kernels
+} ow_resampler_backend_t;
+
+typedef enum
+{
+  OW_DLL_ESTIMATOR_ZALSA,	//Second order loop filter taken from zalsa
+  OW_DLL_ESTIMATOR_KALMAN	//Joint offset and drift estimation
+} ow_dll_estimator_t;
+
+typedef enum
+{
+  OW_TARGET_DELAY_DEFAULT,	//Two transfers and one and a half buffers
+  OW_TARGET_DELAY_FRAMES,	//A fixed amount of frames
+  OW_TARGET_DELAY_FACTOR,	//A multiple of the default
+  OW_TARGET_DELAY_AUTO		//Follows the measured o2h buffer minimums
+} ow_target_delay_policy_t;
+
 typedef enum
 {
   OW_ENGINE_OPTION_O2H_AUDIO = 1,
-  OW_ENGINE_OPTION_H2O_AUDIO = 2
+  OW_ENGINE_OPTION_H2O_AUDIO = 2,
+  OW_ENGINE_OPTION_H2O_DITHER = 4	//TPDF dither for 24 and 16 bits outputs
 } ow_engine_option_t;
 
+//Engine counters. These only increase while the engine exists.
+typedef enum
+{
+  OW_ENGINE_STAT_O2H_TRANSFERS,
+  OW_ENGINE_STAT_O2H_BYTES,
+  OW_ENGINE_STAT_H2O_TRANSFERS,
+  OW_ENGINE_STAT_H2O_BYTES,
+  OW_ENGINE_STAT_O2H_OVERFLOWS,	//Transfers discarded as the ring was full
+  OW_ENGINE_STAT_H2O_UNDERFLOWS,	//Transfers concealed
+  OW_ENGINE_STAT_H2O_CONCEALED_FRAMES,
+  OW_ENGINE_STAT_O2H_INCOMPLETE,
+  OW_ENGINE_STAT_H2O_INCOMPLETE,
+  OW_ENGINE_STAT_O2H_LOST_PACKETS,	//Isochronous only
+  OW_ENGINE_STAT_H2O_LOST_PACKETS,	//Isochronous only
+  //Failed transfers by libusb status in the enum libusb_transfer_status order
+  OW_ENGINE_STAT_USB_ERROR,
+  OW_ENGINE_STAT_USB_TIMED_OUT,
+  OW_ENGINE_STAT_USB_CANCELLED,
+  OW_ENGINE_STAT_USB_STALL,
+  OW_ENGINE_STAT_USB_NO_DEVICE,
+  OW_ENGINE_STAT_USB_OVERFLOW,
+  OW_ENGINE_STAT_USB_SUBMIT_ERRORS,
+  OW_ENGINE_STAT_O2H_GAPS,	//Blocks after a frame counter jump
+  OW_ENGINE_STAT_O2H_REPEATS,	//Blocks with a frame counter already seen
+  OW_ENGINE_STAT_O2H_INSERTED_FRAMES,	//Silence written for the gaps
+  OW_ENGINE_STATS
+} ow_engine_stat_t;
+
+//Timing histograms in ns
+typedef enum
+{
+  OW_HISTOGRAM_O2H_PERIOD,	//Between USB callbacks
+  OW_HISTOGRAM_O2H_PROCESSING,	//Inside the USB callback
+  OW_HISTOGRAM_H2O_PERIOD,
+  OW_HISTOGRAM_H2O_PROCESSING,
+  OW_HISTOGRAM_HOST_PROCESSING,	//Inside the host audio callback
+  OW_HISTOGRAMS
+} ow_histogram_t;
+
 typedef enum
 {
   OW_DEVICE_TYPE_1 = 1,		//16 bits isochronous transfers (Analog Rytm MKI and Analog Four MKI and Keys)
@@ -125,6 +207,11 @@ struct ow_context
   ow_buffer_write_t write;
   ow_buffer_rw_space_t read_space;
   ow_buffer_read_t read;
+  //Optional. If these are set, the engine uses the buffer memory directly.
+  ow_buffer_get_regions_t get_read_regions;
+  ow_buffer_commit_t read_commit;
+  ow_buffer_get_regions_t get_write_regions;
+  ow_buffer_commit_t write_commit;
   //Needed for the DLL
   ow_get_time_t get_time;
   //Data
@@ -137,8 +224,15 @@ struct ow_context
   //RT priority is always activated. If this is NULL, Overwitch will set itself with its default RT priority and policy.
   ow_set_rt_priority_t set_rt_priority;
   int priority;
-  //Options
-  int options;
+  //Options. These can be changed while the engine is running.
+  atomic_int options;
+  //Disabled tracks, where the bit n is the track n, so that all the tracks
+  //are enabled with 0. The disabled ones are neither decoded nor encoded and
+  //their samples are 0 in the buffers. These can be changed while the engine
+  //is running with the ow_engine_set_*_tracks functions, which take the
+  //enabled tracks.
+  _Atomic uint64_t o2h_disabled_tracks;
+  _Atomic uint64_t h2o_disabled_tracks;
 };
 
 struct ow_device_track
@@ -174,6 +268,21 @@ struct ow_resampler_reporter
   void *data;
 };
 
+//Bucket n counts the durations in [2^n, 2^(n + 1)) ns. The last bucket
+//counts everything above.
+#define OW_HISTOGRAM_BUCKETS 32
+
+struct ow_histogram
+{
+  uint64_t buckets[OW_HISTOGRAM_BUCKETS];
+  uint64_t max;
+};
+
+struct ow_engine_stats
+{
+  uint64_t counters[OW_ENGINE_STATS];
+};
+
 struct ow_resampler_state
 {
   ow_resampler_status_t status;
@@ -185,12 +294,15 @@ struct ow_resampler_state
   double latency_h2o_max;
   double ratio_o2h;
   double ratio_h2o;
+  struct ow_engine_stats stats;
 };
 
 typedef void (*ow_hotplug_callback_t) (struct ow_device * device);
 
 struct ow_engine;
 struct ow_resampler;
+struct ow_ring;
+struct ow_reactor;
 
 //Common
 const char *ow_get_err_str (ow_err_t);
@@ -210,11 +322,54 @@ size_t ow_get_frame_size_from_desc_tracks (unsigned int tracks,
 					   const struct ow_device_track
 					   *track);
 
+uint64_t ow_get_raw_time ();	//CLOCK_MONOTONIC_RAW in ns
+
+//Ring
+//The capacity is rounded up to a power of two frames and reads and writes
+//are always done in whole frames. The memory is locked if possible.
+struct ow_ring *ow_ring_create (size_t frames, size_t frame_size);
+
+void ow_ring_destroy (struct ow_ring *);
+
+size_t ow_ring_get_frame_size (struct ow_ring *);
+
+size_t ow_ring_read_space (void *);
+
+size_t ow_ring_read (void *, char *, size_t);
+
+size_t ow_ring_get_read_regions (void *, struct ow_buffer_region *);
+
+void ow_ring_read_commit (void *, size_t);
+
+size_t ow_ring_write_space (void *);
+
+size_t ow_ring_write (void *, const char *, size_t);
+
+size_t ow_ring_get_write_regions (void *, struct ow_buffer_region *);
+
+void ow_ring_write_commit (void *, size_t);
+
+//Set the rings and all the buffer functions in the context. A NULL ring is
+//created by the engine when the direction is enabled.
+void ow_context_set_rings (struct ow_context *, struct ow_ring *o2h,
+			   struct ow_ring *h2o);
+
+//Reactor
+//A reactor drives the USB transfers of many engines from a few threads
+//instead of a thread per engine. The engines using a reactor must be
+//destroyed before it.
+ow_err_t ow_reactor_init (struct ow_reactor **reactor, unsigned int threads);
+
+void ow_reactor_destroy (struct ow_reactor *reactor);
+
 //Engine
+//If the reactor is NULL, the engine runs in its own thread.
 ow_err_t ow_engine_init_from_device (struct ow_engine **engine,
 				     struct ow_device *device,
 				     unsigned int blocks_per_transfer,
-				     unsigned int xfr_timeout);
+				     unsigned int xfr_queue_depth,
+				     unsigned int xfr_timeout,
+				     struct ow_reactor *reactor);
 
 ow_err_t ow_engine_init_from_libusb_device_descriptor (struct ow_engine **,
 						       int, unsigned int,
@@ -237,6 +392,14 @@ int ow_engine_is_option (struct ow_engine *engine, ow_engine_option_t);
 
 void ow_engine_set_option (struct ow_engine *engine, ow_engine_option_t, int);
 
+uint64_t ow_engine_get_o2h_tracks (struct ow_engine *engine);
+
+void ow_engine_set_o2h_tracks (struct ow_engine *engine, uint64_t);
+
+uint64_t ow_engine_get_h2o_tracks (struct ow_engine *engine);
+
+void ow_engine_set_h2o_tracks (struct ow_engine *engine, uint64_t);
+
 const struct ow_device *ow_engine_get_device (struct ow_engine *engine);
 
 void ow_engine_stop (struct ow_engine *engine);
@@ -245,6 +408,20 @@ void ow_engine_set_overbridge_name (struct ow_engine *engine, const char *);
 
 const char *ow_engine_get_overbridge_name (struct ow_engine *engine);
 
+void ow_engine_get_stats (struct ow_engine *engine,
+			  struct ow_engine_stats *stats);
+
+const char *ow_engine_get_stat_name (ow_engine_stat_t stat);
+
+void ow_engine_add_histogram_sample (struct ow_engine *engine,
+				     ow_histogram_t histogram, uint64_t ns);
+
+//Copies OW_HISTOGRAMS histograms and optionally clears them.
+void ow_engine_get_histograms (struct ow_engine *engine,
+			       struct ow_histogram *histograms, int reset);
+
+const char *ow_engine_get_histogram_name (ow_histogram_t histogram);
+
 int ow_hotplug_loop (int *running, pthread_spinlock_t * lock,
 		     ow_hotplug_callback_t cb);
 
@@ -252,8 +429,13 @@ int ow_hotplug_loop (int *running, pthread_spinlock_t * lock,
 ow_err_t ow_resampler_init_from_device (struct ow_resampler **resampler,
 					struct ow_device *device,
 					unsigned int blocks_per_transfer,
+					unsigned int xfr_queue_depth,
 					unsigned int xfr_timeout,
-					unsigned int quality);
+					unsigned int quality,
+					ow_resampler_backend_t backend,
+					unsigned int threads,
+					ow_dll_estimator_t estimator,
+					struct ow_reactor *reactor);
 
 ow_err_t ow_resampler_start (struct ow_resampler *resampler,
 			     struct ow_context *context);
@@ -271,6 +453,11 @@ void ow_resampler_reset (struct ow_resampler *resampler);
 
 void ow_resampler_read_audio (struct ow_resampler *resampler);
 
+//Resample straight into a buffer per track. Tracks with a NULL buffer are
+//not processed at all.
+void ow_resampler_read_audio_planar (struct ow_resampler *resampler,
+				     float *buffers[]);
+
 void ow_resampler_write_audio (struct ow_resampler *resampler);
 
 int ow_resampler_compute_ratios (struct ow_resampler *resampler, uint64_t,
@@ -278,6 +465,8 @@ int ow_resampler_compute_ratios (struct ow_resampler *resampler, uint64_t,
 
 void ow_resampler_reset_latencies (struct ow_resampler *resampler);
 
+void ow_resampler_resync (struct ow_resampler *resampler);
+
 ow_resampler_status_t ow_resampler_get_status (struct ow_resampler
 					       *resampler);
 
@@ -299,6 +488,7 @@ size_t ow_resampler_get_h2o_frame_size (struct ow_resampler *resampler);
 
 float *ow_resampler_get_o2h_audio_buffer (struct ow_resampler *resampler);
 
+//The buffer changes every cycle so it must be got before writing to it.
 float *ow_resampler_get_h2o_audio_buffer (struct ow_resampler *resampler);
 
 struct ow_resampler_reporter *ow_resampler_get_reporter (struct ow_resampler
@@ -311,3 +501,9 @@ void ow_resampler_get_o2h_latency (struct ow_resampler *resampler, uint32_t *,
 				   uint32_t *, uint32_t *);
 
 double ow_resampler_get_target_delay_ms (struct ow_resampler *resampler);
+
+//The value is ignored by the default and auto policies. It is applied the
+//next time the DLL is reset.
+void ow_resampler_set_target_delay (struct ow_resampler *resampler,
+				    ow_target_delay_policy_t policy,
+				    double value);
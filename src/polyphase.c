@@ -0,0 +1,500 @@
+/*
+ *   polyphase.c
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "polyphase.h"
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OW_POLYPHASE_X86
+#include <immintrin.h>
+#define SIMD_KERNEL(k) k
+#else
+#define SIMD_KERNEL(k) NULL
+#endif
+
+#define ALIGNMENT 32
+
+struct polyphase_quality
+{
+  int taps;			//For ratios not below 1
+  double rolloff;		//Cutoff relative to the lowest Nyquist frequency
+  double beta;			//Kaiser window
+};
+
+//Roughly equivalent to the libsamplerate converters with the same index.
+static const struct polyphase_quality QUALITIES[] = {
+  {64, 0.95, 10.0},
+  {32, 0.92, 8.0},
+  {16, 0.88, 6.0},
+  {8, 0.8, 4.0},
+  {8, 0.8, 4.0}
+};
+
+static double
+bessel_i0 (double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  double y = x * x / 4.0;
+
+  for (int k = 1; k < 64 && term > 1e-12 * sum; k++)
+    {
+      term *= y / ((double) k * k);
+      sum += term;
+    }
+
+  return sum;
+}
+
+static double
+sinc (double x)
+{
+  return x == 0.0 ? 1.0 : sin (M_PI * x) / (M_PI * x);
+}
+
+//The row p holds the taps for an output sample placed p / phases samples
+//after the input sample taps / 2 - 1 of the window. Every row is normalized
+//to unity gain at DC.
+static void
+polyphase_design (struct ow_polyphase *pp, double cutoff, double beta)
+{
+  int half = pp->taps / 2;
+  double i0_beta = bessel_i0 (beta);
+  double t, x, w, sum;
+  float *row;
+
+  for (int p = 0; p <= OW_POLYPHASE_PHASES; p++)
+    {
+      row = pp->coefs + p * pp->taps;
+      sum = 0.0;
+      for (int k = 0; k < pp->taps; k++)
+	{
+	  t = k - (half - 1) - (double) p / OW_POLYPHASE_PHASES;
+	  x = t / half;
+	  w = x * x <= 1.0 ? bessel_i0 (beta * sqrt (1.0 - x * x)) / i0_beta :
+	    0.0;
+	  row[k] = cutoff * sinc (cutoff * t) * w;
+	  sum += row[k];
+	}
+      for (int k = 0; k < pp->taps; k++)
+	{
+	  row[k] /= sum;
+	}
+    }
+}
+
+static void
+interpolate_scalar (const float *coefs, float t, float *dst, int taps)
+{
+  const float *next = coefs + taps;
+
+  for (int i = 0; i < taps; i++)
+    {
+      dst[i] = coefs[i] + t * (next[i] - coefs[i]);
+    }
+}
+
+static float
+dot_scalar (const float *x, const float *coefs, int taps)
+{
+  float sum = 0.0f;
+
+  for (int i = 0; i < taps; i++)
+    {
+      sum += x[i] * coefs[i];
+    }
+
+  return sum;
+}
+
+#if defined(OW_POLYPHASE_X86)
+
+//The coefficients are aligned but the history is read from any sample.
+//The accumulation order differs from the scalar kernels so the outputs are
+//not bit-identical.
+
+#define TARGET_SSE2 __attribute__ ((target ("sse2")))
+#define TARGET_AVX2 __attribute__ ((target ("avx2")))
+
+static TARGET_SSE2 void
+interpolate_sse2 (const float *coefs, float t, float *dst, int taps)
+{
+  const float *next = coefs + taps;
+  __m128 vt = _mm_set1_ps (t);
+
+  for (int i = 0; i < taps; i += 4)
+    {
+      __m128 c0 = _mm_load_ps (&coefs[i]);
+      __m128 c1 = _mm_load_ps (&next[i]);
+      c1 = _mm_mul_ps (vt, _mm_sub_ps (c1, c0));
+      _mm_store_ps (&dst[i], _mm_add_ps (c0, c1));
+    }
+}
+
+static TARGET_SSE2 float
+dot_sse2 (const float *x, const float *coefs, int taps)
+{
+  __m128 acc0 = _mm_setzero_ps ();
+  __m128 acc1 = _mm_setzero_ps ();
+  __m128 shuf;
+
+  for (int i = 0; i < taps; i += 8)
+    {
+      acc0 = _mm_add_ps (acc0, _mm_mul_ps (_mm_loadu_ps (&x[i]),
+					   _mm_load_ps (&coefs[i])));
+      acc1 = _mm_add_ps (acc1, _mm_mul_ps (_mm_loadu_ps (&x[i + 4]),
+					   _mm_load_ps (&coefs[i + 4])));
+    }
+
+  acc0 = _mm_add_ps (acc0, acc1);
+  shuf = _mm_shuffle_ps (acc0, acc0, _MM_SHUFFLE (2, 3, 0, 1));
+  acc0 = _mm_add_ps (acc0, shuf);
+  shuf = _mm_movehl_ps (shuf, acc0);
+  acc0 = _mm_add_ss (acc0, shuf);
+  return _mm_cvtss_f32 (acc0);
+}
+
+static TARGET_AVX2 void
+interpolate_avx2 (const float *coefs, float t, float *dst, int taps)
+{
+  const float *next = coefs + taps;
+  __m256 vt = _mm256_set1_ps (t);
+
+  for (int i = 0; i < taps; i += 8)
+    {
+      __m256 c0 = _mm256_load_ps (&coefs[i]);
+      __m256 c1 = _mm256_load_ps (&next[i]);
+      c1 = _mm256_mul_ps (vt, _mm256_sub_ps (c1, c0));
+      _mm256_store_ps (&dst[i], _mm256_add_ps (c0, c1));
+    }
+}
+
+static TARGET_AVX2 float
+dot_avx2 (const float *x, const float *coefs, int taps)
+{
+  __m256 acc = _mm256_setzero_ps ();
+  __m128 sum, shuf;
+
+  for (int i = 0; i < taps; i += 8)
+    {
+      acc = _mm256_add_ps (acc, _mm256_mul_ps (_mm256_loadu_ps (&x[i]),
+					       _mm256_load_ps (&coefs[i])));
+    }
+
+  sum = _mm_add_ps (_mm256_castps256_ps128 (acc),
+		    _mm256_extractf128_ps (acc, 1));
+  shuf = _mm_shuffle_ps (sum, sum, _MM_SHUFFLE (2, 3, 0, 1));
+  sum = _mm_add_ps (sum, shuf);
+  shuf = _mm_movehl_ps (shuf, sum);
+  sum = _mm_add_ss (sum, shuf);
+  return _mm_cvtss_f32 (sum);
+}
+
+#endif
+
+static const ow_polyphase_interpolator_t INTERPOLATORS[OW_CODEC_ISA_MAX] = {
+  interpolate_scalar, SIMD_KERNEL (interpolate_sse2), NULL,
+  SIMD_KERNEL (interpolate_avx2)
+};
+
+static const ow_polyphase_dot_t DOTS[OW_CODEC_ISA_MAX] = {
+  dot_scalar, SIMD_KERNEL (dot_sse2), NULL, SIMD_KERNEL (dot_avx2)
+};
+
+ow_codec_isa_t
+ow_polyphase_set_isa (struct ow_polyphase *pp, ow_codec_isa_t isa)
+{
+  ow_codec_isa_t cpu_isa = ow_codec_get_cpu_isa ();
+  ow_codec_isa_t i;
+
+  pp->isa = isa > cpu_isa ? cpu_isa : isa;
+
+  for (i = pp->isa; !INTERPOLATORS[i]; i--);
+  pp->interpolator = INTERPOLATORS[i];
+
+  for (i = pp->isa; !DOTS[i]; i--);
+  pp->dot = DOTS[i];
+
+  return pp->isa;
+}
+
+static void *
+aligned_calloc (size_t n)
+{
+  size_t size = (n * sizeof (float) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  void *p = aligned_alloc (ALIGNMENT, size);
+  if (p)
+    {
+      memset (p, 0, size);
+    }
+  return p;
+}
+
+static struct ow_polyphase *
+polyphase_new (int channels, int taps, double ratio, int max_frames)
+{
+  struct ow_polyphase *pp;
+
+  if (channels < 1 || channels > OB_MAX_TRACKS || ratio <= 0.0)
+    {
+      return NULL;
+    }
+
+  pp = malloc (sizeof (struct ow_polyphase));
+  if (!pp)
+    {
+      return NULL;
+    }
+
+  pp->channels = channels;
+  pp->taps = (taps + 7) & ~7;
+  //Room for the window, the input and the step of an output sample.
+  pp->capacity = pp->taps + max_frames + ceil (1.0 / ratio) + 1;
+  pp->step = 1.0 / ratio;
+
+  pp->coefs = aligned_calloc ((OW_POLYPHASE_PHASES + 1) * pp->taps);
+  pp->frame_coefs = aligned_calloc (pp->taps);
+  for (int i = 0; i < channels; i++)
+    {
+      pp->history[i] = calloc (pp->capacity, sizeof (float));
+    }
+
+  ow_polyphase_set_isa (pp, OW_CODEC_ISA_MAX - 1);
+  ow_polyphase_reset (pp);
+
+  return pp;
+}
+
+//Downsampling lowers the cutoff so the filter gets longer to keep the same
+//transition band.
+struct ow_polyphase *
+ow_polyphase_create (int channels, double ratio, int quality, int max_frames)
+{
+  struct ow_polyphase *pp;
+  const struct polyphase_quality *q;
+  double min_ratio = ratio < 1.0 ? ratio : 1.0;
+
+  quality = quality < 0 ? 0 : quality > 4 ? 4 : quality;
+  q = &QUALITIES[quality];
+
+  pp = polyphase_new (channels, ceil (q->taps / min_ratio), ratio,
+		      max_frames);
+  if (!pp)
+    {
+      return NULL;
+    }
+
+  polyphase_design (pp, q->rolloff * min_ratio, q->beta);
+
+  debug_print (2,
+	       "Polyphase resampler: %d channels, %d taps, %d phases, ratio %f (%s)",
+	       channels, pp->taps, OW_POLYPHASE_PHASES, ratio,
+	       ow_codec_get_isa_name (pp->isa));
+
+  return pp;
+}
+
+//Lagrange interpolation is maximally flat at DC and needs no window. With
+//8 points, the attenuation in the worst phase is below 0.1 dB up to 10 kHz.
+struct ow_polyphase *
+ow_polyphase_create_lagrange (int channels, int max_frames)
+{
+  struct ow_polyphase *pp;
+  double x, c;
+  float *row;
+
+  pp = polyphase_new (channels, OW_POLYPHASE_LAGRANGE_POINTS, 1.0,
+		      max_frames);
+  if (!pp)
+    {
+      return NULL;
+    }
+
+  for (int p = 0; p <= OW_POLYPHASE_PHASES; p++)
+    {
+      row = pp->coefs + p * pp->taps;
+      x = pp->taps / 2 - 1 + (double) p / OW_POLYPHASE_PHASES;
+      for (int k = 0; k < pp->taps; k++)
+	{
+	  c = 1.0;
+	  for (int m = 0; m < pp->taps; m++)
+	    {
+	      if (m != k)
+		{
+		  c *= (x - m) / (k - m);
+		}
+	    }
+	  row[k] = c;
+	}
+    }
+
+  debug_print (2, "Lagrange resampler: %d channels, %d points (%s)",
+	       channels, pp->taps, ow_codec_get_isa_name (pp->isa));
+
+  return pp;
+}
+
+void
+ow_polyphase_destroy (struct ow_polyphase *pp)
+{
+  if (!pp)
+    {
+      return;
+    }
+
+  for (int i = 0; i < pp->channels; i++)
+    {
+      free (pp->history[i]);
+    }
+  free (pp->coefs);
+  free (pp->frame_coefs);
+  free (pp);
+}
+
+//The history is primed with silence so the first output sample is
+//centered on the first input sample.
+void
+ow_polyphase_reset (struct ow_polyphase *pp)
+{
+  for (int i = 0; i < pp->channels; i++)
+    {
+      ow_polyphase_reset_channel (pp, i);
+    }
+  pp->history_len = pp->taps / 2 - 1;
+  pp->pos = 0.0;
+}
+
+inline void
+ow_polyphase_reset_channel (struct ow_polyphase *pp, int channel)
+{
+  memset (pp->history[channel], 0, pp->capacity * sizeof (float));
+}
+
+//Both windows are centered on the same input sample so the history of the
+//destination is padded with silence if its window is longer. The step is
+//kept so a ramp goes on too.
+void
+ow_polyphase_handover (struct ow_polyphase *dst, struct ow_polyphase *src)
+{
+  long first, len, pad;
+  double center = src->pos + src->taps / 2 - 1;
+  long offset = (long) center - (dst->taps / 2 - 1);
+
+  pad = offset < 0 ? -offset : 0;
+  first = offset < 0 ? 0 : offset;
+  len = src->history_len - first;
+  len = len < 0 ? 0 : len;
+  len = pad + len > dst->capacity ? dst->capacity - pad : len;
+
+  for (int i = 0; i < dst->channels; i++)
+    {
+      memset (dst->history[i], 0, pad * sizeof (float));
+      memcpy (dst->history[i] + pad, src->history[i] + first,
+	      len * sizeof (float));
+    }
+
+  dst->history_len = pad + len;
+  dst->pos = center - (long) center;
+  dst->step = src->step;
+}
+
+void
+ow_polyphase_process (struct ow_polyphase *pp, const float *const in[],
+		      long in_frames, float *const out[], long out_frames,
+		      double ratio, long *in_used, long *out_gen)
+{
+  long n, pos, frames, gen = 0;
+  double phase, step, step_inc;
+  int p;
+
+  n = pp->capacity - pp->history_len;
+  n = in_frames < n ? in_frames : n;
+  for (int i = 0; i < pp->channels; i++)
+    {
+      if (in[i])
+	{
+	  memcpy (pp->history[i] + pp->history_len, in[i],
+		  n * sizeof (float));
+	}
+    }
+  pp->history_len += n;
+
+  //The step reaches the new ratio at the last frame that can be generated
+  //with the buffered input, which might be far less than the output room.
+  step = pp->step;
+  frames = (pp->history_len - pp->taps - pp->pos) / step + 1;
+  frames = frames < out_frames ? frames : out_frames;
+  step_inc = frames > 0 ? (1.0 / ratio - step) / frames : 0.0;
+
+  while (gen < out_frames)
+    {
+      pos = (long) pp->pos;
+      if (pos + pp->taps > pp->history_len)
+	{
+	  break;
+	}
+
+      phase = (pp->pos - pos) * OW_POLYPHASE_PHASES;
+      p = (int) phase;
+      pp->interpolator (pp->coefs + p * pp->taps, phase - p,
+			pp->frame_coefs, pp->taps);
+
+      for (int i = 0; i < pp->channels; i++)
+	{
+	  if (in[i])
+	    {
+	      out[i][gen] = pp->dot (pp->history[i] + pos, pp->frame_coefs,
+				     pp->taps);
+	    }
+	}
+
+      gen++;
+      if (gen <= frames)
+	{
+	  step += step_inc;
+	}
+      pp->pos += step;
+    }
+
+  pp->step = step;
+
+  //The consumed input is discarded. The skipped channels are not moved as
+  //these need to be reset before being processed again.
+  pos = (long) pp->pos;
+  pos = pos > pp->history_len ? pp->history_len : pos;
+  if (pos)
+    {
+      for (int i = 0; i < pp->channels; i++)
+	{
+	  if (in[i])
+	    {
+	      memmove (pp->history[i], pp->history[i] + pos,
+		       (pp->history_len - pos) * sizeof (float));
+	    }
+	}
+      pp->history_len -= pos;
+      pp->pos -= pos;
+    }
+
+  *in_used = n;
+  *out_gen = gen;
+}
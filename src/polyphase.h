@@ -0,0 +1,83 @@
+/*
+ *   polyphase.h
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "codec.h"
+#include "overwitch.h"
+
+//A polyphase windowed sinc resampler for planar audio. The filter is
+//designed once for the nominal ratio and stored as a table of phases. The
+//coefficients for an output sample are interpolated between two phases so
+//any ratio close to the nominal one can be used and changed at any time.
+
+#define OW_POLYPHASE_PHASES 256
+#define OW_POLYPHASE_LAGRANGE_POINTS 8
+
+typedef void (*ow_polyphase_interpolator_t) (const float *, float, float *,
+					     int);
+typedef float (*ow_polyphase_dot_t) (const float *, const float *, int);
+
+struct ow_polyphase
+{
+  int channels;
+  int taps;			//Multiple of 8
+  int capacity;			//Samples of the history of every channel
+  float *coefs;			//OW_POLYPHASE_PHASES + 1 rows of taps
+  float *frame_coefs;		//Coefficients for the current output sample
+  float *history[OB_MAX_TRACKS];
+  int history_len;
+  double pos;			//Input position of the next output sample
+  double step;			//Input samples per output sample
+  ow_codec_isa_t isa;
+  ow_polyphase_interpolator_t interpolator;
+  ow_polyphase_dot_t dot;
+};
+
+//The ratio is the output sample rate divided by the input one. The quality
+//is the same than libsamplerate's so 0 is the best and 4 the worst. The
+//maximum frames is the input that can be given at once.
+struct ow_polyphase *ow_polyphase_create (int channels, double ratio,
+					  int quality, int max_frames);
+
+//A short fractional delay filter for ratios very close to 1.
+struct ow_polyphase *ow_polyphase_create_lagrange (int channels,
+						   int max_frames);
+
+void ow_polyphase_destroy (struct ow_polyphase *);
+
+void ow_polyphase_reset (struct ow_polyphase *);
+
+//Clear the history of a channel that has not been processed for a while.
+void ow_polyphase_reset_channel (struct ow_polyphase *, int);
+
+//Move the input that has not been used yet to another converter with the
+//same channels so its output goes on from the same input position.
+void ow_polyphase_handover (struct ow_polyphase *, struct ow_polyphase *);
+
+//Use the fastest kernels not exceeding the given instruction set.
+ow_codec_isa_t ow_polyphase_set_isa (struct ow_polyphase *, ow_codec_isa_t);
+
+//The channels with a NULL input are skipped. As much input as possible is
+//buffered and as much output as possible is generated. The step changes
+//linearly from the last ratio to the given one along the output frames.
+void ow_polyphase_process (struct ow_polyphase *, const float *const[],
+			   long, float *const[], long, double, long *,
+			   long *);
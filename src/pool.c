@@ -0,0 +1,300 @@
+/*
+ *   pool.c
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "pool.h"
+#include "utils.h"
+
+//The jobs of a cycle come one after the other so a part of the cycle is
+//enough to catch them without sleeping. Until the period is known, a
+//millisecond is used. Workers that are not pinned never spin as they would
+//take the core from the calling thread.
+#define OW_POOL_SPIN_PERIOD_DIVISOR 4
+#define OW_POOL_DEFAULT_SPIN_NS 1000000
+#define OW_POOL_SPINS_PER_CHECK 64
+
+//The cores pinned by all the pools of the process.
+static pthread_mutex_t ow_pool_cpus_lock = PTHREAD_MUTEX_INITIALIZER;
+static cpu_set_t ow_pool_cpus;
+
+static inline void
+ow_pool_relax ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause ();
+#endif
+}
+
+static inline void
+ow_pool_run_part (struct ow_pool *pool, int part)
+{
+  int parts = pool->workers_len + 1;
+  int first = pool->items * part / parts;
+  int last = pool->items * (part + 1) / parts;
+
+  if (first < last)
+    {
+      pool->job (pool->data, first, last);
+    }
+}
+
+//The sleeping flag and the generation are checked in opposite order by the
+//worker and the caller so that a job is never missed.
+static void
+ow_pool_wait_job (struct ow_pool_worker *worker, unsigned int generation)
+{
+  struct ow_pool *pool = worker->pool;
+  uint64_t start = ow_get_raw_time ();
+  uint64_t spin_ns = worker->cpu < 0 ? 0 :
+    atomic_load_explicit (&pool->spin_ns, memory_order_relaxed);
+
+  for (int i = 1; spin_ns; i++)
+    {
+      if (atomic_load (&pool->generation) != generation)
+	{
+	  return;
+	}
+      if (i % OW_POOL_SPINS_PER_CHECK == 0 &&
+	  ow_get_raw_time () - start >= spin_ns)
+	{
+	  break;
+	}
+      ow_pool_relax ();
+    }
+
+  atomic_store (&worker->sleeping, 1);
+  if (atomic_load (&pool->generation) == generation ||
+      !atomic_exchange (&worker->sleeping, 0))
+    {
+      sem_wait (&worker->wake);
+    }
+}
+
+static void *
+ow_pool_run_worker (void *data)
+{
+  struct ow_pool_worker *worker = data;
+  struct ow_pool *pool = worker->pool;
+  unsigned int generation = 0;
+
+  while (1)
+    {
+      if (atomic_load (&pool->generation) == generation)
+	{
+	  ow_pool_wait_job (worker, generation);
+	  continue;
+	}
+
+      generation = atomic_load (&pool->generation);
+      if (!atomic_load (&pool->running))
+	{
+	  break;
+	}
+
+      ow_pool_run_part (pool, worker->part);
+      atomic_fetch_sub_explicit (&pool->pending, 1, memory_order_release);
+    }
+
+  return NULL;
+}
+
+static void
+ow_pool_wake_workers (struct ow_pool *pool)
+{
+  struct ow_pool_worker *worker = pool->workers;
+
+  for (int i = 0; i < pool->workers_len; i++, worker++)
+    {
+      if (atomic_exchange (&worker->sleeping, 0))
+	{
+	  sem_post (&worker->wake);
+	}
+    }
+}
+
+//The first core of the process affinity mask is left for the other
+//threads. If there are no cores left, the worker is not pinned.
+static int
+ow_pool_claim_cpu ()
+{
+  cpu_set_t allowed;
+  int first = 1;
+  int cpu = -1;
+
+  if (sched_getaffinity (0, sizeof (cpu_set_t), &allowed))
+    {
+      return -1;
+    }
+
+  pthread_mutex_lock (&ow_pool_cpus_lock);
+  for (int i = 0; i < CPU_SETSIZE; i++)
+    {
+      if (!CPU_ISSET (i, &allowed))
+	{
+	  continue;
+	}
+      if (first)
+	{
+	  first = 0;
+	  continue;
+	}
+      if (!CPU_ISSET (i, &ow_pool_cpus))
+	{
+	  CPU_SET (i, &ow_pool_cpus);
+	  cpu = i;
+	  break;
+	}
+    }
+  pthread_mutex_unlock (&ow_pool_cpus_lock);
+
+  return cpu;
+}
+
+static void
+ow_pool_release_cpu (int cpu)
+{
+  if (cpu < 0)
+    {
+      return;
+    }
+
+  pthread_mutex_lock (&ow_pool_cpus_lock);
+  CPU_CLR (cpu, &ow_pool_cpus);
+  pthread_mutex_unlock (&ow_pool_cpus_lock);
+}
+
+ow_err_t
+ow_pool_init (struct ow_pool **pool_, unsigned int threads)
+{
+  struct ow_pool_worker *worker;
+  struct ow_pool *pool;
+  cpu_set_t cpus;
+  char name[16];
+
+  if (threads < 1 || threads > OW_POOL_MAX_THREADS)
+    {
+      error_print ("Pool threads must be in [1, %d]", OW_POOL_MAX_THREADS);
+      return OW_GENERIC_ERROR;
+    }
+
+  pool = malloc (sizeof (struct ow_pool));
+  atomic_init (&pool->running, 1);
+  atomic_init (&pool->generation, 0);
+  atomic_init (&pool->pending, 0);
+  atomic_init (&pool->spin_ns, OW_POOL_DEFAULT_SPIN_NS);
+  pool->workers_len = 0;
+
+  debug_print (1, "Starting pool with %u threads...", threads);
+
+  for (int i = 0; i < threads; i++)
+    {
+      worker = &pool->workers[i];
+      worker->pool = pool;
+      worker->part = i + 1;
+      worker->cpu = -1;
+      atomic_init (&worker->sleeping, 0);
+      sem_init (&worker->wake, 0, 0);
+
+      if (pthread_create (&worker->thread, NULL, ow_pool_run_worker, worker))
+	{
+	  error_print ("Could not start pool thread");
+	  sem_destroy (&worker->wake);
+	  ow_pool_destroy (pool);
+	  return OW_GENERIC_ERROR;
+	}
+
+      snprintf (name, sizeof (name), "pool-%d", i);
+      pthread_setname_np (worker->thread, name);
+
+      pool->workers_len++;
+
+      worker->cpu = ow_pool_claim_cpu ();
+      if (worker->cpu < 0)
+	{
+	  debug_print (1, "No free core for pool thread %d", i);
+	  continue;
+	}
+
+      CPU_ZERO (&cpus);
+      CPU_SET (worker->cpu, &cpus);
+      if (pthread_setaffinity_np (worker->thread, sizeof (cpu_set_t), &cpus))
+	{
+	  error_print ("Could not pin pool thread %d", i);
+	  ow_pool_release_cpu (worker->cpu);
+	  worker->cpu = -1;
+	}
+      else
+	{
+	  debug_print (2, "Pool thread %d pinned to core %d", i, worker->cpu);
+	}
+    }
+
+  *pool_ = pool;
+  return OW_OK;
+}
+
+void
+ow_pool_destroy (struct ow_pool *pool)
+{
+  struct ow_pool_worker *worker = pool->workers;
+
+  atomic_store (&pool->running, 0);
+  atomic_fetch_add (&pool->generation, 1);
+  ow_pool_wake_workers (pool);
+
+  for (int i = 0; i < pool->workers_len; i++, worker++)
+    {
+      pthread_join (worker->thread, NULL);
+      sem_destroy (&worker->wake);
+      ow_pool_release_cpu (worker->cpu);
+    }
+
+  free (pool);
+}
+
+void
+ow_pool_set_period (struct ow_pool *pool, uint64_t period_ns)
+{
+  atomic_store_explicit (&pool->spin_ns,
+			 period_ns / OW_POOL_SPIN_PERIOD_DIVISOR,
+			 memory_order_relaxed);
+}
+
+void
+ow_pool_run (struct ow_pool *pool, ow_pool_job_t job, void *data, int items)
+{
+  pool->job = job;
+  pool->data = data;
+  pool->items = items;
+  atomic_store_explicit (&pool->pending, pool->workers_len,
+			 memory_order_relaxed);
+  atomic_fetch_add (&pool->generation, 1);
+  ow_pool_wake_workers (pool);
+
+  ow_pool_run_part (pool, 0);
+
+  while (atomic_load_explicit (&pool->pending, memory_order_acquire))
+    {
+      ow_pool_relax ();
+    }
+}
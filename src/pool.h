@@ -0,0 +1,70 @@
+/*
+ *   pool.h
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "overwitch.h"
+
+#define OW_POOL_MAX_THREADS 8
+
+//A job processes the items in [first, last).
+typedef void (*ow_pool_job_t) (void *, int, int);
+
+struct ow_pool_worker
+{
+  pthread_t thread;
+  sem_t wake;
+  atomic_int sleeping;
+  int part;
+  int cpu;			//-1 if not pinned
+  struct ow_pool *pool;
+};
+
+//A set of worker threads created in advance that split a job with the
+//calling thread. Every worker is pinned to a core no other pool uses. The
+//workers spin for a part of the cycle after finishing a job so that
+//consecutive jobs do not need any system call and the caller waits for them
+//spinning on a counter.
+struct ow_pool
+{
+  atomic_int running;
+  _Atomic uint64_t spin_ns;
+  atomic_uint generation;	//Incremented for every job
+  atomic_int pending;		//Workers that have not finished the job
+  ow_pool_job_t job;
+  void *data;
+  int items;
+  unsigned int workers_len;
+  struct ow_pool_worker workers[OW_POOL_MAX_THREADS];
+};
+
+ow_err_t ow_pool_init (struct ow_pool **, unsigned int);
+
+void ow_pool_destroy (struct ow_pool *);
+
+//The period of the cycle the jobs are run in, in ns.
+void ow_pool_set_period (struct ow_pool *, uint64_t);
+
+//Run the job over the items in parallel and wait for it to finish. The
+//calling thread processes the first part.
+void ow_pool_run (struct ow_pool *, ow_pool_job_t, void *, int);
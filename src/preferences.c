@@ -27,7 +27,14 @@
 #define PREF_REFRESH_AT_STARTUP "refreshAtStartup"
 #define PREF_SHOW_ALL_COLUMNS "showAllColumns"
 #define PREF_BLOCKS "blocks"
+#define PREF_XFR_QUEUE_DEPTH "transferQueueDepth"
+#define PREF_REACTOR_THREADS "reactorThreads"
 #define PREF_QUALITY "quality"
+#define PREF_RESAMPLER_BACKEND "resamplerBackend"
+#define PREF_RESAMPLER_THREADS "resamplerThreads"
+#define PREF_DLL_ESTIMATOR "dllEstimator"
+#define PREF_TARGET_DELAY_POLICY "targetDelayPolicy"
+#define PREF_TARGET_DELAY_VALUE "targetDelayValue"
 #define PREF_TIMEOUT "timeout"
 #define PREF_PIPEWIRE_PROPS "pipewireProps"
 
@@ -68,12 +75,33 @@ ow_save_preferences (struct ow_preferences *prefs)
   json_builder_set_member_name (builder, PREF_BLOCKS);
   json_builder_add_int_value (builder, prefs->blocks);
 
+  json_builder_set_member_name (builder, PREF_XFR_QUEUE_DEPTH);
+  json_builder_add_int_value (builder, prefs->xfr_queue_depth);
+
+  json_builder_set_member_name (builder, PREF_REACTOR_THREADS);
+  json_builder_add_int_value (builder, prefs->reactor_threads);
+
   json_builder_set_member_name (builder, PREF_TIMEOUT);
   json_builder_add_int_value (builder, prefs->timeout);
 
   json_builder_set_member_name (builder, PREF_QUALITY);
   json_builder_add_int_value (builder, prefs->quality);
 
+  json_builder_set_member_name (builder, PREF_RESAMPLER_BACKEND);
+  json_builder_add_int_value (builder, prefs->resampler_backend);
+
+  json_builder_set_member_name (builder, PREF_RESAMPLER_THREADS);
+  json_builder_add_int_value (builder, prefs->resampler_threads);
+
+  json_builder_set_member_name (builder, PREF_DLL_ESTIMATOR);
+  json_builder_add_int_value (builder, prefs->dll_estimator);
+
+  json_builder_set_member_name (builder, PREF_TARGET_DELAY_POLICY);
+  json_builder_add_int_value (builder, prefs->target_delay_policy);
+
+  json_builder_set_member_name (builder, PREF_TARGET_DELAY_VALUE);
+  json_builder_add_double_value (builder, prefs->target_delay_value);
+
   json_builder_set_member_name (builder, PREF_PIPEWIRE_PROPS);
   json_builder_add_string_value (builder, prefs->pipewire_props);
 
@@ -102,7 +130,14 @@ ow_load_preferences (struct ow_preferences *prefs)
   gchar *preferences_file = get_expanded_dir (CONF_DIR PREF_FILE);
 
   prefs->blocks = 24;
+  prefs->xfr_queue_depth = 2;
+  prefs->reactor_threads = 0;
   prefs->quality = 2;
+  prefs->resampler_backend = 0;
+  prefs->resampler_threads = 0;
+  prefs->dll_estimator = 0;
+  prefs->target_delay_policy = 0;
+  prefs->target_delay_value = 0;
   prefs->timeout = 10;
   prefs->refresh_at_startup = TRUE;
   prefs->show_all_columns = FALSE;
@@ -139,6 +174,18 @@ ow_load_preferences (struct ow_preferences *prefs)
     }
   json_reader_end_member (reader);
 
+  if (json_reader_read_member (reader, PREF_XFR_QUEUE_DEPTH))
+    {
+      prefs->xfr_queue_depth = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, PREF_REACTOR_THREADS))
+    {
+      prefs->reactor_threads = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+
   if (json_reader_read_member (reader, PREF_TIMEOUT))
     {
       prefs->timeout = json_reader_get_int_value (reader);
@@ -151,6 +198,36 @@ ow_load_preferences (struct ow_preferences *prefs)
     }
   json_reader_end_member (reader);
 
+  if (json_reader_read_member (reader, PREF_RESAMPLER_BACKEND))
+    {
+      prefs->resampler_backend = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, PREF_RESAMPLER_THREADS))
+    {
+      prefs->resampler_threads = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, PREF_DLL_ESTIMATOR))
+    {
+      prefs->dll_estimator = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, PREF_TARGET_DELAY_POLICY))
+    {
+      prefs->target_delay_policy = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, PREF_TARGET_DELAY_VALUE))
+    {
+      prefs->target_delay_value = json_reader_get_double_value (reader);
+    }
+  json_reader_end_member (reader);
+
   if (json_reader_read_member (reader, PREF_PIPEWIRE_PROPS))
     {
       const gchar *v = json_reader_get_string_value (reader);
@@ -25,8 +25,15 @@ struct ow_preferences
   gboolean refresh_at_startup;
   gboolean show_all_columns;
   gint64 blocks;
+  gint64 xfr_queue_depth;
+  gint64 reactor_threads;
   gint64 timeout;
   gint64 quality;
+  gint64 resampler_backend;
+  gint64 resampler_threads;
+  gint64 dll_estimator;
+  gint64 target_delay_policy;
+  gdouble target_delay_value;
   gchar *pipewire_props;
 };
 
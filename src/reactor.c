@@ -0,0 +1,197 @@
+/*
+ *   reactor.c
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <semaphore.h>
+#include "reactor.h"
+#include "engine.h"
+#include "utils.h"
+
+//Events are handled with a timeout so that the engines are polled even
+//without USB activity.
+#define OW_REACTOR_TIMEOUT_USECS 100000
+
+static void *
+ow_reactor_run_loop (void *data)
+{
+  struct ow_reactor_loop *loop = data;
+  struct ow_reactor *reactor = loop->reactor;
+  struct timeval tv;
+  struct ow_engine *engine;
+
+  while (atomic_load (&reactor->running))
+    {
+      tv.tv_sec = 0;
+      tv.tv_usec = OW_REACTOR_TIMEOUT_USECS;
+      libusb_handle_events_timeout_completed (loop->context, &tv, NULL);
+
+      pthread_spin_lock (&loop->lock);
+      for (int i = 0; i < loop->engines_len; i++)
+	{
+	  engine = loop->engines[i];
+	  if (!ow_engine_poll (engine))
+	    {
+	      loop->engines_len--;
+	      loop->engines[i] = loop->engines[loop->engines_len];
+	      i--;
+	      sem_post (&engine->finished);
+	    }
+	}
+      pthread_spin_unlock (&loop->lock);
+    }
+
+  return NULL;
+}
+
+ow_err_t
+ow_reactor_init (struct ow_reactor **reactor_, unsigned int threads)
+{
+  struct ow_reactor_loop *loop;
+  struct ow_reactor *reactor;
+  char name[16];
+  ow_err_t err = OW_OK;
+
+  if (threads < 1 || threads > OW_REACTOR_MAX_THREADS)
+    {
+      error_print ("Reactor threads must be in [1, %d]",
+		   OW_REACTOR_MAX_THREADS);
+      return OW_GENERIC_ERROR;
+    }
+
+  reactor = malloc (sizeof (struct ow_reactor));
+  atomic_init (&reactor->running, 1);
+  pthread_spin_init (&reactor->lock, PTHREAD_PROCESS_PRIVATE);
+  reactor->loops_len = 0;
+
+  debug_print (1, "Starting reactor with %u threads...", threads);
+
+  for (int i = 0; i < threads; i++)
+    {
+      loop = &reactor->loops[i];
+      loop->reactor = reactor;
+      loop->engines_len = 0;
+      loop->users = 0;
+
+      if (libusb_init (&loop->context) != LIBUSB_SUCCESS)
+	{
+	  err = OW_USB_ERROR_LIBUSB_INIT_FAILED;
+	  goto error;
+	}
+
+      pthread_spin_init (&loop->lock, PTHREAD_PROCESS_PRIVATE);
+
+      if (pthread_create (&loop->thread, NULL, ow_reactor_run_loop, loop))
+	{
+	  error_print ("Could not start reactor thread");
+	  pthread_spin_destroy (&loop->lock);
+	  libusb_exit (loop->context);
+	  err = OW_GENERIC_ERROR;
+	  goto error;
+	}
+
+      snprintf (name, sizeof (name), "reactor-%d", i);
+      pthread_setname_np (loop->thread, name);
+      ow_set_thread_rt_priority (loop->thread, OW_DEFAULT_RT_PROPERTY);
+
+      reactor->loops_len++;
+    }
+
+  *reactor_ = reactor;
+  return OW_OK;
+
+error:
+  ow_reactor_destroy (reactor);
+  return err;
+}
+
+//All the engines must have been destroyed before.
+void
+ow_reactor_destroy (struct ow_reactor *reactor)
+{
+  struct ow_reactor_loop *loop;
+
+  atomic_store (&reactor->running, 0);
+
+  for (int i = 0; i < reactor->loops_len; i++)
+    {
+      loop = &reactor->loops[i];
+      pthread_join (loop->thread, NULL);
+      pthread_spin_destroy (&loop->lock);
+      libusb_exit (loop->context);
+    }
+
+  pthread_spin_destroy (&reactor->lock);
+  free (reactor);
+}
+
+struct ow_reactor_loop *
+ow_reactor_acquire_loop (struct ow_reactor *reactor)
+{
+  struct ow_reactor_loop *loop = &reactor->loops[0];
+
+  pthread_spin_lock (&reactor->lock);
+  for (int i = 1; i < reactor->loops_len; i++)
+    {
+      if (reactor->loops[i].users < loop->users)
+	{
+	  loop = &reactor->loops[i];
+	}
+    }
+  loop->users++;
+  pthread_spin_unlock (&reactor->lock);
+
+  return loop;
+}
+
+void
+ow_reactor_release_loop (struct ow_reactor_loop *loop)
+{
+  pthread_spin_lock (&loop->reactor->lock);
+  loop->users--;
+  pthread_spin_unlock (&loop->reactor->lock);
+}
+
+ow_err_t
+ow_reactor_add_engine (struct ow_reactor_loop *loop, struct ow_engine *engine)
+{
+  ow_err_t err = OW_OK;
+
+  pthread_spin_lock (&loop->lock);
+  if (loop->engines_len == OW_REACTOR_MAX_ENGINES)
+    {
+      error_print ("Too many engines in reactor loop");
+      err = OW_GENERIC_ERROR;
+    }
+  else
+    {
+      loop->engines[loop->engines_len] = engine;
+      loop->engines_len++;
+    }
+  pthread_spin_unlock (&loop->lock);
+
+#if LIBUSB_API_VERSION >= 0x01000105
+  //Do not wait for the timeout to boot the engine.
+  libusb_interrupt_event_handler (loop->context);
+#endif
+
+  return err;
+}
@@ -0,0 +1,62 @@
+/*
+ *   reactor.h
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <libusb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "overwitch.h"
+
+#define OW_REACTOR_MAX_THREADS 8
+#define OW_REACTOR_MAX_ENGINES 64
+
+//An event loop with its own libusb context and thread. The engines using
+//the loop open their devices with its context and are driven from its
+//thread, so the transfer callbacks and the engine state machine are never
+//run concurrently.
+struct ow_reactor_loop
+{
+  libusb_context *context;
+  pthread_t thread;
+  pthread_spinlock_t lock;
+  struct ow_engine *engines[OW_REACTOR_MAX_ENGINES];
+  int engines_len;
+  int users;			//Engines initialized with this loop
+  struct ow_reactor *reactor;
+};
+
+struct ow_reactor
+{
+  atomic_int running;
+  pthread_spinlock_t lock;
+  unsigned int loops_len;
+  struct ow_reactor_loop loops[OW_REACTOR_MAX_THREADS];
+};
+
+//Get the loop with fewer engines. It must be released once the engine is
+//destroyed.
+struct ow_reactor_loop *ow_reactor_acquire_loop (struct ow_reactor *);
+
+void ow_reactor_release_loop (struct ow_reactor_loop *);
+
+//Run the engine from the loop thread until ow_engine_poll reports that it
+//has finished.
+ow_err_t ow_reactor_add_engine (struct ow_reactor_loop *, struct ow_engine *);
@@ -19,18 +19,44 @@
  */
 
 #include <math.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include "resampler.h"
 
-#define MAX_READ_FRAMES 5
+//Frames given to the converters when there is nothing to read.
+#define O2H_FILLER_FRAMES 5
+//Extra frames read as the converters might need a bit more input than the
+//ratio tells.
+#define O2H_READ_MARGIN 2
+//Minimum planar read once most of the input of the cycle has been read.
+#define O2H_TOPUP_FRAMES 2
 #define DEFAULT_REPORT_PERIOD 2
 #define TUNING_PERIOD_US 5000000
+//With a calibration, tuning ends as soon as the ratio confirms it.
+#define FAST_TUNING_PERIOD_US 250000
+#define CALIBRATION_TOLERANCE 0.0001
+//Calibrations further than this from the nominal ratio are ignored.
+#define CALIBRATION_MAX_DEVIATION 0.01
 
 #define OB_PERIOD_MS (1000.0 / OB_SAMPLE_RATE)
 
 #define RATIO_ERROR_TOLERANCE 4
 
+//Drift-only mode is used if the ratio deviation stays below the first
+//value for a second and it is left once the deviation is above the second.
+#define DRIFT_DEVIATION_IN 0.0005
+#define DRIFT_DEVIATION_OUT 0.001
+
+//In auto mode, the target delay is lowered by a part of the frames left in
+//the buffer above the margin after every window without underflows and it
+//is raised by half a transfer after an underflow. The first window is not
+//used as the buffer might underflow while the device starts.
+#define TARGET_DELAY_AUTO_WINDOW_SECS 8
+#define TARGET_DELAY_AUTO_MARGIN 32
+#define TARGET_DELAY_AUTO_SHRINK 0.125
+#define TARGET_DELAY_AUTO_MAX_FACTOR 2
+
 inline ow_resampler_status_t
 ow_resampler_get_status (struct ow_resampler *resampler)
 {
@@ -102,6 +128,20 @@ ow_resampler_get_state (struct ow_resampler *resampler,
   state->ratio_h2o = resampler->h2o_ratio;
 
   state->status = ow_resampler_get_status (resampler);
+
+  ow_engine_get_stats (resampler->engine, &state->stats);
+}
+
+static uint64_t
+ow_resampler_count_usb_errors (struct ow_engine_stats *stats)
+{
+  uint64_t errors = 0;
+  for (int i = OW_ENGINE_STAT_USB_ERROR; i <= OW_ENGINE_STAT_USB_SUBMIT_ERRORS;
+       i++)
+    {
+      errors += stats->counters[i];
+    }
+  return errors;
 }
 
 static inline void
@@ -113,12 +153,27 @@ ow_resampler_report_state (struct ow_resampler *resampler)
 
   if (debug_level > 1)
     {
-      fprintf (stderr,
-	       "%s (%s): o2h latency: %4.1f [%4.1f, %4.1f] ms; h2o latency: %4.1f [%4.1f, %4.1f] ms, o2h ratio: %f\n",
-	       resampler->engine->name, resampler->engine->overbridge_name,
-	       state.latency_o2h, state.latency_o2h_min,
-	       state.latency_o2h_max, state.latency_h2o,
-	       state.latency_h2o_min, state.latency_h2o_max, state.ratio_o2h);
+      uint64_t *c = state.stats.counters;
+      ow_log_print (0,
+		    "%s (%s): o2h latency: %4.1f [%4.1f, %4.1f] ms; h2o latency: %4.1f [%4.1f, %4.1f] ms, o2h ratio: %f",
+		    resampler->engine->name,
+		    resampler->engine->overbridge_name, state.latency_o2h,
+		    state.latency_o2h_min, state.latency_o2h_max,
+		    state.latency_h2o, state.latency_h2o_min,
+		    state.latency_h2o_max, state.ratio_o2h);
+      ow_log_print (0,
+		    "%s (%s): o2h overflows: %" PRIu64 ", lost: %" PRIu64
+		    ", gaps: %" PRIu64 ", repeats: %" PRIu64
+		    "; h2o underflows: %" PRIu64 ", lost: %" PRIu64
+		    "; USB errors: %" PRIu64,
+		    resampler->engine->name,
+		    resampler->engine->overbridge_name,
+		    c[OW_ENGINE_STAT_O2H_OVERFLOWS],
+		    c[OW_ENGINE_STAT_O2H_LOST_PACKETS],
+		    c[OW_ENGINE_STAT_O2H_GAPS], c[OW_ENGINE_STAT_O2H_REPEATS],
+		    c[OW_ENGINE_STAT_H2O_UNDERFLOWS],
+		    c[OW_ENGINE_STAT_H2O_LOST_PACKETS],
+		    ow_resampler_count_usb_errors (&state.stats));
     }
 
   if (resampler->reporter.callback)
@@ -127,6 +182,14 @@ ow_resampler_report_state (struct ow_resampler *resampler)
     }
 }
 
+static inline void
+resampler_set_h2o_queue_len (struct ow_resampler *resampler, size_t len)
+{
+  resampler->h2o_queue_len = len;
+  resampler->h2o_buf_in = resampler->h2o_queues[resampler->h2o_queue_fill] +
+    len * resampler->engine->device->desc.inputs;
+}
+
 void
 ow_resampler_clear_buffers (struct ow_resampler *resampler)
 {
@@ -135,8 +198,11 @@ ow_resampler_clear_buffers (struct ow_resampler *resampler)
 
   debug_print (2, "Clearing buffers...");
 
-  resampler->h2o_queue_len = 0;
+  resampler_set_h2o_queue_len (resampler, 0);
   resampler->reading_at_o2h_end = 0;
+  resampler->o2h_planes_pos = 0;
+  resampler->o2h_planes_len = 0;
+  resampler->o2h_pad_frames = 0;
 
   if (context && context->o2h_audio)
     {
@@ -156,27 +222,28 @@ ow_resampler_reset_buffers (struct ow_resampler *resampler)
   resampler->o2h_bufsize = resampler->bufsize * resampler->o2h_frame_size;
   resampler->h2o_bufsize = resampler->bufsize * resampler->h2o_frame_size;
 
-  if (resampler->h2o_aux)
+  if (resampler->h2o_queues[0])
     {
-      free (resampler->h2o_aux);
-      free (resampler->h2o_buf_out);
-      free (resampler->h2o_buf_in);
-      free (resampler->h2o_queue);
-      free (resampler->o2h_buf_in);
+      free (resampler->h2o_queues[0]);
+      free (resampler->h2o_queues[1]);
       free (resampler->o2h_buf_out);
     }
 
-  //The 8 times scale allow up to more than 192 kHz sample rate in JACK.
-  resampler->h2o_buf_in = malloc (resampler->h2o_bufsize);
-  resampler->h2o_buf_out = malloc (resampler->h2o_bufsize * 8);
-  resampler->h2o_aux = malloc (resampler->h2o_bufsize * 8);
-  resampler->h2o_queue = malloc (resampler->h2o_bufsize * 8);
+  //The h2o output and the o2h input depend on the sample rate too so these
+  //are allocated when the DLL is reset.
+  free (resampler->h2o_buf_out);
+  resampler->h2o_buf_out = NULL;
+  resampler->h2o_max_frames = 0;
+  resampler->o2h_read_frames = 0;
 
-  resampler->o2h_buf_in = malloc (resampler->o2h_bufsize);
-  resampler->o2h_buf_out = malloc (resampler->o2h_bufsize);
+  for (int i = 0; i < 2; i++)
+    {
+      resampler->h2o_queues[i] =
+	malloc (resampler->h2o_bufsize * H2O_QUEUE_CYCLES);
+    }
+  resampler->h2o_queue_fill = 0;
 
-  memset (resampler->h2o_aux, 0, resampler->h2o_bufsize);
-  memset (resampler->o2h_buf_in, 0, resampler->h2o_bufsize);
+  resampler->o2h_buf_out = malloc (resampler->o2h_bufsize);
 
   ow_resampler_clear_buffers (resampler);
 }
@@ -187,6 +254,418 @@ ow_resampler_get_target_delay_ms (struct ow_resampler *resampler)
   return resampler->dll.target_delay * 1000 / OB_SAMPLE_RATE;
 }
 
+void
+ow_resampler_set_target_delay (struct ow_resampler *resampler,
+			       ow_target_delay_policy_t policy, double value)
+{
+  resampler->target_delay_policy = policy;
+  resampler->target_delay_value = value;
+}
+
+static void
+resampler_reset_target_delay_window (struct ow_resampler *resampler)
+{
+  resampler->target_delay_window_frames = 0;
+  resampler->o2h_min_spare = HUGE_VAL;
+  resampler->target_delay_underflows = resampler->o2h_underflows;
+}
+
+//The DLL sets the default target delay when it is reset.
+static void
+resampler_reset_target_delay (struct ow_resampler *resampler)
+{
+  int target_delay = resampler->dll.target_delay;
+
+  switch (resampler->target_delay_policy)
+    {
+    case OW_TARGET_DELAY_FRAMES:
+      target_delay = resampler->target_delay_value;
+      break;
+    case OW_TARGET_DELAY_FACTOR:
+      target_delay *= resampler->target_delay_value;
+      break;
+    case OW_TARGET_DELAY_AUTO:
+      target_delay = resampler->engine->frames_per_transfer +
+	resampler->bufsize;
+      break;
+    default:
+      break;
+    }
+
+  //Less than a transfer underflows on every transfer.
+  resampler->target_delay_min = resampler->engine->frames_per_transfer;
+  resampler->target_delay_max =
+    resampler->dll.target_delay * TARGET_DELAY_AUTO_MAX_FACTOR;
+
+  if (target_delay < resampler->target_delay_min)
+    {
+      error_print ("%s (%s): Target delay %d too low. Using %d frames...",
+		   resampler->engine->name,
+		   resampler->engine->overbridge_name, target_delay,
+		   resampler->target_delay_min);
+      target_delay = resampler->target_delay_min;
+    }
+
+  resampler->dll.target_delay = target_delay;
+
+  resampler->target_delay_windows = 0;
+  resampler_reset_target_delay_window (resampler);
+}
+
+static void
+resampler_update_target_delay (struct ow_resampler *resampler)
+{
+  struct ow_context *context = resampler->engine->context;
+  struct ow_dll *dll = &resampler->dll;
+  double spare, excess;
+  int target_delay;
+
+  spare = context->read_space (context->o2h_audio) /
+    resampler->o2h_frame_size - resampler->bufsize / resampler->o2h_ratio;
+  if (spare < resampler->o2h_min_spare)
+    {
+      resampler->o2h_min_spare = spare;
+    }
+  resampler->target_delay_window_frames += resampler->bufsize;
+
+  if (resampler->target_delay_windows &&
+      resampler->o2h_underflows != resampler->target_delay_underflows)
+    {
+      target_delay = dll->target_delay +
+	resampler->engine->frames_per_transfer / 2;
+      if (target_delay > resampler->target_delay_max)
+	{
+	  target_delay = resampler->target_delay_max;
+	}
+      debug_print (1, "%s (%s): Raising target delay to %d frames...",
+		   resampler->engine->name,
+		   resampler->engine->overbridge_name, target_delay);
+      dll->target_delay = target_delay;
+      resampler_reset_target_delay_window (resampler);
+      return;
+    }
+
+  if (resampler->target_delay_window_frames <
+      resampler->samplerate * TARGET_DELAY_AUTO_WINDOW_SECS)
+    {
+      return;
+    }
+
+  excess = resampler->o2h_min_spare - TARGET_DELAY_AUTO_MARGIN;
+  if (resampler->target_delay_windows && excess >= 1.0)
+    {
+      target_delay = dll->target_delay - excess * TARGET_DELAY_AUTO_SHRINK;
+      if (target_delay < resampler->target_delay_min)
+	{
+	  target_delay = resampler->target_delay_min;
+	}
+      debug_print (2, "%s (%s): Lowering target delay to %d frames...",
+		   resampler->engine->name,
+		   resampler->engine->overbridge_name, target_delay);
+      dll->target_delay = target_delay;
+    }
+
+  resampler->target_delay_windows++;
+  resampler_reset_target_delay_window (resampler);
+}
+
+static void
+resampler_free_polyphase (struct ow_resampler *resampler)
+{
+  ow_polyphase_destroy (resampler->o2h_polyphase);
+  ow_polyphase_destroy (resampler->h2o_polyphase);
+  ow_polyphase_destroy (resampler->o2h_drift);
+  ow_polyphase_destroy (resampler->h2o_drift);
+  free (resampler->o2h_polyphase_out);
+  free (resampler->h2o_polyphase_in);
+  free (resampler->h2o_polyphase_out);
+  resampler->o2h_polyphase = NULL;
+  resampler->h2o_polyphase = NULL;
+  resampler->o2h_drift = NULL;
+  resampler->h2o_drift = NULL;
+  resampler->o2h_polyphase_out = NULL;
+  resampler->h2o_polyphase_in = NULL;
+  resampler->h2o_polyphase_out = NULL;
+}
+
+//The resampler is stopped if the ratio goes beyond the bounds so neither
+//the h2o output nor the o2h input of a cycle can be larger than these.
+static void
+resampler_reset_ratio_buffers (struct ow_resampler *resampler)
+{
+  size_t frames;
+  int outputs = resampler->engine->device->desc.outputs;
+
+  if (!resampler->bufsize)
+    {
+      return;
+    }
+
+  frames = ceil (resampler->bufsize / resampler->min_target_ratio) + 1;
+  if (frames != resampler->h2o_max_frames)
+    {
+      debug_print (2, "Setting h2o output to %zu frames...", frames);
+
+      free (resampler->h2o_buf_out);
+      resampler->h2o_buf_out = malloc (frames * resampler->h2o_frame_size);
+      resampler->h2o_max_frames = frames;
+    }
+
+  frames = ceil (resampler->bufsize / resampler->min_target_ratio) +
+    O2H_READ_MARGIN;
+  if (frames != resampler->o2h_read_frames)
+    {
+      debug_print (2, "Setting o2h input to %zu frames...", frames);
+
+      free (resampler->o2h_buf_in);
+      resampler->o2h_buf_in = calloc (frames, resampler->o2h_frame_size);
+      for (int i = 0; i < outputs; i++)
+	{
+	  free (resampler->o2h_planes[i]);
+	  resampler->o2h_planes[i] = calloc (frames, sizeof (float));
+	}
+      resampler->o2h_planes_pos = 0;
+      resampler->o2h_planes_len = 0;
+      resampler->o2h_read_frames = frames;
+    }
+}
+
+//Enough input for the given output at the current ratio so that a cycle
+//usually takes a single read.
+static inline long
+resampler_o2h_read_size (struct ow_resampler *resampler, long out_frames)
+{
+  long frames = ceil (out_frames / resampler->o2h_ratio) + O2H_READ_MARGIN;
+  return frames > resampler->o2h_read_frames ? resampler->o2h_read_frames :
+    frames;
+}
+
+//The planar converters take all the input they are given, even if it is more
+//than what the output needs, so reading a margin every cycle would make the
+//input held by the converters grow until they are full and the DLL would see
+//it as consumed. Hence, the first read of a cycle is a bit short and the
+//rest is read in small reads.
+static inline long
+resampler_o2h_planar_read_size (struct ow_resampler *resampler,
+				long out_frames)
+{
+  long frames = floor (out_frames / resampler->o2h_ratio) - 1;
+  frames = frames < O2H_TOPUP_FRAMES ? O2H_TOPUP_FRAMES : frames;
+  return frames > resampler->o2h_read_frames ? resampler->o2h_read_frames :
+    frames;
+}
+
+//The filters are designed for the nominal ratios so these are only created
+//again if the sample rate or the buffer size change.
+static void
+resampler_reset_polyphase (struct ow_resampler *resampler)
+{
+  int inputs = resampler->engine->device->desc.inputs;
+  int outputs = resampler->engine->device->desc.outputs;
+  double ratio = resampler->samplerate / OB_SAMPLE_RATE;
+
+  resampler->drift = 0;
+  resampler->drift_cycles = 0;
+
+  if (!resampler->samplerate || !resampler->bufsize)
+    {
+      return;
+    }
+
+  if (resampler->polyphase_samplerate == resampler->samplerate &&
+      resampler->polyphase_bufsize == resampler->bufsize)
+    {
+      if (resampler->o2h_polyphase)
+	{
+	  ow_polyphase_reset (resampler->o2h_polyphase);
+	  ow_polyphase_reset (resampler->h2o_polyphase);
+	}
+      return;
+    }
+
+  resampler_free_polyphase (resampler);
+
+  if (resampler->backend == OW_RESAMPLER_BACKEND_POLYPHASE)
+    {
+      resampler->o2h_polyphase = ow_polyphase_create (outputs, ratio,
+						      resampler->quality,
+						      resampler->o2h_read_frames);
+      resampler->h2o_polyphase = ow_polyphase_create (inputs, 1.0 / ratio,
+						      resampler->quality,
+						      resampler->bufsize);
+    }
+
+  //The history of libsamplerate can not be handed over so the mode needs
+  //the polyphase converters. These leave a longer lookahead after a switch.
+  if (resampler->o2h_polyphase && resampler->samplerate == OB_SAMPLE_RATE)
+    {
+      resampler->o2h_drift =
+	ow_polyphase_create_lagrange (outputs,
+				      resampler->o2h_read_frames +
+				      resampler->o2h_polyphase->taps);
+      resampler->h2o_drift =
+	ow_polyphase_create_lagrange (inputs,
+				      resampler->bufsize +
+				      resampler->h2o_polyphase->taps);
+    }
+
+  if (resampler->o2h_polyphase || resampler->o2h_drift)
+    {
+      resampler->o2h_polyphase_out = malloc (resampler->o2h_bufsize);
+      resampler->h2o_polyphase_in = malloc (resampler->h2o_bufsize);
+      resampler->h2o_polyphase_out = malloc (resampler->h2o_max_frames *
+					     resampler->h2o_frame_size);
+    }
+
+  resampler->polyphase_samplerate = resampler->samplerate;
+  resampler->polyphase_bufsize = resampler->bufsize;
+}
+
+static inline struct ow_polyphase *
+resampler_get_o2h_polyphase (struct ow_resampler *resampler)
+{
+  return resampler->drift ? resampler->o2h_drift : resampler->o2h_polyphase;
+}
+
+static inline struct ow_polyphase *
+resampler_get_h2o_polyphase (struct ow_resampler *resampler)
+{
+  return resampler->drift ? resampler->h2o_drift : resampler->h2o_polyphase;
+}
+
+//The converters that take over go on from the input position of the ones
+//being left so there is no gap and the h2o queue is kept.
+static void
+resampler_set_drift (struct ow_resampler *resampler, int drift)
+{
+  struct ow_polyphase *o2h = resampler_get_o2h_polyphase (resampler);
+  struct ow_polyphase *h2o = resampler_get_h2o_polyphase (resampler);
+
+  debug_print (1, "%s (%s): %s drift-only mode (ratio %f)...",
+	       resampler->engine->name, resampler->engine->overbridge_name,
+	       drift ? "Entering" : "Leaving", resampler->o2h_ratio);
+
+  resampler->drift = drift;
+  resampler->drift_cycles = 0;
+
+  ow_polyphase_handover (resampler_get_o2h_polyphase (resampler), o2h);
+  ow_polyphase_handover (resampler_get_h2o_polyphase (resampler), h2o);
+}
+
+//There is some hysteresis so that the converters are not switched back and
+//forth and the mode is only entered while running.
+static void
+resampler_update_drift (struct ow_resampler *resampler,
+			ow_resampler_status_t status)
+{
+  double deviation = fabs (resampler->o2h_ratio - 1.0);
+
+  if (!resampler->o2h_drift)
+    {
+      return;
+    }
+
+  if (resampler->drift)
+    {
+      if (status != OW_RESAMPLER_STATUS_RUN ||
+	  deviation > DRIFT_DEVIATION_OUT)
+	{
+	  resampler_set_drift (resampler, 0);
+	}
+      return;
+    }
+
+  if (status == OW_RESAMPLER_STATUS_RUN && deviation < DRIFT_DEVIATION_IN)
+    {
+      resampler->drift_cycles++;
+      if (resampler->drift_cycles * resampler->bufsize >=
+	  resampler->samplerate)
+	{
+	  resampler_set_drift (resampler, 1);
+	}
+    }
+  else
+    {
+      resampler->drift_cycles = 0;
+    }
+}
+
+//This never blocks the audio thread.
+static void
+resampler_load_converged (struct ow_resampler *resampler,
+			  struct ow_calibration *converged)
+{
+  unsigned int s0, s1;
+
+  do
+    {
+      s0 = atomic_load_explicit (&resampler->converged_seq,
+				 memory_order_acquire);
+      *converged = resampler->converged;
+      atomic_thread_fence (memory_order_acquire);
+      s1 = atomic_load_explicit (&resampler->converged_seq,
+				 memory_order_relaxed);
+    }
+  while ((s0 & 1) || s0 != s1);
+}
+
+//The DLL state of the current run is preferred over the saved ones.
+static void
+resampler_seed_dll (struct ow_resampler *resampler, uint32_t samplerate)
+{
+  double nominal = samplerate / (double) OB_SAMPLE_RATE;
+  struct ow_calibration *calibration = resampler->calibrations;
+  struct ow_calibration converged;
+
+  resampler->seeded = 0;
+
+  resampler_load_converged (resampler, &converged);
+  if (converged.samplerate == samplerate)
+    {
+      resampler->seed = converged;
+      resampler->seeded = 1;
+    }
+
+  for (int i = 0; i < resampler->calibrations_len && !resampler->seeded;
+       i++, calibration++)
+    {
+      if (calibration->samplerate == samplerate)
+	{
+	  resampler->seed = *calibration;
+	  resampler->seeded = 1;
+	}
+    }
+
+  if (!resampler->seeded)
+    {
+      return;
+    }
+
+  if (fabs (resampler->seed.ratio / nominal - 1.0) >
+      CALIBRATION_MAX_DEVIATION)
+    {
+      error_print ("%s (%s): Ignoring invalid calibration ratio %f",
+		   resampler->engine->name,
+		   resampler->engine->overbridge_name, resampler->seed.ratio);
+      resampler->seeded = 0;
+      return;
+    }
+
+  ow_dll_host_seed (&resampler->dll, resampler->seed.ratio,
+		    resampler->seed.z1, resampler->seed.z2,
+		    resampler->seed.z3);
+}
+
+static void
+resampler_set_pool_period (struct ow_resampler *resampler)
+{
+  if (resampler->pool && resampler->samplerate)
+    {
+      ow_pool_set_period (resampler->pool, resampler->bufsize *
+			  1000000000ULL / resampler->samplerate);
+    }
+}
+
 static void
 ow_resampler_reset_dll (struct ow_resampler *resampler,
 			uint32_t new_samplerate)
@@ -205,6 +684,8 @@ ow_resampler_reset_dll (struct ow_resampler *resampler,
       ow_dll_host_reset (&resampler->dll, new_samplerate, OB_SAMPLE_RATE,
 			 resampler->bufsize,
 			 resampler->engine->frames_per_transfer);
+      resampler_seed_dll (resampler, new_samplerate);
+      resampler_reset_target_delay (resampler);
 
       target_delay_ms = ow_resampler_get_target_delay_ms (resampler);
       debug_print (2, "DLL target delay: %d frames (%f ms)",
@@ -223,36 +704,88 @@ ow_resampler_reset_dll (struct ow_resampler *resampler,
   resampler->max_target_ratio = target_ratio * RATIO_ERROR_TOLERANCE;
   resampler->min_target_ratio = target_ratio / RATIO_ERROR_TOLERANCE;
   pthread_spin_unlock (&resampler->lock);
+
+  resampler_reset_ratio_buffers (resampler);
+  resampler_reset_polyphase (resampler);
+  resampler_set_pool_period (resampler);
 }
 
-static long
-resampler_h2o_reader (void *cb_data, float **data)
+//libsamplerate only calls this once the previous input has been used so
+//that queue can be filled again.
+long
+ow_resampler_h2o_reader (void *cb_data, float **data)
 {
-  long ret;
+  long frames;
   struct ow_resampler *resampler = cb_data;
+  float *queue = resampler->h2o_queues[resampler->h2o_queue_fill];
 
-  *data = resampler->h2o_aux;
-
-  if (resampler->h2o_queue_len == 0)
+  frames = resampler->h2o_queue_len;
+  if (frames == 0)
     {
       debug_print (2, "h2o: Can not read data from queue");
-      return resampler->bufsize;
+      memset (queue, 0, resampler->h2o_bufsize);
+      frames = resampler->bufsize;
     }
 
-  ret = resampler->h2o_queue_len;
-  memcpy (resampler->h2o_aux, resampler->h2o_queue,
-	  ret * resampler->h2o_frame_size);
-  resampler->h2o_queue_len = 0;
+  *data = queue;
+
+  resampler->h2o_queue_fill ^= 1;
+  resampler_set_h2o_queue_len (resampler, 0);
+
+  return frames;
+}
+
+//Silence read after a resync instead of the buffer.
+static inline long
+resampler_o2h_pad_size (struct ow_resampler *resampler, long frames)
+{
+  frames = frames > resampler->o2h_pad_frames ? resampler->o2h_pad_frames :
+    frames;
+  resampler->o2h_pad_frames -= frames;
+  return frames;
+}
+
+//The device starts writing once running so the audio read before is just
+//the DLL filler. With the default policy, whole buffers are discarded and the
+//rest is used. Otherwise, the DLL keeps the frames left in the buffer at the
+//start so the target delay is left.
+static void
+resampler_o2h_start_reading (struct ow_resampler *resampler, size_t rso2h)
+{
+  size_t bytes, keep;
+  struct ow_context *context = resampler->engine->context;
+
+  if (resampler->target_delay_policy == OW_TARGET_DELAY_DEFAULT)
+    {
+      if (rso2h < resampler->o2h_bufsize)
+	{
+	  return;
+	}
+      bytes = ow_bytes_to_frame_bytes (rso2h, resampler->o2h_bufsize);
+    }
+  else
+    {
+      keep = resampler->dll.target_delay * resampler->o2h_frame_size;
+      if (rso2h < keep)
+	{
+	  return;
+	}
+      bytes = rso2h - keep;
+    }
 
-  return ret;
+  debug_print (2, "o2h: Emptying buffer (%zu B) and running...", bytes);
+  context->read (context->o2h_audio, NULL, bytes);
+  resampler->reading_at_o2h_end = 1;
 }
 
+//libsamplerate keeps what has not been used yet so the frames are counted
+//when read.
 static long
 resampler_o2h_reader (void *cb_data, float **data)
 {
   size_t rso2h;
   size_t bytes;
-  long frames;
+  long frames, n;
   struct ow_resampler *resampler = cb_data;
 
   *data = resampler->o2h_buf_in;
@@ -262,10 +795,18 @@ resampler_o2h_reader (void *cb_data, float **data)
 					    context->o2h_audio);
   if (resampler->reading_at_o2h_end)
     {
-      if (rso2h >= resampler->o2h_frame_size)
+      if (resampler->o2h_pad_frames)
+	{
+	  n = resampler_o2h_read_size (resampler, resampler->bufsize);
+	  frames = resampler_o2h_pad_size (resampler, n);
+	  memset (resampler->o2h_buf_in, 0,
+		  frames * resampler->o2h_frame_size);
+	}
+      else if (rso2h >= resampler->o2h_frame_size)
 	{
+	  n = resampler_o2h_read_size (resampler, resampler->bufsize);
 	  frames = rso2h / resampler->o2h_frame_size;
-	  frames = frames > MAX_READ_FRAMES ? MAX_READ_FRAMES : frames;
+	  frames = frames > n ? n : frames;
 	  bytes = frames * resampler->o2h_frame_size;
 	  resampler->engine->context->read (resampler->engine->context->
 					    o2h_audio,
@@ -277,36 +818,388 @@ resampler_o2h_reader (void *cb_data, float **data)
 	  debug_print (2, "o2h: Audio ring buffer underflow (%zu < %zu)",
 		       rso2h, resampler->engine->o2h_transfer_size);
 
-	  pthread_spin_lock (&resampler->engine->lock);
-	  resampler->engine->o2h_max_latency = 0;	// Any maximum values is invalid at this point
-	  pthread_spin_unlock (&resampler->engine->lock);
+	  resampler->o2h_underflows++;
 
-	  frames = MAX_READ_FRAMES;
+	  // Any maximum values is invalid at this point
+	  atomic_store_explicit (&resampler->engine->o2h_max_latency, 0,
+				 memory_order_relaxed);
+
+	  frames = O2H_FILLER_FRAMES;
 	}
     }
   else
     {
-      if (rso2h >= resampler->o2h_bufsize)
+      resampler_o2h_start_reading (resampler, rso2h);
+      frames = O2H_FILLER_FRAMES;
+    }
+
+  resampler->dll.frames += frames;
+
+  return frames;
+}
+
+inline void
+ow_resampler_deinterleave (const float *src, int tracks, size_t frames,
+			   float *planes[], size_t offset)
+{
+  for (int i = 0; i < tracks; i++)
+    {
+      const float *s = src + i;
+      float *d;
+
+      if (!planes[i])
 	{
-	  bytes = ow_bytes_to_frame_bytes (rso2h, resampler->o2h_bufsize);
-	  debug_print (2, "o2h: Emptying buffer (%zu B) and running...",
-		       bytes);
-	  resampler->engine->context->read (resampler->engine->context->
-					    o2h_audio, NULL, bytes);
-	  resampler->reading_at_o2h_end = 1;
+	  continue;
+	}
+
+      d = planes[i] + offset;
+      for (size_t j = 0; j < frames; j++, s += tracks, d++)
+	{
+	  *d = *s;
 	}
-      frames = MAX_READ_FRAMES;
     }
+}
 
-  resampler->dll.frames += frames;
+//Same as resampler_o2h_reader but the frames are de-interleaved into the
+//active planes while being read from the buffer memory. Here, the frames
+//are counted when the converters use them.
+static long
+resampler_o2h_planar_reader (struct ow_resampler *resampler, float *planes[],
+			     long out_frames)
+{
+  size_t rso2h;
+  size_t bytes;
+  long frames, n;
+  struct ow_buffer_region regions[2];
+  struct ow_context *context = resampler->engine->context;
+  int tracks = resampler->engine->device->desc.outputs;
+
+  rso2h = context->read_space (context->o2h_audio);
+  if (resampler->reading_at_o2h_end)
+    {
+      if (resampler->o2h_pad_frames)
+	{
+	  n = resampler_o2h_planar_read_size (resampler, out_frames);
+	  frames = resampler_o2h_pad_size (resampler, n);
+	  for (int i = 0; i < tracks; i++)
+	    {
+	      if (planes[i])
+		{
+		  memset (planes[i], 0, frames * sizeof (float));
+		}
+	    }
+	}
+      else if (rso2h >= resampler->o2h_frame_size)
+	{
+	  n = resampler_o2h_planar_read_size (resampler, out_frames);
+	  frames = rso2h / resampler->o2h_frame_size;
+	  frames = frames > n ? n : frames;
+	  bytes = frames * resampler->o2h_frame_size;
+	  if (context->get_read_regions)
+	    {
+	      context->get_read_regions (context->o2h_audio, regions);
+	      n = regions[0].len / resampler->o2h_frame_size;
+	      n = n > frames ? frames : n;
+	      ow_resampler_deinterleave ((float *) regions[0].data, tracks, n,
+					 planes, 0);
+	      ow_resampler_deinterleave ((float *) regions[1].data, tracks,
+					 frames - n, planes, n);
+	      context->read_commit (context->o2h_audio, bytes);
+	    }
+	  else
+	    {
+	      context->read (context->o2h_audio,
+			     (void *) resampler->o2h_buf_in, bytes);
+	      ow_resampler_deinterleave (resampler->o2h_buf_in, tracks,
+					 frames, planes, 0);
+	    }
+	}
+      else
+	{
+	  debug_print (2, "o2h: Audio ring buffer underflow (%zu < %zu)",
+		       rso2h, resampler->engine->o2h_transfer_size);
+
+	  resampler->o2h_underflows++;
+
+	  // Any maximum values is invalid at this point
+	  atomic_store_explicit (&resampler->engine->o2h_max_latency, 0,
+				 memory_order_relaxed);
+
+	  frames = O2H_FILLER_FRAMES;
+	}
+    }
+  else
+    {
+      resampler_o2h_start_reading (resampler, rso2h);
+      frames = O2H_FILLER_FRAMES;
+    }
 
   return frames;
 }
 
+//All the active planes are resampled at once as they share the positions
+//and the coefficients of every output sample.
+static void
+resampler_o2h_polyphase (struct ow_resampler *resampler,
+			 struct ow_polyphase *pp, float *planes[],
+			 float *buffers[])
+{
+  const float *in[OB_MAX_TRACKS];
+  float *out[OB_MAX_TRACKS];
+  long gen_frames = 0;
+  long used, gen;
+  int tracks = resampler->engine->device->desc.outputs;
+
+  while (gen_frames < resampler->bufsize)
+    {
+      if (!resampler->o2h_planes_len)
+	{
+	  resampler->o2h_planes_pos = 0;
+	  resampler->o2h_planes_len =
+	    resampler_o2h_planar_reader (resampler, planes,
+					 resampler->bufsize - gen_frames);
+	}
+
+      for (int i = 0; i < tracks; i++)
+	{
+	  if (planes[i])
+	    {
+	      in[i] = planes[i] + resampler->o2h_planes_pos;
+	      out[i] = (buffers[i] ? buffers[i] : resampler->o2h_buf_out) +
+		gen_frames;
+	    }
+	  else
+	    {
+	      in[i] = NULL;
+	      out[i] = NULL;
+	    }
+	}
+
+      ow_polyphase_process (pp, in,
+			    resampler->o2h_planes_len, out,
+			    resampler->bufsize - gen_frames,
+			    resampler->o2h_ratio, &used, &gen);
+
+      resampler->o2h_planes_pos += used;
+      resampler->o2h_planes_len -= used;
+      resampler->dll.frames += used;
+      gen_frames += gen;
+    }
+}
+
+//A chunk of the input planes to be resampled by several threads. Every
+//track stores its own results as all of them are the same.
+struct resampler_o2h_chunk
+{
+  struct ow_resampler *resampler;
+  float **planes;
+  float **buffers;
+  int tracks[OB_MAX_TRACKS];
+  long gen_frames;
+  long used[OB_MAX_TRACKS];
+  long gen[OB_MAX_TRACKS];
+  int err[OB_MAX_TRACKS];
+};
+
+static void
+resampler_o2h_chunk_job (void *data_, int first, int last)
+{
+  SRC_DATA data;
+  struct resampler_o2h_chunk *chunk = data_;
+  struct ow_resampler *resampler = chunk->resampler;
+
+  data.src_ratio = resampler->o2h_ratio;
+  data.end_of_input = 0;
+
+  for (int i = first; i < last; i++)
+    {
+      int track = chunk->tracks[i];
+      float *buffer = chunk->buffers[track];
+
+      data.data_in = chunk->planes[track] + resampler->o2h_planes_pos;
+      data.input_frames = resampler->o2h_planes_len;
+      data.data_out = (buffer ? buffer : resampler->o2h_buf_out) +
+	chunk->gen_frames;
+      data.output_frames = resampler->bufsize - chunk->gen_frames;
+
+      chunk->err[track] = src_process (resampler->o2h_states[track], &data);
+      chunk->used[track] = data.input_frames_used;
+      chunk->gen[track] = data.output_frames_gen;
+    }
+}
+
+//A libsamplerate converter can not be positioned, so a reset one does not
+//consume and generate the same frames than the others. Thus, all of them are
+//reset together. Identical states with the same input stay in step.
+static void
+resampler_o2h_reset_states (struct ow_resampler *resampler,
+			    struct resampler_o2h_chunk *chunk,
+			    int active_tracks)
+{
+  debug_print (2, "o2h: Resetting the converters of %d tracks...",
+	       active_tracks);
+  for (int i = 0; i < active_tracks; i++)
+    {
+      src_reset (resampler->o2h_states[chunk->tracks[i]]);
+    }
+}
+
+//The first track is always resampled, even without a buffer, as all the
+//converters consume the same input frames and the buffer needs to be read
+//anyway. The buffers of the disabled tracks are just cleared.
+void
+ow_resampler_read_audio_planar (struct ow_resampler *resampler,
+				float *buffers[])
+{
+  struct resampler_o2h_chunk chunk;
+  float *planes[OB_MAX_TRACKS];
+  int active, active_tracks = 0, reset = 0, kept;
+  int tracks = resampler->engine->device->desc.outputs;
+  uint64_t enabled = ow_engine_get_o2h_tracks (resampler->engine);
+  struct ow_polyphase *pp = resampler_get_o2h_polyphase (resampler);
+
+  for (int i = 0; i < tracks; i++)
+    {
+      active = !i || (buffers[i] && (enabled & (1ULL << i)));
+      if (buffers[i] && !active)
+	{
+	  memset (buffers[i], 0, resampler->bufsize * sizeof (float));
+	}
+      //A converter that has been skipped has an outdated state.
+      if (active && !resampler->o2h_planes_active[i])
+	{
+	  if (pp)
+	    {
+	      ow_polyphase_reset_channel (pp, i);
+	    }
+	  else
+	    {
+	      reset = 1;
+	    }
+	}
+      resampler->o2h_planes_active[i] = active;
+      planes[i] = active ? resampler->o2h_planes[i] : NULL;
+      if (active)
+	{
+	  chunk.tracks[active_tracks] = i;
+	  active_tracks++;
+	}
+    }
+
+  if (pp)
+    {
+      resampler_o2h_polyphase (resampler, pp, planes, buffers);
+      return;
+    }
+
+  if (reset)
+    {
+      resampler_o2h_reset_states (resampler, &chunk, active_tracks);
+    }
+
+  chunk.resampler = resampler;
+  chunk.planes = planes;
+  chunk.buffers = buffers;
+  chunk.gen_frames = 0;
+
+  while (chunk.gen_frames < resampler->bufsize)
+    {
+      if (!resampler->o2h_planes_len)
+	{
+	  resampler->o2h_planes_pos = 0;
+	  resampler->o2h_planes_len =
+	    resampler_o2h_planar_reader (resampler, planes,
+					 resampler->bufsize -
+					 chunk.gen_frames);
+	}
+
+      if (resampler->pool)
+	{
+	  ow_pool_run (resampler->pool, resampler_o2h_chunk_job, &chunk,
+		       active_tracks);
+	}
+      else
+	{
+	  resampler_o2h_chunk_job (&chunk, 0, active_tracks);
+	}
+
+      for (int i = 0; i < active_tracks; i++)
+	{
+	  int err = chunk.err[chunk.tracks[i]];
+	  if (err)
+	    {
+	      error_print ("o2h: Error while resampling: %s",
+			   src_strerror (err));
+	      return;
+	    }
+	}
+
+      //This should not happen but a track out of step would be written at
+      //the wrong offsets. It is silenced until the end of the cycle and the
+      //converters are reset in the next one.
+      kept = 1;
+      for (int i = 1; i < active_tracks; i++)
+	{
+	  int track = chunk.tracks[i];
+	  if (chunk.used[track] != chunk.used[0] ||
+	      chunk.gen[track] != chunk.gen[0])
+	    {
+	      error_print ("o2h: Track %d out of step (%ld, %ld != %ld, %ld)",
+			   track, chunk.used[track], chunk.gen[track],
+			   chunk.used[0], chunk.gen[0]);
+	      memset (buffers[track] + chunk.gen_frames, 0,
+		      (resampler->bufsize - chunk.gen_frames) *
+		      sizeof (float));
+	      resampler->o2h_planes_active[track] = 0;
+	      continue;
+	    }
+	  chunk.tracks[kept] = track;
+	  kept++;
+	}
+      active_tracks = kept;
+
+      //The first track is always active.
+      resampler->o2h_planes_pos += chunk.used[0];
+      resampler->o2h_planes_len -= chunk.used[0];
+      resampler->dll.frames += chunk.used[0];
+      chunk.gen_frames += chunk.gen[0];
+    }
+}
+
+static void
+resampler_interleave (float *const planes[], int tracks, size_t frames,
+		      float *dst)
+{
+  for (int i = 0; i < tracks; i++)
+    {
+      const float *s = planes[i];
+      float *d = dst + i;
+
+      for (size_t j = 0; j < frames; j++, s++, d += tracks)
+	{
+	  *d = *s;
+	}
+    }
+}
+
 void
 ow_resampler_read_audio (struct ow_resampler *resampler)
 {
   long gen_frames;
+  float *planes[OB_MAX_TRACKS];
+  int tracks = resampler->engine->device->desc.outputs;
+
+  if (resampler_get_o2h_polyphase (resampler))
+    {
+      for (int i = 0; i < tracks; i++)
+	{
+	  planes[i] = resampler->o2h_polyphase_out + i * resampler->bufsize;
+	}
+      ow_resampler_read_audio_planar (resampler, planes);
+      resampler_interleave (planes, tracks, resampler->bufsize,
+			    resampler->o2h_buf_out);
+      return;
+    }
 
   gen_frames = src_callback_read (resampler->o2h_state, resampler->o2h_ratio,
 				  resampler->bufsize, resampler->o2h_buf_out);
@@ -318,6 +1211,40 @@ ow_resampler_read_audio (struct ow_resampler *resampler)
     }
 }
 
+//All the input is resampled at once so the generated frames follow the
+//ratio without any accumulator.
+static long
+resampler_h2o_polyphase (struct ow_resampler *resampler,
+			 struct ow_polyphase *pp)
+{
+  const float *in[OB_MAX_TRACKS];
+  float *out[OB_MAX_TRACKS];
+  float *planes[OB_MAX_TRACKS];
+  long used, gen;
+  int tracks = resampler->engine->device->desc.inputs;
+
+  for (int i = 0; i < tracks; i++)
+    {
+      planes[i] = resampler->h2o_polyphase_in + i * resampler->bufsize;
+      in[i] = planes[i];
+      out[i] = resampler->h2o_polyphase_out + i * resampler->h2o_max_frames;
+    }
+
+  ow_resampler_deinterleave (resampler->h2o_buf_in, tracks,
+			     resampler->bufsize, planes, 0);
+  ow_polyphase_process (pp, in, resampler->bufsize, out,
+			resampler->h2o_max_frames, resampler->h2o_ratio,
+			&used, &gen);
+  if (used != resampler->bufsize)
+    {
+      error_print ("h2o: Unexpected input frames used (%ld, expected %d)",
+		   used, resampler->bufsize);
+    }
+  resampler_interleave (out, tracks, gen, resampler->h2o_buf_out);
+
+  return gen;
+}
+
 void
 ow_resampler_write_audio (struct ow_resampler *resampler)
 {
@@ -328,17 +1255,22 @@ ow_resampler_write_audio (struct ow_resampler *resampler)
   size_t wsh2o;
   static double h2o_acc = .0;
   ow_resampler_status_t status = ow_resampler_get_status (resampler);
+  struct ow_polyphase *pp = resampler_get_h2o_polyphase (resampler);
 
   if (status < OW_RESAMPLER_STATUS_RUN)
     {
       return;
     }
 
-  memcpy (&resampler->h2o_queue
-	  [resampler->h2o_queue_len *
-	   resampler->h2o_frame_size], resampler->h2o_buf_in,
-	  resampler->h2o_bufsize);
-  resampler->h2o_queue_len += resampler->bufsize;
+  if (pp)
+    {
+      gen_frames = resampler_h2o_polyphase (resampler, pp);
+      goto write;
+    }
+
+  //The host audio is already at the end of the queue.
+  resampler_set_h2o_queue_len (resampler,
+			       resampler->h2o_queue_len + resampler->bufsize);
 
   h2o_acc += resampler->bufsize * (resampler->h2o_ratio - 1.0);
   inc = trunc (h2o_acc);
@@ -354,6 +1286,16 @@ ow_resampler_write_audio (struct ow_resampler *resampler)
 	 resampler->h2o_ratio, gen_frames, frames);
     }
 
+  //The oldest frames are kept if the queue is not being read.
+  if (resampler->h2o_queue_len + resampler->bufsize >
+      resampler->bufsize * H2O_QUEUE_CYCLES)
+    {
+      error_print ("h2o: Queue overflow. Discarding data...");
+      resampler_set_h2o_queue_len (resampler, resampler->bufsize *
+				   (H2O_QUEUE_CYCLES - 1));
+    }
+
+write:
   bytes = gen_frames * resampler->h2o_frame_size;
   wsh2o =
     resampler->engine->context->write_space (resampler->engine->
@@ -372,6 +1314,65 @@ ow_resampler_write_audio (struct ow_resampler *resampler)
     }
 }
 
+//The DLL error after an xrun is the frames the device kept writing while
+//the host was not reading so these are dropped from the o2h buffer. If
+//negative, silence is read first. The h2o buffer is short of the frames the
+//host did not write so silence is added up to a transfer.
+static void
+resampler_resync (struct ow_resampler *resampler)
+{
+  size_t wsh2o, bytes;
+  long frames, keep, n;
+  struct ow_context *context = resampler->engine->context;
+  struct ow_engine *engine = resampler->engine;
+
+  resampler->resyncs++;
+
+  if (resampler->reading_at_o2h_end)
+    {
+      n = (long) floor (resampler->dll.err + 0.5);
+      if (n > 0)
+	{
+	  frames = context->read_space (context->o2h_audio) /
+	    resampler->o2h_frame_size;
+	  n = n > frames ? frames : n;
+	  context->read (context->o2h_audio, NULL,
+			 n * resampler->o2h_frame_size);
+	}
+      else
+	{
+	  resampler->o2h_pad_frames -= n;
+	}
+
+      debug_print (1, "%s (%s): Resyncing o2h by %ld frames...",
+		   engine->name, engine->overbridge_name, n);
+
+      ow_dll_host_resync (&resampler->dll, n);
+    }
+
+  if (resampler->h2o_buf_out)
+    {
+      frames = context->read_space (context->h2o_audio) /
+	resampler->h2o_frame_size;
+      keep = engine->frames_per_transfer;
+      memset (resampler->h2o_buf_out, 0,
+	      resampler->h2o_max_frames * resampler->h2o_frame_size);
+      for (; frames < keep; frames += n)
+	{
+	  n = keep - frames;
+	  n = n > resampler->h2o_max_frames ? resampler->h2o_max_frames : n;
+	  bytes = n * resampler->h2o_frame_size;
+	  wsh2o = context->write_space (context->h2o_audio);
+	  if (bytes > wsh2o)
+	    {
+	      break;
+	    }
+	  context->write (context->h2o_audio, (void *) resampler->h2o_buf_out,
+			  bytes);
+	}
+    }
+}
+
 int
 ow_resampler_compute_ratios (struct ow_resampler *resampler,
 			     uint64_t current_usecs,
@@ -380,10 +1381,15 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
   ow_engine_status_t engine_status;
   struct ow_dll *dll = &resampler->dll;
   static uint64_t tuning_start_usecs;
+  uint64_t tuning_usecs;
+  int tuned = 0;
+  int resync;
   ow_resampler_status_t status;
 
   engine_status = ow_engine_get_status (resampler->engine);
   status = ow_resampler_get_status (resampler);
+  resync = atomic_exchange_explicit (&resampler->resync, 0,
+				     memory_order_relaxed);
 
   if (status == OW_RESAMPLER_STATUS_READY &&
       engine_status <= OW_ENGINE_STATUS_BOOT)
@@ -399,12 +1405,15 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
       return 1;
     }
 
-  pthread_spin_lock (&resampler->engine->lock);
   ow_dll_host_load_dll_overbridge (dll);
-  pthread_spin_unlock (&resampler->engine->lock);
 
   ow_dll_host_update_error (dll, current_usecs);
 
+  if (resync && status == OW_RESAMPLER_STATUS_RUN)
+    {
+      resampler_resync (resampler);
+    }
+
   if (status == OW_RESAMPLER_STATUS_READY &&
       engine_status == OW_ENGINE_STATUS_WAIT)
     {
@@ -461,8 +1470,32 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
       tuning_start_usecs = current_usecs;
     }
 
-  if (status == OW_RESAMPLER_STATUS_TUNE &&
-      current_usecs - tuning_start_usecs > TUNING_PERIOD_US)
+  if (status == OW_RESAMPLER_STATUS_TUNE)
+    {
+      tuning_usecs = current_usecs - tuning_start_usecs;
+      if (resampler->seeded && tuning_usecs > FAST_TUNING_PERIOD_US)
+	{
+	  if (fabs (dll->ratio / resampler->seed.ratio - 1.0) >
+	      CALIBRATION_TOLERANCE)
+	    {
+	      debug_print (1,
+			   "%s (%s): Ratio %f differs from calibration. Tuning resampler fully...",
+			   resampler->engine->name,
+			   resampler->engine->overbridge_name, dll->ratio);
+	      resampler->seeded = 0;
+	    }
+	  else
+	    {
+	      tuned = 1;
+	    }
+	}
+      else if (tuning_usecs > TUNING_PERIOD_US)
+	{
+	  tuned = 1;
+	}
+    }
+
+  if (tuned)
     {
       debug_print (1, "%s (%s): Running resampler...",
 		   resampler->engine->name,
@@ -478,6 +1511,24 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
       audio_running_cb (cb_data);
     }
 
+  if (status == OW_RESAMPLER_STATUS_RUN)
+    {
+      seqlock_write_begin (&resampler->converged_seq);
+      resampler->converged.samplerate = resampler->samplerate;
+      resampler->converged.ratio = dll->ratio;
+      resampler->converged.z1 = dll->z1;
+      resampler->converged.z2 = dll->z2;
+      resampler->converged.z3 = dll->z3;
+      seqlock_write_end (&resampler->converged_seq);
+
+      if (resampler->target_delay_policy == OW_TARGET_DELAY_AUTO)
+	{
+	  resampler_update_target_delay (resampler);
+	}
+    }
+
+  resampler_update_drift (resampler, ow_resampler_get_status (resampler));
+
   resampler->log_cycles++;
   if (resampler->log_cycles == resampler->log_control_cycles)
     {
@@ -492,13 +1543,19 @@ ow_err_t
 ow_resampler_init_from_device (struct ow_resampler **resampler_,
 			       struct ow_device *device,
 			       unsigned int blocks_per_transfer,
-			       unsigned int xfr_timeout, unsigned int quality)
+			       unsigned int xfr_queue_depth,
+			       unsigned int xfr_timeout, unsigned int quality,
+			       ow_resampler_backend_t backend,
+			       unsigned int threads,
+			       ow_dll_estimator_t estimator,
+			       struct ow_reactor *reactor)
 {
   struct ow_resampler *resampler = malloc (sizeof (struct ow_resampler));
   ow_err_t err = ow_engine_init_from_device (&resampler->engine,
 					     device,
 					     blocks_per_transfer,
-					     xfr_timeout);
+					     xfr_queue_depth,
+					     xfr_timeout, reactor);
   if (err)
     {
       free (resampler);
@@ -513,21 +1570,81 @@ ow_resampler_init_from_device (struct ow_resampler **resampler_,
   resampler->bufsize = 0;
   resampler->o2h_frame_size = device->desc.outputs * OW_BYTES_PER_SAMPLE;
   resampler->h2o_frame_size = device->desc.inputs * OW_BYTES_PER_SAMPLE;
-  resampler->h2o_aux = NULL;
+  resampler->h2o_queues[0] = NULL;
+  resampler->h2o_queues[1] = NULL;
+  resampler->h2o_queue_fill = 0;
+  resampler->h2o_buf_in = NULL;
+  resampler->h2o_buf_out = NULL;
+  resampler->h2o_max_frames = 0;
   resampler->status = OW_RESAMPLER_STATUS_STOP;
 
-  resampler->h2o_state = src_callback_new (resampler_h2o_reader, quality,
-					   device->desc.inputs, NULL,
-					   resampler);
-  resampler->o2h_state = src_callback_new (resampler_o2h_reader, quality,
-					   device->desc.outputs, NULL,
-					   resampler);
+  resampler->backend = backend;
+  resampler->quality = quality;
+  resampler->o2h_polyphase = NULL;
+  resampler->h2o_polyphase = NULL;
+  resampler->o2h_drift = NULL;
+  resampler->h2o_drift = NULL;
+  resampler->drift = 0;
+  resampler->drift_cycles = 0;
+  resampler->o2h_polyphase_out = NULL;
+  resampler->h2o_polyphase_in = NULL;
+  resampler->h2o_polyphase_out = NULL;
+  resampler->polyphase_samplerate = 0;
+  resampler->polyphase_bufsize = 0;
+
+  if (backend == OW_RESAMPLER_BACKEND_LIBSAMPLERATE)
+    {
+      resampler->h2o_state = src_callback_new (ow_resampler_h2o_reader,
+					       quality, device->desc.inputs,
+					       NULL, resampler);
+      resampler->o2h_state = src_callback_new (resampler_o2h_reader,
+					       quality, device->desc.outputs,
+					       NULL, resampler);
+    }
+  else
+    {
+      debug_print (1, "Using the polyphase resampler...");
+      resampler->h2o_state = NULL;
+      resampler->o2h_state = NULL;
+    }
+
+  for (int i = 0; i < device->desc.outputs; i++)
+    {
+      int err;
+      resampler->o2h_states[i] =
+	backend == OW_RESAMPLER_BACKEND_LIBSAMPLERATE ?
+	src_new (quality, 1, &err) : NULL;
+      resampler->o2h_planes[i] = NULL;
+      resampler->o2h_planes_active[i] = 0;
+    }
+  resampler->o2h_planes_pos = 0;
+  resampler->o2h_planes_len = 0;
+  resampler->o2h_buf_in = NULL;
+  resampler->o2h_read_frames = 0;
+
+  resampler->pool_threads = threads;
+  resampler->pool = NULL;
+
+  ow_calibration_get_id (resampler->engine, resampler->calibration_id);
+  resampler->calibrations_len = 0;
+  resampler->seeded = 0;
+  atomic_init (&resampler->converged_seq, 0);
+  resampler->converged.samplerate = 0;
+
+  resampler->target_delay_policy = OW_TARGET_DELAY_DEFAULT;
+  resampler->target_delay_value = 0;
+  resampler->o2h_underflows = 0;
+  atomic_init (&resampler->resync, 0);
+  resampler->o2h_pad_frames = 0;
+  resampler->resyncs = 0;
 
   resampler->reporter.callback = NULL;
   resampler->reporter.data = NULL;
   resampler->reporter.period = DEFAULT_REPORT_PERIOD;
 
-  ow_dll_host_init (&resampler->dll);
+  ow_dll_host_init (&resampler->dll, estimator);
+  debug_print (1, "Using %s clock estimator",
+	       ow_dll_estimator_name (estimator));
 
   return OW_OK;
 }
@@ -535,16 +1652,31 @@ ow_resampler_init_from_device (struct ow_resampler **resampler_,
 void
 ow_resampler_destroy (struct ow_resampler *resampler)
 {
-  src_delete (resampler->h2o_state);
-  src_delete (resampler->o2h_state);
+  if (resampler->backend == OW_RESAMPLER_BACKEND_LIBSAMPLERATE)
+    {
+      src_delete (resampler->h2o_state);
+      src_delete (resampler->o2h_state);
+      for (int i = 0; i < resampler->engine->device->desc.outputs; i++)
+	{
+	  src_delete (resampler->o2h_states[i]);
+	}
+    }
+  for (int i = 0; i < resampler->engine->device->desc.outputs; i++)
+    {
+      free (resampler->o2h_planes[i]);
+    }
+  resampler_free_polyphase (resampler);
+  if (resampler->pool)
+    {
+      ow_pool_destroy (resampler->pool);
+    }
   pthread_spin_destroy (&resampler->lock);
-  if (resampler->h2o_aux)
+  free (resampler->h2o_buf_out);
+  free (resampler->o2h_buf_in);
+  if (resampler->h2o_queues[0])
     {
-      free (resampler->h2o_aux);
-      free (resampler->h2o_buf_out);
-      free (resampler->h2o_buf_in);
-      free (resampler->h2o_queue);
-      free (resampler->o2h_buf_in);
+      free (resampler->h2o_queues[0]);
+      free (resampler->h2o_queues[1]);
       free (resampler->o2h_buf_out);
     }
   ow_engine_destroy (resampler->engine);
@@ -559,6 +1691,36 @@ ow_resampler_start (struct ow_resampler *resampler,
   context->dll_overbridge_init = ow_dll_overbridge_init;
   context->dll_overbridge_update = ow_dll_overbridge_update;
 
+  resampler->calibrations_len =
+    ow_calibration_load (resampler->calibration_id, resampler->calibrations,
+			 OW_CALIBRATION_MAX_SAMPLERATES);
+
+  //The workers run the same real time code than the audio thread.
+  if (resampler->pool_threads && !resampler->pool &&
+      resampler->backend == OW_RESAMPLER_BACKEND_LIBSAMPLERATE)
+    {
+      if (ow_pool_init (&resampler->pool, resampler->pool_threads))
+	{
+	  resampler->pool = NULL;
+	}
+      else
+	{
+	  for (int i = 0; i < resampler->pool->workers_len; i++)
+	    {
+	      pthread_t thread = resampler->pool->workers[i].thread;
+	      if (context->set_rt_priority)
+		{
+		  context->set_rt_priority (thread, context->priority);
+		}
+	      else
+		{
+		  ow_set_thread_rt_priority (thread, OW_DEFAULT_RT_PROPERTY);
+		}
+	    }
+	  resampler_set_pool_period (resampler);
+	}
+    }
+
   ow_resampler_set_status (resampler, OW_RESAMPLER_STATUS_READY);
 
   return ow_engine_start (resampler->engine, context);
@@ -568,6 +1730,7 @@ void
 ow_resampler_wait (struct ow_resampler *resampler)
 {
   ow_resampler_status_t status;
+  struct ow_calibration converged;
 
   ow_engine_wait (resampler->engine);
 
@@ -581,16 +1744,31 @@ ow_resampler_wait (struct ow_resampler *resampler)
     }
   ow_resampler_set_status (resampler, status);
 
+  resampler_load_converged (resampler, &converged);
+
+  if (status == OW_RESAMPLER_STATUS_STOP && converged.samplerate)
+    {
+      ow_calibration_save (resampler->calibration_id, &converged);
+    }
+
   ow_resampler_report_state (resampler);
 }
 
 inline void
 ow_resampler_reset_latencies (struct ow_resampler *resampler)
 {
-  pthread_spin_lock (&resampler->engine->lock);
-  resampler->engine->o2h_max_latency = 0;
-  resampler->engine->h2o_max_latency = 0;
-  pthread_spin_unlock (&resampler->engine->lock);
+  atomic_store_explicit (&resampler->engine->o2h_max_latency, 0,
+			 memory_order_relaxed);
+  atomic_store_explicit (&resampler->engine->h2o_max_latency, 0,
+			 memory_order_relaxed);
+}
+
+//This is called from the JACK notification thread so the buffers are
+//resynced by the process thread in the next cycle.
+void
+ow_resampler_resync (struct ow_resampler *resampler)
+{
+  atomic_store_explicit (&resampler->resync, 1, memory_order_relaxed);
 }
 
 inline struct ow_engine *
@@ -631,7 +1809,7 @@ ow_resampler_set_samplerate (struct ow_resampler *resampler,
   if (resampler->samplerate != samplerate)
     {
       debug_print (1, "Setting resampler sample rate to %d", samplerate);
-      if (resampler->h2o_aux)	//This means that ow_resampler_reset_buffers has been called and thus bufsize has been set.
+      if (resampler->h2o_queues[0])	//This means that ow_resampler_reset_buffers has been called and thus bufsize has been set.
 	{
 	  ow_resampler_reset_dll (resampler, samplerate);
 	}
@@ -691,13 +1869,18 @@ ow_resampler_get_h2o_latency (struct ow_resampler *resampler,
 			      uint32_t *h2o_min_latency,
 			      uint32_t *h2o_max_latency)
 {
-  pthread_spin_lock (&resampler->engine->lock);
-  *h2o_latency = resampler->engine->h2o_latency / resampler->h2o_frame_size;
-  *h2o_min_latency = MAX (resampler->engine->h2o_min_latency,
-			  resampler->h2o_bufsize) / resampler->h2o_frame_size;
-  *h2o_max_latency =
-    resampler->engine->h2o_max_latency / resampler->h2o_frame_size;
-  pthread_spin_unlock (&resampler->engine->lock);
+  struct ow_engine *engine = resampler->engine;
+  size_t min = atomic_load_explicit (&engine->h2o_min_latency,
+				     memory_order_relaxed);
+
+  *h2o_latency = atomic_load_explicit (&engine->h2o_latency,
+				       memory_order_relaxed) /
+    resampler->h2o_frame_size;
+  *h2o_min_latency = MAX (min, resampler->h2o_bufsize) /
+    resampler->h2o_frame_size;
+  *h2o_max_latency = atomic_load_explicit (&engine->h2o_max_latency,
+					   memory_order_relaxed) /
+    resampler->h2o_frame_size;
 }
 
 inline void
@@ -706,11 +1889,16 @@ ow_resampler_get_o2h_latency (struct ow_resampler *resampler,
 			      uint32_t *o2h_min_latency,
 			      uint32_t *o2h_max_latency)
 {
-  pthread_spin_lock (&resampler->engine->lock);
-  *o2h_latency = resampler->engine->o2h_latency / resampler->o2h_frame_size;
-  *o2h_min_latency = MAX (resampler->engine->o2h_min_latency,
-			  resampler->o2h_bufsize) / resampler->o2h_frame_size;
-  *o2h_max_latency =
-    resampler->engine->o2h_max_latency / resampler->o2h_frame_size;
-  pthread_spin_unlock (&resampler->engine->lock);
+  struct ow_engine *engine = resampler->engine;
+  size_t min = atomic_load_explicit (&engine->o2h_min_latency,
+				     memory_order_relaxed);
+
+  *o2h_latency = atomic_load_explicit (&engine->o2h_latency,
+				       memory_order_relaxed) /
+    resampler->o2h_frame_size;
+  *o2h_min_latency = MAX (min, resampler->o2h_bufsize) /
+    resampler->o2h_frame_size;
+  *o2h_max_latency = atomic_load_explicit (&engine->o2h_max_latency,
+					   memory_order_relaxed) /
+    resampler->o2h_frame_size;
 }
@@ -18,9 +18,19 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#pragma once
+
+#include <samplerate.h>
+#include "calibration.h"
 #include "dll.h"
 #include "engine.h"
 #include "overwitch.h"
+#include "polyphase.h"
+#include "pool.h"
+
+//libsamplerate takes the h2o input once its previous queue has been used,
+//which is about a cycle later. This is just a safety margin.
+#define H2O_QUEUE_CYCLES 4
 
 struct ow_resampler
 {
@@ -28,16 +38,78 @@ struct ow_resampler
   ow_resampler_status_t status;
   struct ow_engine *engine;
   struct ow_dll dll;		//The DLL is based on o2j data
+  //DLL states of previous runs. These are loaded when the resampler starts
+  //and the one for the current sample rate is used as the seed when the DLL
+  //is reset.
+  char calibration_id[OW_CALIBRATION_ID_MAX_LEN];
+  struct ow_calibration calibrations[OW_CALIBRATION_MAX_SAMPLERATES];
+  int calibrations_len;
+  struct ow_calibration seed;
+  int seeded;
+  //Last DLL state while running. It is written by the audio thread every
+  //cycle so it is published with a seqlock.
+  atomic_uint converged_seq;
+  struct ow_calibration converged;
+  //Target delay policy. In auto mode, the minimum of the frames available
+  //before reading is measured for a while and the target delay is lowered
+  //while it stays above the margin. Underflows raise it again.
+  ow_target_delay_policy_t target_delay_policy;
+  double target_delay_value;
+  int target_delay_min;
+  int target_delay_max;
+  long target_delay_window_frames;	//Host frames in the current window
+  int target_delay_windows;
+  double o2h_min_spare;		//Frames left after reading in the window
+  uint64_t o2h_underflows;
+  uint64_t target_delay_underflows;	//Underflows before the window
+  //After an xrun, the buffers are taken back to the target delay in the
+  //next cycle while running instead of rebooting.
+  atomic_int resync;
+  long o2h_pad_frames;		//Silence to read before the buffer
+  uint64_t resyncs;
   double o2h_ratio;
   double h2o_ratio;
   SRC_STATE *h2o_state;
   SRC_STATE *o2h_state;
-  float *h2o_buf_in;
+  float *h2o_buf_in;		//Tail of the queue being filled
   float *h2o_buf_out;
-  float *h2o_aux;
-  float *h2o_queue;
+  //Double buffered h2o queue. The host audio is written at the end of one
+  //of these while libsamplerate reads the other one so there are no copies.
+  float *h2o_queues[2];
+  int h2o_queue_fill;
+  size_t h2o_max_frames;	//h2o output of a cycle at the maximum ratio
   float *o2h_buf_in;
   float *o2h_buf_out;
+  //Planar o2h pipeline. There is a mono converter per track and the input
+  //frames are de-interleaved while being read from the buffer.
+  SRC_STATE *o2h_states[OB_MAX_TRACKS];
+  float *o2h_planes[OB_MAX_TRACKS];
+  int o2h_planes_active[OB_MAX_TRACKS];
+  size_t o2h_planes_pos;
+  size_t o2h_planes_len;
+  long o2h_read_frames;		//Maximum frames read at once
+  //Optional workers to split the o2h tracks among cores. The pool is
+  //created when the resampler starts.
+  unsigned int pool_threads;
+  struct ow_pool *pool;
+  //Polyphase backend. The converters depend on the sample rate and the
+  //buffer size so these are created when both are known.
+  ow_resampler_backend_t backend;
+  unsigned int quality;
+  struct ow_polyphase *o2h_polyphase;
+  struct ow_polyphase *h2o_polyphase;
+  //Drift-only mode. With JACK at 48 kHz, the ratio only compensates the
+  //clock drift so a short fractional delay filter is used while the ratio
+  //stays close to 1.
+  struct ow_polyphase *o2h_drift;
+  struct ow_polyphase *h2o_drift;
+  int drift;
+  int drift_cycles;
+  float *o2h_polyphase_out;	//Planar output for the interleaved API
+  float *h2o_polyphase_in;
+  float *h2o_polyphase_out;
+  uint32_t polyphase_samplerate;
+  uint32_t polyphase_bufsize;
   size_t h2o_queue_len;
   int log_control_cycles;
   int log_cycles;
@@ -55,3 +127,11 @@ struct ow_resampler
   double min_target_ratio;
   struct ow_resampler_reporter reporter;
 };
+
+//The libsamplerate callback that hands over the h2o queue being filled.
+long ow_resampler_h2o_reader (void *, float **);
+
+//Copy the given interleaved frames to the planes starting at the given
+//offset. Tracks with a NULL plane are skipped.
+void ow_resampler_deinterleave (const float *, int, size_t, float *[],
+				size_t);
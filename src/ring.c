@@ -0,0 +1,223 @@
+/*
+ *   ring.c
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+#include "ring.h"
+#include "utils.h"
+
+static size_t
+get_regions (struct ow_ring *ring, size_t pos, size_t frames,
+	     struct ow_buffer_region *regions)
+{
+  size_t start = pos & ring->mask;
+  size_t first = ring->frames - start;
+
+  first = frames < first ? frames : first;
+
+  regions[0].data = ring->data + start * ring->frame_size;
+  regions[0].len = first * ring->frame_size;
+  regions[1].data = ring->data;
+  regions[1].len = (frames - first) * ring->frame_size;
+
+  return frames * ring->frame_size;
+}
+
+struct ow_ring *
+ow_ring_create (size_t frames, size_t frame_size)
+{
+  struct ow_ring *ring;
+  size_t capacity = 1;
+
+  while (capacity < frames)
+    {
+      capacity <<= 1;
+    }
+
+  ring = aligned_alloc (OW_CACHE_LINE_SIZE, sizeof (struct ow_ring));
+  if (!ring)
+    {
+      return NULL;
+    }
+
+  ring->frames = capacity;
+  ring->mask = capacity - 1;
+  ring->frame_size = frame_size;
+  ring->size = capacity * frame_size;
+  atomic_init (&ring->head, 0);
+  atomic_init (&ring->tail, 0);
+
+  ring->data = malloc (ring->size);
+  if (!ring->data)
+    {
+      free (ring);
+      return NULL;
+    }
+  memset (ring->data, 0, ring->size);
+
+  ring->locked = mlock (ring->data, ring->size) == 0;
+  if (!ring->locked)
+    {
+      debug_print (1, "Could not lock ring memory");
+    }
+
+  debug_print (2, "Ring created (%zu frames of %zu B)", ring->frames,
+	       ring->frame_size);
+
+  return ring;
+}
+
+void
+ow_ring_destroy (struct ow_ring *ring)
+{
+  if (!ring)
+    {
+      return;
+    }
+  if (ring->locked)
+    {
+      munlock (ring->data, ring->size);
+    }
+  free (ring->data);
+  free (ring);
+}
+
+size_t
+ow_ring_get_frame_size (struct ow_ring *ring)
+{
+  return ring->frame_size;
+}
+
+//Consumer side
+
+size_t
+ow_ring_get_read_regions (void *data, struct ow_buffer_region *regions)
+{
+  struct ow_ring *ring = data;
+  size_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+  return get_regions (ring, tail, head - tail, regions);
+}
+
+void
+ow_ring_read_commit (void *data, size_t size)
+{
+  struct ow_ring *ring = data;
+  size_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+  atomic_store_explicit (&ring->tail, tail + size / ring->frame_size,
+			 memory_order_release);
+}
+
+size_t
+ow_ring_read_space (void *data)
+{
+  struct ow_ring *ring = data;
+  size_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+  return (head - tail) * ring->frame_size;
+}
+
+//If buf is NULL, the data is discarded.
+size_t
+ow_ring_read (void *data, char *buf, size_t size)
+{
+  struct ow_buffer_region regions[2];
+  struct ow_ring *ring = data;
+  size_t available = ow_ring_get_read_regions (ring, regions);
+
+  size = size < available ? size : available;
+  size -= size % ring->frame_size;
+
+  if (buf)
+    {
+      size_t first = size < regions[0].len ? size : regions[0].len;
+      memcpy (buf, regions[0].data, first);
+      memcpy (buf + first, regions[1].data, size - first);
+    }
+
+  ow_ring_read_commit (ring, size);
+
+  return size;
+}
+
+//Producer side
+
+size_t
+ow_ring_get_write_regions (void *data, struct ow_buffer_region *regions)
+{
+  struct ow_ring *ring = data;
+  size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+  return get_regions (ring, head, ring->frames - (head - tail), regions);
+}
+
+void
+ow_ring_write_commit (void *data, size_t size)
+{
+  struct ow_ring *ring = data;
+  size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  atomic_store_explicit (&ring->head, head + size / ring->frame_size,
+			 memory_order_release);
+}
+
+size_t
+ow_ring_write_space (void *data)
+{
+  struct ow_ring *ring = data;
+  size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+  return (ring->frames - (head - tail)) * ring->frame_size;
+}
+
+size_t
+ow_ring_write (void *data, const char *buf, size_t size)
+{
+  struct ow_buffer_region regions[2];
+  struct ow_ring *ring = data;
+  size_t available = ow_ring_get_write_regions (ring, regions);
+  size_t first;
+
+  size = size < available ? size : available;
+  size -= size % ring->frame_size;
+
+  first = size < regions[0].len ? size : regions[0].len;
+  memcpy (regions[0].data, buf, first);
+  memcpy (regions[1].data, buf + first, size - first);
+
+  ow_ring_write_commit (ring, size);
+
+  return size;
+}
+
+void
+ow_context_set_rings (struct ow_context *context, struct ow_ring *o2h,
+		      struct ow_ring *h2o)
+{
+  context->o2h_audio = o2h;
+  context->h2o_audio = h2o;
+  context->read_space = ow_ring_read_space;
+  context->write_space = ow_ring_write_space;
+  context->read = ow_ring_read;
+  context->write = ow_ring_write;
+  context->get_read_regions = ow_ring_get_read_regions;
+  context->read_commit = ow_ring_read_commit;
+  context->get_write_regions = ow_ring_get_write_regions;
+  context->write_commit = ow_ring_write_commit;
+}
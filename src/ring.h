@@ -0,0 +1,46 @@
+/*
+ *   ring.h
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include "overwitch.h"
+
+#define OW_CACHE_LINE_SIZE 64
+
+//Single producer and single consumer ring. Positions are frame counters
+//that are never wrapped and the capacity is a power of two, so the
+//positions inside the buffer are obtained with a mask. The head and the
+//tail are in different cache lines so that the producer and the consumer do
+//not invalidate each other lines.
+struct ow_ring
+{
+  //Written by the consumer
+  _Alignas (OW_CACHE_LINE_SIZE) atomic_size_t tail;
+  //Written by the producer
+  _Alignas (OW_CACHE_LINE_SIZE) atomic_size_t head;
+  //Read only
+  _Alignas (OW_CACHE_LINE_SIZE) char *data;
+  size_t frames;
+  size_t mask;
+  size_t frame_size;
+  size_t size;
+  int locked;
+};
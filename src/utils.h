@@ -23,25 +23,41 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include "../config.h"
 #include <json-glib/json-glib.h>
+#include "log.h"
 
 #define CONF_DIR "~/.config/" PACKAGE
 
 #define debug_print(level, format, ...) { \
   if (level <= debug_level) \
     { \
-      fprintf(stderr, "DEBUG:" __FILE__ ":%d:%s: " format "\n", __LINE__, __FUNCTION__, ## __VA_ARGS__); \
+      ow_log_print(0, "DEBUG:" __FILE__ ":%d:%s: " format, __LINE__, __FUNCTION__, ## __VA_ARGS__); \
     } \
 }
 
 #define error_print(format, ...) { \
-  int tty = isatty(fileno(stderr)); \
-  const char * color_start = tty ? "\x1b[31m" : ""; \
-  const char * color_end = tty ? "\x1b[m" : ""; \
-  fprintf(stderr, "%sERROR:" __FILE__ ":%d:%s: " format "%s\n", color_start, __LINE__, __FUNCTION__, ## __VA_ARGS__, color_end); \
+  ow_log_print(1, "ERROR:" __FILE__ ":%d:%s: " format, __LINE__, __FUNCTION__, ## __VA_ARGS__); \
 }
 
 extern int debug_level;
 
+//Single writer seqlock. The sequence is odd while writing so the readers
+//retry until they get the same even sequence before and after copying.
+static inline void
+seqlock_write_begin (atomic_uint *seq)
+{
+  unsigned int s = atomic_load_explicit (seq, memory_order_relaxed);
+  atomic_store_explicit (seq, s + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+}
+
+static inline void
+seqlock_write_end (atomic_uint *seq)
+{
+  unsigned int s = atomic_load_explicit (seq, memory_order_relaxed);
+  atomic_store_explicit (seq, s + 1, memory_order_release);
+}
+
 char *get_expanded_dir (const char *);
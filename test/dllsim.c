@@ -0,0 +1,626 @@
+/*
+ *   dllsim.c
+ *   Copyright (C) 2024 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Offline simulation of the clocks seen by the DLL. The device transfers and
+//the JACK cycles happen on their own synthetic clocks and these drive the
+//resampler exactly as the engine and the JACK client do, so the DLL and the
+//resampler states can be evaluated without any hardware. The simulation only
+//depends on the given seed.
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/common.h"
+#include "../src/resampler.h"
+#include "../src/ring.h"
+#include "../src/utils.h"
+
+//Any start time is valid but this one makes the 28 bits time used by the
+//DLL wrap after a few seconds.
+#define SIM_START_USECS ((1ULL << 28) - 3000000)
+#define SIM_TRACKS 1
+#define SIM_RING_FRAMES (OW_DEFAULT_RING_FRAMES * 2)
+
+typedef enum
+{
+  SIM_JITTER_UNIFORM,
+  SIM_JITTER_GAUSSIAN,
+  SIM_JITTER_EXPONENTIAL
+} sim_jitter_t;
+
+static const char *SIM_JITTER_NAMES[] = {
+  "uniform", "gaussian", "exponential"
+};
+
+struct sim_stats
+{
+  uint64_t n;
+  double sum;
+  double sum2;
+  double min;
+  double max;
+};
+
+struct sim
+{
+  uint32_t samplerate;
+  uint32_t bufsize;
+  uint32_t blocks;
+  double device_ppm;
+  double host_ppm;
+  double usb_jitter;		//us
+  double host_jitter;		//us
+  sim_jitter_t jitter;
+  ow_dll_estimator_t estimator;
+  ow_target_delay_policy_t target_delay_policy;
+  double target_delay_value;
+  double xruns;			//Per minute
+  double duration;		//s
+  double settle;		//s in RUN before measuring
+  uint64_t seed;
+  uint64_t rng;
+  struct ow_resampler *resampler;
+  int reading;
+  FILE *trace;
+  double tune_time;
+  double run_time;
+  uint64_t xrun_count;
+  uint64_t underflows;
+  uint64_t overflows;
+  struct sim_stats ratio_error;	//ppm
+  struct sim_stats dll_error;	//frames
+  struct sim_stats latency;	//frames
+};
+
+static struct option options[] = {
+  {"samplerate", 1, NULL, 's'},
+  {"buffer-size", 1, NULL, 'b'},
+  {"blocks-per-transfer", 1, NULL, 'B'},
+  {"device-ppm", 1, NULL, 'd'},
+  {"host-ppm", 1, NULL, 'H'},
+  {"usb-jitter", 1, NULL, 'j'},
+  {"host-jitter", 1, NULL, 'J'},
+  {"jitter-distribution", 1, NULL, 'D'},
+  {"dll-estimator", 1, NULL, 'e'},
+  {"target-delay", 1, NULL, 'y'},
+  {"xruns-per-minute", 1, NULL, 'x'},
+  {"duration", 1, NULL, 't'},
+  {"settle-time", 1, NULL, 'T'},
+  {"seed", 1, NULL, 'S'},
+  {"trace", 1, NULL, 'o'},
+  {"verbose", 0, NULL, 'v'},
+  {"help", 0, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+//xorshift64* so that the results are the same everywhere.
+static double
+sim_random (struct sim *sim)
+{
+  sim->rng ^= sim->rng >> 12;
+  sim->rng ^= sim->rng << 25;
+  sim->rng ^= sim->rng >> 27;
+  return ((sim->rng * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+//The USB transfers can only complete late so their jitter is always
+//positive while the JACK cycle times are estimations and can be off in both
+//directions.
+static double
+sim_jitter (struct sim *sim, double scale, int symmetric)
+{
+  double u, v;
+
+  if (scale <= 0.0)
+    {
+      return 0.0;
+    }
+
+  switch (sim->jitter)
+    {
+    case SIM_JITTER_GAUSSIAN:
+      u = 1.0 - sim_random (sim);
+      v = sim_random (sim);
+      v = scale * sqrt (-2.0 * log (u)) * cos (2.0 * M_PI * v);
+      return symmetric ? v : fabs (v);
+    case SIM_JITTER_EXPONENTIAL:
+      v = -scale * log (1.0 - sim_random (sim));
+      return symmetric && sim_random (sim) < 0.5 ? -v : v;
+    default:
+      v = sim_random (sim);
+      return symmetric ? scale * (v - 0.5) : scale * v;
+    }
+}
+
+static void
+sim_stats_add (struct sim_stats *stats, double v)
+{
+  if (!stats->n)
+    {
+      stats->min = v;
+      stats->max = v;
+    }
+  stats->n++;
+  stats->sum += v;
+  stats->sum2 += v * v;
+  stats->min = v < stats->min ? v : stats->min;
+  stats->max = v > stats->max ? v : stats->max;
+}
+
+static double
+sim_stats_mean (struct sim_stats *stats)
+{
+  return stats->n ? stats->sum / stats->n : 0.0;
+}
+
+static double
+sim_stats_stddev (struct sim_stats *stats)
+{
+  double mean = sim_stats_mean (stats);
+  double var = stats->n ? stats->sum2 / stats->n - mean * mean : 0.0;
+  return var > 0.0 ? sqrt (var) : 0.0;
+}
+
+static double
+sim_stats_rms (struct sim_stats *stats)
+{
+  return stats->n ? sqrt (stats->sum2 / stats->n) : 0.0;
+}
+
+//Only one simulation runs at a time.
+static struct sim *sim_current;
+
+//The underflows are counted when the resampler reads from an empty buffer.
+static size_t
+sim_read_space (void *data)
+{
+  size_t rs = ow_ring_read_space (data);
+  struct ow_resampler *resampler = sim_current->resampler;
+
+  if (sim_current->reading && resampler->reading_at_o2h_end &&
+      rs < resampler->o2h_frame_size)
+    {
+      sim_current->underflows++;
+    }
+
+  return rs;
+}
+
+static void
+sim_running (void *data)
+{
+  debug_print (1, "Audio running");
+}
+
+static struct ow_resampler *
+sim_resampler_new (struct sim *sim, struct ow_context *context)
+{
+  struct ow_resampler *resampler = calloc (1, sizeof (struct ow_resampler));
+  struct ow_engine *engine = calloc (1, sizeof (struct ow_engine));
+  struct ow_device *device = calloc (1, sizeof (struct ow_device));
+
+  //The polyphase backend is used as it is created with the DLL.
+  memset (context, 0, sizeof (struct ow_context));
+  device->desc.outputs = SIM_TRACKS;
+  device->desc.inputs = 2;
+  snprintf (engine->name, OW_ENGINE_NAME_MAX_LEN, "dllsim");
+  snprintf (engine->overbridge_name, OB_NAME_MAX_LEN, "Simulation");
+  engine->device = device;
+  engine->context = context;
+  engine->frames_per_transfer = OB_FRAMES_PER_BLOCK * sim->blocks;
+  ow_engine_set_status (engine, OW_ENGINE_STATUS_READY);
+  resampler->engine = engine;
+  resampler->backend = OW_RESAMPLER_BACKEND_POLYPHASE;
+  resampler->quality = 4;
+  resampler->o2h_frame_size = SIM_TRACKS * OW_BYTES_PER_SAMPLE;
+  resampler->h2o_frame_size = 2 * OW_BYTES_PER_SAMPLE;
+  resampler->reporter.period = 1;
+  pthread_spin_init (&resampler->lock, PTHREAD_PROCESS_PRIVATE);
+  ow_dll_host_init (&resampler->dll, sim->estimator);
+
+  ow_context_set_rings (context,
+			ow_ring_create (SIM_RING_FRAMES,
+					resampler->o2h_frame_size),
+			ow_ring_create (SIM_RING_FRAMES,
+					resampler->h2o_frame_size));
+  context->read_space = sim_read_space;
+  context->o2h_disabled_tracks = 0;
+  context->dll = &resampler->dll;
+
+  //Same order than JACK when the client is activated.
+  ow_resampler_set_target_delay (resampler, sim->target_delay_policy,
+				 sim->target_delay_value);
+  ow_resampler_set_samplerate (resampler, sim->samplerate);
+  ow_resampler_set_buffer_size (resampler, sim->bufsize);
+
+  return resampler;
+}
+
+static void
+sim_resampler_free (struct ow_resampler *resampler)
+{
+  struct ow_context *context = resampler->engine->context;
+
+  ow_ring_destroy (context->o2h_audio);
+  ow_ring_destroy (context->h2o_audio);
+  free (resampler->engine->device);
+  free (resampler->engine);
+  free (resampler);
+}
+
+static uint64_t
+sim_usecs (double t)
+{
+  return t < 0.0 ? 0 : (uint64_t) llround (t);
+}
+
+//A USB transfer has been completed. The engine only moves audio once the
+//resampler is running.
+static void
+sim_device_cycle (struct sim *sim, struct ow_resampler *resampler,
+		  double t, const char *frames)
+{
+  struct ow_engine *engine = resampler->engine;
+  struct ow_context *context = engine->context;
+  size_t bytes = engine->frames_per_transfer * resampler->o2h_frame_size;
+
+  ow_dll_overbridge_update (&resampler->dll, engine->frames_per_transfer,
+			    sim_usecs (t));
+
+  if (ow_engine_get_status (engine) < OW_ENGINE_STATUS_RUN)
+    {
+      return;
+    }
+
+  if (context->write_space (context->o2h_audio) >= bytes)
+    {
+      context->write (context->o2h_audio, frames, bytes);
+    }
+  else
+    {
+      sim->overflows++;
+    }
+}
+
+static int
+sim_host_cycle (struct sim *sim, struct ow_resampler *resampler,
+		double t, double elapsed, double true_ratio, float *buffers[])
+{
+  size_t frames;
+  int settled;
+  ow_resampler_status_t status;
+  struct ow_context *context = resampler->engine->context;
+
+  if (ow_resampler_compute_ratios (resampler, sim_usecs (t), sim_running,
+				   sim))
+    {
+      return 0;
+    }
+
+  status = ow_resampler_get_status (resampler);
+  if (status == OW_RESAMPLER_STATUS_ERROR)
+    {
+      return 1;
+    }
+
+  if (status >= OW_RESAMPLER_STATUS_TUNE && sim->tune_time < 0.0)
+    {
+      sim->tune_time = elapsed;
+    }
+  if (status == OW_RESAMPLER_STATUS_RUN && sim->run_time < 0.0)
+    {
+      sim->run_time = elapsed;
+    }
+
+  frames = context->read_space (context->o2h_audio) /
+    resampler->o2h_frame_size;
+
+  if (sim->trace)
+    {
+      fprintf (sim->trace, "%.6f,%d,%.9f,%.3f,%zu\n", elapsed, status,
+	       resampler->dll.ratio, resampler->dll.err, frames);
+    }
+
+  settled = status == OW_RESAMPLER_STATUS_RUN &&
+    elapsed - sim->run_time >= sim->settle;
+
+  if (settled)
+    {
+      sim_stats_add (&sim->ratio_error,
+		     (resampler->dll.ratio / true_ratio - 1.0) * 1e6);
+      sim_stats_add (&sim->dll_error, resampler->dll.err);
+
+      if (resampler->reading_at_o2h_end)
+	{
+	  sim_stats_add (&sim->latency, frames);
+	}
+    }
+
+  sim->reading = settled;
+  ow_resampler_read_audio_planar (resampler, buffers);
+  sim->reading = 0;
+
+  return 0;
+}
+
+static int
+sim_run (struct sim *sim)
+{
+  int err = 0;
+  uint64_t dev_cycle = 0, host_cycle = 0;
+  double dev_period, host_period, true_ratio, t_dev, t_host, next, elapsed;
+  double xrun_prob;
+  char *frames;
+  float *buffers[SIM_TRACKS];
+  struct ow_context context;
+  struct ow_resampler *resampler;
+  uint32_t frames_per_transfer;
+
+  sim_current = sim;
+  resampler = sim_resampler_new (sim, &context);
+  sim->resampler = resampler;
+  frames_per_transfer = resampler->engine->frames_per_transfer;
+
+  //Periods in us of the system clock.
+  dev_period = 1e6 * frames_per_transfer /
+    (OB_SAMPLE_RATE * (1.0 + sim->device_ppm * 1e-6));
+  host_period = 1e6 * sim->bufsize /
+    (sim->samplerate * (1.0 + sim->host_ppm * 1e-6));
+  true_ratio = dev_period / frames_per_transfer * sim->bufsize / host_period;
+  xrun_prob = sim->xruns * host_period / 60e6;
+
+  frames = calloc (frames_per_transfer, resampler->o2h_frame_size);
+  buffers[0] = malloc (sim->bufsize * sizeof (float));
+
+  sim->tune_time = -1.0;
+  sim->run_time = -1.0;
+
+  //Same than ow_engine_boot and ow_engine_enter_run.
+  ow_dll_overbridge_init (&resampler->dll, OB_SAMPLE_RATE,
+			  frames_per_transfer);
+  ow_dll_overbridge_update (&resampler->dll, frames_per_transfer,
+			    SIM_START_USECS);
+  ow_engine_set_status (resampler->engine, OW_ENGINE_STATUS_WAIT);
+
+  t_dev = SIM_START_USECS + dev_period +
+    sim_jitter (sim, sim->usb_jitter, 0);
+  t_host = SIM_START_USECS + host_period * sim_random (sim);
+
+  while (1)
+    {
+      if (t_dev <= t_host)
+	{
+	  sim_device_cycle (sim, resampler, t_dev, frames);
+	  dev_cycle++;
+	  //Completions keep their order.
+	  next = SIM_START_USECS + (dev_cycle + 1) * dev_period +
+	    sim_jitter (sim, sim->usb_jitter, 0);
+	  t_dev = next > t_dev ? next : t_dev;
+	  continue;
+	}
+
+      elapsed = (t_host - SIM_START_USECS) * 1e-6;
+      if (elapsed > sim->duration)
+	{
+	  break;
+	}
+
+      if (sim_random (sim) < xrun_prob)
+	{
+	  debug_print (1, "Simulating xrun at %.3f s", elapsed);
+	  sim->xrun_count++;
+	  ow_resampler_reset_latencies (resampler);
+	  ow_resampler_resync (resampler);
+	}
+      else if (sim_host_cycle (sim, resampler,
+			       t_host + sim_jitter (sim, sim->host_jitter, 1),
+			       elapsed, true_ratio, buffers))
+	{
+	  error_print ("Resampler error at %.3f s", elapsed);
+	  err = 1;
+	  break;
+	}
+
+      host_cycle++;
+      t_host = SIM_START_USECS + host_cycle * host_period;
+    }
+
+  printf ("Device clock: %+.1f ppm; host clock: %+.1f ppm; ratio: %.9f\n",
+	  sim->device_ppm, sim->host_ppm, true_ratio);
+  printf ("Jitter (%s): USB %.1f us; host %.1f us; xruns: %" PRIu64 "\n",
+	  SIM_JITTER_NAMES[sim->jitter], sim->usb_jitter, sim->host_jitter,
+	  sim->xrun_count);
+  printf ("Estimator: %s\n", ow_dll_estimator_name (sim->estimator));
+  printf ("Target delay: %d frames (%.3f ms)\n",
+	  resampler->dll.target_delay,
+	  ow_resampler_get_target_delay_ms (resampler));
+
+  if (sim->run_time < 0.0)
+    {
+      printf ("Not locked after %.3f s\n", sim->duration);
+      err = 1;
+      goto cleanup;
+    }
+
+  printf ("Tune time: %.3f s; lock time: %.3f s\n", sim->tune_time,
+	  sim->run_time);
+  printf ("Ratio error: mean %+.3f ppm; RMS %.3f ppm; range [%+.3f, %+.3f]\n",
+	  sim_stats_mean (&sim->ratio_error), sim_stats_rms (&sim->ratio_error),
+	  sim->ratio_error.min, sim->ratio_error.max);
+  printf ("DLL error: mean %+.3f frames; stddev %.3f frames\n",
+	  sim_stats_mean (&sim->dll_error),
+	  sim_stats_stddev (&sim->dll_error));
+  printf
+    ("Latency: mean %.1f frames (%.3f ms); stddev %.3f frames; range [%.0f, %.0f]\n",
+     sim_stats_mean (&sim->latency),
+     sim_stats_mean (&sim->latency) * 1000.0 / OB_SAMPLE_RATE,
+     sim_stats_stddev (&sim->latency), sim->latency.min, sim->latency.max);
+  printf ("Underflows: %" PRIu64 "; overflows: %" PRIu64 "\n",
+	  sim->underflows, sim->overflows);
+
+cleanup:
+  free (frames);
+  free (buffers[0]);
+  sim_resampler_free (resampler);
+  return err;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int opt;
+  int long_index = 0;
+  int vflg = 0, errflg = 0;
+  char *trace = NULL;
+  struct sim sim;
+
+  memset (&sim, 0, sizeof (sim));
+  sim.samplerate = 48000;
+  sim.bufsize = 256;
+  sim.blocks = 24;
+  sim.device_ppm = 30.0;
+  sim.host_ppm = -20.0;
+  sim.usb_jitter = 250.0;
+  sim.host_jitter = 10.0;
+  sim.jitter = SIM_JITTER_GAUSSIAN;
+  sim.duration = 60.0;
+  sim.settle = 5.0;
+  sim.seed = 1;
+
+  while ((opt = getopt_long (argc, argv, "s:b:B:d:H:j:J:D:e:y:x:t:T:S:o:vh",
+			     options, &long_index)) != -1)
+    {
+      switch (opt)
+	{
+	case 's':
+	  sim.samplerate = atoi (optarg);
+	  break;
+	case 'b':
+	  sim.bufsize = atoi (optarg);
+	  break;
+	case 'B':
+	  sim.blocks = atoi (optarg);
+	  break;
+	case 'd':
+	  sim.device_ppm = atof (optarg);
+	  break;
+	case 'H':
+	  sim.host_ppm = atof (optarg);
+	  break;
+	case 'j':
+	  sim.usb_jitter = atof (optarg);
+	  break;
+	case 'J':
+	  sim.host_jitter = atof (optarg);
+	  break;
+	case 'D':
+	  errflg++;
+	  for (int i = 0; i <= SIM_JITTER_EXPONENTIAL; i++)
+	    {
+	      if (!strcmp (optarg, SIM_JITTER_NAMES[i]))
+		{
+		  sim.jitter = i;
+		  errflg--;
+		}
+	    }
+	  break;
+	case 'e':
+	  errflg++;
+	  for (int i = 0; i <= OW_DLL_ESTIMATOR_KALMAN; i++)
+	    {
+	      if (!strcmp (optarg, ow_dll_estimator_name (i)))
+		{
+		  sim.estimator = i;
+		  errflg--;
+		}
+	    }
+	  break;
+	case 'y':
+	  if (get_ow_target_delay_argument (optarg, &sim.target_delay_policy,
+					    &sim.target_delay_value))
+	    {
+	      errflg++;
+	    }
+	  break;
+	case 'x':
+	  sim.xruns = atof (optarg);
+	  break;
+	case 't':
+	  sim.duration = atof (optarg);
+	  break;
+	case 'T':
+	  sim.settle = atof (optarg);
+	  break;
+	case 'S':
+	  sim.seed = strtoull (optarg, NULL, 10);
+	  break;
+	case 'o':
+	  trace = optarg;
+	  break;
+	case 'v':
+	  vflg++;
+	  break;
+	case 'h':
+	  print_help (argv[0], PACKAGE_STRING, options, NULL);
+	  return EXIT_SUCCESS;
+	case '?':
+	  errflg++;
+	}
+    }
+
+  if (!sim.samplerate || !sim.bufsize || !sim.blocks || sim.duration <= 0.0)
+    {
+      errflg++;
+    }
+
+  if (errflg)
+    {
+      print_help (argv[0], PACKAGE_STRING, options, NULL);
+      return EXIT_FAILURE;
+    }
+
+  debug_level = vflg;
+
+  //Zero is not a valid state for xorshift.
+  sim.rng = sim.seed ? sim.seed : 1;
+
+  if (trace)
+    {
+      sim.trace = fopen (trace, "w");
+      if (!sim.trace)
+	{
+	  error_print ("Could not open '%s'", trace);
+	  return EXIT_FAILURE;
+	}
+      fprintf (sim.trace, "time,status,ratio,error,latency\n");
+    }
+
+  opt = sim_run (&sim);
+
+  if (sim.trace)
+    {
+      fclose (sim.trace);
+    }
+
+  return opt ? EXIT_FAILURE : EXIT_SUCCESS;
+}
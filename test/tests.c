@@ -1,13 +1,23 @@
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <inttypes.h>
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
 #include "../src/jclient.h"
 #include "../src/engine.h"
+#include "../src/dll.h"
+#include "../src/ring.h"
+#include "../src/reactor.h"
+#include "../src/resampler.h"
+#include "../src/polyphase.h"
+#include "../src/pool.h"
+#include "../src/calibration.h"
 #include "../src/common.h"
 #include "../src/message.h"
 
 #define BLOCKS 4
+#define XFR_QUEUE_DEPTH 2
 #define TRACKS 6
 #define NFRAMES 64
 
@@ -51,6 +61,26 @@ static const struct ow_device_desc TESTDEV_DESC_T3 = {
 		    {.name = "T6",.size = 3}},
 };
 
+static const struct ow_device_desc TESTDEV_DESC_T1 = {
+  .pid = 0,
+  .type = OW_DEVICE_TYPE_1,
+  .name = "Test Device Type 1",
+  .inputs = TRACKS,
+  .outputs = TRACKS,
+  .input_tracks = {{.name = "T1",.size = 2},
+		   {.name = "T2",.size = 2},
+		   {.name = "T3",.size = 2},
+		   {.name = "T4",.size = 2},
+		   {.name = "T5",.size = 2},
+		   {.name = "T6",.size = 2}},
+  .output_tracks = {{.name = "T1",.size = 2},
+		    {.name = "T2",.size = 2},
+		    {.name = "T3",.size = 2},
+		    {.name = "T4",.size = 2},
+		    {.name = "T5",.size = 2},
+		    {.name = "T6",.size = 2}},
+};
+
 static const struct ow_device_desc TESTDEV_DESC_SIZE = {
   .pid = 0,
   .type = OW_DEVICE_TYPE_1,
@@ -141,7 +171,7 @@ test_sizes ()
   ow_copy_device_desc (&engine.device->desc, &TESTDEV_DESC_SIZE);
   engine.usb.audio_in_blk_len = 0;
   engine.usb.audio_out_blk_len = 0;
-  ow_engine_init_mem (&engine, BLOCKS);
+  ow_engine_init_mem (&engine, BLOCKS, XFR_QUEUE_DEPTH);
 
   printf ("\n");
 
@@ -161,6 +191,21 @@ test_sizes ()
   CU_ASSERT_EQUAL (engine.h2o_transfer_size,
 		   BLOCKS * OB_FRAMES_PER_BLOCK * 2 * OW_BYTES_PER_SAMPLE);
 
+  CU_ASSERT_EQUAL (engine.usb.xfr_queue_depth, XFR_QUEUE_DEPTH);
+  CU_ASSERT_EQUAL (engine.usb.xfrs_in_flight, 0);
+  CU_ASSERT_PTR_EQUAL (engine.usb.xfr_audio_in_data,
+		       engine.usb.xfr_audio_in_ring);
+  CU_ASSERT_PTR_EQUAL (engine.usb.xfr_audio_out_data,
+		       engine.usb.xfr_audio_out_ring);
+
+  for (int i = 0; i < BLOCKS * XFR_QUEUE_DEPTH; i++)
+    {
+      struct ow_engine_usb_blk *blk =
+	GET_NTH_USB_BLK (engine.usb.xfr_audio_out_ring,
+			 engine.usb.audio_out_blk_len, i);
+      CU_ASSERT_EQUAL (0x7ff, be16toh (blk->header));
+    }
+
   ow_engine_free_mem (&engine);
 }
 
@@ -184,7 +229,7 @@ test_usb_blocks (const struct ow_device_desc *device_desc, float max_error)
   ow_copy_device_desc (&engine.device->desc, device_desc);
   engine.usb.audio_in_blk_len = 0;
   engine.usb.audio_out_blk_len = 0;
-  ow_engine_init_mem (&engine, BLOCKS);
+  ow_engine_init_mem (&engine, BLOCKS, XFR_QUEUE_DEPTH);
 
   CU_ASSERT_EQUAL (engine.usb.audio_out_blk_len, blk_size);
   CU_ASSERT_EQUAL (engine.usb.audio_in_blk_len, blk_size);
@@ -253,175 +298,2230 @@ test_usb_blocks_t2 ()
 }
 
 static void
-test_jack_buffers ()
+test_usb_blocks_16 ()
+{
+  test_usb_blocks (&TESTDEV_DESC_T1, 1e-4);
+}
+
+//A ramp stretched to a transfer is still a ramp from the first to the last
+//frame.
+static void
+test_engine_conceal_h2o ()
 {
-  jack_default_audio_sample_t *jack_input[TRACKS];
-  jack_default_audio_sample_t *jack_output[TRACKS];
-  float input[TRACKS * NFRAMES];
-  float output[TRACKS * NFRAMES];
   struct ow_engine engine;
+  struct ow_engine_stats stats;
+  int frames = 10, channels;
+  float *f, expected;
 
   printf ("\n");
 
+  memset (&engine, 0, sizeof (engine));
   engine.device = malloc (sizeof (struct ow_device));
   ow_copy_device_desc (&engine.device->desc, &TESTDEV_DESC_T2);
+  ow_engine_init_mem (&engine, BLOCKS, XFR_QUEUE_DEPTH);
+  channels = engine.device->desc.inputs;
 
-  for (int i = 0; i < TRACKS; i++)
+  for (int i = 0; i < frames; i++)
     {
-      jack_input[i] = malloc (sizeof (jack_default_audio_sample_t) * NFRAMES);
-      jack_output[i] =
-	malloc (sizeof (jack_default_audio_sample_t) * NFRAMES);
-      for (int j = 0; j < NFRAMES; j++)
+      for (int j = 0; j < channels; j++)
 	{
-	  jack_input[i][j] = 1e-8 * (i + 1) * (j + 1);
+	  engine.h2o_conceal_buf[i * channels + j] = (j + 1) * i;
 	}
     }
 
-  jclient_copy_j2o_audio (output, NFRAMES, jack_input, &engine.device->desc);
-
-  memcpy (input, output,
-	  TRACKS * NFRAMES * sizeof (jack_default_audio_sample_t));
+  ow_engine_conceal_h2o (&engine, frames);
 
-  jclient_copy_o2j_audio (input, NFRAMES, jack_output, &engine.device->desc);
-
-  for (int i = 0; i < TRACKS; i++)
+  f = engine.h2o_transfer_buf;
+  for (int i = 0; i < engine.frames_per_transfer; i++)
     {
-      for (int j = 0; j < NFRAMES; j++)
+      for (int j = 0; j < channels; j++, f++)
 	{
-	  printf ("%.10f =?= %.10f\n", jack_output[i][j], jack_input[i][j]);
-	  CU_ASSERT_EQUAL (jack_output[i][j], jack_input[i][j]);
+	  expected = (j + 1) * i * (frames - 1.0) /
+	    (engine.frames_per_transfer - 1);
+	  CU_ASSERT_DOUBLE_EQUAL (*f, expected, 1e-4);
 	}
+    }
 
-      free (jack_input[i]);
-      free (jack_output[i]);
+  ow_engine_conceal_h2o (&engine, 0);
+
+  f = engine.h2o_transfer_buf;
+  for (int i = 0; i < engine.frames_per_transfer * channels; i++, f++)
+    {
+      CU_ASSERT_EQUAL (*f, 0);
     }
 
+  ow_engine_get_stats (&engine, &stats);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_H2O_UNDERFLOWS], 2);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_H2O_CONCEALED_FRAMES],
+		   2 * engine.frames_per_transfer - frames);
+
+  ow_engine_free_mem (&engine);
   free (engine.device);
 }
 
 static void
-test_get_bus_address_from_str ()
+set_usb_input_frames (struct ow_engine *engine, uint16_t frames)
 {
-  uint8_t bus, address;
+  for (int i = 0; i < engine->blocks_per_transfer; i++)
+    {
+      struct ow_engine_usb_blk *blk = GET_NTH_INPUT_USB_BLK (engine, i);
+      blk->frames = htobe16 (frames);
+      frames += OB_FRAMES_PER_BLOCK;
+    }
+}
+
+static void
+test_engine_stats ()
+{
+  struct ow_engine engine;
+  struct ow_engine_stats stats;
+  uint16_t frames = 0xffff - OB_FRAMES_PER_BLOCK;	//Wraps around
 
   printf ("\n");
 
-  CU_ASSERT_EQUAL (get_bus_address_from_str ("a", &bus, &address), -EINVAL);
-  CU_ASSERT_EQUAL (get_bus_address_from_str ("a,", &bus, &address), -EINVAL);
-  CU_ASSERT_EQUAL (get_bus_address_from_str ("a,b", &bus, &address), -EINVAL);
-  CU_ASSERT_EQUAL (get_bus_address_from_str ("1,b", &bus, &address), -EINVAL);
-  CU_ASSERT_EQUAL (get_bus_address_from_str ("a,2", &bus, &address), -EINVAL);
-  CU_ASSERT_EQUAL (get_bus_address_from_str ("1,2", &bus, &address), 0);
-  CU_ASSERT_EQUAL (bus, 1);
-  CU_ASSERT_EQUAL (address, 2);
+  memset (&engine, 0, sizeof (engine));
+  engine.device = malloc (sizeof (struct ow_device));
+  ow_copy_device_desc (&engine.device->desc, &TESTDEV_DESC_T2);
+  ow_engine_init_mem (&engine, BLOCKS, XFR_QUEUE_DEPTH);
+
+  for (int i = 0; i < OW_ENGINE_STATS; i++)
+    {
+      CU_ASSERT_PTR_NOT_NULL (ow_engine_get_stat_name (i));
+    }
+  CU_ASSERT_PTR_NULL (ow_engine_get_stat_name (OW_ENGINE_STATS));
+
+  set_usb_input_frames (&engine, frames);
+  CU_ASSERT_EQUAL (ow_engine_check_usb_input_frames (&engine), 0);
+
+  frames += BLOCKS * OB_FRAMES_PER_BLOCK;
+  set_usb_input_frames (&engine, frames);
+  CU_ASSERT_EQUAL (ow_engine_check_usb_input_frames (&engine), 0);
+
+  //A lost transfer
+  frames += 2 * BLOCKS * OB_FRAMES_PER_BLOCK;
+  set_usb_input_frames (&engine, frames);
+  CU_ASSERT_EQUAL (ow_engine_check_usb_input_frames (&engine),
+		   engine.frames_per_transfer);
+
+  //A repeated transfer
+  set_usb_input_frames (&engine, frames);
+  CU_ASSERT_EQUAL (ow_engine_check_usb_input_frames (&engine), 0);
+
+  //Jumps too large to be filled, the second one wrapping around
+  frames += 0x4000;
+  set_usb_input_frames (&engine, frames);
+  CU_ASSERT_EQUAL (ow_engine_check_usb_input_frames (&engine), 0);
+
+  frames += 0xc000;
+  set_usb_input_frames (&engine, frames);
+  CU_ASSERT_EQUAL (ow_engine_check_usb_input_frames (&engine), 0);
+
+  ow_engine_get_stats (&engine, &stats);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_O2H_GAPS], 3);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_O2H_REPEATS], 1);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_O2H_TRANSFERS], 0);
+
+  ow_engine_free_mem (&engine);
+  free (engine.device);
 }
 
 static void
-test_state_parser ()
+test_engine_incomplete_transfer ()
 {
-  char *message;
-  guint devices;
-  OverwitchDevice *device;
-  guint32 samplerate, buffer_size;
-  double target_delay_ms;
-  JsonReader *reader;
-  JsonBuilder *builder;
   struct ow_engine engine;
-  struct ow_resampler_state state;
+  struct ow_context context;
+  struct ow_engine_stats stats;
+  struct libusb_transfer xfr;
+  uint16_t frames = 0;
+
+  printf ("\n");
 
+  memset (&engine, 0, sizeof (engine));
+  memset (&context, 0, sizeof (context));
   engine.device = malloc (sizeof (struct ow_device));
   ow_copy_device_desc (&engine.device->desc, &TESTDEV_DESC_T2);
+  ow_engine_init_mem (&engine, BLOCKS, XFR_QUEUE_DEPTH);
+  engine.context = &context;
 
-  builder = message_state_builder_start ();
+  xfr.status = LIBUSB_TRANSFER_COMPLETED;
+  xfr.length = engine.usb.xfr_audio_in_data_len;
 
-  state.latency_o2h = 2;
-  state.latency_o2h_max = 3;
-  state.latency_o2h_min = 1;
-  state.latency_h2o = 2;
-  state.latency_h2o_max = 3;
-  state.latency_h2o_min = 1;
-  state.ratio_o2h = 0.9;
-  state.ratio_h2o = 1.0 / 0.9;
-  state.status = OW_RESAMPLER_STATUS_RUN;
+  //Every buffer of the ring is used once.
+  for (int i = 0; i < XFR_QUEUE_DEPTH; i++)
+    {
+      xfr.buffer = engine.usb.xfr_audio_in_ring +
+	i * engine.usb.xfr_audio_in_data_len;
+      xfr.actual_length = xfr.length;
+      engine.usb.xfr_audio_in_data = xfr.buffer;
+      set_usb_input_frames (&engine, frames);
+      ow_engine_process_usb_input (&engine, &xfr);
+      frames += BLOCKS * OB_FRAMES_PER_BLOCK;
+    }
 
-  message_state_builder_add_device (builder, 0, "name 1", engine.device,
-				    &state);
-  message_state_builder_add_device (builder, 1, "name 2", engine.device,
-				    &state);
-  message = message_state_builder_end (builder, 1, 2, 3);
+  //Only 2 blocks are received over the stale ones of the first buffer.
+  xfr.buffer = engine.usb.xfr_audio_in_ring;
+  xfr.actual_length = 2 * engine.usb.audio_in_blk_len;
+  engine.usb.xfr_audio_in_data = xfr.buffer;
+  GET_NTH_INPUT_USB_BLK (&engine, 0)->frames = htobe16 (frames);
+  GET_NTH_INPUT_USB_BLK (&engine, 1)->frames =
+    htobe16 (frames + OB_FRAMES_PER_BLOCK);
+  ow_engine_process_usb_input (&engine, &xfr);
+  frames += 2 * OB_FRAMES_PER_BLOCK;
+
+  xfr.buffer = engine.usb.xfr_audio_in_ring +
+    engine.usb.xfr_audio_in_data_len;
+  xfr.actual_length = xfr.length;
+  engine.usb.xfr_audio_in_data = xfr.buffer;
+  set_usb_input_frames (&engine, frames);
+  ow_engine_process_usb_input (&engine, &xfr);
+
+  ow_engine_get_stats (&engine, &stats);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_O2H_INCOMPLETE], 1);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_O2H_REPEATS], 0);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_O2H_GAPS], 1);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_O2H_TRANSFERS],
+		   XFR_QUEUE_DEPTH + 2);
+
+  ow_engine_free_mem (&engine);
+  free (engine.device);
+}
 
+static uint32_t test_dll_frames;
 
-  reader = message_state_reader_start (message, &devices);
-  CU_ASSERT_TRUE (reader != NULL);
-  CU_ASSERT_EQUAL (devices, 2);
+static void
+test_dll_overbridge_update (void *data, uint32_t frames, uint64_t t)
+{
+  test_dll_frames = frames;
+}
 
-  for (guint i = 0; i < devices; i++)
+static uint64_t
+test_get_time ()
+{
+  return 0;
+}
+
+static void
+test_engine_gap_silence ()
+{
+  struct ow_engine engine;
+  struct ow_context context;
+  struct ow_engine_stats stats;
+  struct libusb_transfer xfr;
+  struct ow_ring *ring;
+  struct ow_dll dll;
+  uint16_t frames = 0;
+  float *output;
+  size_t frame_size, transfer_len;
+
+  printf ("\n");
+
+  memset (&engine, 0, sizeof (engine));
+  memset (&context, 0, sizeof (context));
+  engine.device = malloc (sizeof (struct ow_device));
+  ow_copy_device_desc (&engine.device->desc, &TESTDEV_DESC_T2);
+  ow_engine_init_mem (&engine, BLOCKS, XFR_QUEUE_DEPTH);
+
+  frame_size = engine.device->desc.outputs * OW_BYTES_PER_SAMPLE;
+  transfer_len = engine.frames_per_transfer * engine.device->desc.outputs;
+  ring = ow_ring_create (4 * engine.frames_per_transfer, frame_size);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (ring);
+  ow_context_set_rings (&context, ring, NULL);
+  context.options = OW_ENGINE_OPTION_O2H_AUDIO;
+  context.dll = &dll;
+  context.dll_overbridge_update = test_dll_overbridge_update;
+  context.get_time = test_get_time;
+  engine.context = &context;
+  ow_engine_set_status (&engine, OW_ENGINE_STATUS_RUN);
+
+  xfr.status = LIBUSB_TRANSFER_COMPLETED;
+  xfr.length = engine.usb.xfr_audio_in_data_len;
+  xfr.actual_length = xfr.length;
+  xfr.buffer = engine.usb.xfr_audio_in_data;
+  for (int i = 0; i < BLOCKS; i++)
     {
-      device = message_state_reader_get_device (reader, i);
-      g_object_unref (device);
+      struct ow_engine_usb_blk *blk = GET_NTH_INPUT_USB_BLK (&engine, i);
+      memset (blk->data, 0x11, engine.usb.audio_in_blk_len -
+	      sizeof (struct ow_engine_usb_blk));
     }
 
-  message_state_reader_end (reader, &samplerate, &buffer_size,
-			    &target_delay_ms);
+  set_usb_input_frames (&engine, frames);
+  ow_engine_process_usb_input (&engine, &xfr);
+  CU_ASSERT_EQUAL (test_dll_frames, engine.frames_per_transfer);
 
-  CU_ASSERT_EQUAL (samplerate, 1);
-  CU_ASSERT_EQUAL (buffer_size, 2);
-  CU_ASSERT_EQUAL (target_delay_ms, 3);
+  //A transfer is lost.
+  frames += 2 * BLOCKS * OB_FRAMES_PER_BLOCK;
+  set_usb_input_frames (&engine, frames);
+  ow_engine_process_usb_input (&engine, &xfr);
+  CU_ASSERT_EQUAL (test_dll_frames, 2 * engine.frames_per_transfer);
 
-  free (message);
+  CU_ASSERT_EQUAL (ow_ring_read_space (ring),
+		   3 * engine.frames_per_transfer * frame_size);
+
+  output = malloc (3 * transfer_len * sizeof (float));
+  ow_ring_read (ring, (char *) output, 3 * transfer_len * sizeof (float));
+  for (int i = 0; i < 3 * transfer_len; i++)
+    {
+      int silence = i >= transfer_len && i < 2 * transfer_len;
+      if (silence)
+	{
+	  CU_ASSERT_EQUAL (output[i], 0);
+	}
+      else
+	{
+	  CU_ASSERT_NOT_EQUAL (output[i], 0);
+	}
+    }
+
+  ow_engine_get_stats (&engine, &stats);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_O2H_GAPS], 1);
+  CU_ASSERT_EQUAL (stats.counters[OW_ENGINE_STAT_O2H_INSERTED_FRAMES],
+		   engine.frames_per_transfer);
+
+  free (output);
+  ow_ring_destroy (ring);
+  ow_engine_free_mem (&engine);
   free (engine.device);
 }
 
-int
-main (int argc, char *argv[])
+static void
+test_engine_tracks ()
 {
-  int err;
+  struct ow_engine engine;
+  struct ow_context context;
 
-  debug_level = 2;
+  memset (&engine, 0, sizeof (engine));
+  memset (&context, 0, sizeof (context));
+  engine.context = &context;
 
-  if (CU_initialize_registry () != CUE_SUCCESS)
+  CU_ASSERT_EQUAL (ow_engine_get_o2h_tracks (&engine), OW_ALL_TRACKS);
+  CU_ASSERT_EQUAL (ow_engine_get_h2o_tracks (&engine), OW_ALL_TRACKS);
+
+  ow_engine_set_o2h_tracks (&engine, 5);
+  CU_ASSERT_EQUAL (ow_engine_get_o2h_tracks (&engine), 5);
+  CU_ASSERT_EQUAL (context.o2h_disabled_tracks, ~5ULL);
+
+  ow_engine_set_h2o_tracks (&engine, 0);
+  CU_ASSERT_EQUAL (ow_engine_get_h2o_tracks (&engine), 0);
+  CU_ASSERT_EQUAL (context.h2o_disabled_tracks, OW_ALL_TRACKS);
+}
+
+static void
+test_engine_histograms ()
+{
+  struct ow_engine engine;
+  struct ow_histogram histograms[OW_HISTOGRAMS];
+  struct ow_histogram *h = &histograms[OW_HISTOGRAM_O2H_PERIOD];
+
+  printf ("\n");
+
+  memset (&engine, 0, sizeof (engine));
+  engine.device = malloc (sizeof (struct ow_device));
+  ow_copy_device_desc (&engine.device->desc, &TESTDEV_DESC_T2);
+  ow_engine_init_mem (&engine, BLOCKS, XFR_QUEUE_DEPTH);
+
+  for (int i = 0; i < OW_HISTOGRAMS; i++)
     {
-      goto cleanup;
+      CU_ASSERT_PTR_NOT_NULL (ow_engine_get_histogram_name (i));
     }
-  CU_pSuite suite = CU_add_suite ("Overwitch USB blocks tests", 0, 0);
-  if (!suite)
+  CU_ASSERT_PTR_NULL (ow_engine_get_histogram_name (OW_HISTOGRAMS));
+
+  ow_engine_add_histogram_sample (&engine, OW_HISTOGRAM_O2H_PERIOD, 0);
+  ow_engine_add_histogram_sample (&engine, OW_HISTOGRAM_O2H_PERIOD, 1);
+  ow_engine_add_histogram_sample (&engine, OW_HISTOGRAM_O2H_PERIOD, 3);
+  ow_engine_add_histogram_sample (&engine, OW_HISTOGRAM_O2H_PERIOD, 3500000);
+  ow_engine_add_histogram_sample (&engine, OW_HISTOGRAM_O2H_PERIOD,
+				  1000000000000);
+
+  ow_engine_get_histograms (&engine, histograms, 1);
+  CU_ASSERT_EQUAL (h->buckets[0], 2);
+  CU_ASSERT_EQUAL (h->buckets[1], 1);
+  CU_ASSERT_EQUAL (h->buckets[21], 1);
+  CU_ASSERT_EQUAL (h->buckets[OW_HISTOGRAM_BUCKETS - 1], 1);
+  CU_ASSERT_EQUAL (h->max, 1000000000000);
+  CU_ASSERT_EQUAL (histograms[OW_HISTOGRAM_H2O_PERIOD].max, 0);
+
+  ow_engine_get_histograms (&engine, histograms, 0);
+  for (int i = 0; i < OW_HISTOGRAM_BUCKETS; i++)
     {
-      goto cleanup;
+      CU_ASSERT_EQUAL (h->buckets[i], 0);
     }
+  CU_ASSERT_EQUAL (h->max, 0);
 
-  if (!CU_add_test (suite, "test_get_frame_size_from_desc_tracks",
-		    test_get_frame_size_from_desc_tracks))
+  ow_engine_free_mem (&engine);
+  free (engine.device);
+}
+
+static void
+test_usb_iso_packets ()
+{
+  struct ow_engine engine;
+  struct libusb_transfer *xfr;
+  size_t data_len;
+  uint8_t *data;
+
+  engine.device = malloc (sizeof (struct ow_device));
+  ow_copy_device_desc (&engine.device->desc, &TESTDEV_DESC_T1);
+  engine.usb.audio_in_blk_len = 0;
+  engine.usb.audio_out_blk_len = 0;
+  ow_engine_init_mem (&engine, BLOCKS, XFR_QUEUE_DEPTH);
+
+  xfr = malloc (sizeof (struct libusb_transfer) +
+		BLOCKS * sizeof (struct libusb_iso_packet_descriptor));
+  xfr->buffer = engine.usb.xfr_audio_in_data;
+  xfr->num_iso_packets = BLOCKS;
+  memset (xfr->buffer, 0xff, engine.usb.xfr_audio_in_data_len);
+  for (int i = 0; i < BLOCKS; i++)
     {
-      goto cleanup;
+      xfr->iso_packet_desc[i].length = engine.usb.audio_in_blk_len;
+      xfr->iso_packet_desc[i].actual_length = engine.usb.audio_in_blk_len;
+      xfr->iso_packet_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
     }
+  xfr->iso_packet_desc[1].status = LIBUSB_TRANSFER_ERROR;
+  xfr->iso_packet_desc[2].actual_length = 0;
 
-  if (!CU_add_test (suite, "test_sizes", test_sizes))
+  CU_ASSERT_EQUAL (ow_engine_check_iso_packets (&engine, xfr, 1), 2);
+  engine.usb.iso = 1;
+  CU_ASSERT_EQUAL (ow_engine_get_xfr_actual_length (&engine, xfr),
+		   (BLOCKS - 1) * engine.usb.audio_in_blk_len);
+
+  data_len = engine.usb.audio_in_blk_len - sizeof (struct ow_engine_usb_blk);
+  for (int i = 0; i < BLOCKS; i++)
     {
-      goto cleanup;
+      struct ow_engine_usb_blk *blk = GET_NTH_INPUT_USB_BLK (&engine, i);
+      data = (uint8_t *) blk->data;
+      CU_ASSERT_EQUAL (blk->header, 0xffff);
+      //The lost blocks follow the previous one.
+      CU_ASSERT_EQUAL (be16toh (blk->frames),
+		       i == 1 || i == 2 ? (uint16_t) (0xffff + i *
+						      OB_FRAMES_PER_BLOCK) :
+		       0xffff);
+      for (int j = 0; j < data_len; j++)
+	{
+	  CU_ASSERT_EQUAL (data[j], i == 1 || i == 2 ? 0 : 0xff);
+	}
     }
 
-  if (!CU_add_test (suite, "test_usb_blocks_t1", test_usb_blocks_t1))
+  //Output packets are left untouched.
+  xfr->buffer = engine.usb.xfr_audio_out_data;
+  CU_ASSERT_EQUAL (ow_engine_check_iso_packets (&engine, xfr, 0), 2);
+  CU_ASSERT_EQUAL (be16toh (GET_NTH_OUTPUT_USB_BLK (&engine, 1)->header),
+		   0x7ff);
+
+  free (xfr);
+  ow_engine_free_mem (&engine);
+  free (engine.device);
+}
+
+static void
+test_codec_plan ()
+{
+  struct ow_codec_plan plan;
+  const struct ow_device_track tracks[] = {
+    {.name = "T1",.size = 3},
+    {.name = "T2",.size = 4},
+    {.name = "T3",.size = 3}
+  };
+
+  printf ("\n");
+
+  ow_codec_plan_init (&plan, TESTDEV_DESC_T2.type, TESTDEV_DESC_T2.outputs,
+		      TESTDEV_DESC_T2.output_tracks);
+  CU_ASSERT_EQUAL (plan.layout, OW_CODEC_LAYOUT_32);
+  CU_ASSERT_EQUAL (plan.runs_len, 1);
+  CU_ASSERT_EQUAL (plan.runs[0].tracks, TRACKS);
+  CU_ASSERT_EQUAL (plan.runs[0].shift, 0);
+  CU_ASSERT_EQUAL (plan.frame_size, TRACKS * 4);
+
+  ow_codec_plan_init (&plan, TESTDEV_DESC_T3.type, TESTDEV_DESC_T3.outputs,
+		      TESTDEV_DESC_T3.output_tracks);
+  CU_ASSERT_EQUAL (plan.layout, OW_CODEC_LAYOUT_32_24);
+  CU_ASSERT_EQUAL (plan.runs_len, 2);
+  CU_ASSERT_EQUAL (plan.runs[0].tracks, 2);
+  CU_ASSERT_EQUAL (plan.runs[0].size, 4);
+  CU_ASSERT_EQUAL (plan.runs[0].offset, 0);
+  CU_ASSERT_EQUAL (plan.runs[0].shift, 8);
+  CU_ASSERT_EQUAL (plan.runs[1].tracks, 4);
+  CU_ASSERT_EQUAL (plan.runs[1].size, 3);
+  CU_ASSERT_EQUAL (plan.runs[1].offset, 8);
+  CU_ASSERT_EQUAL (plan.runs[1].shift, 0);
+  CU_ASSERT_EQUAL (plan.frame_size, 2 * 4 + 4 * 3);
+
+  ow_codec_plan_init (&plan, TESTDEV_DESC_T1.type, TESTDEV_DESC_T1.outputs,
+		      TESTDEV_DESC_T1.output_tracks);
+  CU_ASSERT_EQUAL (plan.layout, OW_CODEC_LAYOUT_16);
+  CU_ASSERT_EQUAL (plan.frame_size, TRACKS * 2);
+
+  ow_codec_plan_init (&plan, OW_DEVICE_TYPE_3, 3, tracks);
+  CU_ASSERT_EQUAL (plan.layout, OW_CODEC_LAYOUT_GENERIC);
+  CU_ASSERT_EQUAL (plan.runs_len, 3);
+  CU_ASSERT_EQUAL (plan.runs[1].shift, 8);
+  CU_ASSERT_EQUAL (plan.runs[2].offset, 7);
+  CU_ASSERT_EQUAL (plan.frame_size, 10);
+}
+
+static void
+test_codec_decode_t3 ()
+{
+  struct ow_codec_plan plan;
+  float output[TRACKS];
+  //24 bits samples in 4 bytes words followed by 3 bytes samples
+  const uint8_t frame[] = {
+    0xff, 0x80, 0x00, 0x01,
+    0x00, 0x7f, 0xff, 0xff,
+    0x80, 0x00, 0x01,
+    0x7f, 0xff, 0xff,
+    0x00, 0x00, 0x00,
+    0xff, 0xff, 0xff
+  };
+  const int32_t expected[] = {
+    (int32_t) 0x80000100, 0x7fffff00,
+    (int32_t) 0x80000100, 0x7fffff00, 0, (int32_t) 0xffffff00
+  };
+
+  printf ("\n");
+
+  ow_codec_plan_init (&plan, TESTDEV_DESC_T3.type, TESTDEV_DESC_T3.outputs,
+		      TESTDEV_DESC_T3.output_tracks);
+  ow_codec_decode (&plan, frame, output, 1);
+
+  for (int i = 0; i < TRACKS; i++)
     {
-      goto cleanup;
+      CU_ASSERT_EQUAL (output[i], expected[i] / (float) INT32_MAX);
     }
+}
 
-  if (!CU_add_test (suite, "test_usb_blocks_t2", test_usb_blocks_t2))
+static void
+test_codec_decoders_layout (ow_device_type_t type, int tracks,
+			    const struct ow_device_track *track)
+{
+  struct ow_codec_plan scalar, plan;
+  size_t frame_size;
+  uint8_t *src;
+  float *expected, *actual;
+  ow_codec_isa_t cpu_isa = ow_codec_get_cpu_isa ();
+
+  ow_codec_plan_init (&scalar, type, tracks, track);
+  ow_codec_plan_set_isa (&scalar, OW_CODEC_ISA_SCALAR);
+  frame_size = scalar.frame_size;
+
+  src = malloc (frame_size * OB_FRAMES_PER_BLOCK);
+  expected = malloc (sizeof (float) * tracks * OB_FRAMES_PER_BLOCK);
+  actual = malloc (sizeof (float) * tracks * OB_FRAMES_PER_BLOCK);
+
+  srand (tracks);
+  for (int i = 0; i < frame_size * OB_FRAMES_PER_BLOCK; i++)
     {
-      goto cleanup;
+      src[i] = rand ();
     }
 
-  if (!CU_add_test (suite, "test_jack_buffers", test_jack_buffers))
+  for (ow_codec_isa_t isa = OW_CODEC_ISA_SCALAR; isa <= cpu_isa; isa++)
     {
-      goto cleanup;
+      ow_codec_plan_init (&plan, type, tracks, track);
+      CU_ASSERT_EQUAL (ow_codec_plan_set_isa (&plan, isa), isa);
+      printf ("%s layout with %d tracks (%s)\n",
+	      ow_codec_get_layout_name (plan.layout), tracks,
+	      ow_codec_get_isa_name (isa));
+
+      for (int frames = 1; frames <= OB_FRAMES_PER_BLOCK; frames++)
+	{
+	  ow_codec_decode (&scalar, src, expected, frames);
+	  ow_codec_decode (&plan, src, actual, frames);
+	  CU_ASSERT_EQUAL (memcmp (expected, actual,
+				   sizeof (float) * tracks * frames), 0);
+	}
     }
 
-  if (!CU_add_test
-      (suite, "get_bus_address_from_str", test_get_bus_address_from_str))
+  free (src);
+  free (expected);
+  free (actual);
+}
+
+static void
+test_codec_decoders ()
+{
+  struct ow_device_track tracks[OB_MAX_TRACKS];
+
+  printf ("\n");
+
+  test_codec_decoders_layout (TESTDEV_DESC_T2.type, TESTDEV_DESC_T2.outputs,
+			      TESTDEV_DESC_T2.output_tracks);
+  test_codec_decoders_layout (TESTDEV_DESC_T3.type, TESTDEV_DESC_T3.outputs,
+			      TESTDEV_DESC_T3.output_tracks);
+  test_codec_decoders_layout (TESTDEV_DESC_T1.type, TESTDEV_DESC_T1.outputs,
+			      TESTDEV_DESC_T1.output_tracks);
+  test_codec_decoders_layout (TESTDEV_DESC_SIZE.type,
+			      TESTDEV_DESC_SIZE.outputs,
+			      TESTDEV_DESC_SIZE.output_tracks);
+
+  //Digitakt II and Digitone II outputs and inputs
+  for (int i = 0; i < 42; i++)
     {
-      goto cleanup;
+      tracks[i].size = i < 14 ? 4 : 3;
     }
+  test_codec_decoders_layout (OW_DEVICE_TYPE_3, 42, tracks);
+  test_codec_decoders_layout (OW_DEVICE_TYPE_3, 8, tracks);
 
-  if (!CU_add_test (suite, "state_parser", test_state_parser))
+  //Generic layout and odd lengths
+  for (int i = 0; i < 19; i++)
+    {
+      tracks[i].size = 2 + i % 3;
+    }
+  test_codec_decoders_layout (OW_DEVICE_TYPE_3, 19, tracks);
+  test_codec_decoders_layout (OW_DEVICE_TYPE_2, 13, tracks + 14);
+  test_codec_decoders_layout (OW_DEVICE_TYPE_2, 13, tracks + 13);
+}
+
+//Only the enabled tracks are converted and the other ones are cleared.
+static void
+test_codec_tracks_layout (ow_device_type_t type, int tracks,
+			  const struct ow_device_track *track, uint64_t mask)
+{
+  struct ow_codec_plan plan;
+  size_t frame_size;
+  uint8_t *src, *expected_usb, *actual_usb;
+  float *expected, *actual;
+  int frames = OB_FRAMES_PER_BLOCK;
+  const struct ow_device_track *t;
+  size_t offset;
+
+  ow_codec_plan_init (&plan, type, tracks, track);
+  frame_size = plan.frame_size;
+
+  src = malloc (frame_size * frames);
+  expected_usb = malloc (frame_size * frames);
+  actual_usb = malloc (frame_size * frames);
+  expected = malloc (sizeof (float) * tracks * frames);
+  actual = malloc (sizeof (float) * tracks * frames);
+
+  srand (tracks);
+  for (int i = 0; i < frame_size * frames; i++)
+    {
+      src[i] = rand ();
+    }
+
+  ow_codec_decode (&plan, src, expected, frames);
+  ow_codec_decode_tracks (&plan, src, actual, frames, mask);
+  for (int i = 0; i < frames; i++)
+    {
+      for (int j = 0; j < tracks; j++)
+	{
+	  float v = expected[i * tracks + j];
+	  CU_ASSERT_EQUAL (actual[i * tracks + j],
+			   mask & (1ULL << j) ? v : 0);
+	}
+    }
+
+  ow_codec_encode (&plan, expected, expected_usb, frames);
+  ow_codec_encode_tracks (&plan, expected, actual_usb, frames, mask);
+  for (int i = 0; i < frames; i++)
+    {
+      offset = i * frame_size;
+      t = track;
+      for (int j = 0; j < tracks; j++, t++)
+	{
+	  for (int k = 0; k < t->size; k++, offset++)
+	    {
+	      CU_ASSERT_EQUAL (actual_usb[offset],
+			       mask & (1ULL << j) ? expected_usb[offset] : 0);
+	    }
+	}
+    }
+
+  ow_codec_decode_tracks (&plan, src, actual, frames, plan.tracks_mask);
+  CU_ASSERT_EQUAL (memcmp (expected, actual, sizeof (float) * tracks *
+			   frames), 0);
+
+  free (src);
+  free (expected_usb);
+  free (actual_usb);
+  free (expected);
+  free (actual);
+}
+
+static void
+test_codec_tracks ()
+{
+  struct ow_device_track tracks[OB_MAX_TRACKS];
+
+  test_codec_tracks_layout (TESTDEV_DESC_T3.type, TESTDEV_DESC_T3.outputs,
+			    TESTDEV_DESC_T3.output_tracks, 0x5);
+  test_codec_tracks_layout (TESTDEV_DESC_T1.type, TESTDEV_DESC_T1.outputs,
+			    TESTDEV_DESC_T1.output_tracks, 0);
+
+  for (int i = 0; i < 42; i++)
+    {
+      tracks[i].size = i < 14 ? 4 : 3;
+    }
+  test_codec_tracks_layout (OW_DEVICE_TYPE_3, 42, tracks, 0x2aaaaaaaaa1ULL);
+
+  for (int i = 0; i < OB_MAX_TRACKS; i++)
+    {
+      tracks[i].size = 2 + i % 3;
+    }
+  test_codec_tracks_layout (OW_DEVICE_TYPE_3, OB_MAX_TRACKS, tracks,
+			    0x8000000000000001ULL);
+}
+
+#define ENCODER_GUARD 32
+
+static void
+test_codec_encoders_layout (ow_device_type_t type, int tracks,
+			    const struct ow_device_track *track)
+{
+  struct ow_codec_plan scalar, plan;
+  size_t frame_size, size;
+  float *src;
+  uint8_t *expected, *actual;
+  ow_codec_isa_t cpu_isa = ow_codec_get_cpu_isa ();
+  const float special[] = { 1.0f, -1.0f, 2.0f, -2.0f, 0.0f, -0.0f, INFINITY,
+    -INFINITY, NAN, 1e-9f
+  };
+
+  ow_codec_plan_init (&scalar, type, tracks, track);
+  ow_codec_plan_set_isa (&scalar, OW_CODEC_ISA_SCALAR);
+  frame_size = scalar.frame_size;
+  size = frame_size * OB_FRAMES_PER_BLOCK;
+
+  src = malloc (sizeof (float) * tracks * OB_FRAMES_PER_BLOCK);
+  expected = malloc (size + ENCODER_GUARD);
+  actual = malloc (size + ENCODER_GUARD);
+
+  srand (tracks);
+  for (int i = 0; i < tracks * OB_FRAMES_PER_BLOCK; i++)
+    {
+      src[i] = 3.0f * rand () / RAND_MAX - 1.5f;
+    }
+  for (int i = 0; i < sizeof (special) / sizeof (float); i++)
+    {
+      src[(i * 7) % (tracks * OB_FRAMES_PER_BLOCK)] = special[i];
+    }
+
+  for (ow_codec_isa_t isa = OW_CODEC_ISA_SCALAR; isa <= cpu_isa; isa++)
+    {
+      ow_codec_plan_init (&plan, type, tracks, track);
+      CU_ASSERT_EQUAL (ow_codec_plan_set_isa (&plan, isa), isa);
+      printf ("%s layout with %d tracks (%s)\n",
+	      ow_codec_get_layout_name (plan.layout), tracks,
+	      ow_codec_get_isa_name (isa));
+
+      for (int frames = 1; frames <= OB_FRAMES_PER_BLOCK; frames++)
+	{
+	  memset (expected, 0xaa, size + ENCODER_GUARD);
+	  memset (actual, 0xaa, size + ENCODER_GUARD);
+	  ow_codec_encode (&scalar, src, expected, frames);
+	  ow_codec_encode (&plan, src, actual, frames);
+	  //The bytes after the frames must not be written.
+	  CU_ASSERT_EQUAL (memcmp (expected, actual, size + ENCODER_GUARD),
+			   0);
+	}
+    }
+
+  free (src);
+  free (expected);
+  free (actual);
+}
+
+static void
+test_codec_encoders ()
+{
+  struct ow_device_track tracks[OB_MAX_TRACKS];
+
+  printf ("\n");
+
+  test_codec_encoders_layout (TESTDEV_DESC_T2.type, TESTDEV_DESC_T2.inputs,
+			      TESTDEV_DESC_T2.input_tracks);
+  test_codec_encoders_layout (TESTDEV_DESC_T3.type, TESTDEV_DESC_T3.outputs,
+			      TESTDEV_DESC_T3.output_tracks);
+  test_codec_encoders_layout (TESTDEV_DESC_T1.type, TESTDEV_DESC_T1.inputs,
+			      TESTDEV_DESC_T1.input_tracks);
+  test_codec_encoders_layout (TESTDEV_DESC_SIZE.type,
+			      TESTDEV_DESC_SIZE.outputs,
+			      TESTDEV_DESC_SIZE.output_tracks);
+
+  //Digitakt II and Digitone II outputs and inputs
+  for (int i = 0; i < 42; i++)
+    {
+      tracks[i].size = i < 14 ? 4 : 3;
+    }
+  test_codec_encoders_layout (OW_DEVICE_TYPE_3, 42, tracks);
+  test_codec_encoders_layout (OW_DEVICE_TYPE_3, 8, tracks);
+
+  for (int i = 0; i < 19; i++)
+    {
+      tracks[i].size = 2;
+    }
+  test_codec_encoders_layout (OW_DEVICE_TYPE_1, 19, tracks);
+
+  //Generic layout and odd lengths
+  for (int i = 0; i < 19; i++)
+    {
+      tracks[i].size = 2 + i % 3;
+    }
+  test_codec_encoders_layout (OW_DEVICE_TYPE_3, 19, tracks);
+  test_codec_encoders_layout (OW_DEVICE_TYPE_2, 13, tracks + 14);
+}
+
+static void
+test_codec_encode_saturation ()
+{
+  struct ow_codec_plan plan;
+  float input[TRACKS];
+  uint8_t output[20];
+  ow_codec_isa_t cpu_isa = ow_codec_get_cpu_isa ();
+  //24 bits samples in 4 bytes words followed by 3 bytes samples
+  const uint8_t expected[] = {
+    0x00, 0x7f, 0xff, 0xff,
+    0xff, 0x80, 0x00, 0x00,
+    0x7f, 0xff, 0xff,
+    0x80, 0x00, 0x00,
+    0x40, 0x00, 0x00,
+    0x7f, 0xff, 0xff
+  };
+
+  printf ("\n");
+
+  input[0] = 1.0f;
+  input[1] = -4.0f;
+  input[2] = 1.5f;
+  input[3] = -1.0f;
+  input[4] = 0.5f;
+  input[5] = NAN;
+
+  for (ow_codec_isa_t isa = OW_CODEC_ISA_SCALAR; isa <= cpu_isa; isa++)
+    {
+      ow_codec_plan_init (&plan, TESTDEV_DESC_T3.type,
+			  TESTDEV_DESC_T3.outputs,
+			  TESTDEV_DESC_T3.output_tracks);
+      ow_codec_plan_set_isa (&plan, isa);
+      ow_codec_encode (&plan, input, output, 1);
+      CU_ASSERT_EQUAL (memcmp (output, expected, sizeof (expected)), 0);
+    }
+}
+
+static void
+test_codec_encode_dither ()
+{
+  struct ow_codec_plan plan;
+  int frames = OB_FRAMES_PER_BLOCK * 1024;
+  float *input = malloc (sizeof (float) * TRACKS * frames);
+  uint8_t *output = malloc (TESTDEV_DESC_T1.inputs * 2 * frames);
+  ow_codec_isa_t cpu_isa = ow_codec_get_cpu_isa ();
+  //A constant signal between two 16 bits values
+  float v = 1000.3f / 32768;
+  double mean;
+  int16_t s;
+  int errors;
+
+  printf ("\n");
+
+  for (int i = 0; i < TRACKS * frames; i++)
+    {
+      input[i] = v;
+    }
+
+  for (ow_codec_isa_t isa = OW_CODEC_ISA_SCALAR; isa <= cpu_isa; isa++)
+    {
+      ow_codec_plan_init (&plan, TESTDEV_DESC_T1.type,
+			  TESTDEV_DESC_T1.inputs,
+			  TESTDEV_DESC_T1.input_tracks);
+      ow_codec_plan_set_isa (&plan, isa);
+
+      //Without dither, the value is truncated.
+      ow_codec_encode (&plan, input, output, frames);
+      errors = 0;
+      for (int i = 0; i < TRACKS * frames; i++)
+	{
+	  s = output[i * 2] << 8 | output[i * 2 + 1];
+	  errors += s != 1000;
+	}
+      CU_ASSERT_EQUAL (errors, 0);
+
+      //With dither, the mean is preserved and the error is below 2 LSB.
+      ow_codec_plan_set_dither (&plan, 1);
+      ow_codec_encode (&plan, input, output, frames);
+      mean = 0;
+      errors = 0;
+      for (int i = 0; i < TRACKS * frames; i++)
+	{
+	  s = output[i * 2] << 8 | output[i * 2 + 1];
+	  errors += s < 999 || s > 1002;
+	  mean += s;
+	}
+      mean /= TRACKS * frames;
+      printf ("Dithered mean (%s): %f\n", ow_codec_get_isa_name (isa), mean);
+      CU_ASSERT_EQUAL (errors, 0);
+      CU_ASSERT_DOUBLE_EQUAL (mean, 1000.3, 0.02);
+    }
+
+  //32 bits samples are never dithered.
+  ow_codec_plan_init (&plan, TESTDEV_DESC_T2.type, TESTDEV_DESC_T2.inputs,
+		      TESTDEV_DESC_T2.input_tracks);
+  ow_codec_plan_set_dither (&plan, 1);
+  CU_ASSERT_EQUAL (plan.runs[0].dither, 0);
+
+  free (input);
+  free (output);
+}
+
+static void
+test_codec_encoders_throughput ()
+{
+  struct ow_codec_plan plan;
+  struct ow_device_track tracks[OB_MAX_TRACKS];
+  struct timespec start, end;
+  int iterations = 4096;
+  int frames = OB_FRAMES_PER_BLOCK * 24;
+  float *input = malloc (sizeof (float) * OB_MAX_TRACKS * frames);
+  uint8_t *output = malloc (sizeof (uint32_t) * OB_MAX_TRACKS * frames);
+  ow_codec_isa_t cpu_isa = ow_codec_get_cpu_isa ();
+  double ns;
+
+  printf ("\n");
+
+  for (int i = 0; i < 42; i++)
+    {
+      tracks[i].size = i < 14 ? 4 : 3;
+    }
+
+  for (int i = 0; i < OB_MAX_TRACKS * frames; i++)
+    {
+      input[i] = sinf (i * 0.01f);
+    }
+
+  for (ow_codec_isa_t isa = OW_CODEC_ISA_SCALAR; isa <= cpu_isa; isa++)
+    {
+      for (int dither = 0; dither < 2; dither++)
+	{
+	  ow_codec_plan_init (&plan, OW_DEVICE_TYPE_3, 42, tracks);
+	  ow_codec_plan_set_isa (&plan, isa);
+	  ow_codec_plan_set_dither (&plan, dither);
+
+	  clock_gettime (CLOCK_MONOTONIC, &start);
+	  for (int i = 0; i < iterations; i++)
+	    {
+	      ow_codec_encode (&plan, input, output, frames);
+	    }
+	  clock_gettime (CLOCK_MONOTONIC, &end);
+
+	  ns = (end.tv_sec - start.tv_sec) * 1e9 + end.tv_nsec -
+	    start.tv_nsec;
+	  printf ("%s layout encoder (%s%s): %.3f ns/sample\n",
+		  ow_codec_get_layout_name (plan.layout),
+		  ow_codec_get_isa_name (isa), dither ? ", dither" : "",
+		  ns / ((double) iterations * frames * 42));
+	}
+    }
+
+  free (input);
+  free (output);
+}
+
+static void
+test_jack_buffers ()
+{
+  jack_default_audio_sample_t *jack_input[TRACKS];
+  float output[TRACKS * NFRAMES];
+  struct ow_engine engine;
+
+  printf ("\n");
+
+  engine.device = malloc (sizeof (struct ow_device));
+  ow_copy_device_desc (&engine.device->desc, &TESTDEV_DESC_T2);
+
+  for (int i = 0; i < TRACKS; i++)
+    {
+      jack_input[i] = malloc (sizeof (jack_default_audio_sample_t) * NFRAMES);
+      for (int j = 0; j < NFRAMES; j++)
+	{
+	  jack_input[i][j] = 1e-8 * (i + 1) * (j + 1);
+	}
+    }
+
+  jclient_copy_j2o_audio (output, NFRAMES, jack_input, &engine.device->desc);
+
+  for (int i = 0; i < TRACKS; i++)
+    {
+      for (int j = 0; j < NFRAMES; j++)
+	{
+	  printf ("%.10f =?= %.10f\n", output[j * TRACKS + i],
+		  jack_input[i][j]);
+	  CU_ASSERT_EQUAL (output[j * TRACKS + i], jack_input[i][j]);
+	}
+
+      free (jack_input[i]);
+    }
+
+  free (engine.device);
+}
+
+static void
+test_ring ()
+{
+  struct ow_ring *ring;
+  struct ow_buffer_region regions[2];
+  size_t frame_size = 2 * OW_BYTES_PER_SAMPLE;
+  float input[32], output[32];
+
+  for (int i = 0; i < 32; i++)
+    {
+      input[i] = i;
+    }
+
+  ring = ow_ring_create (10, frame_size);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (ring);
+  CU_ASSERT_EQUAL (ow_ring_get_frame_size (ring), frame_size);
+  CU_ASSERT_EQUAL ((uintptr_t) & ring->head % OW_CACHE_LINE_SIZE, 0);
+  CU_ASSERT_EQUAL ((uintptr_t) & ring->tail % OW_CACHE_LINE_SIZE, 0);
+  CU_ASSERT_NOT_EQUAL ((uintptr_t) & ring->head, (uintptr_t) & ring->tail);
+
+  //The capacity is rounded up to 16 frames.
+  CU_ASSERT_EQUAL (ow_ring_write_space (ring), 16 * frame_size);
+  CU_ASSERT_EQUAL (ow_ring_read_space (ring), 0);
+
+  //Incomplete frames are not written.
+  CU_ASSERT_EQUAL (ow_ring_write (ring, (char *) input, 12 * frame_size + 3),
+		   12 * frame_size);
+  CU_ASSERT_EQUAL (ow_ring_read_space (ring), 12 * frame_size);
+  CU_ASSERT_EQUAL (ow_ring_write_space (ring), 4 * frame_size);
+
+  //Discard
+  CU_ASSERT_EQUAL (ow_ring_read (ring, NULL, 10 * frame_size),
+		   10 * frame_size);
+  CU_ASSERT_EQUAL (ow_ring_read_space (ring), 2 * frame_size);
+
+  //The write space wraps around.
+  CU_ASSERT_EQUAL (ow_ring_get_write_regions (ring, regions),
+		   14 * frame_size);
+  CU_ASSERT_EQUAL (regions[0].len, 4 * frame_size);
+  CU_ASSERT_EQUAL (regions[1].len, 10 * frame_size);
+  CU_ASSERT_PTR_EQUAL (regions[1].data, ring->data);
+  memcpy (regions[0].data, &input[24], regions[0].len);
+  memcpy (regions[1].data, input, 2 * frame_size);
+  ow_ring_write_commit (ring, 6 * frame_size);
+  CU_ASSERT_EQUAL (ow_ring_read_space (ring), 8 * frame_size);
+
+  //The read space wraps around too.
+  CU_ASSERT_EQUAL (ow_ring_get_read_regions (ring, regions), 8 * frame_size);
+  CU_ASSERT_EQUAL (regions[0].len, 6 * frame_size);
+  CU_ASSERT_EQUAL (regions[1].len, 2 * frame_size);
+
+  CU_ASSERT_EQUAL (ow_ring_read (ring, (char *) output, 8 * frame_size),
+		   8 * frame_size);
+  CU_ASSERT_EQUAL (memcmp (output, &input[20], 12 * OW_BYTES_PER_SAMPLE), 0);
+  CU_ASSERT_EQUAL (memcmp (&output[12], input, 4 * OW_BYTES_PER_SAMPLE), 0);
+
+  //Full
+  CU_ASSERT_EQUAL (ow_ring_write (ring, (char *) input, 32 *
+				  OW_BYTES_PER_SAMPLE), 16 * frame_size);
+  CU_ASSERT_EQUAL (ow_ring_write_space (ring), 0);
+  CU_ASSERT_EQUAL (ow_ring_get_write_regions (ring, regions), 0);
+  CU_ASSERT_EQUAL (ow_ring_read (ring, (char *) output, 32 *
+				 OW_BYTES_PER_SAMPLE), 16 * frame_size);
+  CU_ASSERT_EQUAL (memcmp (output, input, 32 * OW_BYTES_PER_SAMPLE), 0);
+  CU_ASSERT_EQUAL (ow_ring_read_space (ring), 0);
+
+  ow_ring_destroy (ring);
+}
+
+//The engine converts the USB blocks to and from ring memory split in two.
+static void
+test_ring_usb_blocks ()
+{
+  struct ow_engine engine;
+  struct ow_ring *ring;
+  struct ow_buffer_region regions[2];
+  size_t frame_size = TRACKS * OW_BYTES_PER_SAMPLE;
+  size_t frames = BLOCKS * OB_FRAMES_PER_BLOCK;
+  float *output;
+
+  engine.device = malloc (sizeof (struct ow_device));
+  ow_copy_device_desc (&engine.device->desc, &TESTDEV_DESC_T2);
+  engine.usb.audio_in_blk_len = 0;
+  engine.usb.audio_out_blk_len = 0;
+  ow_engine_init_mem (&engine, BLOCKS, XFR_QUEUE_DEPTH);
+
+  output = malloc (engine.o2h_transfer_size);
+
+  for (int i = 0; i < frames * TRACKS; i++)
+    {
+      engine.h2o_transfer_buf[i] = 1e-4 * (i + 1);
+    }
+
+  //32 frames
+  ring = ow_ring_create (frames, frame_size);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (ring);
+
+  //Move the positions 3 frames before the end so the first block is split.
+  ow_ring_write (ring, (char *) engine.h2o_transfer_buf, 20 * frame_size);
+  ow_ring_read (ring, NULL, 20 * frame_size);
+  ow_ring_write (ring, (char *) engine.h2o_transfer_buf, 9 * frame_size);
+  ow_ring_read (ring, NULL, 9 * frame_size);
+
+  ow_ring_write (ring, (char *) engine.h2o_transfer_buf,
+		 engine.h2o_transfer_size);
+  CU_ASSERT_EQUAL (ow_ring_get_read_regions (ring, regions),
+		   engine.h2o_transfer_size);
+  CU_ASSERT_EQUAL (regions[0].len, 3 * frame_size);
+  ow_engine_encode_usb_output_blocks (&engine, regions);
+  ow_ring_read_commit (ring, engine.h2o_transfer_size);
+
+  memcpy (engine.usb.xfr_audio_in_data, engine.usb.xfr_audio_out_data,
+	  engine.usb.xfr_audio_in_data_len);
+
+  //Now, the third block is split.
+  ow_ring_write (ring, (char *) engine.h2o_transfer_buf, 2 * frame_size);
+  ow_ring_read (ring, NULL, 2 * frame_size);
+  CU_ASSERT_EQUAL (ow_ring_get_write_regions (ring, regions),
+		   32 * frame_size);
+  CU_ASSERT_EQUAL (regions[0].len, 5 * frame_size);
+  ow_engine_decode_usb_input_blocks (&engine, regions);
+  ow_ring_write_commit (ring, engine.o2h_transfer_size);
+
+  CU_ASSERT_EQUAL (ow_ring_read (ring, (char *) output,
+				 engine.o2h_transfer_size),
+		   engine.o2h_transfer_size);
+  for (int i = 0; i < frames * TRACKS; i++)
+    {
+      CU_ASSERT_TRUE (fabsf (output[i] - engine.h2o_transfer_buf[i]) < 1e-9);
+    }
+
+  ow_ring_destroy (ring);
+  free (output);
+  ow_engine_free_mem (&engine);
+  free (engine.device);
+}
+
+static void
+test_resampler_deinterleave ()
+{
+  float input[TRACKS * NFRAMES];
+  float *planes[TRACKS];
+
+  for (int i = 0; i < TRACKS * NFRAMES; i++)
+    {
+      input[i] = i;
+    }
+
+  for (int i = 0; i < TRACKS; i++)
+    {
+      planes[i] = i % 2 ? NULL : calloc (NFRAMES + 2, sizeof (float));
+    }
+
+  ow_resampler_deinterleave (input, TRACKS, NFRAMES, planes, 2);
+
+  for (int i = 0; i < TRACKS; i++)
+    {
+      if (!planes[i])
+	{
+	  continue;
+	}
+      CU_ASSERT_EQUAL (planes[i][0], 0);
+      CU_ASSERT_EQUAL (planes[i][1], 0);
+      for (int j = 0; j < NFRAMES; j++)
+	{
+	  CU_ASSERT_EQUAL (planes[i][j + 2], input[j * TRACKS + i]);
+	}
+      free (planes[i]);
+    }
+}
+
+#define O2H_READS_CYCLES 2000
+#define O2H_READS_BUFSIZE 256
+
+static int o2h_reads;
+
+static size_t
+o2h_reads_read_space (void *ring)
+{
+  o2h_reads++;
+  return ow_ring_read_space (ring);
+}
+
+//The device side writes at 48 kHz while the host reads a cycle at a time.
+//Every frame used by the converter must be counted by the DLL.
+static void
+test_resampler_o2h_reads_run (struct ow_resampler *resampler,
+			      long read_frames, long pad_frames,
+			      const char *name)
+{
+  struct ow_context *context = resampler->engine->context;
+  float *buffers[TRACKS];
+  float *block;
+  struct timespec start, end;
+  double acc = 0, ns = 0;
+  size_t written = 0, block_frames = 1024, ring_start, planes_start, n;
+  uint32_t dll_start = resampler->dll.frames;
+
+  block = calloc (block_frames * TRACKS, sizeof (float));
+  for (int i = 0; i < TRACKS; i++)
+    {
+      buffers[i] = calloc (O2H_READS_BUFSIZE, sizeof (float));
+    }
+
+  resampler->o2h_read_frames = read_frames;
+  resampler->o2h_pad_frames = pad_frames;
+  ring_start = ow_ring_read_space (context->o2h_audio) /
+    resampler->o2h_frame_size;
+  planes_start = resampler->o2h_planes_len;
+  o2h_reads = 0;
+
+  for (int i = 0; i < O2H_READS_CYCLES; i++)
+    {
+      acc += O2H_READS_BUFSIZE / resampler->o2h_ratio;
+      n = acc;
+      acc -= n;
+      ow_ring_write (context->o2h_audio, (char *) block,
+		     n * resampler->o2h_frame_size);
+      written += n;
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      ow_resampler_read_audio_planar (resampler, buffers);
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      ns += (end.tv_sec - start.tv_sec) * 1e9 + end.tv_nsec - start.tv_nsec;
+    }
+
+  //The silence read after a resync is counted as it was in the buffer.
+  n = ow_ring_read_space (context->o2h_audio) / resampler->o2h_frame_size;
+  CU_ASSERT_EQUAL (resampler->o2h_pad_frames, 0);
+  CU_ASSERT_EQUAL ((uint32_t) (resampler->dll.frames - dll_start),
+		   (uint32_t) (written + pad_frames - (n - ring_start) -
+			       (resampler->o2h_planes_len - planes_start)));
+
+  printf ("o2h reads (%s): %.2f reads/cycle, %.3f us/cycle\n", name,
+	  o2h_reads / (double) O2H_READS_CYCLES,
+	  ns / O2H_READS_CYCLES / 1000.0);
+
+  for (int i = 0; i < TRACKS; i++)
+    {
+      free (buffers[i]);
+    }
+  free (block);
+}
+
+//The previous fixed read size is compared with the adaptive one.
+static void
+test_resampler_o2h_reads ()
+{
+  struct ow_resampler *resampler = calloc (1, sizeof (struct ow_resampler));
+  struct ow_engine *engine = calloc (1, sizeof (struct ow_engine));
+  struct ow_device *device = calloc (1, sizeof (struct ow_device));
+  struct ow_context context;
+  long read_frames;
+
+  printf ("\n");
+
+  memset (&context, 0, sizeof (context));
+  device->desc.outputs = TRACKS;
+  device->desc.inputs = 2;
+  engine->device = device;
+  engine->context = &context;
+  engine->frames_per_transfer = OB_FRAMES_PER_BLOCK * BLOCKS;
+  resampler->engine = engine;
+  resampler->backend = OW_RESAMPLER_BACKEND_POLYPHASE;
+  resampler->quality = 2;
+  resampler->o2h_frame_size = TRACKS * OW_BYTES_PER_SAMPLE;
+  resampler->h2o_frame_size = 2 * OW_BYTES_PER_SAMPLE;
+  resampler->samplerate = 44100;
+  pthread_spin_init (&resampler->lock, PTHREAD_PROCESS_PRIVATE);
+  ow_dll_host_init (&resampler->dll, OW_DLL_ESTIMATOR_ZALSA);
+
+  ow_context_set_rings (&context,
+			ow_ring_create (8192, resampler->o2h_frame_size),
+			ow_ring_create (8192, resampler->h2o_frame_size));
+  context.read_space = o2h_reads_read_space;
+  context.o2h_disabled_tracks = 0;
+
+  ow_resampler_set_buffer_size (resampler, O2H_READS_BUFSIZE);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (resampler->o2h_polyphase);
+  resampler->o2h_ratio = resampler->dll.ratio;
+  resampler->reading_at_o2h_end = 1;
+  read_frames = resampler->o2h_read_frames;
+
+  //Some margin in the buffer to never underflow.
+  for (int i = 0; i < 2; i++)
+    {
+      char block[O2H_READS_BUFSIZE * TRACKS * OW_BYTES_PER_SAMPLE];
+      memset (block, 0, sizeof (block));
+      ow_ring_write (context.o2h_audio, block, sizeof (block));
+    }
+
+  test_resampler_o2h_reads_run (resampler, 5, 0, "5 frames");
+  test_resampler_o2h_reads_run (resampler, read_frames, 0, "adaptive");
+  CU_ASSERT_TRUE (o2h_reads <= 2 * O2H_READS_CYCLES);
+  test_resampler_o2h_reads_run (resampler, read_frames, 300, "padded");
+
+  ow_ring_destroy (context.o2h_audio);
+  ow_ring_destroy (context.h2o_audio);
+  free (device);
+  free (engine);
+  free (resampler);
+}
+
+#define H2O_QUEUE_BUFSIZE 64
+#define H2O_QUEUE_INPUTS 2
+#define H2O_QUEUE_SAMPLES (H2O_QUEUE_BUFSIZE * H2O_QUEUE_INPUTS)
+
+//A converter that never takes the queue so this one is only filled.
+static long
+h2o_queue_silence_reader (void *cb_data, float **data)
+{
+  static float silence[H2O_QUEUE_SAMPLES];
+  *data = silence;
+  return H2O_QUEUE_BUFSIZE;
+}
+
+static void
+h2o_queue_write_host (struct ow_resampler *resampler, float value)
+{
+  float *buf = ow_resampler_get_h2o_audio_buffer (resampler);
+  for (int i = 0; i < H2O_QUEUE_SAMPLES; i++)
+    {
+      buf[i] = value;
+    }
+}
+
+//The host audio is written at the end of the queue being filled and
+//libsamplerate gets a pointer to the whole queue, which is silence if
+//empty. If the queue is not read, the oldest frames are kept.
+static void
+test_resampler_h2o_queue ()
+{
+  struct ow_resampler *resampler = calloc (1, sizeof (struct ow_resampler));
+  struct ow_engine *engine = calloc (1, sizeof (struct ow_engine));
+  struct ow_device *device = calloc (1, sizeof (struct ow_device));
+  struct ow_context context;
+  float *data, *queue;
+  size_t len, rsh2o;
+  long frames;
+  int err;
+
+  memset (&context, 0, sizeof (context));
+  device->desc.outputs = 2;
+  device->desc.inputs = H2O_QUEUE_INPUTS;
+  engine->device = device;
+  engine->context = &context;
+  engine->frames_per_transfer = OB_FRAMES_PER_BLOCK * BLOCKS;
+  resampler->engine = engine;
+  resampler->backend = OW_RESAMPLER_BACKEND_LIBSAMPLERATE;
+  resampler->o2h_frame_size = 2 * OW_BYTES_PER_SAMPLE;
+  resampler->h2o_frame_size = H2O_QUEUE_INPUTS * OW_BYTES_PER_SAMPLE;
+  resampler->samplerate = OB_SAMPLE_RATE;
+  pthread_spin_init (&resampler->lock, PTHREAD_PROCESS_PRIVATE);
+  ow_dll_host_init (&resampler->dll, OW_DLL_ESTIMATOR_ZALSA);
+
+  ow_context_set_rings (&context,
+			ow_ring_create (1024, resampler->o2h_frame_size),
+			ow_ring_create (1024, resampler->h2o_frame_size));
+
+  ow_resampler_set_buffer_size (resampler, H2O_QUEUE_BUFSIZE);
+  CU_ASSERT_EQUAL (resampler->h2o_max_frames,
+		   ceil (H2O_QUEUE_BUFSIZE / resampler->min_target_ratio) +
+		   1);
+  CU_ASSERT_PTR_EQUAL (resampler->h2o_buf_in, resampler->h2o_queues[0]);
+
+  //The output grows with the ratio bounds of the sample rate.
+  len = resampler->h2o_max_frames;
+  ow_resampler_set_samplerate (resampler, OB_SAMPLE_RATE * 2);
+  CU_ASSERT_EQUAL (resampler->h2o_max_frames,
+		   ceil (H2O_QUEUE_BUFSIZE / resampler->min_target_ratio) +
+		   1);
+  CU_ASSERT_TRUE (resampler->h2o_max_frames < len);
+  ow_resampler_set_samplerate (resampler, OB_SAMPLE_RATE);
+  CU_ASSERT_EQUAL (resampler->h2o_max_frames, len);
+
+  resampler->status = OW_RESAMPLER_STATUS_RUN;
+  resampler->h2o_ratio = 1.0;
+
+  //Empty
+  queue = resampler->h2o_queues[0];
+  h2o_queue_write_host (resampler, 1.0);
+  frames = ow_resampler_h2o_reader (resampler, &data);
+  CU_ASSERT_EQUAL (frames, H2O_QUEUE_BUFSIZE);
+  CU_ASSERT_PTR_EQUAL (data, queue);
+  for (int i = 0; i < H2O_QUEUE_SAMPLES; i++)
+    {
+      CU_ASSERT_EQUAL (data[i], 0);
+    }
+  CU_ASSERT_EQUAL (resampler->h2o_queue_fill, 1);
+  CU_ASSERT_EQUAL (resampler->h2o_queue_len, 0);
+  CU_ASSERT_PTR_EQUAL (resampler->h2o_buf_in, resampler->h2o_queues[1]);
+
+  //Overflow
+  queue = resampler->h2o_queues[1];
+  resampler->h2o_state = src_callback_new (h2o_queue_silence_reader,
+					   SRC_LINEAR, H2O_QUEUE_INPUTS,
+					   &err, resampler);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (resampler->h2o_state);
+  for (int i = 0; i < H2O_QUEUE_CYCLES + 2; i++)
+    {
+      len = i + 1 < H2O_QUEUE_CYCLES - 1 ? i + 1 : H2O_QUEUE_CYCLES - 1;
+      rsh2o = ow_ring_read_space (context.h2o_audio);
+      h2o_queue_write_host (resampler, i + 1);
+      ow_resampler_write_audio (resampler);
+      CU_ASSERT_EQUAL (ow_ring_read_space (context.h2o_audio) - rsh2o,
+		       resampler->h2o_bufsize);
+      CU_ASSERT_EQUAL (resampler->h2o_queue_len, len * H2O_QUEUE_BUFSIZE);
+      CU_ASSERT_PTR_EQUAL (resampler->h2o_buf_in,
+			   queue + len * H2O_QUEUE_SAMPLES);
+      CU_ASSERT_TRUE (resampler->h2o_buf_in + H2O_QUEUE_SAMPLES <=
+		      queue + H2O_QUEUE_CYCLES * H2O_QUEUE_SAMPLES);
+    }
+  src_delete (resampler->h2o_state);
+
+  //Normal
+  frames = ow_resampler_h2o_reader (resampler, &data);
+  CU_ASSERT_EQUAL (frames, (H2O_QUEUE_CYCLES - 1) * H2O_QUEUE_BUFSIZE);
+  CU_ASSERT_PTR_EQUAL (data, queue);
+  for (int i = 0; i < frames * H2O_QUEUE_INPUTS; i++)
+    {
+      CU_ASSERT_EQUAL (data[i], i / H2O_QUEUE_SAMPLES + 1);
+    }
+  CU_ASSERT_EQUAL (resampler->h2o_queue_fill, 0);
+  CU_ASSERT_EQUAL (resampler->h2o_queue_len, 0);
+  CU_ASSERT_PTR_EQUAL (resampler->h2o_buf_in, resampler->h2o_queues[0]);
+
+  //libsamplerate takes the queue every cycle or so.
+  resampler->h2o_state = src_callback_new (ow_resampler_h2o_reader,
+					   SRC_LINEAR, H2O_QUEUE_INPUTS,
+					   &err, resampler);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (resampler->h2o_state);
+  for (int i = 0; i < 2 * H2O_QUEUE_CYCLES; i++)
+    {
+      rsh2o = ow_ring_read_space (context.h2o_audio);
+      h2o_queue_write_host (resampler, 1.0);
+      ow_resampler_write_audio (resampler);
+      CU_ASSERT_EQUAL (ow_ring_read_space (context.h2o_audio) - rsh2o,
+		       resampler->h2o_bufsize);
+      CU_ASSERT_TRUE (resampler->h2o_queue_len <= H2O_QUEUE_BUFSIZE);
+      queue = resampler->h2o_queues[resampler->h2o_queue_fill];
+      CU_ASSERT_PTR_EQUAL (resampler->h2o_buf_in,
+			   queue +
+			   resampler->h2o_queue_len * H2O_QUEUE_INPUTS);
+    }
+  src_delete (resampler->h2o_state);
+
+  ow_ring_destroy (context.o2h_audio);
+  ow_ring_destroy (context.h2o_audio);
+  free (resampler->h2o_queues[0]);
+  free (resampler->h2o_queues[1]);
+  free (device);
+  free (engine);
+  free (resampler);
+}
+
+#define POLYPHASE_FRAMES 4800
+#define POLYPHASE_TONE 1000.0
+#define POLYPHASE_LAGRANGE -1
+
+//A tone is resampled in chunks of different lengths and compared with the
+//same tone generated at the output sample rate. The input sample n is
+//placed at the output time n * ratio.
+static void
+test_polyphase_ratio (double ratio, int quality, ow_codec_isa_t isa,
+		      float max_error)
+{
+  struct ow_polyphase *pp;
+  float *input[2], *output[2];
+  const float *in[2];
+  float *out[2];
+  long pos = 0, gen_frames = 0, used, gen, n;
+  long out_len = POLYPHASE_FRAMES * ratio + 64;
+  float error, max = 0;
+
+  if (quality == POLYPHASE_LAGRANGE)
+    {
+      pp = ow_polyphase_create_lagrange (2, 64);
+    }
+  else
+    {
+      pp = ow_polyphase_create (2, ratio, quality, 64);
+    }
+  CU_ASSERT_PTR_NOT_NULL_FATAL (pp);
+  if (ow_polyphase_set_isa (pp, isa) != isa)
+    {
+      ow_polyphase_destroy (pp);
+      return;
+    }
+
+  for (int i = 0; i < 2; i++)
+    {
+      input[i] = malloc (sizeof (float) * POLYPHASE_FRAMES);
+      output[i] = malloc (sizeof (float) * out_len);
+    }
+
+  for (int i = 0; i < POLYPHASE_FRAMES; i++)
+    {
+      input[0][i] = 0.5 * sin (2 * M_PI * POLYPHASE_TONE * i /
+			       OB_SAMPLE_RATE);
+      input[1][i] = -input[0][i];
+    }
+
+  srand (quality);
+  while (pos < POLYPHASE_FRAMES)
+    {
+      n = 1 + rand () % 64;
+      n = pos + n > POLYPHASE_FRAMES ? POLYPHASE_FRAMES - pos : n;
+      for (int i = 0; i < 2; i++)
+	{
+	  in[i] = input[i] + pos;
+	  out[i] = output[i] + gen_frames;
+	}
+      ow_polyphase_process (pp, in, n, out, out_len - gen_frames, ratio,
+			    &used, &gen);
+      pos += used;
+      gen_frames += gen;
+    }
+
+  //The last output frames need the input that comes after the window.
+  CU_ASSERT_TRUE (gen_frames <= POLYPHASE_FRAMES * ratio);
+  CU_ASSERT_TRUE (gen_frames > (POLYPHASE_FRAMES - pp->taps) * ratio);
+
+  //The first output frames are affected by the silence at the beginning.
+  for (int i = pp->taps; i < gen_frames; i++)
+    {
+      float expected = 0.5 * sin (2 * M_PI * POLYPHASE_TONE * i /
+				  (OB_SAMPLE_RATE * ratio));
+      error = fabsf (output[0][i] - expected);
+      max = error > max ? error : max;
+      CU_ASSERT_EQUAL (output[1][i], -output[0][i]);
+    }
+  printf ("Ratio %f, quality %d (%s): %d taps, max error %e\n", ratio,
+	  quality, ow_codec_get_isa_name (isa), pp->taps, max);
+  CU_ASSERT_TRUE (max < max_error);
+
+  for (int i = 0; i < 2; i++)
+    {
+      free (input[i]);
+      free (output[i]);
+    }
+  ow_polyphase_destroy (pp);
+}
+
+//The tone goes from a windowed sinc converter to a Lagrange one and back in
+//the middle of a chunk. The output must follow the tone with no gap.
+static void
+test_polyphase_handover ()
+{
+  struct ow_polyphase *pp[3];
+  float *input, *output;
+  const float *in[1];
+  float *out[1];
+  long pos = 0, gen_frames = 0, used, gen, n;
+  double ratio = 1.0001;
+  long out_len = POLYPHASE_FRAMES * ratio + 64;
+  float error, max = 0;
+  int current = 0;
+
+  printf ("\n");
+
+  pp[0] = ow_polyphase_create (1, ratio, 2, 64);
+  pp[1] = ow_polyphase_create_lagrange (1, 64 + pp[0]->taps);
+  pp[2] = ow_polyphase_create (1, ratio, 2, 64);
+  input = malloc (sizeof (float) * POLYPHASE_FRAMES);
+  output = malloc (sizeof (float) * out_len);
+
+  for (int i = 0; i < POLYPHASE_FRAMES; i++)
+    {
+      input[i] = 0.5 * sin (2 * M_PI * POLYPHASE_TONE * i / OB_SAMPLE_RATE);
+    }
+
+  while (pos < POLYPHASE_FRAMES)
+    {
+      if (current < 2 && pos >= (current + 1) * POLYPHASE_FRAMES / 3)
+	{
+	  ow_polyphase_handover (pp[current + 1], pp[current]);
+	  current++;
+	}
+
+      n = pos + 50 > POLYPHASE_FRAMES ? POLYPHASE_FRAMES - pos : 50;
+      in[0] = input + pos;
+      out[0] = output + gen_frames;
+      ow_polyphase_process (pp[current], in, n, out, out_len - gen_frames,
+			    ratio, &used, &gen);
+      CU_ASSERT_EQUAL (used, n);
+      pos += used;
+      gen_frames += gen;
+    }
+
+  CU_ASSERT_EQUAL (current, 2);
+  CU_ASSERT_TRUE (gen_frames <= POLYPHASE_FRAMES * ratio);
+  CU_ASSERT_TRUE (gen_frames > (POLYPHASE_FRAMES - pp[2]->taps) * ratio);
+
+  for (int i = pp[0]->taps; i < gen_frames; i++)
+    {
+      float expected = 0.5 * sin (2 * M_PI * POLYPHASE_TONE * i /
+				  (OB_SAMPLE_RATE * ratio));
+      error = fabsf (output[i] - expected);
+      max = error > max ? error : max;
+    }
+  printf ("Handover: max error %e\n", max);
+  CU_ASSERT_TRUE (max < 1e-3);
+
+  free (input);
+  free (output);
+  for (int i = 0; i < 3; i++)
+    {
+      ow_polyphase_destroy (pp[i]);
+    }
+}
+
+static void
+test_polyphase ()
+{
+  ow_codec_isa_t cpu_isa = ow_codec_get_cpu_isa ();
+
+  printf ("\n");
+
+  for (ow_codec_isa_t isa = OW_CODEC_ISA_SCALAR; isa <= cpu_isa; isa++)
+    {
+      test_polyphase_ratio (1.0, 2, isa, 1e-4);
+      test_polyphase_ratio (1.0001, 0, isa, 1e-5);
+      test_polyphase_ratio (44100.0 / 48000.0, 1, isa, 1e-4);
+      test_polyphase_ratio (48000.0 / 44100.0, 1, isa, 1e-4);
+      test_polyphase_ratio (2.0, 0, isa, 1e-5);
+      test_polyphase_ratio (0.5, 0, isa, 1e-5);
+      //The step starts at 1 so there is a tiny lag after the first chunk.
+      test_polyphase_ratio (1.0, POLYPHASE_LAGRANGE, isa, 1e-4);
+      test_polyphase_ratio (1.0002, POLYPHASE_LAGRANGE, isa, 1e-3);
+      test_polyphase_ratio (0.9998, POLYPHASE_LAGRANGE, isa, 1e-3);
+    }
+}
+
+static void
+test_reactor_loops ()
+{
+  struct ow_reactor *reactor;
+  struct ow_reactor_loop *a, *b, *c;
+
+  CU_ASSERT_NOT_EQUAL (ow_reactor_init (&reactor, 0), OW_OK);
+  CU_ASSERT_NOT_EQUAL (ow_reactor_init (&reactor,
+					OW_REACTOR_MAX_THREADS + 1), OW_OK);
+
+  CU_ASSERT_EQUAL (ow_reactor_init (&reactor, 2), OW_OK);
+  CU_ASSERT_EQUAL (reactor->loops_len, 2);
+
+  //The engines are spread among the loops.
+  a = ow_reactor_acquire_loop (reactor);
+  b = ow_reactor_acquire_loop (reactor);
+  CU_ASSERT_PTR_NOT_EQUAL (a, b);
+  ow_reactor_release_loop (a);
+  c = ow_reactor_acquire_loop (reactor);
+  CU_ASSERT_PTR_EQUAL (a, c);
+  CU_ASSERT_EQUAL (a->users, 1);
+  CU_ASSERT_EQUAL (b->users, 1);
+  ow_reactor_release_loop (b);
+  ow_reactor_release_loop (c);
+
+  ow_reactor_destroy (reactor);
+}
+
+#define POOL_ITEMS 24
+#define POOL_RUNS 10000
+
+static void
+pool_count_job (void *data, int first, int last)
+{
+  int *counts = data;
+
+  for (int i = first; i < last; i++)
+    {
+      counts[i]++;
+    }
+}
+
+//Every item must be processed exactly once per run, even with fewer items
+//than threads.
+static void
+test_pool ()
+{
+  struct ow_pool *pool;
+  int counts[POOL_ITEMS];
+
+  CU_ASSERT_NOT_EQUAL (ow_pool_init (&pool, 0), OW_OK);
+  CU_ASSERT_NOT_EQUAL (ow_pool_init (&pool, OW_POOL_MAX_THREADS + 1),
+		       OW_OK);
+
+  CU_ASSERT_EQUAL (ow_pool_init (&pool, 3), OW_OK);
+  CU_ASSERT_EQUAL (pool->workers_len, 3);
+
+  memset (counts, 0, sizeof (counts));
+  for (int i = 0; i < POOL_RUNS; i++)
+    {
+      ow_pool_run (pool, pool_count_job, counts, POOL_ITEMS);
+    }
+  for (int i = 0; i < POOL_ITEMS; i++)
+    {
+      CU_ASSERT_EQUAL (counts[i], POOL_RUNS);
+    }
+
+  memset (counts, 0, sizeof (counts));
+  for (int i = 0; i < POOL_RUNS; i++)
+    {
+      ow_pool_run (pool, pool_count_job, counts, 2);
+      //Let the workers fall asleep from time to time.
+      if (i % 1000 == 0)
+	{
+	  usleep (1000);
+	}
+    }
+  CU_ASSERT_EQUAL (counts[0], POOL_RUNS);
+  CU_ASSERT_EQUAL (counts[1], POOL_RUNS);
+  CU_ASSERT_EQUAL (counts[2], 0);
+
+  ow_pool_set_period (pool, 1000000);
+  CU_ASSERT_EQUAL (pool->spin_ns, 250000);
+
+  ow_pool_destroy (pool);
+}
+
+//The workers of different pools never share a core.
+static void
+test_pool_cpus ()
+{
+  struct ow_pool *pools[2];
+  int cpus[2 * OW_POOL_MAX_THREADS];
+  int pinned = 0;
+
+  for (int i = 0; i < 2; i++)
+    {
+      CU_ASSERT_EQUAL_FATAL (ow_pool_init (&pools[i], 2), OW_OK);
+      for (int j = 0; j < pools[i]->workers_len; j++)
+	{
+	  int cpu = pools[i]->workers[j].cpu;
+	  if (cpu < 0)
+	    {
+	      continue;
+	    }
+	  for (int k = 0; k < pinned; k++)
+	    {
+	      CU_ASSERT_NOT_EQUAL (cpus[k], cpu);
+	    }
+	  cpus[pinned++] = cpu;
+	}
+    }
+
+  printf ("\n%d workers pinned\n", pinned);
+
+  ow_pool_destroy (pools[0]);
+  ow_pool_destroy (pools[1]);
+
+  //The cores are released.
+  CU_ASSERT_EQUAL_FATAL (ow_pool_init (&pools[0], 2), OW_OK);
+  for (int j = 0; j < pools[0]->workers_len; j++)
+    {
+      if (pinned > j)
+	{
+	  CU_ASSERT_EQUAL (pools[0]->workers[j].cpu, cpus[j]);
+	}
+    }
+  ow_pool_destroy (pools[0]);
+}
+
+#define DLL_UPDATES 1000000
+
+static void *
+dll_overbridge_writer (void *data)
+{
+  struct ow_dll *dll = data;
+
+  for (int i = 0; i < DLL_UPDATES; i++)
+    {
+      ow_dll_overbridge_update (dll, BLOCKS * OB_FRAMES_PER_BLOCK,
+				i * 583);
+    }
+
+  return NULL;
+}
+
+static void
+test_dll_overbridge_snapshot ()
+{
+  struct ow_dll dll;
+  pthread_t thread;
+  int torn = 0, loads = 0;
+  uint32_t frames;
+
+  printf ("\n");
+
+  ow_dll_host_init (&dll, OW_DLL_ESTIMATOR_ZALSA);
+  ow_dll_overbridge_init (&dll, OB_SAMPLE_RATE, BLOCKS * OB_FRAMES_PER_BLOCK);
+  ow_dll_overbridge_update (&dll, BLOCKS * OB_FRAMES_PER_BLOCK, 0);
+
+  pthread_create (&thread, NULL, dll_overbridge_writer, &dll);
+
+  //The writer copies i1 to i0 and then increments i1 so a snapshot taken in
+  //between would have no frames.
+  do
+    {
+      ow_dll_host_load_dll_overbridge (&dll);
+      frames = dll.i1.frames - dll.i0.frames;
+      torn += frames != BLOCKS * OB_FRAMES_PER_BLOCK;
+      loads++;
+    }
+  while (dll.i1.frames < DLL_UPDATES * BLOCKS * OB_FRAMES_PER_BLOCK);
+
+  pthread_join (thread, NULL);
+
+  printf ("%d snapshots loaded\n", loads);
+  CU_ASSERT_EQUAL (torn, 0);
+}
+
+#define DLL_KALMAN_CYCLES 20000
+#define DLL_KALMAN_BUFSIZE 256
+#define DLL_KALMAN_DRIFT 1.0001	//Device frames per host frame
+
+//The error is generated from the frames produced by a device running faster
+//than the host and the frames consumed with the estimated ratio.
+static void
+test_dll_kalman ()
+{
+  struct ow_dll dll;
+  double produced = 0, consumed = 0;
+  uint32_t used;
+
+  printf ("\n");
+
+  ow_dll_host_init (&dll, OW_DLL_ESTIMATOR_KALMAN);
+  ow_dll_host_reset (&dll, OB_SAMPLE_RATE, OB_SAMPLE_RATE,
+		     DLL_KALMAN_BUFSIZE, BLOCKS * OB_FRAMES_PER_BLOCK);
+  ow_dll_host_set_loop_filter (&dll, 1.0, DLL_KALMAN_BUFSIZE,
+			       OB_SAMPLE_RATE);
+
+  for (int i = 0; i < DLL_KALMAN_CYCLES; i++)
+    {
+      if (i == DLL_KALMAN_CYCLES / 2)
+	{
+	  ow_dll_host_set_loop_filter (&dll, 0.05, DLL_KALMAN_BUFSIZE,
+				       OB_SAMPLE_RATE);
+	  //A skipped cycle
+	  produced += DLL_KALMAN_BUFSIZE * DLL_KALMAN_DRIFT;
+	}
+
+      produced += DLL_KALMAN_BUFSIZE * DLL_KALMAN_DRIFT;
+      dll.err = produced - floor (consumed) + (i % 3) * 0.5 - 0.5;
+      ow_dll_host_update (&dll);
+
+      used = floor (consumed + DLL_KALMAN_BUFSIZE / dll.ratio) -
+	floor (consumed);
+      consumed += DLL_KALMAN_BUFSIZE / dll.ratio;
+      dll.frames += used;
+    }
+
+  printf ("Ratio: %.9f; error: %f\n", dll.ratio, dll.err);
+  CU_ASSERT_DOUBLE_EQUAL (dll.ratio, 1.0 / DLL_KALMAN_DRIFT, 1e-6);
+  CU_ASSERT (fabs (dll.err) < 2.0);
+}
+
+//Nothing is printed while writing so the ring fills up and the rest of the
+//messages are dropped.
+static void
+test_log ()
+{
+  int level = debug_level;
+  uint64_t printed_start, dropped_start, printed, dropped;
+  int messages = OW_LOG_RECORDS * 2;
+
+  printf ("\n");
+
+  ow_log_get_stats (&printed_start, &dropped_start);
+
+  debug_level = 1;
+  ow_log_start ();
+  for (int i = 0; i < messages; i++)
+    {
+      debug_print (1, "Message %d", i);
+    }
+  ow_log_stop ();
+  debug_level = level;
+
+  ow_log_get_stats (&printed, &dropped);
+  printed -= printed_start;
+  dropped -= dropped_start;
+  printf ("Log messages: %" PRIu64 " printed, %" PRIu64 " dropped\n",
+	  printed, dropped);
+  CU_ASSERT_EQUAL (printed + dropped, messages);
+  CU_ASSERT_TRUE (printed >= OW_LOG_RECORDS);
+}
+
+static void
+test_get_bus_address_from_str ()
+{
+  uint8_t bus, address;
+
+  printf ("\n");
+
+  CU_ASSERT_EQUAL (get_bus_address_from_str ("a", &bus, &address), -EINVAL);
+  CU_ASSERT_EQUAL (get_bus_address_from_str ("a,", &bus, &address), -EINVAL);
+  CU_ASSERT_EQUAL (get_bus_address_from_str ("a,b", &bus, &address), -EINVAL);
+  CU_ASSERT_EQUAL (get_bus_address_from_str ("1,b", &bus, &address), -EINVAL);
+  CU_ASSERT_EQUAL (get_bus_address_from_str ("a,2", &bus, &address), -EINVAL);
+  CU_ASSERT_EQUAL (get_bus_address_from_str ("1,2", &bus, &address), 0);
+  CU_ASSERT_EQUAL (bus, 1);
+  CU_ASSERT_EQUAL (address, 2);
+}
+
+static void
+test_get_ow_target_delay_argument ()
+{
+  ow_target_delay_policy_t policy;
+  double value;
+
+  printf ("\n");
+
+  CU_ASSERT_EQUAL (get_ow_target_delay_argument ("", &policy, &value),
+		   -EINVAL);
+  CU_ASSERT_EQUAL (get_ow_target_delay_argument ("a", &policy, &value),
+		   -EINVAL);
+  CU_ASSERT_EQUAL (get_ow_target_delay_argument ("0", &policy, &value),
+		   -EINVAL);
+  CU_ASSERT_EQUAL (get_ow_target_delay_argument ("-64", &policy, &value),
+		   -EINVAL);
+  CU_ASSERT_EQUAL (get_ow_target_delay_argument ("64.5", &policy, &value),
+		   -EINVAL);
+  CU_ASSERT_EQUAL (get_ow_target_delay_argument ("2y", &policy, &value),
+		   -EINVAL);
+
+  CU_ASSERT_EQUAL (get_ow_target_delay_argument ("auto", &policy, &value),
+		   0);
+  CU_ASSERT_EQUAL (policy, OW_TARGET_DELAY_AUTO);
+
+  CU_ASSERT_EQUAL (get_ow_target_delay_argument ("256", &policy, &value),
+		   0);
+  CU_ASSERT_EQUAL (policy, OW_TARGET_DELAY_FRAMES);
+  CU_ASSERT_DOUBLE_EQUAL (value, 256, 0);
+
+  CU_ASSERT_EQUAL (get_ow_target_delay_argument ("0.5x", &policy, &value),
+		   0);
+  CU_ASSERT_EQUAL (policy, OW_TARGET_DELAY_FACTOR);
+  CU_ASSERT_DOUBLE_EQUAL (value, 0.5, 0);
+}
+
+static void
+test_state_parser ()
+{
+  char *message;
+  guint devices;
+  OverwitchDevice *device;
+  guint32 samplerate, buffer_size;
+  double target_delay_ms;
+  JsonReader *reader;
+  JsonBuilder *builder;
+  struct ow_engine engine;
+  struct ow_resampler_state state;
+
+  engine.device = malloc (sizeof (struct ow_device));
+  ow_copy_device_desc (&engine.device->desc, &TESTDEV_DESC_T2);
+
+  builder = message_state_builder_start ();
+
+  state.latency_o2h = 2;
+  state.latency_o2h_max = 3;
+  state.latency_o2h_min = 1;
+  state.latency_h2o = 2;
+  state.latency_h2o_max = 3;
+  state.latency_h2o_min = 1;
+  state.ratio_o2h = 0.9;
+  state.ratio_h2o = 1.0 / 0.9;
+  state.status = OW_RESAMPLER_STATUS_RUN;
+
+  message_state_builder_add_device (builder, 0, "name 1", engine.device,
+				    &state);
+  message_state_builder_add_device (builder, 1, "name 2", engine.device,
+				    &state);
+  message = message_state_builder_end (builder, 1, 2, 3);
+
+
+  reader = message_state_reader_start (message, &devices);
+  CU_ASSERT_TRUE (reader != NULL);
+  CU_ASSERT_EQUAL (devices, 2);
+
+  for (guint i = 0; i < devices; i++)
+    {
+      device = message_state_reader_get_device (reader, i);
+      g_object_unref (device);
+    }
+
+  message_state_reader_end (reader, &samplerate, &buffer_size,
+			    &target_delay_ms);
+
+  CU_ASSERT_EQUAL (samplerate, 1);
+  CU_ASSERT_EQUAL (buffer_size, 2);
+  CU_ASSERT_EQUAL (target_delay_ms, 3);
+
+  free (message);
+  free (engine.device);
+}
+
+//The configuration directory is moved to a temporary one.
+static void
+test_calibration ()
+{
+  char home[] = "/tmp/overwitch-XXXXXX";
+  char path[PATH_MAX];
+  struct ow_calibration calibrations[OW_CALIBRATION_MAX_SAMPLERATES];
+  struct ow_calibration c44 = { 44100, 0.91875, 1e-6, 2e-6, 0.08125 };
+  struct ow_calibration c48 = { 48000, 1.00002, 1e-7, 2e-7, -0.00002 };
+  int n;
+
+  printf ("\n");
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL (mkdtemp (home));
+  setenv ("HOME", home, 1);
+
+  CU_ASSERT_EQUAL (ow_calibration_load ("000c-A", calibrations, 8), 0);
+
+  CU_ASSERT_EQUAL (ow_calibration_save ("000c-A", &c44), 0);
+  CU_ASSERT_EQUAL (ow_calibration_save ("000c-A", &c48), 0);
+  CU_ASSERT_EQUAL (ow_calibration_save ("000c-B", &c48), 0);
+  c44.ratio = 0.91876;
+  CU_ASSERT_EQUAL (ow_calibration_save ("000c-A", &c44), 0);
+
+  n = ow_calibration_load ("000c-A", calibrations, 8);
+  CU_ASSERT_EQUAL (n, 2);
+  for (int i = 0; i < n; i++)
+    {
+      struct ow_calibration *c =
+	calibrations[i].samplerate == 44100 ? &c44 : &c48;
+      CU_ASSERT_EQUAL (calibrations[i].samplerate, c->samplerate);
+      CU_ASSERT_DOUBLE_EQUAL (calibrations[i].ratio, c->ratio, 1e-12);
+      CU_ASSERT_DOUBLE_EQUAL (calibrations[i].z1, c->z1, 1e-15);
+      CU_ASSERT_DOUBLE_EQUAL (calibrations[i].z2, c->z2, 1e-15);
+      CU_ASSERT_DOUBLE_EQUAL (calibrations[i].z3, c->z3, 1e-12);
+    }
+
+  CU_ASSERT_EQUAL (ow_calibration_load ("000c-A", calibrations, 1), 1);
+  CU_ASSERT_EQUAL (ow_calibration_load ("000c-B", calibrations, 8), 1);
+  CU_ASSERT_EQUAL (ow_calibration_load ("000c", calibrations, 8), 0);
+
+  snprintf (path, PATH_MAX, "%s/.config/%s/calibration.json", home,
+	    PACKAGE);
+  unlink (path);
+  snprintf (path, PATH_MAX, "%s/.config/%s", home, PACKAGE);
+  rmdir (path);
+  snprintf (path, PATH_MAX, "%s/.config", home);
+  rmdir (path);
+  rmdir (home);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int err;
+
+  debug_level = 2;
+
+  if (CU_initialize_registry () != CUE_SUCCESS)
+    {
+      goto cleanup;
+    }
+  CU_pSuite suite = CU_add_suite ("Overwitch USB blocks tests", 0, 0);
+  if (!suite)
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_get_frame_size_from_desc_tracks",
+		    test_get_frame_size_from_desc_tracks))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_sizes", test_sizes))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_usb_blocks_t1", test_usb_blocks_t1))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_usb_blocks_t2", test_usb_blocks_t2))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_usb_blocks_16", test_usb_blocks_16))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_engine_conceal_h2o",
+		    test_engine_conceal_h2o))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_engine_stats", test_engine_stats))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_engine_incomplete_transfer",
+		    test_engine_incomplete_transfer))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_engine_gap_silence",
+		    test_engine_gap_silence))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_engine_tracks", test_engine_tracks))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_engine_histograms",
+		    test_engine_histograms))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_usb_iso_packets", test_usb_iso_packets))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_codec_plan", test_codec_plan))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_codec_decode_t3", test_codec_decode_t3))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_codec_decoders", test_codec_decoders))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_codec_encoders", test_codec_encoders))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_codec_tracks", test_codec_tracks))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_codec_encode_saturation",
+		    test_codec_encode_saturation))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_codec_encode_dither",
+		    test_codec_encode_dither))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_codec_encoders_throughput",
+		    test_codec_encoders_throughput))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_jack_buffers", test_jack_buffers))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_ring", test_ring))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_ring_usb_blocks", test_ring_usb_blocks))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_resampler_deinterleave",
+		    test_resampler_deinterleave))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_resampler_o2h_reads",
+		    test_resampler_o2h_reads))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_resampler_h2o_queue",
+		    test_resampler_h2o_queue))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_polyphase", test_polyphase))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_polyphase_handover",
+		    test_polyphase_handover))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_reactor_loops", test_reactor_loops))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_pool", test_pool))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_pool_cpus", test_pool_cpus))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_dll_overbridge_snapshot",
+		    test_dll_overbridge_snapshot))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_dll_kalman", test_dll_kalman))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_log", test_log))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test
+      (suite, "get_bus_address_from_str", test_get_bus_address_from_str))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test
+      (suite, "get_ow_target_delay_argument",
+       test_get_ow_target_delay_argument))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "state_parser", test_state_parser))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_calibration", test_calibration))
     {
       goto cleanup;
     }